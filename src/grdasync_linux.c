@@ -0,0 +1,359 @@
+/*
+ * Asynchronous communication to device (grd_ioctl_submit)
+ *
+ * Copyright (C) 2008 Aktiv Co. (Aleksey Samsonov)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/*
+ * The requests are queued in the submit order and run by up to
+ * GRD_ASYNC_THREADS I/O threads with grd_ioctl_device. A thread takes the
+ * first request whose device is not used by another thread: the requests
+ * to one device run in order and a locked device does not stall the
+ * requests to the others. The completed requests are taken by
+ * grd_ioctl_wait.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "grdimpl.h"
+
+#define GRD_ASYNC_THREADS       4
+#define GRD_ASYNC_MAX_QUEUED    1024
+#define GRD_ASYNC_PATH_LEN      256
+
+struct async_request
+{
+    struct async_request* next;
+    unsigned long long cookie;
+    uint64_t deadline_ms;       /* zero: none */
+    char dev_path[GRD_ASYNC_PATH_LEN];
+    unsigned int prod_id;
+    size_t pack_size;
+    void* in;
+    size_t len_in;
+    void* out;
+    size_t len_out;
+    int status;
+};
+
+struct async_list
+{
+    struct async_request* head;
+    struct async_request* tail;
+};
+
+static pthread_mutex_t async_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t async_queued = PTHREAD_COND_INITIALIZER;  /* to the I/O threads */
+static pthread_cond_t async_done = PTHREAD_COND_INITIALIZER;    /* to grd_ioctl_wait */
+static struct async_list queue;     /* not started */
+static struct async_list completed; /* not taken by grd_ioctl_wait */
+static struct async_request* running[GRD_ASYNC_THREADS];
+static size_t queued_count;
+static unsigned int threads_count, threads_idle;
+
+static uint64_t monotonic_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static void list_append(struct async_list* list, struct async_request* r)
+{
+    r->next = NULL;
+    if (list->tail)
+        list->tail->next = r;
+    else
+        list->head = r;
+    list->tail = r;
+}
+
+/* Unlink r (prev is the previous request or NULL) */
+static void list_unlink(struct async_list* list, struct async_request* prev,
+                        struct async_request* r)
+{
+    if (prev)
+        prev->next = r->next;
+    else
+        list->head = r->next;
+    if (list->tail == r)
+        list->tail = prev;
+    r->next = NULL;
+}
+
+/* Complete the request (async_mutex is locked) */
+static void complete_request(struct async_request* r, int status)
+{
+    r->status = status;
+    list_append(&completed, r);
+    pthread_cond_broadcast(&async_done);
+}
+
+static int is_device_running(const char* dev_path)
+{
+    size_t i;
+
+    for (i = 0; i < GRD_ASYNC_THREADS; ++i)
+        if (running[i]  &&  strcmp(running[i]->dev_path, dev_path) == 0)
+            return 1;
+    return 0;
+}
+
+/*
+ * Take the first request whose device is idle (async_mutex is locked),
+ * the expired requests are completed on the way.
+ */
+static struct async_request* take_request(void)
+{
+    struct async_request* prev = NULL;
+    struct async_request* r;
+    struct async_request* next;
+    uint64_t now = 0;
+
+    for (r = queue.head; r; r = next)
+    {
+        next = r->next;
+        if (r->deadline_ms)
+        {
+            if (!now)
+                now = monotonic_ms();
+            if (now >= r->deadline_ms)
+            {
+                list_unlink(&queue, prev, r);
+                --queued_count;
+                complete_request(r, ETIMEDOUT);
+                continue;
+            }
+        }
+        if (!is_device_running(r->dev_path))
+        {
+            list_unlink(&queue, prev, r);
+            --queued_count;
+            return r;
+        }
+        prev = r;
+    }
+    return NULL;
+}
+
+static void* run_async(void* arg)
+{
+    struct async_request* r;
+    size_t slot = (size_t)(uintptr_t)arg;
+    int status;
+
+    assert(slot < GRD_ASYNC_THREADS);
+    pthread_mutex_lock(&async_mutex);
+    for (;;)
+    {
+        r = take_request();
+        if (!r)
+        {
+            ++threads_idle;
+            pthread_cond_wait(&async_queued, &async_mutex);
+            --threads_idle;
+            continue;
+        }
+        running[slot] = r;
+        pthread_mutex_unlock(&async_mutex);
+
+        errno = 0;
+        if (grd_ioctl_device(r->dev_path, r->prod_id, r->pack_size,
+                             r->in, r->len_in, r->out, r->len_out) == 0)
+            status = 0;
+        else
+            status = errno ? errno : EIO;
+
+        pthread_mutex_lock(&async_mutex);
+        running[slot] = NULL;
+        complete_request(r, status);
+        /* the device is idle again: its next request may wait for a thread */
+        if (queue.head)
+            pthread_cond_broadcast(&async_queued);
+    }
+    return NULL;
+}
+
+/* Start one more I/O thread if all are busy (async_mutex is locked) */
+static void start_thread(void)
+{
+    pthread_attr_t attr;
+    pthread_t thread;
+
+    if (threads_idle > 0  ||  threads_count >= GRD_ASYNC_THREADS)
+        return;
+    if (pthread_attr_init(&attr) != 0)
+        return;
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, run_async,
+                       (void*)(uintptr_t)threads_count) == 0)
+        ++threads_count;
+    pthread_attr_destroy(&attr);
+}
+
+static int is_cookie_used(unsigned long long cookie)
+{
+    const struct async_request* r;
+    size_t i;
+
+    for (r = queue.head; r; r = r->next)
+        if (r->cookie == cookie)
+            return 1;
+    for (r = completed.head; r; r = r->next)
+        if (r->cookie == cookie)
+            return 1;
+    for (i = 0; i < GRD_ASYNC_THREADS; ++i)
+        if (running[i]  &&  running[i]->cookie == cookie)
+            return 1;
+    return 0;
+}
+
+int grd_ioctl_submit(const char* dev_path, unsigned int prod_id, size_t pack_size,
+                     void* in, size_t len_in, void* out, size_t len_out,
+                     unsigned int timeout_ms, unsigned long long cookie)
+{
+    struct async_request* r;
+
+    if (!dev_path  ||  !in  ||  !out  ||  pack_size == 0
+        ||  len_in % pack_size != 0  ||  len_out % pack_size != 0
+        )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (strlen(dev_path) >= GRD_ASYNC_PATH_LEN)
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    r = calloc(1, sizeof(*r));
+    if (!r)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    r->cookie = cookie;
+    r->deadline_ms = timeout_ms ? monotonic_ms() + timeout_ms : 0;
+    strcpy(r->dev_path, dev_path);
+    r->prod_id = prod_id;
+    r->pack_size = pack_size;
+    r->in = in;
+    r->len_in = len_in;
+    r->out = out;
+    r->len_out = len_out;
+    r->status = EINPROGRESS;
+
+    pthread_mutex_lock(&async_mutex);
+    if (queued_count >= GRD_ASYNC_MAX_QUEUED  ||  is_cookie_used(cookie))
+    {
+        pthread_mutex_unlock(&async_mutex);
+        free(r);
+        errno = queued_count >= GRD_ASYNC_MAX_QUEUED ? EAGAIN : EEXIST;
+        return -1;
+    }
+    start_thread();
+    if (threads_count == 0)
+    {
+        /* no thread: the request can not run */
+        pthread_mutex_unlock(&async_mutex);
+        free(r);
+        errno = EAGAIN;
+        return -1;
+    }
+    list_append(&queue, r);
+    ++queued_count;
+    pthread_cond_signal(&async_queued);
+    pthread_mutex_unlock(&async_mutex);
+    return 0;
+}
+
+int grd_ioctl_cancel(unsigned long long cookie)
+{
+    struct async_request* prev = NULL;
+    struct async_request* r;
+    size_t i;
+    int ret = -1;
+
+    pthread_mutex_lock(&async_mutex);
+    for (r = queue.head; r; prev = r, r = r->next)
+        if (r->cookie == cookie)
+            break;
+    if (r)
+    {
+        list_unlink(&queue, prev, r);
+        --queued_count;
+        complete_request(r, ECANCELED);
+        ret = 0;
+    }
+    else
+    {
+        errno = ENOENT;
+        for (i = 0; i < GRD_ASYNC_THREADS; ++i)
+            if (running[i]  &&  running[i]->cookie == cookie)
+                errno = EBUSY;
+    }
+    pthread_mutex_unlock(&async_mutex);
+    return ret;
+}
+
+size_t grd_ioctl_wait(struct grd_ioctl_completion* done, size_t max, int timeout_ms)
+{
+    struct async_request* r;
+    struct timespec deadline;
+    size_t n = 0;
+
+    if (!done  ||  max == 0)
+        return 0;
+    if (timeout_ms > 0)
+    {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            ++deadline.tv_sec;
+            deadline.tv_nsec -= 1000000000;
+        }
+    }
+    pthread_mutex_lock(&async_mutex);
+    while (!completed.head  &&  timeout_ms != 0)
+    {
+        if (timeout_ms < 0)
+            pthread_cond_wait(&async_done, &async_mutex);
+        else if (pthread_cond_timedwait(&async_done, &async_mutex, &deadline) == ETIMEDOUT)
+            break;
+    }
+    while (n < max  &&  (r = completed.head) != NULL)
+    {
+        list_unlink(&completed, NULL, r);
+        done[n].cookie = r->cookie;
+        done[n].status = r->status;
+        ++n;
+        free(r);
+    }
+    pthread_mutex_unlock(&async_mutex);
+    return n;
+}
@@ -0,0 +1,473 @@
+/*
+ * Benchmark of the GrdWine implementation (grdimpl.h), native Linux program
+ *
+ * Copyright (C) 2008 Aktiv Co. (Aleksey Samsonov)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/*
+ * grdbench [-t threads] [-p processes] [-n calls] [-m packs] [-o file] [test...]
+ * tests: ioctl (one pack), ioctl_multi (-m packs), ioctl_batch (one pack to
+ * every device in one grd_ioctl_devices), ioctl_product (one pack to any
+ * device of the product of the first device), session (-m one-pack
+ * exchanges in one explicit session), probe, search
+ *
+ * Every test runs with 1, 2, 4 .. threads in 1, 2, 4 .. processes. Devices
+ * are the found ones: use GRD_EMUL (emulated devices) or USB_DEVFS_PATH and
+ * GRD_SYSFS_PATH (fake usbfs) to run without dongles. The results are also
+ * written to the file (-o) as one JSON object per line. "run" is the most
+ * calls finished in a row by one process: the processes sharing a device
+ * take turns if it stays near the batch of a session (GRD_SESSION_BATCH).
+ * Syscalls are counted with the raw_syscalls:sys_enter tracepoint if the
+ * perf events are allowed (-1 otherwise).
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+#include <linux/perf_event.h>
+#include "grdimpl.h"
+#include "grdimpl_linux.h"
+
+#define BENCH_MAX_DEVICES       64
+#define BENCH_PACK_SIZE         64   /* HID report, fits the bulk packs too */
+#define BENCH_MAX_PACKS         64
+
+enum bench_test
+{
+    BENCH_IOCTL,
+    BENCH_IOCTL_MULTI,
+    BENCH_IOCTL_BATCH,
+    BENCH_IOCTL_PRODUCT,
+    BENCH_IOCTL_SESSION,
+    BENCH_PROBE,
+    BENCH_SEARCH,
+    BENCH_TEST_COUNT
+};
+
+static const char* const bench_names[BENCH_TEST_COUNT] =
+{
+    "ioctl", "ioctl_multi", "ioctl_batch", "ioctl_product", "session", "probe",
+    "search"
+};
+
+struct bench_device
+{
+    char path[256];
+    unsigned int prod_id;
+};
+
+/* Results of all workers (shared by the processes) */
+struct bench_shared
+{
+    volatile uint64_t errors;
+    volatile int64_t syscalls;      /* -1: not counted */
+    volatile uint32_t last_proc;    /* process of the last finished call */
+    volatile uint32_t run;          /* calls finished in a row by last_proc */
+    volatile uint32_t max_run;
+    uint64_t lat_ns[1];             /* [workers * calls] */
+};
+
+struct bench_worker
+{
+    enum bench_test test;
+    unsigned int index;             /* worker number */
+    unsigned int proc;              /* process number */
+    unsigned int calls;
+    unsigned int packs;
+    struct bench_shared* shared;
+};
+
+static struct bench_device devices[BENCH_MAX_DEVICES];
+static unsigned int devices_count;
+static long syscall_event_id = -1;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static int __attribute__((ms_abi)) found_device(const char* path, void* param)
+{
+    struct bench_device* d;
+
+    (void)param;
+    if (devices_count >= BENCH_MAX_DEVICES  ||  strlen(path) >= sizeof(d->path))
+        return 0;
+    d = &devices[devices_count];
+    if (grd_probe_device(path, &d->prod_id) != 0)
+        return 0;
+    strcpy(d->path, path);
+    ++devices_count;
+    return 1;
+}
+
+static int __attribute__((ms_abi)) count_device(const char* path, void* param)
+{
+    (void)path;
+    (void)param;
+    return 1;
+}
+
+static void load_syscall_event_id(void)
+{
+    static const char* const paths[] =
+    {
+        "/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+        "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id"
+    };
+    char buf[32];
+    size_t i;
+    ssize_t r;
+    int fd;
+
+    for (i = 0; i < sizeof(paths) / sizeof(paths[0]); ++i)
+    {
+        fd = open(paths[i], O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            continue;
+        r = read(fd, buf, sizeof(buf) - 1);
+        close(fd);
+        if (r > 0)
+        {
+            buf[r] = '\0';
+            syscall_event_id = strtol(buf, NULL, 10);
+            return;
+        }
+    }
+}
+
+/* Counter of the syscalls of the calling thread, or -1 */
+static int open_syscall_counter(void)
+{
+    struct perf_event_attr attr;
+
+    if (syscall_event_id < 0)
+        return -1;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_TRACEPOINT;
+    attr.size = sizeof(attr);
+    attr.config = (uint64_t)syscall_event_id;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/* Count the calls finished in a row by the process (roughly: not locked) */
+static void note_call(struct bench_shared* shared, unsigned int proc)
+{
+    uint32_t run, max_run;
+
+    if (shared->last_proc != proc)
+    {
+        shared->last_proc = proc;
+        shared->run = 0;
+    }
+    run = __sync_add_and_fetch(&shared->run, 1);
+    while ((max_run = shared->max_run) < run
+           &&  !__sync_bool_compare_and_swap(&shared->max_run, max_run, run)
+           )
+        ;
+}
+
+static void* run_worker(void* arg)
+{
+    struct bench_worker* w = arg;
+    const struct bench_device* d;
+    unsigned char out[BENCH_PACK_SIZE * BENCH_MAX_PACKS];
+    unsigned char in[BENCH_PACK_SIZE * BENCH_MAX_PACKS];
+    struct grd_ioctl_request batch[BENCH_MAX_DEVICES];
+    uint64_t* lat;
+    uint64_t start, count;
+    unsigned long long handle;
+    unsigned int i, j, id;
+    size_t len;
+    int fd, ret = 0;
+
+    assert(w && w->shared);
+    assert(devices_count > 0);
+    d = &devices[w->index % devices_count];
+    lat = &w->shared->lat_ns[(size_t)w->index * w->calls];
+    len = BENCH_PACK_SIZE * (w->test == BENCH_IOCTL_MULTI ? w->packs : 1);
+    memset(out, 0x5a, sizeof(out));
+    for (i = 0; i < devices_count; ++i)
+    {
+        batch[i].dev_path = devices[i].path;
+        batch[i].prod_id = devices[i].prod_id;
+        batch[i].pack_size = BENCH_PACK_SIZE;
+        batch[i].in = in + BENCH_PACK_SIZE * (i % BENCH_MAX_PACKS);
+        batch[i].len_in = BENCH_PACK_SIZE;
+        batch[i].out = out;
+        batch[i].len_out = BENCH_PACK_SIZE;
+    }
+
+    fd = open_syscall_counter();
+    if (fd >= 0)
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    for (i = 0; i < w->calls; ++i)
+    {
+        start = now_ns();
+        switch (w->test)
+        {
+        case BENCH_IOCTL:
+        case BENCH_IOCTL_MULTI:
+            ret = grd_ioctl_device(d->path, d->prod_id, BENCH_PACK_SIZE,
+                                   in, len, out, len);
+            break;
+        case BENCH_IOCTL_BATCH:
+            ret = grd_ioctl_devices(batch, devices_count);
+            break;
+        case BENCH_IOCTL_PRODUCT:
+            ret = grd_ioctl_product(devices[0].prod_id, NULL, 0, BENCH_PACK_SIZE,
+                                    in, BENCH_PACK_SIZE, out, BENCH_PACK_SIZE);
+            break;
+        case BENCH_IOCTL_SESSION:
+            ret = grd_session_open(d->path, d->prod_id, 0, 0, &handle);
+            for (j = 0; j < w->packs  &&  ret == 0; ++j)
+                ret = grd_session_ioctl(handle, BENCH_PACK_SIZE,
+                                        in, BENCH_PACK_SIZE, out, BENCH_PACK_SIZE);
+            if (handle  &&  grd_session_close(handle) != 0)
+                ret = -1;
+            break;
+        case BENCH_PROBE:
+            ret = grd_probe_device(d->path, &id);
+            break;
+        default:
+            ret = search_usb_devices(count_device, NULL) >= 0 ? 0 : -1;
+            break;
+        }
+        lat[i] = now_ns() - start;
+        note_call(w->shared, w->proc);
+        if (ret != 0)
+            __sync_fetch_and_add(&w->shared->errors, 1);
+    }
+    if (fd >= 0)
+    {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd, &count, sizeof(count)) == sizeof(count))
+            __sync_fetch_and_add(&w->shared->syscalls, (int64_t)count);
+        close(fd);
+    }
+    else
+        w->shared->syscalls = -1;
+    return NULL;
+}
+
+/* Run threads workers from first (in this process) */
+static void run_threads(enum bench_test test, unsigned int first, unsigned int threads,
+                        unsigned int calls, unsigned int packs, struct bench_shared* shared)
+{
+    struct bench_worker w[256];
+    pthread_t tid[256];
+    unsigned int i;
+
+    assert(threads <= sizeof(w) / sizeof(w[0]));
+    for (i = 0; i < threads; ++i)
+    {
+        w[i].test = test;
+        w[i].index = first + i;
+        w[i].proc = first / threads;
+        w[i].calls = calls;
+        w[i].packs = packs;
+        w[i].shared = shared;
+        if (pthread_create(&tid[i], NULL, run_worker, &w[i]) != 0)
+        {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    for (i = 0; i < threads; ++i)
+        pthread_join(tid[i], NULL);
+}
+
+static int compare_u64(const void* a, const void* b)
+{
+    const uint64_t x = *(const uint64_t*)a;
+    const uint64_t y = *(const uint64_t*)b;
+
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static double percentile_us(const uint64_t* sorted, size_t n, double p)
+{
+    size_t i;
+
+    assert(n > 0);
+    i = (size_t)(p * (double)(n - 1) + 0.5);
+    return (double)sorted[i] / 1000.0;
+}
+
+static int run_test(enum bench_test test, unsigned int procs, unsigned int threads,
+                    unsigned int calls, unsigned int packs, FILE* json)
+{
+    struct bench_shared* shared;
+    size_t size, n;
+    uint64_t start, elapsed;
+    double seconds, p50, p99, p999, syscalls;
+    unsigned int p;
+    pid_t pid;
+    int status;
+
+    n = (size_t)procs * threads * calls;
+    size = sizeof(*shared) + n * sizeof(shared->lat_ns[0]);
+    shared = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED)
+    {
+        perror("mmap");
+        return -1;
+    }
+
+    start = now_ns();
+    for (p = 1; p < procs; ++p)
+    {
+        pid = fork();
+        if (pid < 0)
+        {
+            perror("fork");
+            break;
+        }
+        if (pid == 0)
+        {
+            run_threads(test, p * threads, threads, calls, packs, shared);
+            _exit(0);
+        }
+    }
+    run_threads(test, 0, threads, calls, packs, shared);
+    while (wait(&status) > 0  ||  errno == EINTR)
+        ;
+    elapsed = now_ns() - start;
+
+    qsort(shared->lat_ns, n, sizeof(shared->lat_ns[0]), compare_u64);
+    p50 = percentile_us(shared->lat_ns, n, 0.5);
+    p99 = percentile_us(shared->lat_ns, n, 0.99);
+    p999 = percentile_us(shared->lat_ns, n, 0.999);
+    seconds = (double)elapsed / 1e9;
+    syscalls = shared->syscalls < 0 ? -1.0 : (double)shared->syscalls / (double)n;
+
+    printf("%-12s %5u %7u %12.0f %10.1f %10.1f %10.1f %9.1f %6u %7llu\n",
+           bench_names[test], procs, threads, (double)n / seconds, p50, p99, p999,
+           syscalls, shared->max_run, (unsigned long long)shared->errors);
+    if (json)
+    {
+        fprintf(json, "{\"test\":\"%s\",\"processes\":%u,\"threads\":%u,\"calls\":%lu,"
+                      "\"pack_size\":%u,\"packs\":%u,\"calls_per_sec\":%.1f,"
+                      "\"p50_us\":%.2f,\"p99_us\":%.2f,\"p999_us\":%.2f,"
+                      "\"syscalls_per_call\":%.2f,\"run\":%u,\"errors\":%llu}\n",
+                bench_names[test], procs, threads, (unsigned long)n,
+                BENCH_PACK_SIZE,
+                test == BENCH_IOCTL_MULTI  ||  test == BENCH_IOCTL_SESSION ? packs : 1,
+                (double)n / seconds, p50, p99, p999, syscalls, shared->max_run,
+                (unsigned long long)shared->errors);
+        fflush(json);
+    }
+    munmap(shared, size);
+    return 0;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: grdbench [-t threads] [-p processes] [-n calls] "
+                    "[-m packs] [-o file] [ioctl|ioctl_multi|ioctl_batch|ioctl_product|"
+                    "session|probe|search...]\n");
+    exit(2);
+}
+
+int main(int argc, char* argv[])
+{
+    unsigned int max_threads = 4, max_procs = 2, calls = 1000, packs = 8;
+    unsigned int procs, threads;
+    int tests[BENCH_TEST_COUNT];
+    int opt, i, t;
+    FILE* json = NULL;
+
+    while ((opt = getopt(argc, argv, "t:p:n:m:o:")) != -1)
+    {
+        switch (opt)
+        {
+        case 't': max_threads = (unsigned int)atoi(optarg); break;
+        case 'p': max_procs = (unsigned int)atoi(optarg); break;
+        case 'n': calls = (unsigned int)atoi(optarg); break;
+        case 'm': packs = (unsigned int)atoi(optarg); break;
+        case 'o':
+            json = fopen(optarg, "a");
+            if (!json)
+            {
+                perror(optarg);
+                return 1;
+            }
+            break;
+        default:
+            usage();
+        }
+    }
+    if (max_threads < 1  ||  max_threads > 256  ||  max_procs < 1  ||  calls < 1
+        ||  packs < 1  ||  packs > BENCH_MAX_PACKS
+        )
+        usage();
+    for (t = 0; t < BENCH_TEST_COUNT; ++t)
+        tests[t] = optind == argc;
+    for (i = optind; i < argc; ++i)
+    {
+        for (t = 0; t < BENCH_TEST_COUNT; ++t)
+            if (strcmp(argv[i], bench_names[t]) == 0)
+                break;
+        if (t == BENCH_TEST_COUNT)
+            usage();
+        tests[t] = 1;
+    }
+
+    if (search_usb_devices(found_device, NULL) <= 0  ||  devices_count == 0)
+    {
+        fprintf(stderr, "grdbench: no Guardant devices found (see GRD_EMUL)\n");
+        return 1;
+    }
+    load_syscall_event_id();
+
+    printf("%-12s %5s %7s %12s %10s %10s %10s %9s %6s %7s\n", "test", "procs",
+           "threads", "calls/s", "p50 us", "p99 us", "p999 us", "syscalls", "run",
+           "errors");
+    for (t = 0; t < BENCH_TEST_COUNT; ++t)
+    {
+        if (!tests[t])
+            continue;
+        for (procs = 1; procs <= max_procs; procs *= 2)
+            for (threads = 1; threads <= max_threads; threads *= 2)
+                if (run_test((enum bench_test)t, procs, threads, calls, packs, json) != 0)
+                    return 1;
+    }
+    if (json)
+        fclose(json);
+    return 0;
+}
@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2008 Aktiv Co. (Aleksey Samsonov)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#ifndef GRDBROKER__H__
+#define GRDBROKER__H__
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+#ifdef HAVE_STDDEF_H
+#include <stddef.h>
+#endif /* HAVE_STDDEF_H */
+#include <stdint.h>
+#include <sys/types.h> /* for pid_t */
+#include "grdimpl.h"
+
+/*
+ * Broker (grdbrokerd): one process owns the devices and serves the other
+ * processes of its user (and root) over the SOCK_SEQPACKET socket
+ * grdwine-broker.sock in the GRD_IPC_NAME directory, or in XDG_RUNTIME_DIR
+ * if GRD_IPC_NAME is not set. The directory must belong to root or to the
+ * user and must not be writable by the others: there is no default.
+ * A client connection passes a shared-memory buffer (a memfd sealed against
+ * resizing, SCM_RIGHTS, with any request) for the payloads: the out data at
+ * offset 0, the in data after it, the search result as NUL-terminated paths. A connection has one
+ * request in flight; the reply is struct grd_broker_reply.
+ */
+
+#define GRD_BROKER_SOCKET_NAME  "grdwine-broker.sock"
+#define GRD_BROKER_ENV          "GRD_BROKER"   /* "0": never use the broker */
+#define GRD_BROKER_MAGIC        0x4b524247     /* "GBRK" */
+#define GRD_BROKER_BUFFER_SIZE  65536          /* initial buffer of a client */
+#define GRD_BROKER_PATH_LEN     256
+
+#define GRD_BROKER_IOCTL        1
+#define GRD_BROKER_PROBE        2
+#define GRD_BROKER_SEARCH       3
+
+#define GRD_BROKER_UNAVAILABLE  (-2) /* no broker: access the devices directly */
+
+struct grd_broker_request
+{
+    uint32_t magic;             /* GRD_BROKER_MAGIC */
+    uint32_t op;                /* GRD_BROKER_* */
+    uint32_t prod_id;
+    uint32_t reserved;
+    uint64_t pack_size;
+    uint64_t len_in;
+    uint64_t len_out;
+    char path[GRD_BROKER_PATH_LEN];
+} __attribute__((aligned(8)));
+
+struct grd_broker_reply
+{
+    int32_t ret;                /* result of the call */
+    int32_t err;                /* errno if ret is -1 */
+    uint32_t value;             /* prod_id (probe), count of paths (search) */
+    uint32_t reserved;
+} __attribute__((aligned(8)));
+
+/* Path of the broker socket (see above). Return zero on success. */
+int grd_broker_socket_path(char* buf, size_t buf_size);
+
+/*
+ * Check the peer of the broker socket: it must run as root or as this
+ * user. Return zero (and the pid of the peer) if it does.
+ */
+int grd_broker_check_peer(int fd, pid_t* pid);
+
+/*
+ * Calls through the broker (client side). Return GRD_BROKER_UNAVAILABLE if
+ * the broker is not running (or the request was not delivered), else the
+ * result of the call.
+ */
+int grd_broker_ioctl(const char* dev_path, unsigned int prod_id, size_t pack_size,
+                     void* in, size_t len_in, void* out, size_t len_out);
+
+int grd_broker_probe(const char* dev_path, unsigned int* prod_id);
+
+int grd_broker_search(search_usb_device_callback callback, void* param);
+
+#endif /* !GRDBROKER__H__ */
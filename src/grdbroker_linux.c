@@ -0,0 +1,408 @@
+/*
+ * Client of the GrdWine broker (grdbrokerd)
+ *
+ * Copyright (C) 2008 Aktiv Co. (Aleksey Samsonov)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h> /* for PATH_MAX */
+#include <stdio.h>  /* for snprintf */
+#include <time.h>
+#include <pthread.h>
+#include "grdbroker.h"
+#include "grdlock.h"
+
+#define BROKER_RETRY_MS         1000 /* do not try to connect more often */
+#define BROKER_SEARCH_TRIES     4    /* grow the buffer for the search result */
+
+/* Connection of a thread to the broker */
+struct broker_conn
+{
+    int fd;
+    pid_t pid;                  /* the process which connected */
+    unsigned char* buf;         /* shared buffer of the payloads */
+    size_t size;
+    int buf_fd;                 /* buffer not passed to the broker yet, or -1 */
+};
+
+static pthread_once_t broker_once = PTHREAD_ONCE_INIT;
+static pthread_key_t broker_key;
+static int broker_disabled;
+static volatile uint64_t broker_retry_at; /* CLOCK_MONOTONIC, ms */
+
+static uint64_t monotonic_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static void conn_free(struct broker_conn* c)
+{
+    assert(c);
+    if (c->fd >= 0)
+        close(c->fd);
+    if (c->buf_fd >= 0)
+        close(c->buf_fd);
+    if (c->buf)
+        munmap(c->buf, c->size);
+    free(c);
+}
+
+static void conn_destructor(void* p)
+{
+    conn_free(p);
+}
+
+static void broker_init(void)
+{
+    const char* env;
+
+    env = getenv(GRD_BROKER_ENV);
+    if (env  &&  strcmp(env, "0") == 0)
+        broker_disabled = 1;
+    else if (pthread_key_create(&broker_key, conn_destructor) != 0)
+        broker_disabled = 1;
+}
+
+int grd_broker_socket_path(char* buf, size_t buf_size)
+{
+    /* another user could listen there in place of the broker */
+    return grd_private_ipc_path(GRD_BROKER_SOCKET_NAME, buf, buf_size);
+}
+
+int grd_broker_check_peer(int fd, pid_t* pid)
+{
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0)
+        return -1;
+    if (cred.uid != 0  &&  cred.uid != geteuid())
+    {
+        errno = EACCES;
+        return -1;
+    }
+    if (pid)
+        *pid = cred.pid;
+    return 0;
+}
+
+/* Forget the connection of the thread */
+static void conn_drop(struct broker_conn* c)
+{
+    pthread_setspecific(broker_key, NULL);
+    conn_free(c);
+}
+
+/*
+ * Sealed buffer: the broker maps it and rejects a buffer the client could
+ * shrink under it (SIGBUS). No buffer without memfd: no broker.
+ */
+static int create_buffer(size_t size)
+{
+#ifdef HAVE_MEMFD_CREATE
+    int fd;
+
+    fd = memfd_create("grdwine-broker", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0)
+        return -1;
+    if (ftruncate(fd, (off_t)size) != 0
+        ||  fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0
+        )
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+#else
+    (void)size;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/* Replace the buffer with one of size bytes (at least) */
+static int conn_grow(struct broker_conn* c, size_t size)
+{
+    void* p;
+    int fd;
+
+    assert(c);
+    if (size < GRD_BROKER_BUFFER_SIZE)
+        size = GRD_BROKER_BUFFER_SIZE;
+    size = (size + 4095) & ~(size_t)4095;
+    fd = create_buffer(size);
+    if (fd < 0)
+        return -1;
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED)
+    {
+        close(fd);
+        return -1;
+    }
+    if (c->buf)
+        munmap(c->buf, c->size);
+    if (c->buf_fd >= 0)
+        close(c->buf_fd);
+    c->buf = p;
+    c->size = size;
+    c->buf_fd = fd;
+    return 0;
+}
+
+/*
+ * Connection of the thread with a buffer of size bytes (at least).
+ * Return NULL if the broker is not running.
+ */
+static struct broker_conn* conn_get(size_t size)
+{
+    char path[PATH_MAX];
+    struct sockaddr_un addr;
+    struct broker_conn* c;
+
+    pthread_once(&broker_once, broker_init);
+    if (broker_disabled)
+        return NULL;
+    c = pthread_getspecific(broker_key);
+    if (c  &&  c->pid != getpid())
+    {
+        /* inherited from the parent: the socket is shared with it */
+        conn_drop(c);
+        c = NULL;
+    }
+    if (!c)
+    {
+        if (monotonic_ms() < broker_retry_at)
+            return NULL;
+        if (grd_broker_socket_path(path, sizeof(path)) != 0
+            ||  strlen(path) >= sizeof(addr.sun_path)
+            )
+        {
+            /* no usable directory: do not look it up on every call */
+            broker_retry_at = monotonic_ms() + BROKER_RETRY_MS;
+            return NULL;
+        }
+        c = calloc(1, sizeof(*c));
+        if (!c)
+            return NULL;
+        c->buf_fd = -1;
+        c->pid = getpid();
+        c->fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, path);
+        if (c->fd < 0  ||  connect(c->fd, (struct sockaddr*)&addr, sizeof(addr)) != 0
+            ||  grd_broker_check_peer(c->fd, NULL) != 0
+            )
+        {
+            /* no broker (or not ours): direct access, try again later */
+            broker_retry_at = monotonic_ms() + BROKER_RETRY_MS;
+            conn_free(c);
+            return NULL;
+        }
+        pthread_setspecific(broker_key, c);
+    }
+    if ((!c->buf  ||  c->size < size)  &&  conn_grow(c, size) != 0)
+        return NULL;
+    return c;
+}
+
+/*
+ * Send the request (with the new buffer) and receive the reply.
+ * Return zero, GRD_BROKER_UNAVAILABLE if the request was not delivered,
+ * -1 if the reply is lost.
+ */
+static int conn_call(struct broker_conn* c, struct grd_broker_request* req,
+                     struct grd_broker_reply* reply)
+{
+    union
+    {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg;
+    struct cmsghdr* cmsg;
+    struct iovec iov;
+    ssize_t r;
+
+    assert(c && req && reply);
+    req->magic = GRD_BROKER_MAGIC;
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = req;
+    iov.iov_len = sizeof(*req);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (c->buf_fd >= 0)
+    {
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &c->buf_fd, sizeof(int));
+    }
+    while ((r = sendmsg(c->fd, &msg, MSG_NOSIGNAL)) < 0  &&  errno == EINTR)
+        ;
+    if (r != (ssize_t)sizeof(*req))
+    {
+        /* the broker is gone (restarted?): connect next time */
+        conn_drop(c);
+        return GRD_BROKER_UNAVAILABLE;
+    }
+    if (c->buf_fd >= 0)
+    {
+        close(c->buf_fd); /* the broker has it */
+        c->buf_fd = -1;
+    }
+    while ((r = recv(c->fd, reply, sizeof(*reply), 0)) < 0  &&  errno == EINTR)
+        ;
+    if (r != (ssize_t)sizeof(*reply))
+    {
+        conn_drop(c);
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+int grd_broker_ioctl(const char* dev_path, unsigned int prod_id, size_t pack_size,
+                     void* in, size_t len_in, void* out, size_t len_out)
+{
+    struct grd_broker_request req;
+    struct grd_broker_reply reply;
+    struct broker_conn* c;
+    int ret;
+
+    assert(dev_path);
+    if (strlen(dev_path) >= sizeof(req.path))
+        return GRD_BROKER_UNAVAILABLE;
+    c = conn_get(len_in + len_out);
+    if (!c)
+        return GRD_BROKER_UNAVAILABLE;
+
+    memset(&req, 0, sizeof(req));
+    req.op = GRD_BROKER_IOCTL;
+    req.prod_id = prod_id;
+    req.pack_size = pack_size;
+    req.len_in = len_in;
+    req.len_out = len_out;
+    strcpy(req.path, dev_path);
+    if (len_out > 0)
+        memcpy(c->buf, out, len_out);
+    ret = conn_call(c, &req, &reply);
+    if (ret != 0)
+        return ret;
+    if (reply.ret == 0  &&  len_in > 0)
+        memcpy(in, c->buf + len_out, len_in);
+    if (reply.ret != 0)
+        errno = reply.err;
+    return reply.ret;
+}
+
+int grd_broker_probe(const char* dev_path, unsigned int* prod_id)
+{
+    struct grd_broker_request req;
+    struct grd_broker_reply reply;
+    struct broker_conn* c;
+
+    assert(dev_path);
+    assert(prod_id);
+    if (strlen(dev_path) >= sizeof(req.path))
+        return GRD_BROKER_UNAVAILABLE;
+    c = conn_get(0);
+    if (!c)
+        return GRD_BROKER_UNAVAILABLE;
+
+    memset(&req, 0, sizeof(req));
+    req.op = GRD_BROKER_PROBE;
+    strcpy(req.path, dev_path);
+    if (conn_call(c, &req, &reply) != 0)
+        return GRD_BROKER_UNAVAILABLE; /* probe again directly */
+    if (reply.ret == 0)
+        *prod_id = reply.value;
+    else
+        errno = reply.err;
+    return reply.ret;
+}
+
+int grd_broker_search(search_usb_device_callback callback, void* param)
+{
+    struct grd_broker_request req;
+    struct grd_broker_reply reply;
+    struct broker_conn* c;
+    const char* path;
+    char* paths;
+    size_t size = 0;
+    uint32_t i;
+    int tries, count = 0;
+
+    assert(callback);
+    for (tries = 0; tries < BROKER_SEARCH_TRIES; ++tries)
+    {
+        c = conn_get(size);
+        if (!c)
+            return GRD_BROKER_UNAVAILABLE;
+        memset(&req, 0, sizeof(req));
+        req.op = GRD_BROKER_SEARCH;
+        req.len_in = c->size;
+        if (conn_call(c, &req, &reply) != 0)
+            return GRD_BROKER_UNAVAILABLE; /* search again directly */
+        if (reply.ret >= 0  ||  reply.err != ENOSPC)
+            break;
+        size = c->size * 2;
+    }
+    if (reply.ret < 0)
+    {
+        errno = reply.err;
+        return -1;
+    }
+    /* copy: the callbacks may call the broker with this connection */
+    path = (const char*)c->buf;
+    for (i = 0, size = 0; i < reply.value; ++i)
+        size += strlen(path + size) + 1;
+    paths = malloc(size + 1);
+    if (!paths)
+        return -1;
+    memcpy(paths, c->buf, size);
+
+    /* the callbacks run here, in the calling process */
+    for (i = 0, path = paths; i < reply.value; ++i)
+    {
+        if (callback(path, param))
+            ++count;
+        path += strlen(path) + 1;
+    }
+    free(paths);
+    return count;
+}
@@ -0,0 +1,615 @@
+/*
+ * GrdWine broker: owns the Guardant devices and serves the GrdWine processes
+ *
+ * Copyright (C) 2008 Aktiv Co. (Aleksey Samsonov)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/*
+ * grdbrokerd [-d]
+ * Listens on grdwine-broker.sock (see grdbroker.h), -d: run in the
+ * background. Only the processes of the same user (and root) are served,
+ * only the devices found by the broker itself are opened. The device sessions stay open (GRD_SESSION_IDLE is one
+ * hour unless set). Every device has a worker thread; its queue is served
+ * round-robin over the client processes, so a busy process can not starve
+ * the others; the worker of an idle device exits. The device locks are still taken for every call: processes
+ * which do not use the broker (libgrdapi.a, GRD_BROKER=0) keep working.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h> /* for PATH_MAX */
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+#include "grdimpl.h"
+#include "grdbroker.h"
+
+#define BROKER_MAX_CLIENTS      1024
+#define BROKER_SESSION_IDLE     "3600000" /* ms */
+#define BROKER_DEVICE_IDLE      60        /* s, then the worker exits */
+
+struct client
+{
+    struct client* next;
+    int fd;
+    pid_t pid;                  /* peer process */
+    unsigned int refs;          /* the connection and the queued jobs */
+    unsigned char* buf;         /* shared buffer of the client */
+    size_t size;
+};
+
+struct job
+{
+    struct job* next;
+    struct client* client;
+    struct grd_broker_request req;
+};
+
+/* Device (or the search: empty path) with its worker */
+struct device
+{
+    struct device* next;
+    pthread_cond_t cond;
+    struct job* jobs;           /* in arrival order */
+    pid_t last_pid;             /* the process served last */
+    char path[GRD_BROKER_PATH_LEN];
+};
+
+/* the clients, the devices and their queues */
+static pthread_mutex_t broker_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct client* clients;
+static struct device* devices;
+static volatile sig_atomic_t stop;
+
+struct search_result
+{
+    char* buf;
+    size_t size;
+    size_t used;
+    uint32_t count;
+    int overflow;
+};
+
+struct find_path
+{
+    const char* path;
+    int found;
+};
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    stop = 1;
+}
+
+/* Called with broker_mutex locked */
+static void client_put(struct client* c)
+{
+    assert(c);
+    assert(c->refs > 0);
+    if (--c->refs > 0)
+        return;
+    close(c->fd);
+    if (c->buf)
+        munmap(c->buf, c->size);
+    free(c);
+}
+
+/*
+ * Next job of the device: the first job of the process after the one served
+ * last (by pid, round-robin). Called with broker_mutex locked.
+ */
+static struct job* take_job(struct device* dev)
+{
+    struct job** p;
+    struct job** next = NULL;
+    struct job** first = NULL;
+    struct job* job;
+    pid_t pid;
+
+    assert(dev && dev->jobs);
+    for (p = &dev->jobs; *p; p = &(*p)->next)
+    {
+        pid = (*p)->client->pid;
+        if (!first  ||  pid < (*first)->client->pid)
+            first = p;
+        if (pid > dev->last_pid  &&  (!next  ||  pid < (*next)->client->pid))
+            next = p;
+    }
+    p = next ? next : first;
+    job = *p;
+    *p = job->next;
+    dev->last_pid = job->client->pid;
+    return job;
+}
+
+static int __attribute__((ms_abi)) add_path(const char* path, void* param)
+{
+    struct search_result* res = param;
+    size_t len = strlen(path) + 1;
+
+    if (res->used + len > res->size)
+    {
+        res->overflow = 1;
+        return 0;
+    }
+    memcpy(res->buf + res->used, path, len);
+    res->used += len;
+    ++res->count;
+    return 1;
+}
+
+static int __attribute__((ms_abi)) match_path(const char* path, void* param)
+{
+    struct find_path* f = param;
+
+    if (strcmp(path, f->path) == 0)
+        f->found = 1;
+    return 0;
+}
+
+/* Non-zero if the search finds the device: the clients choose the paths */
+static int known_path(const char* path)
+{
+    struct find_path f;
+
+    assert(path);
+    f.path = path;
+    f.found = 0;
+    search_usb_devices(match_path, &f);
+    return f.found;
+}
+
+static void run_job(struct job* job, struct grd_broker_reply* reply)
+{
+    struct grd_broker_request* req;
+    struct search_result res;
+    unsigned char* buf;
+    unsigned int prod_id;
+
+    assert(job && reply);
+    req = &job->req;
+    buf = job->client->buf;
+    memset(reply, 0, sizeof(*reply));
+    errno = 0;
+    switch (req->op)
+    {
+    case GRD_BROKER_IOCTL:
+        /* out data at offset 0, in data after it: no copies */
+        reply->ret = grd_ioctl_device(req->path, req->prod_id, (size_t)req->pack_size,
+                                      buf + req->len_out, (size_t)req->len_in,
+                                      buf, (size_t)req->len_out);
+        break;
+    case GRD_BROKER_PROBE:
+        reply->ret = grd_probe_device(req->path, &prod_id);
+        reply->value = prod_id;
+        break;
+    default:
+        memset(&res, 0, sizeof(res));
+        res.buf = (char*)buf;
+        res.size = (size_t)req->len_in;
+        reply->ret = search_usb_devices(add_path, &res);
+        reply->value = res.count;
+        if (res.overflow)
+        {
+            reply->ret = -1;
+            errno = ENOSPC;
+        }
+        break;
+    }
+    if (reply->ret < 0)
+        reply->err = errno ? errno : EIO;
+}
+
+static void* device_worker(void* arg)
+{
+    struct device* dev = arg;
+    struct device** p;
+    struct grd_broker_reply reply;
+    struct timespec deadline;
+    struct job* job;
+
+    pthread_mutex_lock(&broker_mutex);
+    for (;;)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += BROKER_DEVICE_IDLE;
+        while (!dev->jobs
+               &&  pthread_cond_timedwait(&dev->cond, &broker_mutex, &deadline) != ETIMEDOUT
+               )
+            ;
+        if (!dev->jobs)
+            break;
+        job = take_job(dev);
+        pthread_mutex_unlock(&broker_mutex);
+
+        run_job(job, &reply);
+        send(job->client->fd, &reply, sizeof(reply), MSG_NOSIGNAL);
+
+        pthread_mutex_lock(&broker_mutex);
+        client_put(job->client);
+        free(job);
+    }
+    /* idle: the next job of the device starts a new worker */
+    for (p = &devices; *p != dev; p = &(*p)->next)
+        ;
+    *p = dev->next;
+    pthread_mutex_unlock(&broker_mutex);
+    pthread_cond_destroy(&dev->cond);
+    free(dev);
+    return NULL;
+}
+
+/* Called with broker_mutex locked */
+static struct device* find_device(const char* path)
+{
+    struct device* dev;
+
+    for (dev = devices; dev; dev = dev->next)
+        if (strcmp(dev->path, path) == 0)
+            return dev;
+    return NULL;
+}
+
+/* Called with broker_mutex locked */
+static struct device* get_device(const char* path)
+{
+    pthread_condattr_t attr;
+    struct device* dev;
+    pthread_t thread;
+
+    dev = find_device(path);
+    if (dev)
+        return dev;
+    dev = calloc(1, sizeof(*dev));
+    if (!dev)
+        return NULL;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&dev->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    strcpy(dev->path, path);
+    if (pthread_create(&thread, NULL, device_worker, dev) != 0)
+    {
+        pthread_cond_destroy(&dev->cond);
+        free(dev);
+        return NULL;
+    }
+    pthread_detach(thread);
+    dev->next = devices;
+    devices = dev;
+    return dev;
+}
+
+/*
+ * Map the buffer passed by the client: it must be sealed, else the client
+ * could truncate it under the worker. Return zero on success.
+ */
+static int map_buffer(struct client* c, int fd)
+{
+    const int need = F_SEAL_SHRINK | F_SEAL_GROW;
+    struct stat st;
+    void* p;
+    int seals;
+
+    assert(c);
+    seals = fcntl(fd, F_GET_SEALS);
+    if (seals < 0  ||  (seals & need) != need
+        ||  fstat(fd, &st) != 0  ||  st.st_size <= 0
+        )
+        return -1;
+    p = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED)
+        return -1;
+    if (c->buf)
+        munmap(c->buf, c->size);
+    c->buf = p;
+    c->size = (size_t)st.st_size;
+    return 0;
+}
+
+static void send_error(struct client* c, int err)
+{
+    struct grd_broker_reply reply;
+
+    assert(c);
+    memset(&reply, 0, sizeof(reply));
+    reply.ret = -1;
+    reply.err = err;
+    send(c->fd, &reply, sizeof(reply), MSG_NOSIGNAL);
+}
+
+static int valid_request(const struct client* c, const struct grd_broker_request* req)
+{
+    assert(c && req);
+    if (req->magic != GRD_BROKER_MAGIC  ||  !c->buf
+        ||  memchr(req->path, '\0', sizeof(req->path)) == NULL
+        )
+        return 0;
+    switch (req->op)
+    {
+    case GRD_BROKER_IOCTL:
+        return req->pack_size > 0
+               &&  req->len_in % req->pack_size == 0  &&  req->len_out % req->pack_size == 0
+               &&  req->len_in <= c->size  &&  req->len_out <= c->size - req->len_in;
+    case GRD_BROKER_PROBE:
+        return 1;
+    case GRD_BROKER_SEARCH:
+        return req->len_in <= c->size;
+    }
+    return 0;
+}
+
+/*
+ * Read a request of the client and queue it.
+ * Return -1 if the connection is closed.
+ */
+static int read_request(struct client* c)
+{
+    union
+    {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg;
+    struct cmsghdr* cmsg;
+    struct iovec iov;
+    struct device* dev;
+    struct job* job;
+    struct job** tail;
+    const char* path;
+    ssize_t r;
+    int fd, busy;
+
+    job = calloc(1, sizeof(*job));
+    if (!job)
+        return -1;
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &job->req;
+    iov.iov_len = sizeof(job->req);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    r = recvmsg(c->fd, &msg, MSG_CMSG_CLOEXEC);
+    if (r < 0  &&  errno == EINTR)
+    {
+        free(job);
+        return 0;
+    }
+    for (cmsg = CMSG_FIRSTHDR(&msg); r > 0  &&  cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        if (cmsg->cmsg_level == SOL_SOCKET  &&  cmsg->cmsg_type == SCM_RIGHTS)
+        {
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+            pthread_mutex_lock(&broker_mutex);
+            busy = c->refs > 1; /* a job of the client uses the buffer */
+            pthread_mutex_unlock(&broker_mutex);
+            if (busy  ||  map_buffer(c, fd) != 0)
+                r = -1;
+            close(fd);
+        }
+    if (r != (ssize_t)sizeof(job->req))
+    {
+        free(job);
+        return -1;
+    }
+    if (!valid_request(c, &job->req))
+    {
+        free(job);
+        send_error(c, EINVAL);
+        return 0;
+    }
+
+    path = job->req.op == GRD_BROKER_SEARCH ? "" : job->req.path;
+    pthread_mutex_lock(&broker_mutex);
+    dev = find_device(path);
+    pthread_mutex_unlock(&broker_mutex);
+    if (!dev  &&  path[0] != '\0'  &&  !known_path(path))
+    {
+        free(job);
+        send_error(c, ENODEV);
+        return 0;
+    }
+    pthread_mutex_lock(&broker_mutex);
+    dev = get_device(path);
+    if (!dev)
+    {
+        pthread_mutex_unlock(&broker_mutex);
+        free(job);
+        return -1;
+    }
+    job->client = c;
+    ++c->refs;
+    job->next = NULL;
+    for (tail = &dev->jobs; *tail; tail = &(*tail)->next)
+        ;
+    *tail = job;
+    pthread_cond_signal(&dev->cond);
+    pthread_mutex_unlock(&broker_mutex);
+    return 0;
+}
+
+static void accept_client(int listen_fd, unsigned int* count)
+{
+    struct client* c;
+    pid_t pid;
+    int fd;
+
+    fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0)
+        return;
+    c = *count < BROKER_MAX_CLIENTS ? calloc(1, sizeof(*c)) : NULL;
+    if (!c  ||  grd_broker_check_peer(fd, &pid) != 0)
+    {
+        free(c);
+        close(fd);
+        return;
+    }
+    c->fd = fd;
+    c->pid = pid;
+    c->refs = 1;
+    pthread_mutex_lock(&broker_mutex);
+    c->next = clients;
+    clients = c;
+    pthread_mutex_unlock(&broker_mutex);
+    ++*count;
+}
+
+static int open_socket(void)
+{
+    char path[PATH_MAX];
+    struct sockaddr_un addr;
+    mode_t mode;
+    int fd, probe_fd;
+
+    if (grd_broker_socket_path(path, sizeof(path)) != 0
+        ||  strlen(path) >= sizeof(addr.sun_path)
+        )
+    {
+        fprintf(stderr, "grdbrokerd: no private directory for the socket"
+                        " (set GRD_IPC_NAME or XDG_RUNTIME_DIR)\n");
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    /* a socket left by a dead broker is removed, a live broker is kept */
+    probe_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (probe_fd >= 0  &&  connect(probe_fd, (struct sockaddr*)&addr, sizeof(addr)) == 0)
+    {
+        fprintf(stderr, "grdbrokerd: another broker listens on %s\n", path);
+        close(probe_fd);
+        return -1;
+    }
+    if (probe_fd >= 0)
+        close(probe_fd);
+    unlink(path);
+
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        perror("grdbrokerd: socket");
+        return -1;
+    }
+    mode = umask(077); /* the processes of this user connect */
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0  ||  listen(fd, 64) != 0)
+    {
+        umask(mode);
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    umask(mode);
+    return fd;
+}
+
+int main(int argc, char* argv[])
+{
+    struct pollfd* fds;
+    struct client** p;
+    struct client* c;
+    unsigned int count = 0, n, i;
+    int listen_fd, opt, background = 0;
+    char path[PATH_MAX];
+
+    while ((opt = getopt(argc, argv, "d")) != -1)
+    {
+        if (opt != 'd')
+        {
+            fprintf(stderr, "usage: grdbrokerd [-d]\n");
+            return 2;
+        }
+        background = 1;
+    }
+    /* the devices are accessed here directly, the sessions stay open */
+    setenv(GRD_BROKER_ENV, "0", 1);
+    setenv("GRD_SESSION_IDLE", BROKER_SESSION_IDLE, 0);
+
+    listen_fd = open_socket();
+    if (listen_fd < 0)
+        return 1;
+    if (background  &&  daemon(0, 0) != 0)
+    {
+        perror("grdbrokerd: daemon");
+        return 1;
+    }
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    signal(SIGPIPE, SIG_IGN);
+
+    fds = calloc(BROKER_MAX_CLIENTS + 1, sizeof(*fds));
+    if (!fds)
+        return 1;
+    while (!stop)
+    {
+        fds[0].fd = listen_fd;
+        fds[0].events = POLLIN;
+        n = 1;
+        pthread_mutex_lock(&broker_mutex);
+        for (c = clients; c; c = c->next)
+        {
+            fds[n].fd = c->fd;
+            fds[n].events = POLLIN;
+            ++n;
+        }
+        pthread_mutex_unlock(&broker_mutex);
+
+        if (poll(fds, n, -1) < 0)
+            continue; /* EINTR: check stop */
+        if (fds[0].revents & POLLIN)
+            accept_client(listen_fd, &count);
+        for (i = 1; i < n; ++i)
+        {
+            if (!fds[i].revents)
+                continue;
+            pthread_mutex_lock(&broker_mutex);
+            for (p = &clients; *p  &&  (*p)->fd != fds[i].fd; p = &(*p)->next)
+                ;
+            c = *p;
+            pthread_mutex_unlock(&broker_mutex);
+            if (!c  ||  read_request(c) == 0)
+                continue;
+            /* disconnected: the queued jobs keep the client until done */
+            pthread_mutex_lock(&broker_mutex);
+            for (p = &clients; *p != c; p = &(*p)->next)
+                ;
+            *p = c->next;
+            shutdown(c->fd, SHUT_RDWR);
+            client_put(c);
+            pthread_mutex_unlock(&broker_mutex);
+            --count;
+        }
+    }
+    if (grd_broker_socket_path(path, sizeof(path)) == 0)
+        unlink(path);
+    return 0;
+}
@@ -0,0 +1,127 @@
+/*
+ * Copyright (C) 2008 Aktiv Co. (Aleksey Samsonov)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#ifndef GRDCAPTURE__H__
+#define GRDCAPTURE__H__
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+#ifdef HAVE_STDDEF_H
+#include <stddef.h>
+#endif /* HAVE_STDDEF_H */
+#include <stdint.h>
+#include "grdstats.h"
+
+/*
+ * Capture of the calls: GRD_CAPTURE="prefix" makes every process append
+ * the shape and the times of its grd_ioctl_device and grd_probe_device
+ * calls to prefix.<pid>. The file is mapped in memory while it is written:
+ * the records stay in it if the process dies, and a reader may map it
+ * while it grows. The bytes of the packs are left out unless
+ * GRD_CAPTURE_PAYLOAD="1". grdreplay plays the captures back.
+ */
+
+#define GRD_CAPTURE_ENV         "GRD_CAPTURE"
+#define GRD_CAPTURE_PAYLOAD_ENV "GRD_CAPTURE_PAYLOAD"
+#define GRD_CAPTURE_MAGIC       0x50434447 /* "GDCP" */
+#define GRD_CAPTURE_VERSION     1
+
+/* Records */
+enum grd_capture_type
+{
+    GRD_CAPTURE_DEVICE = 1,     /* names dev: the payload is the path */
+    GRD_CAPTURE_IOCTL,          /* grd_ioctl_device: the payload is in, then out */
+    GRD_CAPTURE_PROBE           /* grd_probe_device: prod_id is the result */
+};
+
+/* Flags of a record */
+#define GRD_CAPTURE_BROKER      0x01 /* done by the broker */
+#define GRD_CAPTURE_PASSED      0x02 /* the lock was passed by a thread of the process */
+#define GRD_CAPTURE_CACHED      0x04 /* the probe result was cached */
+
+/* Flags of the file */
+#define GRD_CAPTURE_PAYLOADS    0x01 /* the records keep the bytes of the packs */
+
+/*
+ * File: the header, then the records, each followed by its payload padded
+ * to 8 bytes. The file is longer than the records (the space reserved for
+ * the next ones): length is the end of the last complete record.
+ */
+struct grd_capture_header
+{
+    uint32_t magic;             /* GRD_CAPTURE_MAGIC */
+    uint32_t version;           /* GRD_CAPTURE_VERSION */
+    uint32_t pid;
+    uint32_t record_size;       /* sizeof(struct grd_capture_record) */
+    uint32_t flags;             /* GRD_CAPTURE_PAYLOADS */
+    uint32_t dropped;           /* records not written (the file was full) */
+    uint64_t realtime_ns;       /* CLOCK_REALTIME at the start */
+    uint64_t monotonic_ns;      /* CLOCK_MONOTONIC at the start */
+    volatile uint64_t length;   /* bytes of the records after the header */
+} __attribute__((aligned(8)));
+
+struct grd_capture_record
+{
+    uint16_t type;              /* GRD_CAPTURE_* */
+    uint16_t flags;             /* GRD_CAPTURE_BROKER, ... */
+    uint32_t tid;
+    uint64_t start_ns;          /* CLOCK_MONOTONIC at the call */
+    uint64_t duration_ns;
+    uint64_t lock_ns;           /* wait for the turn and the lock of the device */
+    uint32_t dev;               /* see GRD_CAPTURE_DEVICE, from 1 */
+    uint32_t prod_id;
+    uint32_t pack_size;
+    uint32_t len_in;
+    uint32_t len_out;
+    int32_t err;                /* errno, zero: success */
+    uint32_t payload;           /* bytes which follow (without the padding) */
+    uint32_t reserved;
+} __attribute__((aligned(8)));
+
+/* A captured call in progress */
+struct grd_capture_call
+{
+    uint64_t start;
+    uint64_t lock_ns;
+    unsigned int flags;
+};
+
+extern int grd_capture_enabled;     /* -1 until the environment is read */
+
+/* Read the environment (once), return grd_capture_enabled */
+int grd_capture_init(void);
+
+/*
+ * Record the calls started by grd_capture_begin (errno is kept).
+ */
+void grd_capture_ioctl(const char* dev_path, unsigned int prod_id, size_t pack_size,
+                       const void* in, size_t len_in, const void* out, size_t len_out,
+                       const struct grd_capture_call* call, int err);
+void grd_capture_probe(const char* dev_path, unsigned int prod_id,
+                       const struct grd_capture_call* call, int err);
+
+/* Start of a call: zero if the capture is disabled */
+static inline uint64_t grd_capture_begin(void)
+{
+    if (grd_capture_enabled < 0)
+        grd_capture_init();
+    return grd_capture_enabled ? grd_stats_now() : 0;
+}
+
+#endif /* !GRDCAPTURE__H__ */
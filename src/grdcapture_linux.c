@@ -0,0 +1,316 @@
+/*
+ * Capture of the call shapes and times for grdreplay
+ *
+ * Copyright (C) 2008 Aktiv Co. (Aleksey Samsonov)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/*
+ * The file is grown by GRD_CAPTURE_CHUNK at least and mapped shared: a
+ * record is copied under capture_mutex, with no syscall unless the file
+ * grows. A forked child leaves the mapping of its parent and starts its
+ * own file on its first record.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h> /* for PATH_MAX */
+#include <stdio.h>  /* for snprintf */
+#include <time.h>
+#include <pthread.h>
+#include "grdcapture.h"
+
+#define GRD_CAPTURE_CHUNK       (1024 * 1024)
+#define GRD_CAPTURE_MAX_SIZE    (1024 * 1024 * 1024)
+#define GRD_CAPTURE_DEVICES     64
+#define GRD_CAPTURE_PAD(n)      (((n) + 7) & ~(size_t)7)
+
+int grd_capture_enabled = -1;
+
+static pthread_once_t capture_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t capture_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread uint32_t capture_tid;
+static char capture_prefix[PATH_MAX];
+static int capture_payload;
+/* the file of capture_pid (capture_mutex) */
+static pid_t capture_pid;
+static int capture_fd = -1;
+static struct grd_capture_header* capture_map;
+static size_t capture_size;
+static char* devices[GRD_CAPTURE_DEVICES];
+static unsigned int devices_count;
+
+static void capture_atfork_child(void)
+{
+    pthread_mutex_init(&capture_mutex, NULL);
+    capture_tid = 0;
+}
+
+static void capture_init(void)
+{
+    const char* env;
+
+    env = getenv(GRD_CAPTURE_ENV);
+    if (!env  ||  !*env  ||  strlen(env) >= sizeof(capture_prefix) - 16)
+    {
+        grd_capture_enabled = 0;
+        return;
+    }
+    strcpy(capture_prefix, env);
+    env = getenv(GRD_CAPTURE_PAYLOAD_ENV);
+    capture_payload = env  &&  strcmp(env, "1") == 0;
+    pthread_atfork(NULL, NULL, capture_atfork_child);
+    grd_capture_enabled = 1;
+}
+
+int grd_capture_init(void)
+{
+    pthread_once(&capture_once, capture_init);
+    return grd_capture_enabled;
+}
+
+static uint64_t clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/* Leave the file of the parent (or the failed one) */
+static void capture_close(void)
+{
+    unsigned int i;
+
+    if (capture_map)
+        munmap(capture_map, capture_size);
+    if (capture_fd >= 0)
+        close(capture_fd);
+    capture_map = NULL;
+    capture_size = 0;
+    capture_fd = -1;
+    for (i = 0; i < devices_count; ++i)
+        free(devices[i]);
+    devices_count = 0;
+}
+
+/* Start prefix.<pid> (capture_mutex is locked) */
+static int capture_open(void)
+{
+    char path[sizeof(capture_prefix) + sizeof(".-2147483648")];
+    void* map;
+    int fd, ret;
+
+    capture_close();
+    capture_pid = getpid();
+    ret = snprintf(path, sizeof(path), "%s.%d", capture_prefix, (int)capture_pid);
+    if (ret <= 0  ||  (size_t)ret >= sizeof(path))
+        return -1;
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP);
+    if (fd < 0)
+        return -1;
+    if (ftruncate(fd, GRD_CAPTURE_CHUNK) != 0)
+    {
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+    map = mmap(NULL, GRD_CAPTURE_CHUNK, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+    capture_fd = fd;
+    capture_map = map;
+    capture_size = GRD_CAPTURE_CHUNK;
+    capture_map->version = GRD_CAPTURE_VERSION;
+    capture_map->pid = (uint32_t)capture_pid;
+    capture_map->record_size = sizeof(struct grd_capture_record);
+    capture_map->flags = capture_payload ? GRD_CAPTURE_PAYLOADS : 0;
+    capture_map->realtime_ns = clock_ns(CLOCK_REALTIME);
+    capture_map->monotonic_ns = clock_ns(CLOCK_MONOTONIC);
+    capture_map->length = 0;
+    /* a reader takes the file once the magic is there */
+    __atomic_store_n(&capture_map->magic, GRD_CAPTURE_MAGIC, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* Room for len more bytes (capture_mutex is locked) */
+static int capture_reserve(size_t len)
+{
+    size_t need, size;
+    void* map;
+
+    need = sizeof(*capture_map) + capture_map->length + len;
+    if (need <= capture_size)
+        return 0;
+    if (need > GRD_CAPTURE_MAX_SIZE)
+        return -1;
+    size = capture_size * 2 > need ? capture_size * 2 : need + GRD_CAPTURE_CHUNK;
+    if (size > GRD_CAPTURE_MAX_SIZE)
+        size = GRD_CAPTURE_MAX_SIZE;
+    if (ftruncate(capture_fd, (off_t)size) != 0)
+        return -1;
+    map = mremap(capture_map, capture_size, size, MREMAP_MAYMOVE);
+    if (map == MAP_FAILED)
+        return -1;
+    capture_map = map;
+    capture_size = size;
+    return 0;
+}
+
+/* Append a record and its payload (capture_mutex is locked) */
+static void capture_append(struct grd_capture_record* r, const void* p1, size_t n1,
+                           const void* p2, size_t n2)
+{
+    char* dst;
+
+    if (capture_reserve(sizeof(*r) + GRD_CAPTURE_PAD(n1 + n2)) != 0)
+    {
+        ++capture_map->dropped;
+        return;
+    }
+    r->payload = (uint32_t)(n1 + n2);
+    dst = (char*)(capture_map + 1) + capture_map->length;
+    memcpy(dst, r, sizeof(*r));
+    dst += sizeof(*r);
+    if (n1)
+        memcpy(dst, p1, n1);
+    if (n2)
+        memcpy(dst + n1, p2, n2);
+    memset(dst + n1 + n2, 0, GRD_CAPTURE_PAD(n1 + n2) - n1 - n2);
+    /* the record is complete before a reader sees it */
+    __atomic_store_n(&capture_map->length,
+                     capture_map->length + sizeof(*r) + GRD_CAPTURE_PAD(n1 + n2),
+                     __ATOMIC_RELEASE);
+}
+
+/* Number of the device in the file, its record written first (capture_mutex is locked) */
+static unsigned int capture_device(const char* dev_path)
+{
+    struct grd_capture_record r;
+    unsigned int i;
+
+    for (i = 0; i < devices_count; ++i)
+        if (strcmp(devices[i], dev_path) == 0)
+            return i + 1;
+    if (devices_count == GRD_CAPTURE_DEVICES)
+        return 0;
+    devices[devices_count] = strdup(dev_path);
+    if (!devices[devices_count])
+        return 0;
+    ++devices_count;
+    memset(&r, 0, sizeof(r));
+    r.type = GRD_CAPTURE_DEVICE;
+    r.tid = capture_tid;
+    r.start_ns = clock_ns(CLOCK_MONOTONIC);
+    r.dev = devices_count;
+    capture_append(&r, dev_path, strlen(dev_path) + 1, NULL, 0);
+    return devices_count;
+}
+
+/* Fill the common fields and lock the file, return -1 if there is none */
+static int capture_lock(struct grd_capture_record* r, enum grd_capture_type type,
+                        const struct grd_capture_call* call, int err)
+{
+    uint64_t end;
+
+    assert(call);
+    end = grd_stats_now();
+    if (!capture_tid)
+        capture_tid = (uint32_t)syscall(SYS_gettid);
+    memset(r, 0, sizeof(*r));
+    r->type = (uint16_t)type;
+    r->flags = (uint16_t)call->flags;
+    r->tid = capture_tid;
+    r->start_ns = call->start;
+    r->duration_ns = end - call->start;
+    r->lock_ns = call->lock_ns;
+    r->err = err;
+
+    pthread_mutex_lock(&capture_mutex);
+    if (capture_pid != getpid()  &&  capture_open() != 0)
+        capture_close(); /* not again in this process */
+    if (!capture_map)
+    {
+        pthread_mutex_unlock(&capture_mutex);
+        return -1;
+    }
+    return 0;
+}
+
+static size_t clamp_len(size_t len)
+{
+    return len > UINT32_MAX ? UINT32_MAX : len;
+}
+
+void grd_capture_ioctl(const char* dev_path, unsigned int prod_id, size_t pack_size,
+                       const void* in, size_t len_in, const void* out, size_t len_out,
+                       const struct grd_capture_call* call, int err)
+{
+    struct grd_capture_record r;
+    const int saved = errno;
+
+    assert(dev_path);
+    if (capture_lock(&r, GRD_CAPTURE_IOCTL, call, err) != 0)
+    {
+        errno = saved;
+        return;
+    }
+    r.dev = capture_device(dev_path);
+    r.prod_id = prod_id;
+    r.pack_size = (uint32_t)clamp_len(pack_size);
+    r.len_in = (uint32_t)clamp_len(len_in);
+    r.len_out = (uint32_t)clamp_len(len_out);
+    if (capture_payload  &&  in  &&  out  &&  len_in + len_out < GRD_CAPTURE_CHUNK)
+        capture_append(&r, in, len_in, out, len_out);
+    else
+        capture_append(&r, NULL, 0, NULL, 0);
+    pthread_mutex_unlock(&capture_mutex);
+    errno = saved;
+}
+
+void grd_capture_probe(const char* dev_path, unsigned int prod_id,
+                       const struct grd_capture_call* call, int err)
+{
+    struct grd_capture_record r;
+    const int saved = errno;
+
+    assert(dev_path);
+    if (capture_lock(&r, GRD_CAPTURE_PROBE, call, err) != 0)
+    {
+        errno = saved;
+        return;
+    }
+    r.dev = capture_device(dev_path);
+    r.prod_id = prod_id;
+    capture_append(&r, NULL, 0, NULL, 0);
+    pthread_mutex_unlock(&capture_mutex);
+    errno = saved;
+}
@@ -0,0 +1,446 @@
+/*
+ * Emulated Guardant devices (transport for testing and benchmarking)
+ *
+ * Copyright (C) 2008 Aktiv Co. (Aleksey Samsonov)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/*
+ * GRD_EMUL="devices[:option=value...]" replaces the USB devices, e.g.
+ *     GRD_EMUL="sign*2,code_hid:latency=300:jitter=100:fail=0.01:failmode=eio"
+ * devices:  sign, code, sign_winusb, code_winusb (bulk), sign_hid, code_hid
+ *           (HID), "*N" repeats the device
+ * latency:  delay of every transfer (microseconds)
+ * jitter:   random delay added to latency (0 .. jitter microseconds)
+ * pack:     largest pack accepted by the device (bytes, 0: any)
+ * fail:     probability of a failed transfer (0 .. 1)
+ * failmode: eio (the transfer fails), timeout (it fails after the timeout),
+ *           nodev (the device is unplugged and plugged in again)
+ * The device answers every read with the last written pack, bits inverted.
+ * Invalid devices and options are skipped.
+ * The devices are named EMUL_PATH_HEAD + N.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>  /* for snprintf */
+#include <time.h>
+#include <pthread.h>
+#include "grdimpl.h"
+#include "grdimpl_linux.h"
+#include "grdtransport.h"
+
+#define EMUL_ENV                "GRD_EMUL"
+#define EMUL_PATH_HEAD          "emul:"
+#define EMUL_MAX_COUNT          64
+#define EMUL_MAX_PACK           4096
+
+#define EMUL_FAIL_EIO           0
+#define EMUL_FAIL_TIMEOUT       1
+#define EMUL_FAIL_NODEV         2
+
+struct emul_device
+{
+    unsigned int prod_id;
+    pthread_mutex_t mutex;
+    unsigned int seed;          /* rand_r state */
+    size_t last_len;            /* last written pack */
+    unsigned char last[EMUL_MAX_PACK];
+};
+
+static const struct
+{
+    const char* name;
+    unsigned int prod_id;
+} emul_kinds[] =
+{
+    { "sign",           GRD_PRODID_S3S },
+    { "sign_winusb",    GRD_PRODID_S3S_WINUSB },
+    { "sign_hid",       GRD_PRODID_S3S_HID },
+    { "code",           GRD_PRODID_S3C },
+    { "code_winusb",    GRD_PRODID_S3C_WINUSB },
+    { "code_hid",       GRD_PRODID_S3C_HID }
+};
+
+static pthread_once_t emul_once = PTHREAD_ONCE_INIT;
+static struct emul_device* emul_devices;
+static size_t emul_count;
+static long emul_latency_us;
+static long emul_jitter_us;
+static size_t emul_pack;
+static double emul_fail;
+static int emul_fail_mode = EMUL_FAIL_EIO;
+
+static int parse_device(const char* s, size_t len)
+{
+    const char* star;
+    unsigned long n = 1, i;
+    size_t name_len, k;
+    char* end;
+
+    star = memchr(s, '*', len);
+    name_len = star ? (size_t)(star - s) : len;
+    if (star)
+    {
+        n = strtoul(star + 1, &end, 10);
+        if (end != s + len)
+            return -1;
+    }
+    for (k = 0; k < sizeof(emul_kinds) / sizeof(emul_kinds[0]); ++k)
+        if (strlen(emul_kinds[k].name) == name_len
+            &&  strncmp(emul_kinds[k].name, s, name_len) == 0
+            )
+            break;
+    if (k == sizeof(emul_kinds) / sizeof(emul_kinds[0]))
+        return -1;
+    for (i = 0; i < n  &&  emul_count < EMUL_MAX_COUNT; ++i)
+    {
+        struct emul_device* d = &emul_devices[emul_count];
+
+        d->prod_id = emul_kinds[k].prod_id;
+        d->seed = (unsigned int)emul_count + 1;
+        pthread_mutex_init(&d->mutex, NULL);
+        ++emul_count;
+    }
+    return 0;
+}
+
+static int parse_option(const char* s, size_t len)
+{
+    char buf[64];
+    char* value;
+    char* end;
+
+    if (len >= sizeof(buf))
+        return -1;
+    memcpy(buf, s, len);
+    buf[len] = '\0';
+    value = strchr(buf, '=');
+    if (!value)
+        return -1;
+    *value++ = '\0';
+    if (strcmp(buf, "failmode") == 0)
+    {
+        if (strcmp(value, "eio") == 0)
+            emul_fail_mode = EMUL_FAIL_EIO;
+        else if (strcmp(value, "timeout") == 0)
+            emul_fail_mode = EMUL_FAIL_TIMEOUT;
+        else if (strcmp(value, "nodev") == 0)
+            emul_fail_mode = EMUL_FAIL_NODEV;
+        else
+            return -1;
+        return 0;
+    }
+    if (strcmp(buf, "fail") == 0)
+    {
+        emul_fail = strtod(value, &end);
+        return (*end == '\0'  &&  emul_fail >= 0) ? 0 : -1;
+    }
+    if (strcmp(buf, "latency") == 0)
+        emul_latency_us = strtol(value, &end, 10);
+    else if (strcmp(buf, "jitter") == 0)
+        emul_jitter_us = strtol(value, &end, 10);
+    else if (strcmp(buf, "pack") == 0)
+        emul_pack = (size_t)strtoul(value, &end, 10);
+    else
+        return -1;
+    return (*end == '\0'  &&  emul_latency_us >= 0  &&  emul_jitter_us >= 0) ? 0 : -1;
+}
+
+static void emul_init(void)
+{
+    const char* env;
+    const char* p;
+    const char* next;
+    size_t len;
+    int in_options = 0;
+
+    env = getenv(EMUL_ENV);
+    if (!env  ||  !*env)
+        return;
+    emul_devices = calloc(EMUL_MAX_COUNT, sizeof(*emul_devices));
+    if (!emul_devices)
+        return;
+    /* device,device,...:option:option... */
+    for (p = env; *p; p = *next ? next + 1 : next)
+    {
+        next = p + strcspn(p, in_options ? ":" : ",:");
+        len = (size_t)(next - p);
+        /* an invalid entry is skipped (no output from the library) */
+        if (len > 0  &&  in_options)
+            parse_option(p, len);
+        else if (len > 0)
+            parse_device(p, len);
+        if (*next == ':')
+            in_options = 1;
+    }
+}
+
+/* Return the device, or NULL */
+static struct emul_device* find_device(const char* path)
+{
+    unsigned long n;
+    char* end;
+
+    assert(path);
+    if (strncmp(path, EMUL_PATH_HEAD, sizeof(EMUL_PATH_HEAD) - 1) != 0)
+        return NULL;
+    path += sizeof(EMUL_PATH_HEAD) - 1;
+    n = strtoul(path, &end, 10);
+    if (end == path  ||  *end != '\0'  ||  n >= emul_count)
+        return NULL;
+    return &emul_devices[n];
+}
+
+/*
+ * Wait as the device would, then fail as configured (a timeout fails
+ * after timeout_ms). Called with the device mutex locked. Return zero on
+ * success.
+ */
+static int emul_transfer(struct emul_device* d, int timeout_ms)
+{
+    struct timespec delay;
+    long us = emul_latency_us;
+
+    assert(d);
+    if (emul_jitter_us > 0)
+        us += (long)(rand_r(&d->seed) % (unsigned long)(emul_jitter_us + 1));
+    if (emul_fail > 0  &&  rand_r(&d->seed) < emul_fail * ((double)RAND_MAX + 1))
+    {
+        if (emul_fail_mode == EMUL_FAIL_TIMEOUT)
+            us = timeout_ms * 1000L;
+        else
+            us = 0;
+        if (us > 0)
+        {
+            delay.tv_sec = us / 1000000;
+            delay.tv_nsec = (us % 1000000) * 1000;
+            while (nanosleep(&delay, &delay) != 0  &&  errno == EINTR)
+                ;
+        }
+        errno = emul_fail_mode == EMUL_FAIL_TIMEOUT ? ETIMEDOUT
+                : (emul_fail_mode == EMUL_FAIL_NODEV ? ENODEV : EIO);
+        return -1;
+    }
+    if (us > 0)
+    {
+        delay.tv_sec = us / 1000000;
+        delay.tv_nsec = (us % 1000000) * 1000;
+        while (nanosleep(&delay, &delay) != 0  &&  errno == EINTR)
+            ;
+    }
+    return 0;
+}
+
+static int emul_identify(const char* path, struct grd_dev_id* id)
+{
+    size_t i;
+
+    assert(path);
+    assert(id);
+    memset(id, 0, sizeof(*id));
+    if (strlen(path) >= sizeof(id->serial))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    id->kind = GRD_DEV_ID_NAME;
+    strcpy(id->serial, path);
+    for (i = 0; path[i]; ++i)
+        id->ino = id->ino * 31 + (unsigned char)path[i];
+    return 0;
+}
+
+static int emul_open(struct grd_device* dev, const char* path)
+{
+    assert(dev);
+    pthread_once(&emul_once, emul_init);
+    dev->priv = find_device(path);
+    if (!dev->priv)
+    {
+        errno = ENOENT;
+        return -1;
+    }
+    return 0;
+}
+
+static void emul_close(struct grd_device* dev)
+{
+    assert(dev);
+    dev->priv = NULL;
+}
+
+static int emul_get_prodid(struct grd_device* dev, unsigned int* prod_id)
+{
+    struct emul_device* d;
+
+    assert(dev && dev->priv);
+    assert(prod_id);
+    d = dev->priv;
+    *prod_id = d->prod_id;
+    return 0;
+}
+
+static int emul_claim(struct grd_device* dev)
+{
+    (void)dev;
+    return 0;
+}
+
+static int emul_write(struct grd_device* dev, void* buf, size_t len)
+{
+    struct emul_device* d;
+    int ret;
+
+    assert(dev && dev->priv);
+    d = dev->priv;
+    if (len > EMUL_MAX_PACK  ||  (emul_pack > 0  &&  len > emul_pack))
+    {
+        errno = EOVERFLOW;
+        return -1;
+    }
+    pthread_mutex_lock(&d->mutex);
+    ret = emul_transfer(d, grd_device_timeout(dev));
+    if (ret == 0  &&  buf  &&  len > 0) /* not the idle HID report */
+    {
+        memcpy(d->last, buf, len);
+        d->last_len = len;
+    }
+    pthread_mutex_unlock(&d->mutex);
+    return ret;
+}
+
+static int emul_read(struct grd_device* dev, void* buf, size_t len)
+{
+    struct emul_device* d;
+    unsigned char* p = buf;
+    size_t i;
+    int ret;
+
+    assert(dev && dev->priv);
+    assert(buf);
+    d = dev->priv;
+    if (len > EMUL_MAX_PACK  ||  (emul_pack > 0  &&  len > emul_pack))
+    {
+        errno = EOVERFLOW;
+        return -1;
+    }
+    pthread_mutex_lock(&d->mutex);
+    ret = emul_transfer(d, grd_device_timeout(dev));
+    if (ret == 0)
+        for (i = 0; i < len; ++i)
+            p[i] = i < d->last_len ? (unsigned char)~d->last[i] : 0;
+    pthread_mutex_unlock(&d->mutex);
+    return ret;
+}
+
+static int emul_bulk_write(struct grd_device* dev, void* buf, size_t len)
+{
+    struct emul_device* d = dev->priv;
+
+    assert(d);
+    if (grd_is_hid_prodid(d->prod_id))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    return emul_write(dev, buf, len);
+}
+
+static int emul_bulk_read(struct grd_device* dev, void* buf, size_t len)
+{
+    struct emul_device* d = dev->priv;
+
+    assert(d);
+    if (grd_is_hid_prodid(d->prod_id))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    return emul_read(dev, buf, len);
+}
+
+static int emul_hid_write(struct grd_device* dev, void* buf, size_t len)
+{
+    struct emul_device* d = dev->priv;
+
+    assert(d);
+    if (!grd_is_hid_prodid(d->prod_id))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    return emul_write(dev, buf, len);
+}
+
+static int emul_hid_read(struct grd_device* dev, void* buf, size_t len)
+{
+    struct emul_device* d = dev->priv;
+
+    assert(d);
+    if (!grd_is_hid_prodid(d->prod_id))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    return emul_read(dev, buf, len);
+}
+
+static int emul_search(search_usb_device_callback callback, void* param)
+{
+    char path[32];
+    size_t i;
+    int count = 0;
+
+    assert(callback);
+    pthread_once(&emul_once, emul_init);
+    for (i = 0; i < emul_count; ++i)
+    {
+        snprintf(path, sizeof(path), EMUL_PATH_HEAD "%u", (unsigned int)i);
+        if (callback(path, param))
+            ++count;
+    }
+    return count;
+}
+
+const struct grd_transport grd_transport_emul =
+{
+    "emul",
+    emul_identify,
+    emul_open,
+    emul_close,
+    emul_get_prodid,
+    emul_claim,
+    emul_claim, /* release */
+    emul_bulk_write,
+    emul_bulk_read,
+    NULL, /* bulk_exchange */
+    emul_hid_write,
+    emul_hid_read,
+    NULL, /* hid_flush */
+    emul_search
+};
+
+const struct grd_transport* grd_transport_override(void)
+{
+    pthread_once(&emul_once, emul_init);
+    return emul_devices ? &grd_transport_emul : NULL;
+}
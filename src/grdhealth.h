@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2008 Aktiv Co. (Aleksey Samsonov)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+
+#ifndef GRDHEALTH__H__
+#define GRDHEALTH__H__
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+#ifdef HAVE_STDDEF_H
+#include <stddef.h>
+#endif /* HAVE_STDDEF_H */
+#include <stdint.h>
+
+/*
+ * Health of a device: the transfer timeout from the observed latency of
+ * the packs, and a circuit breaker which fails the calls at once after
+ * several failed exchanges in a row.
+ *
+ * GRD_TIMEOUT="floor:ceiling" bounds the timeout (ms, default 500:3000),
+ * GRD_BREAKER="failures" is the count of failures which opens the breaker
+ * (default 3, "0" disables it).
+ */
+
+#define GRD_HEALTH_BUCKETS      24   /* bucket n: [2^n, 2^(n+1)) microseconds */
+
+/* States of the breaker */
+#define GRD_BREAKER_CLOSED      0    /* the calls go to the device */
+#define GRD_BREAKER_OPEN        1    /* the calls fail at once, the device is checked */
+#define GRD_BREAKER_HALF_OPEN   2    /* the device is back: the next call is a trial */
+
+struct grd_health
+{
+    uint32_t buckets[GRD_HEALTH_BUCKETS]; /* latency of the packs */
+    uint32_t samples;
+    unsigned int timeout_ms;    /* of one pack */
+    volatile int state;         /* GRD_BREAKER_* */
+    unsigned int failures;      /* failed exchanges in a row */
+    unsigned int backoff_ms;    /* between the checks of an open breaker */
+    uint64_t check_ms;          /* open breaker: the time of the next check */
+};
+
+void grd_health_init(struct grd_health* h);
+
+/*
+ * Return zero if a call may go to the device, -1 if the breaker is open.
+ */
+int grd_health_admit(const struct grd_health* h);
+
+/*
+ * An exchange of packs packs succeeded in transfer_ns. Return non-zero if
+ * this closed the breaker.
+ */
+int grd_health_success(struct grd_health* h, uint64_t transfer_ns, size_t packs);
+
+/*
+ * An exchange failed with errno err. Return non-zero if this opened the
+ * breaker.
+ */
+int grd_health_failure(struct grd_health* h, int err);
+
+/*
+ * Return non-zero if the open breaker is due for a check of the device
+ * (now_ms is CLOCK_MONOTONIC).
+ */
+int grd_health_check_due(const struct grd_health* h, uint64_t now_ms);
+
+/*
+ * Result of the check of the device: ok non-zero moves the breaker to
+ * half-open, else the next check is later.
+ */
+void grd_health_checked(struct grd_health* h, int ok, uint64_t now_ms);
+
+#endif /* !GRDHEALTH__H__ */
@@ -0,0 +1,242 @@
+/*
+ * Adaptive transfer timeouts and circuit breaker of the devices
+ *
+ * Copyright (C) 2008 Aktiv Co. (Aleksey Samsonov)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/*
+ * The timeout of a pack is GRD_TIMEOUT_FACTOR times the p99 of the pack
+ * latency, within the floor and the ceiling; the ceiling until enough
+ * packs are seen. A timed out exchange doubles the timeout: a slow
+ * operation of the dongle is not cut again and again. The samples are
+ * halved now and then, so that the old ones fade.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "grdhealth.h"
+#include "grdtransport.h"
+
+#define GRD_TIMEOUT_ENV         "GRD_TIMEOUT"   /* "floor:ceiling", ms */
+#define GRD_TIMEOUT_FLOOR_MS    500
+#define GRD_TIMEOUT_FACTOR      4
+#define GRD_BREAKER_ENV         "GRD_BREAKER"   /* failures in a row */
+#define GRD_BREAKER_FAILURES    3
+#define GRD_BREAKER_CHECK_MS    500             /* the first check of an open breaker */
+#define GRD_BREAKER_BACKOFF_MS  10000           /* the longest time between checks */
+#define GRD_HEALTH_MIN_SAMPLES  32
+#define GRD_HEALTH_MAX_SAMPLES  1024            /* then the samples are halved */
+#define GRD_HEALTH_UPDATE       16              /* the timeout is computed so often */
+
+static pthread_once_t health_once = PTHREAD_ONCE_INIT;
+static unsigned int timeout_floor_ms = GRD_TIMEOUT_FLOOR_MS;
+static unsigned int timeout_ceiling_ms = GRD_TRANSFER_TIMEOUT_MS;
+static unsigned int breaker_failures = GRD_BREAKER_FAILURES;
+
+static uint64_t monotonic_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static void health_init(void)
+{
+    const char* env;
+    char* end;
+    unsigned long floor_ms, ceiling_ms, n;
+
+    env = getenv(GRD_TIMEOUT_ENV);
+    if (env)
+    {
+        floor_ms = strtoul(env, &end, 10);
+        if (end != env  &&  *end == ':')
+        {
+            env = end + 1;
+            ceiling_ms = strtoul(env, &end, 10);
+            if (end != env  &&  *end == '\0'  &&  floor_ms > 0
+                &&  floor_ms <= ceiling_ms  &&  ceiling_ms <= 60000
+                )
+            {
+                timeout_floor_ms = (unsigned int)floor_ms;
+                timeout_ceiling_ms = (unsigned int)ceiling_ms;
+            }
+        }
+    }
+    env = getenv(GRD_BREAKER_ENV);
+    if (env)
+    {
+        n = strtoul(env, &end, 10);
+        if (end != env  &&  *end == '\0'  &&  n < 1000)
+            breaker_failures = (unsigned int)n;
+    }
+}
+
+void grd_health_init(struct grd_health* h)
+{
+    assert(h);
+    pthread_once(&health_once, health_init);
+    memset(h, 0, sizeof(*h));
+    h->timeout_ms = timeout_ceiling_ms;
+    h->state = GRD_BREAKER_CLOSED;
+    h->backoff_ms = GRD_BREAKER_CHECK_MS;
+}
+
+static void halve_samples(struct grd_health* h)
+{
+    unsigned int b;
+
+    h->samples = 0;
+    for (b = 0; b < GRD_HEALTH_BUCKETS; ++b)
+    {
+        h->buckets[b] /= 2;
+        h->samples += h->buckets[b];
+    }
+}
+
+static void update_timeout(struct grd_health* h)
+{
+    uint32_t target, sum = 0;
+    unsigned int b;
+    uint64_t ms;
+
+    if (h->samples < GRD_HEALTH_MIN_SAMPLES)
+    {
+        h->timeout_ms = timeout_ceiling_ms;
+        return;
+    }
+    target = h->samples - h->samples / 100;
+    for (b = 0; b < GRD_HEALTH_BUCKETS - 1; ++b)
+    {
+        sum += h->buckets[b];
+        if (sum >= target)
+            break;
+    }
+    /* the upper bound of the p99 bucket */
+    ms = ((uint64_t)2 << b) * GRD_TIMEOUT_FACTOR / 1000;
+    if (ms < timeout_floor_ms)
+        ms = timeout_floor_ms;
+    if (ms > timeout_ceiling_ms)
+        ms = timeout_ceiling_ms;
+    h->timeout_ms = (unsigned int)ms;
+}
+
+int grd_health_admit(const struct grd_health* h)
+{
+    assert(h);
+    return h->state == GRD_BREAKER_OPEN ? -1 : 0;
+}
+
+int grd_health_success(struct grd_health* h, uint64_t transfer_ns, size_t packs)
+{
+    uint64_t us;
+    unsigned int b = 0;
+    int closed = 0;
+
+    assert(h);
+    if (packs > 0)
+    {
+        us = transfer_ns / 1000 / packs;
+        while (us > 1  &&  b < GRD_HEALTH_BUCKETS - 1)
+        {
+            us >>= 1;
+            ++b;
+        }
+        ++h->buckets[b];
+        if (++h->samples >= GRD_HEALTH_MAX_SAMPLES)
+            halve_samples(h);
+        if (h->samples % GRD_HEALTH_UPDATE == 0  ||  h->samples == GRD_HEALTH_MIN_SAMPLES)
+            update_timeout(h);
+    }
+    h->failures = 0;
+    if (h->state != GRD_BREAKER_CLOSED)
+    {
+        h->state = GRD_BREAKER_CLOSED;
+        h->backoff_ms = GRD_BREAKER_CHECK_MS;
+        closed = 1;
+    }
+    return closed;
+}
+
+/* Errors of the call, not of the device */
+static int is_call_error(int err)
+{
+    return err == EINVAL  ||  err == ENOMEM  ||  err == EOVERFLOW  ||  err == ENAMETOOLONG
+           ||  err == EACCES  ||  err == EPERM;
+}
+
+int grd_health_failure(struct grd_health* h, int err)
+{
+    assert(h);
+    if (is_call_error(err))
+        return 0;
+    if (err == ETIMEDOUT  &&  h->timeout_ms < timeout_ceiling_ms)
+    {
+        /* maybe a slow operation: wait longer, trust the old samples less */
+        h->timeout_ms = h->timeout_ms * 2 < timeout_ceiling_ms
+                        ? h->timeout_ms * 2 : timeout_ceiling_ms;
+        halve_samples(h);
+    }
+    ++h->failures;
+    if (h->state == GRD_BREAKER_HALF_OPEN)
+    {
+        /* the trial failed: check again later */
+        h->backoff_ms = h->backoff_ms * 2 < GRD_BREAKER_BACKOFF_MS
+                        ? h->backoff_ms * 2 : GRD_BREAKER_BACKOFF_MS;
+        h->check_ms = monotonic_ms() + h->backoff_ms;
+        h->state = GRD_BREAKER_OPEN;
+        return 1;
+    }
+    if (h->state == GRD_BREAKER_CLOSED  &&  breaker_failures > 0
+        &&  h->failures >= breaker_failures
+        )
+    {
+        h->check_ms = monotonic_ms() + h->backoff_ms;
+        h->state = GRD_BREAKER_OPEN;
+        return 1;
+    }
+    return 0;
+}
+
+int grd_health_check_due(const struct grd_health* h, uint64_t now_ms)
+{
+    assert(h);
+    return h->state == GRD_BREAKER_OPEN  &&  now_ms >= h->check_ms;
+}
+
+void grd_health_checked(struct grd_health* h, int ok, uint64_t now_ms)
+{
+    assert(h);
+    if (h->state != GRD_BREAKER_OPEN)
+        return;
+    if (ok)
+    {
+        h->state = GRD_BREAKER_HALF_OPEN;
+        return;
+    }
+    h->backoff_ms = h->backoff_ms * 2 < GRD_BREAKER_BACKOFF_MS
+                    ? h->backoff_ms * 2 : GRD_BREAKER_BACKOFF_MS;
+    h->check_ms = now_ms + h->backoff_ms;
+}
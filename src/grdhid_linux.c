@@ -0,0 +1,480 @@
+/*
+ * Linux USB HID transports of the GrdWine (hiddev and hidraw)
+ *
+ * Copyright (C) 2008 Aktiv Co. (Aleksey Samsonov)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/*
+ * System calls per 64-byte report:
+ *   hiddev: write 2 (HIDIOCSUSAGES, HIDIOCSREPORT),
+ *           read 4 (select, read, HIDIOCGREPORT, HIDIOCGUSAGES)
+ *           and a poll per claim (the input of the other processes)
+ *   hidraw: write 1, read 2 (poll, read) and a poll per claim
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+#include <assert.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h> /* for major, minor */
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <poll.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h> /* for PATH_MAX */
+#include <stdio.h>  /* for snprintf */
+#include <linux/hiddev.h>
+#include <linux/hidraw.h>
+#include "grdimpl_linux.h"
+#include "grdhidreg.h"
+#include "grdtransport.h"
+
+#define HIDRAW_PATH_HEAD        "/dev/hidraw"
+#define HID_REPORT_LEN          64
+
+static int hiddevice_get_prodid(int fd, unsigned int* id)
+{
+    struct hiddev_devinfo devinfo;
+
+    assert(fd >= 0);
+    if (ioctl(fd, HIDIOCGDEVINFO, &devinfo) != 0)
+        return -1;
+    if (devinfo.vendor != GRD_VENDOR)
+        return -1;
+    if (!grd_is_hid_prodid(devinfo.product))
+        return -1;
+    assert(id);
+    *id = devinfo.product;
+    return 0;
+}
+
+static int hiddevice_write(int fd, void* buf, size_t len)
+{
+    const size_t report_len = 64;
+    struct hiddev_usage_ref_multi ref;
+    struct hiddev_report_info info;
+    size_t i, n;
+
+    if (len == 0 && buf == NULL)
+        len = report_len; /* idle report */
+
+    assert(len > 0);
+    assert(len % report_len == 0);
+    for (n = 0; n < len / report_len; ++n)
+    {
+        ref.uref.report_type = HID_REPORT_TYPE_OUTPUT;
+        ref.uref.report_id = 0;
+        ref.uref.field_index = 0;
+        ref.uref.usage_index = 0;
+        ref.uref.usage_code = 0xffa00004;
+        ref.uref.value = 0;
+        ref.num_values = report_len;
+        assert(sizeof(ref.values) / sizeof(ref.values[0]) >= ref.num_values);
+        for (i = 0; i < ref.num_values; ++i)
+            if (!buf)
+                ref.values[i] = 0;
+            else
+                ref.values[i] = ((unsigned char*)buf)[i + report_len * n];
+
+        assert(fd >= 0);
+        if (ioctl(fd, HIDIOCSUSAGES, &ref) != 0)
+            return -1;
+
+        info.report_type = HID_REPORT_TYPE_OUTPUT;
+        info.report_id = 0;
+        info.num_fields = 0;
+        if (ioctl(fd, HIDIOCSREPORT, &info) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int hiddevice_read(int fd, void* buf, size_t len, int timeout_ms,
+                          struct grd_stats_dev* stats)
+{
+    const size_t report_len = 64;
+    struct hiddev_usage_ref_multi ref;
+    struct hiddev_report_info info;
+    size_t i, n;
+    fd_set rfds, efds;
+    struct timeval tv;
+    uint64_t start;
+    int ret;
+
+    assert(len > 0);
+    assert(len % report_len == 0);
+    for (n = 0; n < len / report_len; ++n)
+    {
+        assert(fd >= 0);
+
+        if (n > 0)
+            /* write an idle report before reading the next report */
+            if (hiddevice_write(fd, NULL, 0) != 0)
+                return -1;
+
+        FD_ZERO(&rfds);
+        FD_ZERO(&efds);
+        FD_SET(fd, &rfds);
+        FD_SET(fd, &efds);
+        tv.tv_sec = timeout_ms / 1000;
+        tv.tv_usec = (timeout_ms % 1000) * 1000;
+        start = grd_stats_begin();
+        ret = select(fd + 1, &rfds, NULL, &efds, &tv);
+        grd_stats_end(stats, GRD_PHASE_READ_WAIT, start);
+        if (ret == 0)
+            errno = ETIMEDOUT;
+        if (ret != 1 || !FD_ISSET(fd, &rfds) || FD_ISSET(fd, &efds))
+            return -1;
+
+        ret = read(fd, (char*)&ref.uref, sizeof(ref.uref));
+        if (ret < 0 || (size_t)ret != sizeof(ref.uref))
+            return -1;
+
+        info.report_type = HID_REPORT_TYPE_INPUT;
+        info.report_id = 0;
+        info.num_fields = 0;
+        if (ioctl(fd, HIDIOCGREPORT, &info) != 0)
+            return -1;
+        ref.uref.report_type = HID_REPORT_TYPE_INPUT;
+        ref.uref.report_id = 0;
+        ref.uref.field_index = 0;
+        ref.uref.usage_index = 0;
+        ref.uref.usage_code = 0xffa00003;
+        ref.uref.value = 0;
+        ref.num_values = report_len;
+        assert(sizeof(ref.values) / sizeof(ref.values[0]) >= ref.num_values);
+        if (ioctl(fd, HIDIOCGUSAGES, &ref) != 0)
+            return -1;
+
+        assert(buf);
+        assert(ref.num_values == report_len);
+        assert(sizeof(ref.values) / sizeof(ref.values[0]) >= ref.num_values);
+        for (i = 0; i < ref.num_values; ++i)
+            ((unsigned char*)buf)[i + report_len * n] = (unsigned char)ref.values[i];
+    }
+    return 0;
+}
+
+static int hidraw_get_prodid(int fd, unsigned int* id)
+{
+    struct hidraw_devinfo devinfo;
+
+    assert(fd >= 0);
+    if (ioctl(fd, HIDIOCGRAWINFO, &devinfo) != 0)
+        return -1;
+    if ((unsigned short)devinfo.vendor != GRD_VENDOR)
+        return -1;
+    if (!grd_is_hid_prodid((unsigned short)devinfo.product))
+        return -1;
+    assert(id);
+    *id = (unsigned short)devinfo.product;
+    return 0;
+}
+
+/* One write() per report: report number 0 (no numbered reports), data */
+static int hidraw_write(int fd, void* buf, size_t len)
+{
+    unsigned char report[1 + HID_REPORT_LEN];
+    ssize_t ret;
+    size_t n;
+
+    if (len == 0 && buf == NULL)
+        len = HID_REPORT_LEN; /* idle report */
+
+    assert(len > 0);
+    assert(len % HID_REPORT_LEN == 0);
+    report[0] = 0;
+    for (n = 0; n < len / HID_REPORT_LEN; ++n)
+    {
+        if (buf)
+            memcpy(report + 1, (unsigned char*)buf + HID_REPORT_LEN * n, HID_REPORT_LEN);
+        else
+            memset(report + 1, 0, HID_REPORT_LEN);
+
+        assert(fd >= 0);
+        ret = write(fd, report, sizeof(report));
+        if (ret >= 0  &&  (size_t)ret != sizeof(report))
+            errno = EIO;
+        if (ret < 0  ||  (size_t)ret != sizeof(report))
+            return -1;
+    }
+    return 0;
+}
+
+/* One read() per report, straight to buf */
+static int hidraw_read(int fd, void* buf, size_t len, int timeout_ms,
+                       struct grd_stats_dev* stats)
+{
+    struct pollfd pfd;
+    uint64_t start;
+    size_t n;
+    int ret;
+
+    assert(len > 0);
+    assert(len % HID_REPORT_LEN == 0);
+    for (n = 0; n < len / HID_REPORT_LEN; ++n)
+    {
+        assert(fd >= 0);
+
+        if (n > 0)
+            /* write an idle report before reading the next report */
+            if (hidraw_write(fd, NULL, 0) != 0)
+                return -1;
+
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        start = grd_stats_begin();
+        ret = poll(&pfd, 1, timeout_ms);
+        grd_stats_end(stats, GRD_PHASE_READ_WAIT, start);
+        if (ret == 0)
+            errno = ETIMEDOUT;
+        else if (ret == 1  &&  !(pfd.revents & POLLIN))
+            errno = ENODEV;
+        if (ret != 1  ||  !(pfd.revents & POLLIN))
+            return -1;
+
+        assert(buf);
+        ret = read(fd, (unsigned char*)buf + HID_REPORT_LEN * n, HID_REPORT_LEN);
+        if (ret >= 0  &&  ret != HID_REPORT_LEN)
+            errno = EIO;
+        if (ret != HID_REPORT_LEN)
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * Find the hidraw node of the HID device (hiddev node dev_path): the
+ * "BUS:VENDOR:PRODUCT.N/hidraw/hidrawM" child of the same USB interface.
+ */
+static int find_hidraw_path(const char* dev_path, char* buf, size_t size)
+{
+    char path[PATH_MAX];
+    struct stat st;
+    DIR* dir;
+    DIR* dir_raw;
+    struct dirent* entry;
+    struct dirent* entry_raw;
+    unsigned int bus, vendor, product;
+    int ret = -1;
+
+    assert(dev_path);
+    if (stat(dev_path, &st) != 0  ||  !S_ISCHR(st.st_mode))
+        return -1;
+    snprintf(path, sizeof(path), "%s/dev/char/%u:%u/device", grd_sysfs_path(),
+             (unsigned int)major(st.st_rdev), (unsigned int)minor(st.st_rdev));
+    dir = opendir(path);
+    while (dir  &&  ret != 0  &&  (entry = readdir(dir)))
+    {
+        if (sscanf(entry->d_name, "%x:%x:%x.", &bus, &vendor, &product) != 3
+            ||  vendor != GRD_VENDOR  ||  !grd_is_hid_prodid(product)
+            )
+            continue;
+        snprintf(path, sizeof(path), "%s/dev/char/%u:%u/device/%s/hidraw",
+                 grd_sysfs_path(), (unsigned int)major(st.st_rdev),
+                 (unsigned int)minor(st.st_rdev), entry->d_name);
+        dir_raw = opendir(path);
+        while (dir_raw  &&  ret != 0  &&  (entry_raw = readdir(dir_raw)))
+        {
+            if (strncmp(entry_raw->d_name, "hidraw", sizeof("hidraw") - 1) != 0)
+                continue;
+            ret = snprintf(buf, size, "%s%s", HIDRAW_PATH_HEAD,
+                           entry_raw->d_name + sizeof("hidraw") - 1);
+            ret = (ret > 0  &&  (size_t)ret < size) ? 0 : -1;
+        }
+        if (dir_raw)
+            closedir(dir_raw);
+    }
+    if (dir)
+        closedir(dir);
+    return ret;
+}
+
+/* Drop the input left unread by a failed exchange or by the other processes */
+static void flush_input(int fd, size_t size)
+{
+    unsigned char buf[sizeof(struct hiddev_usage_ref) > HID_REPORT_LEN
+                      ? sizeof(struct hiddev_usage_ref) : HID_REPORT_LEN];
+    struct pollfd pfd;
+
+    assert(size <= sizeof(buf));
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    while (poll(&pfd, 1, 0) == 1  &&  (pfd.revents & POLLIN)
+           &&  read(fd, buf, size) > 0
+           )
+        pfd.revents = 0;
+}
+
+static int hid_open(struct grd_device* dev, const char* path)
+{
+    assert(dev);
+    assert(path);
+    dev->fd = open(path, O_RDWR | O_CLOEXEC); /* open device */
+    return dev->fd >= 0 ? 0 : -1;
+}
+
+static void hid_close(struct grd_device* dev)
+{
+    assert(dev);
+    if (dev->fd >= 0)
+        close(dev->fd);
+    dev->fd = -1;
+}
+
+static int hid_release(struct grd_device* dev)
+{
+    (void)dev;
+    return 0;
+}
+
+static int hiddev_get_prodid(struct grd_device* dev, unsigned int* prod_id)
+{
+    assert(dev);
+    return hiddevice_get_prodid(dev->fd, prod_id);
+}
+
+/*
+ * HID flags are kept by the descriptor: set them once. The device is
+ * claimed each time its lock is taken from the other processes: the kernel
+ * queues their replies to this descriptor too, drop them.
+ */
+static int hiddev_claim(struct grd_device* dev)
+{
+    int flags = HIDDEV_FLAG_UREF | HIDDEV_FLAG_REPORT;
+
+    assert(dev);
+    assert(dev->fd >= 0);
+    if (!dev->prepared)
+    {
+        if (ioctl(dev->fd, HIDIOCSFLAG, &flags) != 0)
+            return -1;
+        dev->prepared = 1;
+    }
+    flush_input(dev->fd, sizeof(struct hiddev_usage_ref));
+    return 0;
+}
+
+static int hiddev_write(struct grd_device* dev, void* buf, size_t len)
+{
+    assert(dev);
+    return hiddevice_write(dev->fd, buf, len);
+}
+
+static int hiddev_read(struct grd_device* dev, void* buf, size_t len)
+{
+    assert(dev);
+    return hiddevice_read(dev->fd, buf, len, grd_device_timeout(dev), dev->stats);
+}
+
+static void hiddev_flush(struct grd_device* dev)
+{
+    assert(dev);
+    flush_input(dev->fd, sizeof(struct hiddev_usage_ref));
+}
+
+const struct grd_transport grd_transport_hiddev =
+{
+    "hiddev",
+    grd_dev_id_get,
+    hid_open,
+    hid_close,
+    hiddev_get_prodid,
+    hiddev_claim,
+    hid_release,
+    NULL, /* bulk_write */
+    NULL, /* bulk_read */
+    NULL, /* bulk_exchange */
+    hiddev_write,
+    hiddev_read,
+    hiddev_flush,
+    NULL  /* search */
+};
+
+/* path is the hiddev node: open the hidraw node of the same device */
+static int hidraw_open(struct grd_device* dev, const char* path)
+{
+    char hidraw_path[PATH_MAX];
+    struct grd_hid_info info;
+
+    assert(dev);
+    if (grd_hid_find_path(path, &info) == 0  &&  info.hidraw[0])
+        strcpy(hidraw_path, info.hidraw);
+    else if (find_hidraw_path(path, hidraw_path, sizeof(hidraw_path)) != 0)
+        return -1;
+    dev->fd = open(hidraw_path, O_RDWR | O_CLOEXEC);
+    return dev->fd >= 0 ? 0 : -1;
+}
+
+static int hidraw_dev_get_prodid(struct grd_device* dev, unsigned int* prod_id)
+{
+    assert(dev);
+    return hidraw_get_prodid(dev->fd, prod_id);
+}
+
+/* Drop the reports queued for the other processes (see hiddev_claim) */
+static int hidraw_claim(struct grd_device* dev)
+{
+    assert(dev);
+    assert(dev->fd >= 0);
+    flush_input(dev->fd, HID_REPORT_LEN);
+    return 0;
+}
+
+static int hidraw_dev_write(struct grd_device* dev, void* buf, size_t len)
+{
+    assert(dev);
+    return hidraw_write(dev->fd, buf, len);
+}
+
+static int hidraw_dev_read(struct grd_device* dev, void* buf, size_t len)
+{
+    assert(dev);
+    return hidraw_read(dev->fd, buf, len, grd_device_timeout(dev), dev->stats);
+}
+
+static void hidraw_flush(struct grd_device* dev)
+{
+    assert(dev);
+    flush_input(dev->fd, HID_REPORT_LEN);
+}
+
+const struct grd_transport grd_transport_hidraw =
+{
+    "hidraw",
+    grd_dev_id_get,
+    hidraw_open,
+    hid_close,
+    hidraw_dev_get_prodid,
+    hidraw_claim,
+    hid_release,
+    NULL, /* bulk_write */
+    NULL, /* bulk_read */
+    NULL, /* bulk_exchange */
+    hidraw_dev_write,
+    hidraw_dev_read,
+    hidraw_flush,
+    NULL  /* search */
+};
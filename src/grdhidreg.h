@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2008 Aktiv Co. (Aleksey Samsonov)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#ifndef GRDHIDREG__H__
+#define GRDHIDREG__H__
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+#ifdef HAVE_STDDEF_H
+#include <stddef.h>
+#endif /* HAVE_STDDEF_H */
+#include "grdimpl.h"
+
+/*
+ * Registry of the Guardant HID devices, filled from sysfs (class usbmisc):
+ * any count of hiddev nodes, with or without the GRDHID_PATH_HEAD names of
+ * the legacy udev rule. Lookups by node path, serial number and product id
+ * are hash lookups.
+ */
+
+#define GRD_HID_NAME_LEN        32
+#define GRD_HID_PATH_LEN        128
+#define GRD_HID_SERIAL_LEN      64
+
+struct grd_hid_info
+{
+    char name[GRD_HID_NAME_LEN];     /* kernel name, "hiddevN" */
+    char path[GRD_HID_PATH_LEN];     /* the hiddev node */
+    char hidraw[GRD_HID_PATH_LEN];   /* hidraw node of the interface, may be empty */
+    char serial[GRD_HID_SERIAL_LEN]; /* may be empty */
+    unsigned int prod_id;
+    unsigned int number;             /* N of hiddevN, the order of the search */
+    unsigned int major;
+    unsigned int minor;
+};
+
+/*
+ * Fill the registry again from sysfs.
+ * Return the count of the devices, or -1 if sysfs has no usbmisc class.
+ */
+int grd_hid_registry_scan(void);
+
+/*
+ * Add the device hiddevN (name) to the registry, devname is DEVNAME of the
+ * uevent (may be NULL). Return zero if it is a Guardant device.
+ */
+int grd_hid_registry_add(const char* name, const char* devname, struct grd_hid_info* info);
+
+/*
+ * Remove the device hiddevN (name) from the registry.
+ * Return zero if the device was in the registry (info is its entry).
+ */
+int grd_hid_registry_remove(const char* name, struct grd_hid_info* info);
+
+/*
+ * Find the device by the hiddev node path (or the serial number).
+ * Return zero on success.
+ */
+int grd_hid_find_path(const char* path, struct grd_hid_info* info);
+int grd_hid_find_serial(const char* serial, struct grd_hid_info* info);
+
+/*
+ * Copy up to max devices of the product id (in the search order).
+ * Return the count of the devices of the product.
+ */
+size_t grd_hid_find_prodid(unsigned int prod_id, struct grd_hid_info* infos, size_t max);
+
+/*
+ * Call callback for each device of the registry, in the search order.
+ * Return the count of non-zero values which were returned from callback.
+ */
+int grd_hid_search(search_usb_device_callback callback, void* param);
+
+/*
+ * Return non-zero if path is a HID node: a device of the registry or a
+ * name of a hiddev node (GRDHID_PATH_HEAD, /dev/usb/hiddev, /dev/hiddev).
+ */
+int grd_is_hid_path(const char* path);
+
+#endif /* !GRDHIDREG__H__ */
@@ -0,0 +1,485 @@
+/*
+ * Registry of the Guardant HID devices (see grdhidreg.h)
+ *
+ * Copyright (C) 2008 Aktiv Co. (Aleksey Samsonov)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h> /* for major, minor */
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h> /* for PATH_MAX */
+#include <stdio.h>  /* for snprintf */
+#include <pthread.h>
+#include "grdimpl_linux.h"
+#include "grdhidreg.h"
+
+#define SYSFS_USBMISC           "class/usbmisc"
+#define HIDDEV_NAME_HEAD        "hiddev"
+#define HIDDEV_PATH_HEAD_1      "/dev/usb/hiddev"
+#define HIDDEV_PATH_HEAD_2      "/dev/hiddev"
+#define HIDRAW_PATH_HEAD        "/dev/hidraw"
+#define HID_BUCKETS             256  /* by path and by serial */
+#define HID_PRODID_BUCKETS      16
+
+struct hid_entry
+{
+    struct hid_entry* next;         /* sorted by number */
+    struct hid_entry* next_path;
+    struct hid_entry* next_serial;
+    struct hid_entry* next_prodid;  /* sorted by number */
+    struct grd_hid_info info;
+};
+
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t registry_once = PTHREAD_ONCE_INIT;
+static struct hid_entry* registry;
+static struct hid_entry* by_path[HID_BUCKETS];
+static struct hid_entry* by_serial[HID_BUCKETS];
+static struct hid_entry* by_prodid[HID_PRODID_BUCKETS];
+
+static void registry_atfork_child(void)
+{
+    pthread_mutex_init(&registry_mutex, NULL);
+}
+
+static void registry_init(void)
+{
+    pthread_atfork(NULL, NULL, registry_atfork_child);
+}
+
+/* FNV-1a */
+static unsigned int hash_string(const char* s)
+{
+    uint32_t h = 2166136261u;
+
+    assert(s);
+    while (*s)
+        h = (h ^ (unsigned char)*s++) * 16777619u;
+    return (unsigned int)(h % HID_BUCKETS);
+}
+
+/* Add the entry to the list and the hash tables (registry_mutex is locked) */
+static void insert_entry(struct hid_entry* e)
+{
+    struct hid_entry** p;
+
+    assert(e);
+    for (p = &registry; *p  &&  (*p)->info.number < e->info.number; p = &(*p)->next)
+        ;
+    e->next = *p;
+    *p = e;
+
+    p = &by_path[hash_string(e->info.path)];
+    e->next_path = *p;
+    *p = e;
+
+    e->next_serial = NULL;
+    if (e->info.serial[0])
+    {
+        p = &by_serial[hash_string(e->info.serial)];
+        e->next_serial = *p;
+        *p = e;
+    }
+
+    for (p = &by_prodid[e->info.prod_id % HID_PRODID_BUCKETS];
+         *p  &&  (*p)->info.number < e->info.number;
+         p = &(*p)->next_prodid
+         )
+        ;
+    e->next_prodid = *p;
+    *p = e;
+}
+
+/* Remove the entry from the list and the hash tables (registry_mutex is locked) */
+static void unlink_entry(struct hid_entry* e)
+{
+    struct hid_entry** p;
+
+    assert(e);
+    for (p = &registry; *p  &&  *p != e; p = &(*p)->next)
+        ;
+    if (*p)
+        *p = e->next;
+    for (p = &by_path[hash_string(e->info.path)]; *p  &&  *p != e; p = &(*p)->next_path)
+        ;
+    if (*p)
+        *p = e->next_path;
+    if (e->info.serial[0])
+    {
+        for (p = &by_serial[hash_string(e->info.serial)]; *p  &&  *p != e; p = &(*p)->next_serial)
+            ;
+        if (*p)
+            *p = e->next_serial;
+    }
+    for (p = &by_prodid[e->info.prod_id % HID_PRODID_BUCKETS];
+         *p  &&  *p != e;
+         p = &(*p)->next_prodid
+         )
+        ;
+    if (*p)
+        *p = e->next_prodid;
+}
+
+/* Remove all entries (registry_mutex is locked) */
+static void clear_registry(void)
+{
+    struct hid_entry* e;
+
+    while ((e = registry) != NULL)
+    {
+        registry = e->next;
+        free(e);
+    }
+    memset(by_path, 0, sizeof(by_path));
+    memset(by_serial, 0, sizeof(by_serial));
+    memset(by_prodid, 0, sizeof(by_prodid));
+}
+
+/* The hidraw node: "BUS:VENDOR:PRODUCT.N/hidraw/hidrawM" of the interface */
+static void read_hidraw_path(int dir_fd, char* buf, size_t size)
+{
+    DIR* dir;
+    DIR* dir_raw;
+    struct dirent* entry;
+    struct dirent* entry_raw;
+    unsigned int bus, vendor, product;
+    char name[PATH_MAX];
+    int fd, ret = -1;
+
+    assert(buf);
+    buf[0] = '\0';
+    fd = openat(dir_fd, "device", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    dir = fd >= 0 ? fdopendir(fd) : NULL;
+    if (!dir  &&  fd >= 0)
+        close(fd);
+    while (dir  &&  ret != 0  &&  (entry = readdir(dir)))
+    {
+        if (sscanf(entry->d_name, "%x:%x:%x.", &bus, &vendor, &product) != 3)
+            continue;
+        snprintf(name, sizeof(name), "%s/hidraw", entry->d_name);
+        fd = openat(dirfd(dir), name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        dir_raw = fd >= 0 ? fdopendir(fd) : NULL;
+        if (!dir_raw  &&  fd >= 0)
+            close(fd);
+        while (dir_raw  &&  ret != 0  &&  (entry_raw = readdir(dir_raw)))
+        {
+            if (strncmp(entry_raw->d_name, "hidraw", sizeof("hidraw") - 1) != 0)
+                continue;
+            ret = snprintf(buf, size, "%s%s", HIDRAW_PATH_HEAD,
+                           entry_raw->d_name + sizeof("hidraw") - 1);
+            ret = (ret > 0  &&  (size_t)ret < size) ? 0 : -1;
+        }
+        if (dir_raw)
+            closedir(dir_raw);
+    }
+    if (dir)
+        closedir(dir);
+    if (ret != 0)
+        buf[0] = '\0';
+}
+
+/* DEVNAME of the uevent attribute ("usb/hiddevN") */
+static int read_devname(int dir_fd, char* buf, size_t size)
+{
+    char uevent[512];
+    const char* p;
+    size_t len;
+
+    if (grd_read_sysfs_attr(dir_fd, "uevent", uevent, sizeof(uevent)) <= 0)
+        return -1;
+    p = strstr(uevent, "DEVNAME=");
+    if (!p)
+        return -1;
+    p += sizeof("DEVNAME=") - 1;
+    len = strcspn(p, "\n");
+    if (len == 0  ||  len >= size)
+        return -1;
+    memcpy(buf, p, len);
+    buf[len] = '\0';
+    return 0;
+}
+
+/*
+ * Read the device hiddevN (name) from sysfs.
+ * Return zero if it is a Guardant HID device.
+ */
+static int read_hid_device(const char* name, const char* devname, struct grd_hid_info* info)
+{
+    char path[PATH_MAX];
+    char value[GRD_HID_PATH_LEN];
+    struct stat st;
+    unsigned int vendor;
+    char* end;
+    int dir_fd, usb_fd, ret;
+
+    assert(name);
+    assert(info);
+    memset(info, 0, sizeof(*info));
+    if (strncmp(name, HIDDEV_NAME_HEAD, sizeof(HIDDEV_NAME_HEAD) - 1) != 0
+        ||  strlen(name) >= sizeof(info->name)
+        )
+        return -1;
+    info->number = (unsigned int)strtoul(name + sizeof(HIDDEV_NAME_HEAD) - 1, &end, 10);
+    if (*end != '\0'  ||  end == name + sizeof(HIDDEV_NAME_HEAD) - 1)
+        return -1;
+    strcpy(info->name, name);
+
+    ret = snprintf(path, sizeof(path), "%s/%s/%s", grd_sysfs_path(), SYSFS_USBMISC, name);
+    if (ret < 0  ||  (size_t)ret >= sizeof(path))
+        return -1;
+    dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0)
+        return -1;
+    /* the interface is the parent of hiddevN, the USB device is its parent */
+    usb_fd = openat(dir_fd, "device/..", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    ret = -1;
+    if (usb_fd >= 0
+        &&  grd_read_sysfs_uint(usb_fd, "idVendor", 16, &vendor) == 0
+        &&  vendor == GRD_VENDOR
+        &&  grd_read_sysfs_uint(usb_fd, "idProduct", 16, &info->prod_id) == 0
+        &&  grd_is_hid_prodid(info->prod_id)
+        &&  grd_read_sysfs_attr(dir_fd, "dev", value, sizeof(value)) > 0
+        &&  sscanf(value, "%u:%u", &info->major, &info->minor) == 2
+        )
+    {
+        if (grd_read_sysfs_attr(usb_fd, "serial", info->serial, sizeof(info->serial)) < 0)
+            info->serial[0] = '\0';
+        read_hidraw_path(dir_fd, info->hidraw, sizeof(info->hidraw));
+        if (!devname  &&  read_devname(dir_fd, value, sizeof(value)) == 0)
+            devname = value;
+        ret = 0;
+    }
+    if (usb_fd >= 0)
+        close(usb_fd);
+    close(dir_fd);
+    if (ret != 0)
+        return -1;
+
+    /* the node renamed by the legacy udev rule, else the kernel name */
+    ret = snprintf(info->path, sizeof(info->path), "%s%u", GRDHID_PATH_HEAD, info->number);
+    if (ret > 0  &&  (size_t)ret < sizeof(info->path)
+        &&  stat(info->path, &st) == 0  &&  S_ISCHR(st.st_mode)
+        &&  major(st.st_rdev) == info->major  &&  minor(st.st_rdev) == info->minor
+        )
+        return 0;
+    if (devname)
+        ret = snprintf(info->path, sizeof(info->path), "/dev/%s", devname);
+    else
+        ret = snprintf(info->path, sizeof(info->path), "%s%u", HIDDEV_PATH_HEAD_1, info->number);
+    return (ret > 0  &&  (size_t)ret < sizeof(info->path)) ? 0 : -1;
+}
+
+int grd_hid_registry_scan(void)
+{
+    char path[PATH_MAX];
+    struct hid_entry* found = NULL;
+    struct hid_entry* e;
+    struct dirent* entry;
+    DIR* dir;
+    int ret, count = 0;
+
+    pthread_once(&registry_once, registry_init);
+    ret = snprintf(path, sizeof(path), "%s/%s", grd_sysfs_path(), SYSFS_USBMISC);
+    if (ret < 0  ||  (size_t)ret >= sizeof(path))
+        return -1;
+    dir = opendir(path);
+    if (!dir)
+        return -1;
+    /* read sysfs without the lock */
+    while ((entry = readdir(dir)))
+    {
+        if (strncmp(entry->d_name, HIDDEV_NAME_HEAD, sizeof(HIDDEV_NAME_HEAD) - 1) != 0)
+            continue;
+        e = malloc(sizeof(*e));
+        if (!e)
+            break;
+        if (read_hid_device(entry->d_name, NULL, &e->info) != 0)
+        {
+            free(e);
+            continue;
+        }
+        e->next = found;
+        found = e;
+        ++count;
+    }
+    closedir(dir);
+
+    pthread_mutex_lock(&registry_mutex);
+    clear_registry();
+    while ((e = found) != NULL)
+    {
+        found = e->next;
+        insert_entry(e);
+    }
+    pthread_mutex_unlock(&registry_mutex);
+    return count;
+}
+
+int grd_hid_registry_add(const char* name, const char* devname, struct grd_hid_info* info)
+{
+    struct hid_entry* e;
+    struct hid_entry* old;
+
+    assert(name);
+    pthread_once(&registry_once, registry_init);
+    e = malloc(sizeof(*e));
+    if (!e)
+        return -1;
+    if (read_hid_device(name, devname, &e->info) != 0)
+    {
+        free(e);
+        return -1;
+    }
+    if (info)
+        *info = e->info;
+    pthread_mutex_lock(&registry_mutex);
+    for (old = registry; old; old = old->next)
+        if (strcmp(old->info.name, name) == 0)
+            break;
+    if (old)
+    {
+        unlink_entry(old);
+        free(old);
+    }
+    insert_entry(e);
+    pthread_mutex_unlock(&registry_mutex);
+    return 0;
+}
+
+int grd_hid_registry_remove(const char* name, struct grd_hid_info* info)
+{
+    struct hid_entry* e;
+
+    assert(name);
+    pthread_once(&registry_once, registry_init);
+    pthread_mutex_lock(&registry_mutex);
+    for (e = registry; e; e = e->next)
+        if (strcmp(e->info.name, name) == 0)
+            break;
+    if (e)
+    {
+        unlink_entry(e);
+        if (info)
+            *info = e->info;
+        free(e);
+    }
+    pthread_mutex_unlock(&registry_mutex);
+    return e ? 0 : -1;
+}
+
+int grd_hid_find_path(const char* path, struct grd_hid_info* info)
+{
+    struct hid_entry* e;
+
+    assert(path);
+    pthread_once(&registry_once, registry_init);
+    pthread_mutex_lock(&registry_mutex);
+    for (e = by_path[hash_string(path)]; e; e = e->next_path)
+        if (strcmp(e->info.path, path) == 0)
+            break;
+    if (e  &&  info)
+        *info = e->info;
+    pthread_mutex_unlock(&registry_mutex);
+    return e ? 0 : -1;
+}
+
+int grd_hid_find_serial(const char* serial, struct grd_hid_info* info)
+{
+    struct hid_entry* e;
+
+    assert(serial);
+    if (!serial[0])
+        return -1;
+    pthread_once(&registry_once, registry_init);
+    pthread_mutex_lock(&registry_mutex);
+    for (e = by_serial[hash_string(serial)]; e; e = e->next_serial)
+        if (strcmp(e->info.serial, serial) == 0)
+            break;
+    if (e  &&  info)
+        *info = e->info;
+    pthread_mutex_unlock(&registry_mutex);
+    return e ? 0 : -1;
+}
+
+size_t grd_hid_find_prodid(unsigned int prod_id, struct grd_hid_info* infos, size_t max)
+{
+    struct hid_entry* e;
+    size_t count = 0;
+
+    pthread_once(&registry_once, registry_init);
+    pthread_mutex_lock(&registry_mutex);
+    for (e = by_prodid[prod_id % HID_PRODID_BUCKETS]; e; e = e->next_prodid)
+    {
+        if (e->info.prod_id != prod_id)
+            continue;
+        if (count < max)
+        {
+            assert(infos);
+            infos[count] = e->info;
+        }
+        ++count;
+    }
+    pthread_mutex_unlock(&registry_mutex);
+    return count;
+}
+
+int grd_hid_search(search_usb_device_callback callback, void* param)
+{
+    char (*paths)[GRD_HID_PATH_LEN] = NULL;
+    struct hid_entry* e;
+    size_t n = 0, i;
+    int count = 0;
+
+    assert(callback);
+    pthread_once(&registry_once, registry_init);
+    /* copy: the callbacks may look up the registry */
+    pthread_mutex_lock(&registry_mutex);
+    for (e = registry; e; e = e->next)
+        ++n;
+    if (n > 0)
+        paths = malloc(n * sizeof(*paths));
+    for (e = registry, i = 0; paths  &&  e; e = e->next, ++i)
+        strcpy(paths[i], e->info.path);
+    pthread_mutex_unlock(&registry_mutex);
+    if (n > 0  &&  !paths)
+        return -1;
+
+    for (i = 0; i < n; ++i)
+        if (callback(paths[i], param))
+            ++count;
+    free(paths);
+    return count;
+}
+
+int grd_is_hid_path(const char* path)
+{
+    assert(path);
+    return strncmp(path, GRDHID_PATH_HEAD, sizeof(GRDHID_PATH_HEAD) - 1) == 0
+           ||  strncmp(path, HIDDEV_PATH_HEAD_1, sizeof(HIDDEV_PATH_HEAD_1) - 1) == 0
+           ||  strncmp(path, HIDDEV_PATH_HEAD_2, sizeof(HIDDEV_PATH_HEAD_2) - 1) == 0
+           ||  grd_hid_find_path(path, NULL) == 0;
+}
@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2008 Aktiv Co. (Aleksey Samsonov)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#ifndef GRDHOTPLUG__H__
+#define GRDHOTPLUG__H__
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+#ifdef HAVE_STDDEF_H
+#include <stddef.h>
+#endif /* HAVE_STDDEF_H */
+#include "grdimpl.h"
+
+/*
+ * Called from the monitor thread for every Guardant device node which
+ * was added (added != 0) or removed.
+ */
+typedef void (*grd_hotplug_callback)(const char* path, int added);
+
+/*
+ * Start the monitor (once) if it is enabled by the GRD_HOTPLUG environment
+ * variable. The table of present devices is filled by calling scan (with
+ * the callback which adds devices to the table) after the monitor has
+ * subscribed to the events.
+ * Return zero if the monitor is running.
+ */
+int grd_hotplug_start(const char* usbfs_path, grd_hotplug_callback notify,
+                      int (*scan)(search_usb_device_callback callback, void* param));
+
+/*
+ * Call callback for each present device (read of the table).
+ * Return the count of non-zero values which were returned from callback,
+ * or -1 if the monitor is not running.
+ */
+int grd_hotplug_search(search_usb_device_callback callback, void* param);
+
+#endif /* !GRDHOTPLUG__H__ */
@@ -0,0 +1,451 @@
+/*
+ * Hotplug monitor of the GrdWine (kernel uevents)
+ *
+ * Copyright (C) 2008 Aktiv Co. (Aleksey Samsonov)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/*
+ * With GRD_HOTPLUG=1 a thread listens to the kernel uevents (netlink) and
+ * keeps the table of present Guardant devices: usbfs nodes of the bulk
+ * devices and hiddev nodes of the HID devices (see grdhidreg.h).
+ *
+ * With GRD_HOTPLUG_SOCKET=path the thread also receives the events, in the
+ * kernel format ("ACTION@DEVPATH\0KEY=VALUE\0..."), from the local datagram
+ * socket bound to path (testing without hardware).
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h> /* for PATH_MAX */
+#include <stdio.h>  /* for snprintf */
+#include <pthread.h>
+#include <linux/netlink.h>
+#include "grdimpl_linux.h"
+#include "grdhotplug.h"
+#include "grdhidreg.h"
+
+#define GRD_HOTPLUG_ENV         "GRD_HOTPLUG"
+#define GRD_HOTPLUG_SOCKET_ENV  "GRD_HOTPLUG_SOCKET"
+#define UEVENT_BUFFER_SIZE      8192
+#define UEVENT_GROUP_KERNEL     1
+
+struct hotplug_device
+{
+    struct hotplug_device* next;
+    int ishid;
+    char path[PATH_MAX];
+};
+
+static pthread_mutex_t start_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t hotplug_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct hotplug_device* devices; /* sorted: usbfs, then HID nodes */
+static grd_hotplug_callback hotplug_notify;
+static char hotplug_usbfs[PATH_MAX];
+static int hotplug_started, hotplug_running, atfork_set;
+static int netlink_fd = -1, inject_fd = -1;
+
+/* Order of the devices in the table (the order of search_usb_devices) */
+static int compare_device(int ishid, const char* path, const struct hotplug_device* dev)
+{
+    size_t len, dev_len;
+
+    assert(path);
+    assert(dev);
+    if (ishid != dev->ishid)
+        return ishid ? 1 : -1;
+    /* "hiddev2" < "hiddev10" */
+    len = strlen(path);
+    dev_len = strlen(dev->path);
+    if (len != dev_len)
+        return len < dev_len ? -1 : 1;
+    return strcmp(path, dev->path);
+}
+
+/* Return non-zero if the table was changed */
+static int table_update(const char* path, int added)
+{
+    const int ishid = grd_is_hid_path(path);
+    struct hotplug_device** p;
+    struct hotplug_device* dev;
+    int cmp = 1, changed = 0;
+
+    assert(path);
+    if (strlen(path) >= sizeof(dev->path))
+        return 0;
+
+    pthread_mutex_lock(&hotplug_mutex);
+    for (p = &devices; *p; p = &(*p)->next)
+    {
+        cmp = compare_device(ishid, path, *p);
+        if (cmp <= 0)
+            break;
+    }
+    if (added  &&  (!*p || cmp != 0))
+    {
+        dev = malloc(sizeof(*dev));
+        if (dev)
+        {
+            dev->ishid = ishid;
+            strcpy(dev->path, path);
+            dev->next = *p;
+            *p = dev;
+            changed = 1;
+        }
+    }
+    else if (!added  &&  *p  &&  cmp == 0)
+    {
+        dev = *p;
+        *p = dev->next;
+        free(dev);
+        changed = 1;
+    }
+    pthread_mutex_unlock(&hotplug_mutex);
+    return changed;
+}
+
+static int __attribute__((ms_abi)) scan_callback(const char* path, void* param)
+{
+    (void)param;
+    table_update(path, 1);
+    return 1;
+}
+
+static const char* uevent_get(const char* buf, size_t len, const char* key)
+{
+    const size_t key_len = strlen(key);
+    size_t i;
+
+    assert(buf);
+    /* skip the header "ACTION@DEVPATH" */
+    for (i = strlen(buf) + 1; i < len; i += strlen(buf + i) + 1)
+        if (strncmp(buf + i, key, key_len) == 0  &&  buf[i + key_len] == '=')
+            return buf + i + key_len + 1;
+    return NULL;
+}
+
+/* Vendor and product of a device: PRODUCT=vid/pid/bcd or sysfs attributes */
+static int uevent_get_ids(const char* buf, size_t len,
+                          unsigned int* vendor, unsigned int* product)
+{
+    char path[PATH_MAX];
+    const char* value;
+    const char* devpath;
+    int dir_fd, ret = -1;
+
+    value = uevent_get(buf, len, "PRODUCT");
+    if (value)
+        return sscanf(value, "%x/%x/", vendor, product) == 2 ? 0 : -1;
+
+    devpath = uevent_get(buf, len, "DEVPATH");
+    if (!devpath)
+        return -1;
+    ret = snprintf(path, sizeof(path), "%s%s", grd_sysfs_path(), devpath);
+    if (ret < 0  ||  (size_t)ret >= sizeof(path))
+        return -1;
+    dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0)
+        return -1;
+    ret = -1;
+    if (grd_read_sysfs_uint(dir_fd, "idVendor", 16, vendor) == 0
+        &&  grd_read_sysfs_uint(dir_fd, "idProduct", 16, product) == 0
+        )
+        ret = 0;
+    close(dir_fd);
+    return ret;
+}
+
+static void handle_uevent(const char* buf, size_t len)
+{
+    char path[PATH_MAX];
+    const char* action;
+    const char* subsystem;
+    const char* devtype;
+    const char* busnum;
+    const char* devnum;
+    const char* devname;
+    const char* hiddev;
+    struct grd_hid_info info;
+    unsigned int vendor, product;
+    int added, ret;
+
+    action = uevent_get(buf, len, "ACTION");
+    subsystem = uevent_get(buf, len, "SUBSYSTEM");
+    if (!action  ||  !subsystem)
+        return;
+    if (strcmp(action, "add") == 0)
+        added = 1;
+    else if (strcmp(action, "remove") == 0)
+        added = 0;
+    else
+        return;
+
+    devtype = uevent_get(buf, len, "DEVTYPE");
+    devname = uevent_get(buf, len, "DEVNAME");
+    if (strcmp(subsystem, "usb") == 0  &&  devtype  &&  strcmp(devtype, "usb_device") == 0)
+    {
+        busnum = uevent_get(buf, len, "BUSNUM");
+        devnum = uevent_get(buf, len, "DEVNUM");
+        if (!busnum  ||  !devnum)
+            return;
+        if (added
+            &&  (uevent_get_ids(buf, len, &vendor, &product) != 0
+                 ||  vendor != GRD_VENDOR  ||  !grd_is_usbfs_prodid(product))
+            )
+            return;
+        ret = snprintf(path, sizeof(path), "%s/%s/%s", hotplug_usbfs, busnum, devnum);
+    }
+    else if (strcmp(subsystem, "usbmisc") == 0
+             &&  devname  &&  (hiddev = strstr(devname, "hiddev")) != NULL
+             )
+    {
+        /* the registry reads the device from sysfs (the node name too) */
+        if (added)
+        {
+            if (grd_hid_registry_add(hiddev, devname, &info) != 0)
+                return;
+            ret = snprintf(path, sizeof(path), "%s", info.path);
+        }
+        else if (grd_hid_registry_remove(hiddev, &info) == 0)
+            ret = snprintf(path, sizeof(path), "%s", info.path);
+        else
+            ret = snprintf(path, sizeof(path), "/dev/%s", devname);
+    }
+    else
+        return;
+
+    if (ret < 0  ||  (size_t)ret >= sizeof(path))
+        return;
+    if (table_update(path, added)  &&  hotplug_notify)
+        hotplug_notify(path, added);
+}
+
+static void* hotplug_thread(void* arg)
+{
+    char buf[UEVENT_BUFFER_SIZE];
+    struct sockaddr_nl addr;
+    struct pollfd fds[2];
+    socklen_t addr_len;
+    nfds_t n, i;
+    ssize_t len;
+
+    (void)arg;
+    for (;;)
+    {
+        n = 0;
+        if (netlink_fd >= 0)
+        {
+            fds[n].fd = netlink_fd;
+            fds[n++].events = POLLIN;
+        }
+        if (inject_fd >= 0)
+        {
+            fds[n].fd = inject_fd;
+            fds[n++].events = POLLIN;
+        }
+        if (poll(fds, n, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        for (i = 0; i < n; ++i)
+        {
+            if (!(fds[i].revents & POLLIN))
+                continue;
+            addr_len = sizeof(addr);
+            memset(&addr, 0, sizeof(addr));
+            len = recvfrom(fds[i].fd, buf, sizeof(buf) - 1, 0,
+                           (struct sockaddr*)&addr, &addr_len);
+            if (len <= 0)
+                continue;
+            /* only the kernel messages ("libudev" ones are for udev clients) */
+            if (fds[i].fd == netlink_fd  &&  addr.nl_pid != 0)
+                continue;
+            buf[len] = '\0';
+            if (!strchr(buf, '@'))
+                continue;
+            handle_uevent(buf, (size_t)len);
+        }
+    }
+    return NULL;
+}
+
+static int open_netlink(void)
+{
+    struct sockaddr_nl addr;
+    int fd;
+
+    fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+    if (fd < 0)
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = UEVENT_GROUP_KERNEL;
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int open_inject_socket(const char* path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    assert(path);
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+    fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* The thread is not inherited: the table would not be updated any more */
+static void hotplug_atfork_child(void)
+{
+    struct hotplug_device* dev;
+
+    pthread_mutex_init(&start_mutex, NULL);
+    pthread_mutex_init(&hotplug_mutex, NULL);
+    while ((dev = devices) != NULL)
+    {
+        devices = dev->next;
+        free(dev);
+    }
+    if (netlink_fd >= 0)
+        close(netlink_fd);
+    if (inject_fd >= 0)
+        close(inject_fd);
+    netlink_fd = inject_fd = -1;
+    hotplug_started = hotplug_running = 0;
+}
+
+int grd_hotplug_start(const char* usbfs_path, grd_hotplug_callback notify,
+                      int (*scan)(search_usb_device_callback callback, void* param))
+{
+    const char* env;
+    pthread_attr_t attr;
+    pthread_t thread;
+    int ret;
+
+    pthread_mutex_lock(&start_mutex);
+    if (hotplug_started)
+    {
+        ret = hotplug_running ? 0 : -1;
+        pthread_mutex_unlock(&start_mutex);
+        return ret;
+    }
+    hotplug_started = 1;
+    if (!atfork_set)
+    {
+        pthread_atfork(NULL, NULL, hotplug_atfork_child);
+        atfork_set = 1;
+    }
+
+    env = getenv(GRD_HOTPLUG_ENV);
+    if (!env  ||  strcmp(env, "1") != 0)
+    {
+        pthread_mutex_unlock(&start_mutex);
+        return -1;
+    }
+    assert(usbfs_path);
+    if (strlen(usbfs_path) >= sizeof(hotplug_usbfs))
+    {
+        pthread_mutex_unlock(&start_mutex);
+        return -1;
+    }
+    strcpy(hotplug_usbfs, usbfs_path);
+    hotplug_notify = notify;
+
+    /* subscribe before the scan: no event is lost */
+    netlink_fd = open_netlink();
+    env = getenv(GRD_HOTPLUG_SOCKET_ENV);
+    if (env)
+        inject_fd = open_inject_socket(env);
+    if (netlink_fd < 0  &&  inject_fd < 0)
+    {
+        pthread_mutex_unlock(&start_mutex);
+        return -1;
+    }
+
+    assert(scan);
+    scan(scan_callback, NULL);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, hotplug_thread, NULL) == 0)
+        hotplug_running = 1;
+    pthread_attr_destroy(&attr);
+    ret = hotplug_running ? 0 : -1;
+    pthread_mutex_unlock(&start_mutex);
+    return ret;
+}
+
+int grd_hotplug_search(search_usb_device_callback callback, void* param)
+{
+    struct hotplug_device* dev;
+    char (*paths)[PATH_MAX];
+    size_t n = 0, i;
+    int count = 0;
+
+    if (!hotplug_running)
+        return -1;
+
+    /* call back without the table locked */
+    pthread_mutex_lock(&hotplug_mutex);
+    for (dev = devices; dev; dev = dev->next)
+        ++n;
+    paths = n > 0 ? malloc(n * sizeof(*paths)) : NULL;
+    if (n > 0  &&  !paths)
+    {
+        pthread_mutex_unlock(&hotplug_mutex);
+        return -1;
+    }
+    for (i = 0, dev = devices; dev; dev = dev->next, ++i)
+        strcpy(paths[i], dev->path);
+    pthread_mutex_unlock(&hotplug_mutex);
+
+    assert(callback);
+    for (i = 0; i < n; ++i)
+        if (callback(paths[i], param))
+            ++count;
+    free(paths);
+    return count;
+}
@@ -35,6 +35,100 @@ typedef int __attribute__((ms_abi))
 int grd_ioctl_device(const char* dev_path, unsigned int prod_id,
                      size_t pack_size, void* in, size_t len_in, void* out, size_t len_out);
 
+/*
+ * Request of grd_ioctl_devices.
+ */
+struct grd_ioctl_request
+{
+    const char* dev_path;
+    unsigned int prod_id;
+    size_t pack_size;
+    void* in;
+    size_t len_in;
+    void* out;
+    size_t len_out;
+    int status;                 /* result: zero, or errno of the failure */
+};
+
+/*
+ * Communication to several devices: the requests to different devices run
+ * in parallel, the requests to one device run in the array order.
+ * Return zero if all requests succeeded, else -1 (see status).
+ */
+int grd_ioctl_devices(struct grd_ioctl_request* requests, size_t count);
+
+/*
+ * Communication to any device of the product prod_id: the request goes to
+ * an idle or the least loaded device (the lock state of all processes and
+ * the calls of this process). dev_path may be NULL, else it is a buffer of
+ * dev_path_size bytes: the device to stick to (if not empty), the device
+ * used on return. Pass the same buffer for the calls of one exchange.
+ */
+int grd_ioctl_product(unsigned int prod_id, char* dev_path, size_t dev_path_size,
+                      size_t pack_size, void* in, size_t len_in, void* out, size_t len_out);
+
+/*
+ * Asynchronous grd_ioctl_device: the request is queued to the I/O threads
+ * (dev_path is copied, the buffers are used until the completion). The
+ * request fails with ETIMEDOUT if it is not started in timeout_ms (zero: no
+ * deadline). cookie identifies the request until its completion is taken.
+ * Return zero if the request is queued.
+ */
+int grd_ioctl_submit(const char* dev_path, unsigned int prod_id, size_t pack_size,
+                     void* in, size_t len_in, void* out, size_t len_out,
+                     unsigned int timeout_ms, unsigned long long cookie);
+
+/*
+ * Cancel the request if it is not started yet: it completes with ECANCELED.
+ * Return zero on success, else -1 (errno EBUSY: the exchange is running,
+ * ENOENT: no such request or it is completed).
+ */
+int grd_ioctl_cancel(unsigned long long cookie);
+
+/*
+ * Completion of grd_ioctl_submit.
+ */
+struct grd_ioctl_completion
+{
+    unsigned long long cookie;
+    int status;                 /* zero, or errno of the failure */
+};
+
+/*
+ * Take up to max completed requests, wait for them up to timeout_ms
+ * (negative: no timeout). Return the count of the requests taken, zero on
+ * timeout.
+ */
+size_t grd_ioctl_wait(struct grd_ioctl_completion* done, size_t max, int timeout_ms);
+
+/*
+ * Explicit session: the device is opened, claimed and locked until
+ * grd_session_close, so several exchanges run in a row without the calls
+ * of the other threads and processes in between (the broker is not used).
+ * The hold ends after hold_ms in all, or idle_ms without a call (zero: the
+ * defaults; hold_ms is limited by GRD_SESSION_HOLD): then the calls fail
+ * with ETIMEDOUT, the handle is still to be closed. The hold ends as well
+ * if the breaker of the device opens.
+ * Return zero and the handle of the session, else -1 (errno EMFILE: too
+ * many sessions, EIO: the breaker is open).
+ */
+int grd_session_open(const char* dev_path, unsigned int prod_id,
+                     unsigned int hold_ms, unsigned int idle_ms, unsigned long long* handle);
+
+/*
+ * Communication to the device of the session (see grd_ioctl_device). The
+ * calls of one session are serialized. errno is EBADF if the handle is not
+ * opened.
+ */
+int grd_session_ioctl(unsigned long long handle, size_t pack_size,
+                      void* in, size_t len_in, void* out, size_t len_out);
+
+/*
+ * Release the device of the session and free the handle.
+ * Return zero on success.
+ */
+int grd_session_close(unsigned long long handle);
+
 /*
  * Check device.
  * Return zero if device is Guardant Sign/Time or Guardant Code.
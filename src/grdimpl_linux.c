@@ -27,416 +27,1675 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h> /* for major, minor */
 #include <fcntl.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <limits.h> /* for PATH_MAX */
 #include <stdio.h>  /* for snprintf */
-#include <linux/usbdevice_fs.h>
-#include <linux/hiddev.h>
+#include <time.h>
+#include <pthread.h>
 #include "grdimpl.h"
+#include "grdimpl_linux.h"
+#include "grdbroker.h"
+#include "grdcapture.h"
+#include "grdhealth.h"
+#include "grdhidreg.h"
+#include "grdhotplug.h"
+#include "grdlock.h"
+#include "grdpower.h"
+#include "grdstats.h"
+#include "grdtrace.h"
+#include "grdtransport.h"
 
-#define GRD_VENDOR              0x0a89
-#define GRD_PRODID_S3S          0x08 /* Guardant Sign/Time USB */
-#define GRD_PRODID_S3S_HID      0x0C /* Guardant Sign/Time USB HID */
-#define GRD_PRODID_S3S_WINUSB   0xC2 /* Guardant Sign/Time USB (WINUSB) */
-#define GRD_PRODID_S3C          0x09 /* Guardant Code USB */
-#define GRD_PRODID_S3C_HID      0x0D /* Guardant Code USB HID */
-#define GRD_PRODID_S3C_WINUSB   0xC3 /* Guardant Code USB (WINSUB) */
-#define USBFS_PATH_ENV          "USB_DEVFS_PATH"
-#define GRD_IPC_NAME_ENV        "GRD_IPC_NAME"
-#define USBFS_PATH_1            "/dev/bus/usb"
-#define USBFS_PATH_2            "/proc/bus/usb"
-#define GRDHID_PATH_HEAD        "/dev/grdhid"
-#define GRDHID_MAX_COUNT        16
-
-struct lock_descr
-{
-    int fd;
+#define SYSFS_USB_DEVICES       "bus/usb/devices"
+#define GRD_MAX_DEVICES         256 /* Guardant devices reported by sysfs search */
+
+#define HIDRAW_ENV              "GRD_HIDRAW"
+
+#define GRD_SESSION_IDLE_ENV    "GRD_SESSION_IDLE"
+#define GRD_SESSION_IDLE_MS     5000 /* default idle timeout of a session */
+#define GRD_SESSION_AWAKE_MS    60000 /* the default in the low-latency mode */
+#define GRD_SESSION_BATCH_ENV   "GRD_SESSION_BATCH"
+#define GRD_SESSION_BATCH       8    /* default exchanges of this process under one lock */
+#define GRD_SESSION_HOLD_ENV    "GRD_SESSION_HOLD"
+#define GRD_HOLD_MAX_MS         10000 /* default longest hold of an explicit session */
+#define GRD_HOLD_IDLE_MS        1000 /* default idle timeout of an explicit session */
+#define GRD_HOLD_POLL_MS        100  /* check a hold again while its call runs */
+#define GRD_CHECK_BUSY_MS       100  /* check a device in use again */
+#define GRD_HOLD_COUNT          64   /* explicit sessions of a process */
+
+#define GRD_BATCH_MAX_THREADS   16 /* workers of grd_ioctl_devices (with the caller) */
+#define GRD_BATCH_END           ((size_t)-1)
+
+#define GRD_SEARCH_PROBE_ENV    "GRD_SEARCH_PROBE" /* "workers[:deadline_ms]" */
+#define GRD_SEARCH_MAX_WORKERS  16
+#define GRD_SEARCH_DEADLINE_MS  1000 /* default deadline of one probe */
+
+#define GRD_PROBE_CACHE_SIZE    32  /* probed device nodes remembered */
+#define GRD_PROBE_PATH_LEN      256 /* longer paths are not cached */
+
+/*
+ * Device session: the device stays open (and the HID flags stay set)
+ * between calls, only the exchange is serialized. The threads of this
+ * process take turns in the ticket order; the lock of the device (and the
+ * claim of the interface) is passed to the next thread of this process
+ * without a release, up to session_batch exchanges in a row. Then the
+ * lock is yielded: a waiting process locks the device before this one.
+ */
+struct grd_session
+{
+    struct grd_session* next;
+    struct grd_lock lock;    /* process synchronization */
+    pthread_mutex_t mutex;   /* protects the tickets */
+    pthread_cond_t turn;     /* ticket_serving has changed */
+    unsigned long ticket_next;
+    unsigned long ticket_serving; /* the thread doing the exchange */
+    unsigned int refs;
+    struct grd_device dev;   /* dev.transport is NULL if closed (idle or stale) */
+    int locked;              /* the lock is kept for the next exchange */
+    int claimed;             /* dev is claimed */
+    unsigned int batch;      /* exchanges since the lock was acquired */
+    int flush;               /* unread input reports may be left (HID) */
+    volatile int gone;       /* the device was removed (hotplug monitor) */
+    struct grd_power power;  /* kept awake in the low-latency mode */
+    struct grd_health health; /* timeout and breaker (changed by the thread of the turn) */
+    uint64_t resume_start;   /* the device was suspended at the start of the call */
+    uint64_t lock_ns;        /* wait for the turn and the lock (captured calls) */
+    struct grd_stats_dev* stats;
+    unsigned int trace_dev;
+    struct timespec last_used;
+    char path[PATH_MAX];
+};
+
+/*
+ * Explicit session (grd_session_open): it holds the turn of the device
+ * session between the calls, so the device stays open, claimed and locked.
+ * The turn is given up (the hold expires) after the hold time, or the idle
+ * time without a call. The handle is the slot index plus a multiple of
+ * GRD_HOLD_COUNT: a stale handle does not match the reused slot.
+ */
+struct session_hold
+{
+    pthread_mutex_t mutex;      /* one call at a time, protects the fields below */
+    unsigned long long handle;  /* zero: not opened */
+    struct grd_session* s;      /* NULL: expired */
+    int ishid;
+    uint64_t deadline_ms;       /* the end of the hold time */
+    uint64_t used_ms;           /* the end of the last call */
+    unsigned int idle_ms;
+    int used;                   /* the slot is taken (sessions_mutex) */
 };
 
-static int create_lock_path(const char* dev_path, char* buf, size_t buf_size)
+/* Device node for the probe cache: a replugged device has a new node */
+struct probe_key
+{
+    uint64_t dev;               /* st_rdev of a character device, else st_dev */
+    uint64_t ino;
+    int64_t ctime_sec;
+    int64_t ctime_nsec;
+};
+
+/*
+ * Probe result of a device node. Read without locks: seq is odd while the
+ * entry is written (the writers hold probe_cache_mutex), a reader repeats
+ * if seq has changed meanwhile.
+ */
+struct probe_entry
+{
+    volatile uint32_t seq;
+    int valid;
+    unsigned int prod_id;       /* zero: not a Guardant device */
+    struct probe_key key;
+    char path[GRD_PROBE_PATH_LEN];
+};
+
+static pthread_mutex_t probe_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct probe_entry probe_cache[GRD_PROBE_CACHE_SIZE];
+static unsigned int probe_cache_victim;
+
+static pthread_mutex_t sessions_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t checker_cond = PTHREAD_COND_INITIALIZER; /* a breaker was opened, a hold taken */
+static int checker_started;
+static pthread_once_t sessions_once = PTHREAD_ONCE_INIT;
+static struct grd_session* sessions;
+static long session_idle_ms = GRD_SESSION_IDLE_MS;
+static unsigned int session_batch = GRD_SESSION_BATCH;
+static struct session_hold holds[GRD_HOLD_COUNT];
+static unsigned long long holds_serial; /* handles given out (sessions_mutex) */
+static unsigned int hold_max_ms = GRD_HOLD_MAX_MS;
+static pthread_mutex_t batch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct ioctl_batch* batches;     /* with groups not taken */
+static pthread_cond_t batch_queued = PTHREAD_COND_INITIALIZER; /* to the batch workers */
+static pthread_cond_t batch_done = PTHREAD_COND_INITIALIZER;   /* to the callers */
+static unsigned int batch_threads, batch_idle;
+static int use_hidraw = 1;
+static unsigned int search_workers;     /* zero: the search does not probe */
+static long search_deadline_ms = GRD_SEARCH_DEADLINE_MS;
+
+static long elapsed_ms(const struct timespec* from, const struct timespec* to)
+{
+    return (long)(to->tv_sec - from->tv_sec) * 1000
+           + (to->tv_nsec - from->tv_nsec) / 1000000;
+}
+
+/* The device handle is gone (device unplugged or usbfs node removed) */
+static int is_stale_error(int err)
+{
+    return err == ENODEV || err == ESHUTDOWN || err == ENOENT || err == ENXIO;
+}
+
+/* The descriptors (and locks) are not inherited in a useful state */
+static void sessions_atfork_child(void)
+{
+    struct grd_session* s;
+    size_t i;
+
+    pthread_mutex_init(&sessions_mutex, NULL);
+    pthread_cond_init(&checker_cond, NULL);
+    checker_started = 0;
+    pthread_mutex_init(&batch_mutex, NULL);
+    pthread_cond_init(&batch_queued, NULL);
+    pthread_cond_init(&batch_done, NULL);
+    batches = NULL;
+    batch_threads = batch_idle = 0;
+    pthread_mutex_init(&probe_cache_mutex, NULL);
+    for (i = 0; i < GRD_HOLD_COUNT; ++i)
+    {
+        /* the lock is not inherited: the holds are expired in the child */
+        pthread_mutex_init(&holds[i].mutex, NULL);
+        if (holds[i].s)
+            --holds[i].s->refs;
+        holds[i].s = NULL;
+    }
+    for (s = sessions; s; s = s->next)
+    {
+        pthread_mutex_init(&s->mutex, NULL);
+        pthread_cond_init(&s->turn, NULL);
+        s->ticket_next = s->ticket_serving = 0;
+        s->locked = 0;
+        s->claimed = 0;
+        grd_device_close(&s->dev);
+    }
+}
+
+static void sessions_init(void)
+{
+    const char* env;
+    char* end;
+    long ms;
+    size_t i;
+
+    for (i = 0; i < GRD_HOLD_COUNT; ++i)
+        pthread_mutex_init(&holds[i].mutex, NULL);
+    env = getenv(HIDRAW_ENV);
+    if (env  &&  strcmp(env, "0") == 0)
+        use_hidraw = 0;
+    if (grd_power_low_latency())
+        session_idle_ms = GRD_SESSION_AWAKE_MS;
+    env = getenv(GRD_SESSION_IDLE_ENV);
+    if (env)
+    {
+        ms = strtol(env, &end, 10);
+        if (end != env  &&  *end == '\0'  &&  ms >= 0)
+            session_idle_ms = ms;
+    }
+    env = getenv(GRD_SESSION_BATCH_ENV);
+    if (env)
+    {
+        ms = strtol(env, &end, 10);
+        if (end != env  &&  *end == '\0'  &&  ms >= 0)
+            session_batch = ms < 1000 ? (unsigned int)ms : 1000;
+    }
+    env = getenv(GRD_SESSION_HOLD_ENV);
+    if (env)
+    {
+        ms = strtol(env, &end, 10);
+        if (end != env  &&  *end == '\0'  &&  ms > 0)
+            hold_max_ms = ms < 600000 ? (unsigned int)ms : 600000;
+    }
+    env = getenv(GRD_SEARCH_PROBE_ENV);
+    if (env)
+    {
+        ms = strtol(env, &end, 10);
+        if (end != env  &&  ms > 0)
+            search_workers = ms < GRD_SEARCH_MAX_WORKERS ? (unsigned int)ms : GRD_SEARCH_MAX_WORKERS;
+        if (*end == ':')
+        {
+            env = end + 1;
+            ms = strtol(env, &end, 10);
+            if (end != env  &&  *end == '\0'  &&  ms > 0)
+                search_deadline_ms = ms;
+        }
+    }
+    pthread_atfork(NULL, NULL, sessions_atfork_child);
+}
+
+/*
+ * Close the idle sessions (not used for longer than session_idle_ms), but
+ * not those with a breaker which is not closed. Called with sessions_mutex
+ * locked.
+ */
+static void sweep_sessions(const struct timespec* now)
+{
+    struct grd_session** p;
+    struct grd_session* s;
+
+    p = &sessions;
+    while ((s = *p) != NULL)
+    {
+        if (s->refs == 0  &&  elapsed_ms(&s->last_used, now) >= session_idle_ms
+            &&  s->health.state == GRD_BREAKER_CLOSED
+            )
+        {
+            *p = s->next;
+            grd_device_close(&s->dev);
+            grd_power_close(&s->power);
+            grd_lock_destroy(&s->lock);
+            pthread_mutex_destroy(&s->mutex);
+            pthread_cond_destroy(&s->turn);
+            free(s);
+        }
+        else
+            p = &s->next;
+    }
+}
+
+/* Open device for the session (session is locked) */
+static int session_open_fd(struct grd_session* s)
 {
-    const char* name_prefix;
-    const char* slash;
+    uint64_t start, trace_start;
     int ret;
-    size_t len, i, magic_num = 0;
 
-    name_prefix = getenv(GRD_IPC_NAME_ENV);
-    if (!name_prefix)
-        name_prefix = "/tmp"; /* default */
+    assert(s);
+    assert(!s->dev.transport);
+    s->flush = 0;
+    start = grd_stats_begin();
+    trace_start = grd_trace_begin();
+    ret = grd_device_open(&s->dev, s->path);
+    s->dev.stats = s->stats;
+    s->dev.trace_dev = s->trace_dev;
+    grd_stats_end(s->stats, GRD_PHASE_OPEN, start);
+    grd_trace(GRD_TRACE_OPEN, s->trace_dev, 0, trace_start, ret ? errno : 0);
+    return ret;
+}
 
-    len = strlen(name_prefix);
-    if (len == 0  ||  name_prefix[len - 1] != '/')
-        slash = "/";
-    else
-        slash = "";
+/* Claim the opened device (session is locked), return non-zero if claimed */
+static int session_claim(struct grd_session* s)
+{
+    const struct grd_transport* tr = s->dev.transport;
+    uint64_t start, trace_start;
+    int ret;
+
+    assert(tr);
+    start = grd_stats_begin();
+    trace_start = grd_trace_begin();
+    ret = tr->claim(&s->dev);
+    grd_stats_end(s->stats, GRD_PHASE_CLAIM, start);
+    grd_trace(GRD_TRACE_CLAIM, s->trace_dev, 0, trace_start, ret ? errno : 0);
+    s->claimed = ret == 0;
+    return s->claimed;
+}
+
+/* Forget the device handle, the next call opens the device again */
+static void session_drop_fd(struct grd_session* s)
+{
+    assert(s);
+    grd_device_close(&s->dev);
+    s->claimed = 0;
+}
+
+/*
+ * Give the turn to the next thread of this process. The lock is kept for it
+ * if it is waiting and the batch is not over, else the device is released
+ * and the lock is yielded to the other processes. Return zero on success.
+ */
+static int session_next_turn(struct grd_session* s)
+{
+    const struct grd_transport* tr;
+    int ret = 0;
+
+    assert(s);
+    pthread_mutex_lock(&s->mutex);
+    s->locked = s->dev.transport  &&  s->ticket_next - s->ticket_serving > 1
+                &&  s->batch < session_batch;
+    pthread_mutex_unlock(&s->mutex);
+    if (!s->locked)
+    {
+        tr = s->dev.transport;
+        if (s->claimed  &&  tr  &&  tr->release(&s->dev) != 0)
+            ret = -1;
+        s->claimed = 0;
+        if (grd_lock_yield(&s->lock) != 0)
+            ret = -1;
+        grd_trace(GRD_TRACE_UNLOCK, s->trace_dev, 0, 0, ret ? errno : 0);
+    }
+    pthread_mutex_lock(&s->mutex);
+    ++s->ticket_serving;
+    pthread_cond_broadcast(&s->turn);
+    pthread_mutex_unlock(&s->mutex);
+    return ret;
+}
+
+/*
+ * Find (or create) the session of the device and take a reference.
+ * Return the session, or NULL.
+ */
+static struct grd_session* session_get(const char* dev_path)
+{
+    struct grd_session* s;
+    struct grd_dev_id id;
+    struct timespec now;
 
     assert(dev_path);
-    for (i = 0; dev_path[i]; ++i)
+    if (strlen(dev_path) >= sizeof(s->path))
+        return NULL;
+
+    pthread_once(&sessions_once, sessions_init);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    pthread_mutex_lock(&sessions_mutex);
+    sweep_sessions(&now);
+    for (s = sessions; s; s = s->next)
+        if (strcmp(s->path, dev_path) == 0)
+            break;
+    if (!s)
     {
-        magic_num += dev_path[i] * (i + 1);
-        magic_num %= 0x61;
+        s = calloc(1, sizeof(*s));
+        if (s  &&  (grd_device_identify(dev_path, &id) != 0
+                    ||  grd_lock_init(&s->lock, dev_path, &id) != 0))
+        {
+            grd_lock_destroy(&s->lock);
+            free(s);
+            s = NULL;
+        }
+        if (!s)
+        {
+            pthread_mutex_unlock(&sessions_mutex);
+            free(s);
+            return NULL;
+        }
+        pthread_mutex_init(&s->mutex, NULL);
+        pthread_cond_init(&s->turn, NULL);
+        strcpy(s->path, dev_path);
+        grd_power_open(&s->power, dev_path);
+        grd_health_init(&s->health);
+        s->stats = grd_stats_device(dev_path);
+        s->trace_dev = grd_trace_device(dev_path);
+        if (s->stats)
+        {
+            s->stats->breaker = GRD_BREAKER_CLOSED;
+            s->stats->timeout_ms = s->health.timeout_ms;
+        }
+        s->next = sessions;
+        sessions = s;
     }
+    ++s->refs;
+    pthread_mutex_unlock(&sessions_mutex);
+    return s;
+}
 
-    assert(buf);
-    assert(name_prefix);
-    ret = snprintf(buf, buf_size, "%s%sgrd%02d.lock", name_prefix, slash, magic_num);
-    assert(ret > 0  &&  (size_t)ret < buf_size);
-    if (ret > 0  &&  (size_t)ret < buf_size)
-        return 0;
+/* Release the reference of session_get */
+static void session_put(struct grd_session* s)
+{
+    struct timespec now;
+
+    assert(s);
+    pthread_mutex_lock(&sessions_mutex);
+    assert(s->refs > 0);
+    --s->refs;
+    clock_gettime(CLOCK_MONOTONIC, &s->last_used);
+    if (session_idle_ms == 0)
+    {
+        now = s->last_used;
+        sweep_sessions(&now);
+    }
+    pthread_mutex_unlock(&sessions_mutex);
+}
+
+/*
+ * End of the lock of the session with the turn taken: open device if the
+ * lock is acquired (ret is zero), else give up the turn.
+ * Return zero with the device opened and locked.
+ */
+static int session_lock_done(struct grd_session* s, int ret)
+{
+    if (ret == 0)
+    {
+        /* the resume is paid by the open, the claim or the first pack */
+        s->resume_start = 0;
+        if (grd_stats_begin()  &&  grd_power_is_suspended(&s->power))
+            s->resume_start = grd_stats_now();
+        if (s->dev.transport  ||  session_open_fd(s) == 0)
+            return 0;
+        session_next_turn(s);
+    }
+    else
+    {
+        pthread_mutex_lock(&s->mutex);
+        ++s->ticket_serving;
+        pthread_cond_broadcast(&s->turn);
+        pthread_mutex_unlock(&s->mutex);
+    }
     return -1;
 }
 
-static int close_device(int fd, struct lock_descr* lock)
+/*
+ * Wait for the turn of this thread, lock process and open device.
+ * Return zero with the device opened and locked.
+ */
+static int session_lock(struct grd_session* s)
 {
-    int ret, ret_unlock;
+    unsigned long ticket;
+    uint64_t start, trace_start, capture_start;
+    pid_t holder;
+    int ret;
 
-    assert(fd >= 0);
-    ret = close(fd); /* close device */
+    assert(s);
+    capture_start = grd_capture_begin(); /* the turn is waited for as well */
+    pthread_mutex_lock(&s->mutex);
+    ticket = s->ticket_next++;
+    while (s->ticket_serving != ticket)
+        pthread_cond_wait(&s->turn, &s->mutex);
+    pthread_mutex_unlock(&s->mutex);
+
+    if (__sync_lock_test_and_set(&s->gone, 0))
+        session_drop_fd(s); /* fails at once if the device is not back */
+    if (s->locked)
+    {
+        /* passed by the previous thread of this process */
+        ++s->batch;
+        ret = 0;
+        grd_trace(GRD_TRACE_LOCK, s->trace_dev, 1, 0, 0);
+    }
+    else
+    {
+        start = grd_stats_begin();
+        trace_start = grd_trace_begin();
+        holder = grd_lock_owner(&s->lock);
+        if (start  &&  s->stats  &&  holder != 0)
+            s->stats->lock_holder = (uint32_t)holder;
+        grd_trace(GRD_TRACE_LOCK_WAIT, s->trace_dev, (uint32_t)holder, 0, 0);
+        ret = grd_lock_acquire(&s->lock);
+        grd_stats_end(s->stats, GRD_PHASE_LOCK, start);
+        grd_trace(GRD_TRACE_LOCK, s->trace_dev, 0, trace_start, ret ? errno : 0);
+        s->batch = 1;
+        s->locked = ret == 0;
+    }
+    s->lock_ns = capture_start ? grd_stats_now() - capture_start : 0;
+    return session_lock_done(s, ret);
+}
 
-    assert(lock);
-    assert(lock->fd >= 0);
-    ret_unlock = close(lock->fd); /* process synchronization (unlock) */
+/*
+ * Take the turn and lock process if both are free (do not wait), open
+ * device. Return zero with the device opened and locked, else -1 (errno is
+ * EBUSY if the device is in use).
+ */
+static int session_try_lock(struct grd_session* s)
+{
+    int ret;
 
+    assert(s);
+    pthread_mutex_lock(&s->mutex);
+    ret = s->ticket_serving == s->ticket_next ? 0 : -1;
     if (ret == 0)
-        ret = ret_unlock;
+        ++s->ticket_next;
+    pthread_mutex_unlock(&s->mutex);
+    if (ret != 0)
+    {
+        errno = EBUSY;
+        return -1;
+    }
+
+    if (__sync_lock_test_and_set(&s->gone, 0))
+        session_drop_fd(s);
+    assert(!s->locked); /* no thread waited for the turn */
+    ret = grd_lock_try(&s->lock);
+    grd_trace(GRD_TRACE_LOCK, s->trace_dev, 0, 0, ret ? errno : 0);
+    s->batch = 1;
+    s->locked = ret == 0;
+    s->lock_ns = 0;
+    return session_lock_done(s, ret);
+}
+
+/*
+ * Find (or create) the session of the device, lock process and open device.
+ * Return the session with the device opened and locked, or NULL.
+ */
+static struct grd_session* session_acquire(const char* dev_path)
+{
+    struct grd_session* s;
+
+    s = session_get(dev_path);
+    if (s  &&  session_lock(s) != 0)
+    {
+        session_put(s);
+        s = NULL;
+    }
+    return s;
+}
+
+/*
+ * Unlock process (or pass the lock to the next thread) and release session
+ * (the device stays open). Return zero on success.
+ */
+static int session_release(struct grd_session* s)
+{
+    int ret;
+
+    assert(s);
+    ret = session_next_turn(s);
+    session_put(s);
     return ret;
 }
 
-static int open_device(const char* dev_path, struct lock_descr* lock_dscr)
+static uint64_t now_ms(void)
 {
-    char lock_path[PATH_MAX];
-    struct flock lock;
-    mode_t mode;
-    int fd, fd_dev, ret;
-    long pid;
+    struct timespec now;
 
-    assert(dev_path);
-    if (create_lock_path(dev_path, lock_path, sizeof(lock_path)) != 0)
-        return -1;
-
-    mode = umask(0);
-    fd = open(lock_path, O_RDWR | O_CREAT,
-              S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
-    umask(mode);
-    if (fd >= 0)
-    {
-        /* process synchronization (lock, wait) */
-        lock.l_type = F_WRLCK;
-        lock.l_start = 0;
-        lock.l_whence = SEEK_SET;
-        lock.l_len = 0;
-        /*
-         * FIXME: "while(...) { sleep() }" is compromise.
-         * (for synchronization libgrdapi.a and grdwine.dll.so)
-         */
-        while ((ret = fcntl(fd, F_SETLKW, &lock)) == -1
-               && (errno == EDEADLK || errno == EINTR || errno == ENOLCK)
-               )
-            sleep(1);
-        if (ret != 0)
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+}
+
+/* Show the breaker and the timeout of the session (it has the turn) */
+static void session_show_health(struct grd_session* s)
+{
+    if (!s->stats)
+        return;
+    s->stats->breaker = (uint32_t)s->health.state;
+    s->stats->timeout_ms = s->health.timeout_ms;
+}
+
+/*
+ * Check the device of an open breaker: the device is opened again and
+ * claimed. The breaker is half-open then: the next call is a trial. The
+ * checker does not wait for a device in use (by a hold or by another
+ * process): it is checked again GRD_CHECK_BUSY_MS later.
+ */
+static void session_check(struct grd_session* s)
+{
+    int ok = 0;
+
+    if (session_try_lock(s) == 0)
+    {
+        ok = s->claimed  ||  session_claim(s);
+        grd_health_checked(&s->health, ok, now_ms());
+        session_show_health(s);
+        session_next_turn(s);
+    }
+    else if (errno == EBUSY)
+        s->health.check_ms = now_ms() + GRD_CHECK_BUSY_MS;
+    else
+    {
+        /* no call changes an open breaker */
+        grd_health_checked(&s->health, 0, now_ms());
+    }
+}
+
+/*
+ * Expire a hold which is over its time (sessions_mutex is locked), return
+ * its session: the caller gives up the turn. *next is the earliest expiry
+ * of the others. A hold in a call is not waited for, it is checked again.
+ */
+static struct grd_session* expire_holds(uint64_t now, uint64_t* next)
+{
+    struct session_hold* h;
+    struct grd_session* s;
+    uint64_t expiry;
+    size_t i;
+
+    for (i = 0; i < GRD_HOLD_COUNT; ++i)
+    {
+        h = &holds[i];
+        if (!h->used)
+            continue;
+        if (pthread_mutex_trylock(&h->mutex) != 0)
         {
-            /* process synchronization failed */
-            assert(fd >= 0);
-            close(fd);
-            fd = ret < 0 ? ret : -1;
+            expiry = now + GRD_HOLD_POLL_MS;
+            if (!*next  ||  expiry < *next)
+                *next = expiry;
+            continue;
         }
-        else
+        s = h->s;
+        if (s)
         {
-            pid = (long)getpid();
-            ret = write(fd, (char*)&pid, sizeof(pid));
-            assert(ret == sizeof(pid));
+            expiry = h->used_ms + h->idle_ms < h->deadline_ms
+                     ? h->used_ms + h->idle_ms : h->deadline_ms;
+            if (now >= expiry)
+            {
+                h->s = NULL;
+                pthread_mutex_unlock(&h->mutex);
+                return s;
+            }
+            if (!*next  ||  expiry < *next)
+                *next = expiry;
         }
+        pthread_mutex_unlock(&h->mutex);
     }
-    if (fd >= 0)
+    return NULL;
+}
+
+/*
+ * Check the devices of the open breakers when they are due, and expire
+ * the holds.
+ */
+static void* run_checker(void* arg)
+{
+    struct grd_session* s;
+    struct timespec wake;
+    uint64_t now, next;
+
+    (void)arg;
+    pthread_mutex_lock(&sessions_mutex);
+    for (;;)
     {
-        assert(dev_path);
-        fd_dev = open(dev_path, O_RDWR); /* open device */
-        if (fd_dev >= 0)
+        now = now_ms();
+        next = 0;
+        for (s = sessions; s; s = s->next)
         {
-            assert(lock_dscr);
-            lock_dscr->fd = fd;
+            if (grd_health_check_due(&s->health, now))
+                break;
+            if (s->health.state == GRD_BREAKER_OPEN  &&  (!next  ||  s->health.check_ms < next))
+                next = s->health.check_ms;
         }
-        else
+        if (s)
+        {
+            ++s->refs;
+            pthread_mutex_unlock(&sessions_mutex);
+            session_check(s);
+            session_put(s);
+            pthread_mutex_lock(&sessions_mutex);
+            continue;
+        }
+        s = expire_holds(now, &next);
+        if (s)
+        {
+            /* the reference of the hold is released */
+            pthread_mutex_unlock(&sessions_mutex);
+            session_release(s);
+            pthread_mutex_lock(&sessions_mutex);
+            continue;
+        }
+        if (!next)
+        {
+            pthread_cond_wait(&checker_cond, &sessions_mutex);
+            continue;
+        }
+        /* CLOCK_REALTIME of the condition */
+        clock_gettime(CLOCK_REALTIME, &wake);
+        wake.tv_sec += (time_t)((next - now) / 1000);
+        wake.tv_nsec += (long)((next - now) % 1000) * 1000000;
+        if (wake.tv_nsec >= 1000000000)
+        {
+            ++wake.tv_sec;
+            wake.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&checker_cond, &sessions_mutex, &wake);
+    }
+    return NULL;
+}
+
+/* Start the checker (if not started) and wake it up (sessions_mutex is locked) */
+static int wake_checker(void)
+{
+    pthread_attr_t attr;
+    pthread_t thread;
+
+    if (!checker_started  &&  pthread_attr_init(&attr) == 0)
+    {
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        checker_started = pthread_create(&thread, &attr, run_checker, NULL) == 0;
+        pthread_attr_destroy(&attr);
+    }
+    pthread_cond_signal(&checker_cond);
+    return checker_started ? 0 : -1;
+}
+
+/* The breaker of the session was opened (the session has the turn) */
+static void session_breaker_opened(struct grd_session* s)
+{
+    grd_stats_inc(s->stats, &s->stats->breaker_opens);
+    /* the check opens the device again */
+    session_drop_fd(s);
+
+    pthread_mutex_lock(&sessions_mutex);
+    wake_checker();
+    pthread_mutex_unlock(&sessions_mutex);
+}
+
+/*
+ * Exchange packs with the device (the device is opened, locked and claimed).
+ * *started is set to non-zero as soon as some data was transferred.
+ */
+static int exchange_device(struct grd_device* dev, int ishid, size_t pack_size,
+                           void* in, size_t len_in, void* out, size_t len_out,
+                           int* started)
+{
+    const struct grd_transport* tr;
+    int (*write_pack)(struct grd_device*, void*, size_t);
+    int (*read_pack)(struct grd_device*, void*, size_t);
+    uint64_t start;
+    int r;
+
+    assert(dev && dev->transport);
+    assert(pack_size > 0);
+    assert(len_out % pack_size == 0);
+    assert(len_in % pack_size == 0);
+    assert(started);
+    tr = dev->transport;
+    write_pack = ishid ? tr->hid_write : tr->bulk_write;
+    read_pack = ishid ? tr->hid_read : tr->bulk_read;
+    if (!write_pack  ||  !read_pack)
+    {
+        errno = EINVAL; /* the node does not match the product id */
+        return -1;
+    }
+    if (!ishid  &&  tr->bulk_exchange)
+    {
+        r = tr->bulk_exchange(dev, pack_size, in, len_in, out, len_out, started);
+        if (r != GRD_BULK_EXCHANGE_UNSUPPORTED)
+            return r;
+    }
+    while (pack_size  &&  (len_out >= pack_size || len_in >= pack_size))
+    {
+        if (len_out >= pack_size)
+        {
+            /* write */
+            assert(out);
+            start = grd_trace_begin();
+            r = write_pack(dev, out, pack_size);
+            grd_trace(GRD_TRACE_WRITE, dev->trace_dev, (uint32_t)pack_size, start, r ? errno : 0);
+            if (r != 0)
+                break;
+            *started = 1;
+            len_out -= pack_size;
+            out = (unsigned char*)out + pack_size;
+        }
+        else if (ishid)
         {
-            ret = close(fd); /* process synchronization (unlock) */
-            assert(ret == 0);
+            /* write idle pack */
+            start = grd_trace_begin();
+            r = write_pack(dev, NULL, 0);
+            grd_trace(GRD_TRACE_IDLE, dev->trace_dev, 0, start, r ? errno : 0);
+            if (r != 0)
+                break;
+        }
+        /* read the latest pack after the last written pack */
+        if ((len_in == pack_size && len_out < pack_size)
+            || len_in > pack_size
+            )
+        {
+            /* read */
+            assert(in);
+            start = grd_trace_begin();
+            r = read_pack(dev, in, pack_size);
+            grd_trace(GRD_TRACE_READ, dev->trace_dev, (uint32_t)pack_size, start, r ? errno : 0);
+            if (r != 0)
+                break;
+            *started = 1;
+            len_in -= pack_size;
+            in = (unsigned char*)in + pack_size;
         }
-        fd = fd_dev;
     }
-    return fd;
+    return (len_out == 0 && len_in == 0) ? 0 : -1;
 }
 
-static int ioctl_device_bulk(int fd, unsigned int ep, void* buf, size_t len)
+/*
+ * Exchange with the opened device of the session (this thread has the turn
+ * and the lock). A stale handle is opened again if nothing was transferred.
+ * Return zero on success, else -1 with errno set.
+ */
+static int session_exchange(struct grd_session* s, int ishid, size_t pack_size,
+                            void* in, size_t len_in, void* out, size_t len_out)
 {
-    struct usbdevfs_bulktransfer packet;
+    const struct grd_transport* tr;
+    int started, reopened = 0, err = 0;
     int ret;
+    uint64_t start, transfer_start, transfer_ns = 0;
 
-    assert(fd >= 0);
-    assert(buf);
-    assert(len > 0);
-    assert(len <= 16384 /* MAX_USBFS_BUFFER_SIZE */);
-    packet.ep = ep;
-    packet.len = (unsigned int)len;
-    packet.timeout = 3000;
-    packet.data = buf;
-    ret = ioctl(fd, USBDEVFS_BULK, &packet);
-    if (ret < 0 || (size_t)ret != len)
-        return ret < 0 ? ret : -1;
+    assert(s && s->dev.transport);
+    s->dev.timeout_ms = s->health.timeout_ms;
+    for (;;)
+    {
+        ret = -1;
+        started = 0;
+        tr = s->dev.transport;
+        assert(tr);
+        if (s->claimed  ||  session_claim(s))
+        {
+            if (s->flush  &&  tr->hid_flush)
+                tr->hid_flush(&s->dev);
+            start = grd_stats_begin();
+            transfer_start = grd_stats_now();
+            ret = exchange_device(&s->dev, ishid, pack_size,
+                                  in, len_in, out, len_out, &started);
+            err = errno;
+            transfer_ns = grd_stats_now() - transfer_start;
+            grd_stats_end(s->stats, GRD_PHASE_TRANSFER, start);
+            s->flush = ret != 0;
+        }
+        else
+            err = errno;
+
+        if (ret == 0  ||  !is_stale_error(err))
+            break;
+        /* the opened handle is stale */
+        session_drop_fd(s);
+        if (started  ||  reopened)
+            break;
+        /* nothing was transferred: open device again and repeat */
+        reopened = 1;
+        grd_stats_inc(s->stats, &s->stats->reopens);
+        if (session_open_fd(s) != 0)
+            break;
+        s->dev.timeout_ms = s->health.timeout_ms;
+    }
+    if (ret == 0)
+        grd_health_success(&s->health, transfer_ns, (len_in + len_out) / pack_size);
+    else if (grd_health_failure(&s->health, err))
+        session_breaker_opened(s);
+    session_show_health(s);
+    if (ret != 0)
+    {
+        grd_stats_inc(s->stats, &s->stats->errors);
+        if (err == ETIMEDOUT)
+            grd_stats_inc(s->stats, &s->stats->timeouts);
+        grd_trace(GRD_TRACE_ERROR, s->trace_dev, 0, 0, err);
+    }
+    errno = err;
+    return ret;
+}
+
+/* grd_ioctl_device, the capture of the call is filled if call is not NULL */
+static int ioctl_device(const char* dev_path, unsigned int prod_id, size_t pack_size,
+                        void* in, size_t len_in, void* out, size_t len_out,
+                        struct grd_capture_call* call)
+{
+    const int ishid = grd_is_hid_prodid(prod_id);
+    struct grd_session* s;
+    struct grd_stats_dev* stats;
+    unsigned int trace_dev;
+    int ret, err;
+    uint64_t call_start, trace_start;
+
+    assert(dev_path);
+    /* the broker owns the devices (if it is running) */
+    ret = grd_broker_ioctl(dev_path, prod_id, pack_size, in, len_in, out, len_out);
+    if (ret != GRD_BROKER_UNAVAILABLE)
+    {
+        if (call)
+            call->flags |= GRD_CAPTURE_BROKER;
+        return ret;
+    }
+
+    call_start = grd_stats_begin();
+    trace_start = grd_trace_begin();
+    s = session_get(dev_path);
+    if (!s)
+        return -1;
+    trace_dev = s->trace_dev;
+    if (grd_health_admit(&s->health) != 0)
+    {
+        /* the breaker is open: no wait for the lock and the timeout */
+        grd_stats_inc(s->stats, &s->stats->fast_fails);
+        session_put(s);
+        grd_trace(GRD_TRACE_IOCTL, trace_dev, (uint32_t)(len_in + len_out), trace_start, EIO);
+        errno = EIO;
+        return -1;
+    }
+    /* lock process and open device (or take the opened one) */
+    if (session_lock(s) != 0)
+    {
+        err = errno;
+        session_put(s);
+        grd_trace(GRD_TRACE_IOCTL, trace_dev, (uint32_t)(len_in + len_out), trace_start, err);
+        errno = err;
+        return -1;
+    }
+    ret = session_exchange(s, ishid, pack_size, in, len_in, out, len_out);
+    err = ret ? errno : 0;
+    if (call)
+    {
+        call->lock_ns = s->lock_ns;
+        if (s->batch > 1)
+            call->flags |= GRD_CAPTURE_PASSED;
+    }
+    if (s->resume_start)
+    {
+        grd_stats_inc(s->stats, &s->stats->resumes);
+        grd_stats_end(s->stats, GRD_PHASE_RESUME, s->resume_start);
+    }
+    /* unlock process (device stays opened), s may be freed then */
+    stats = s->stats;
+    if (session_release(s) != 0)
+        ret = -1;
+    grd_stats_end(stats, GRD_PHASE_IOCTL, call_start);
+    grd_trace(GRD_TRACE_IOCTL, trace_dev, (uint32_t)(len_in + len_out), trace_start, err);
+    return ret;
+}
+
+int grd_ioctl_device(const char* dev_path, unsigned int prod_id, size_t pack_size,
+                     void* in, size_t len_in, void* out, size_t len_out)
+{
+    struct grd_capture_call call;
+    int ret;
+
+    call.start = grd_capture_begin();
+    if (!call.start)
+        return ioctl_device(dev_path, prod_id, pack_size, in, len_in, out, len_out, NULL);
+    call.lock_ns = 0;
+    call.flags = 0;
+    ret = ioctl_device(dev_path, prod_id, pack_size, in, len_in, out, len_out, &call);
+    grd_capture_ioctl(dev_path, prod_id, pack_size, in, len_in, out, len_out,
+                      &call, ret ? errno : 0);
+    return ret;
+}
+
+int grd_session_open(const char* dev_path, unsigned int prod_id,
+                     unsigned int hold_ms, unsigned int idle_ms, unsigned long long* handle)
+{
+    struct session_hold* h = NULL;
+    struct grd_session* s;
+    size_t i;
+    int err;
+
+    if (!dev_path  ||  !handle)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    *handle = 0;
+    s = session_get(dev_path);
+    if (!s)
+        return -1;
+    if (grd_health_admit(&s->health) != 0)
+    {
+        grd_stats_inc(s->stats, &s->stats->fast_fails);
+        session_put(s);
+        errno = EIO;
+        return -1;
+    }
+    pthread_mutex_lock(&sessions_mutex);
+    for (i = 0; i < GRD_HOLD_COUNT  &&  !h; ++i)
+        if (!holds[i].used)
+        {
+            h = &holds[i];
+            h->used = 1;
+        }
+    pthread_mutex_unlock(&sessions_mutex);
+    if (!h)
+    {
+        session_put(s);
+        errno = EMFILE;
+        return -1;
+    }
+
+    /* wait for the turn and the lock, claim the device for the whole hold */
+    err = 0;
+    if (session_lock(s) != 0)
+        err = errno ? errno : EIO;
     else
+    {
+        if (!s->claimed  &&  !session_claim(s))
+        {
+            err = errno ? errno : EIO;
+            session_next_turn(s);
+        }
+        else if (s->resume_start)
+        {
+            grd_stats_inc(s->stats, &s->stats->resumes);
+            grd_stats_end(s->stats, GRD_PHASE_RESUME, s->resume_start);
+        }
+    }
+    if (err)
+    {
+        session_put(s);
+        pthread_mutex_lock(&sessions_mutex);
+        h->used = 0;
+        pthread_mutex_unlock(&sessions_mutex);
+        errno = err;
+        return -1;
+    }
+
+    if (hold_ms == 0  ||  hold_ms > hold_max_ms)
+        hold_ms = hold_max_ms;
+    if (idle_ms == 0)
+        idle_ms = GRD_HOLD_IDLE_MS;
+    pthread_mutex_lock(&h->mutex);
+    h->s = s;
+    h->ishid = grd_is_hid_prodid(prod_id);
+    h->used_ms = now_ms();
+    h->deadline_ms = h->used_ms + hold_ms;
+    h->idle_ms = idle_ms < hold_ms ? idle_ms : hold_ms;
+    pthread_mutex_lock(&sessions_mutex);
+    h->handle = ++holds_serial * GRD_HOLD_COUNT + (unsigned long long)(h - holds);
+    *handle = h->handle;
+    /* the checker expires the hold */
+    wake_checker();
+    pthread_mutex_unlock(&sessions_mutex);
+    pthread_mutex_unlock(&h->mutex);
+    return 0;
+}
+
+/* Return the hold of the handle with its mutex locked, or NULL */
+static struct session_hold* hold_lock(unsigned long long handle)
+{
+    struct session_hold* h;
+
+    pthread_once(&sessions_once, sessions_init);
+    if (handle == 0)
+    {
+        errno = EBADF;
+        return NULL;
+    }
+    h = &holds[handle % GRD_HOLD_COUNT];
+    pthread_mutex_lock(&h->mutex);
+    if (h->handle != handle)
+    {
+        pthread_mutex_unlock(&h->mutex);
+        errno = EBADF;
+        return NULL;
+    }
+    return h;
+}
+
+/* Give up the turn of the hold (its mutex is locked) */
+static int hold_expire(struct session_hold* h)
+{
+    struct grd_session* s = h->s;
+
+    h->s = NULL;
+    return s ? session_release(s) : 0;
+}
+
+int grd_session_ioctl(unsigned long long handle, size_t pack_size,
+                      void* in, size_t len_in, void* out, size_t len_out)
+{
+    struct session_hold* h;
+    struct grd_session* s;
+    uint64_t call_start, trace_start, now;
+    int ret, err;
+
+    if (pack_size == 0  ||  len_in % pack_size != 0  ||  len_out % pack_size != 0
+        ||  (len_in  &&  !in)  ||  (len_out  &&  !out)
+        )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    h = hold_lock(handle);
+    if (!h)
+        return -1;
+    now = now_ms();
+    s = h->s;
+    if (!s  ||  now >= h->deadline_ms  ||  now - h->used_ms >= h->idle_ms)
+    {
+        /* expired: the checker may be late */
+        hold_expire(h);
+        pthread_mutex_unlock(&h->mutex);
+        errno = ETIMEDOUT;
+        return -1;
+    }
+
+    call_start = grd_stats_begin();
+    trace_start = grd_trace_begin();
+    if (s->dev.transport  ||  session_open_fd(s) == 0)
+        ret = session_exchange(s, h->ishid, pack_size, in, len_in, out, len_out);
+    else
+        ret = -1;
+    err = ret ? errno : 0;
+    grd_stats_end(s->stats, GRD_PHASE_IOCTL, call_start);
+    grd_trace(GRD_TRACE_IOCTL, s->trace_dev, (uint32_t)(len_in + len_out), trace_start, err);
+    /* a failing device is left to the checker of the breaker */
+    if (s->health.state == GRD_BREAKER_OPEN)
+        hold_expire(h);
+    h->used_ms = now_ms();
+    pthread_mutex_unlock(&h->mutex);
+    errno = err;
+    return ret;
+}
+
+int grd_session_close(unsigned long long handle)
+{
+    struct session_hold* h;
+    int ret;
+
+    h = hold_lock(handle);
+    if (!h)
+        return -1;
+    ret = hold_expire(h);
+    h->handle = 0;
+    pthread_mutex_unlock(&h->mutex);
+    pthread_mutex_lock(&sessions_mutex);
+    h->used = 0;
+    pthread_mutex_unlock(&sessions_mutex);
+    return ret;
+}
+
+/* Requests of one grd_ioctl_devices call, grouped by device */
+struct ioctl_batch
+{
+    struct ioctl_batch* next_batch; /* in batches */
+    int queued;                 /* in batches */
+    unsigned int workers;       /* the pool threads running it */
+    struct grd_ioctl_request* requests;
+    size_t* next;               /* next request to the same device, or GRD_BATCH_END */
+    size_t* groups;             /* the first request to each device */
+    size_t groups_count;
+    volatile size_t next_group; /* the first group not taken by a worker */
+};
+
+/* Take the groups one by one, run the requests of a group in order */
+static void run_ioctl_batch(struct ioctl_batch* batch)
+{
+    struct grd_ioctl_request* r;
+    size_t g, i;
+
+    assert(batch);
+    while ((g = __sync_fetch_and_add(&batch->next_group, 1)) < batch->groups_count)
+    {
+        for (i = batch->groups[g]; i != GRD_BATCH_END; i = batch->next[i])
+        {
+            r = &batch->requests[i];
+            errno = 0;
+            if (grd_ioctl_device(r->dev_path, r->prod_id, r->pack_size,
+                                 r->in, r->len_in, r->out, r->len_out) == 0)
+                r->status = 0;
+            else
+                r->status = errno ? errno : EIO;
+        }
+    }
+}
+
+/* Take the batch out of the queue, if it is there (batch_mutex is locked) */
+static void unlink_batch(struct ioctl_batch* batch)
+{
+    struct ioctl_batch** p;
+
+    if (!batch->queued)
+        return;
+    for (p = &batches; *p != batch; p = &(*p)->next_batch)
+        ;
+    *p = batch->next_batch;
+    batch->queued = 0;
+}
+
+/* Pool thread: help the queued batches, wait for the next one when idle */
+static void* run_batch_worker(void* arg)
+{
+    struct ioctl_batch* batch;
+
+    (void)arg;
+    pthread_mutex_lock(&batch_mutex);
+    for (;;)
+    {
+        batch = batches;
+        if (!batch)
+        {
+            ++batch_idle;
+            pthread_cond_wait(&batch_queued, &batch_mutex);
+            --batch_idle;
+            continue;
+        }
+        if (batch->next_group >= batch->groups_count)
+        {
+            unlink_batch(batch); /* all groups are taken */
+            continue;
+        }
+        ++batch->workers;
+        pthread_mutex_unlock(&batch_mutex);
+
+        run_ioctl_batch(batch);
+
+        pthread_mutex_lock(&batch_mutex);
+        unlink_batch(batch);
+        if (--batch->workers == 0)
+            pthread_cond_broadcast(&batch_done);
+    }
+    return NULL;
+}
+
+/*
+ * Queue the batch for the pool threads (one per device besides the caller,
+ * up to GRD_BATCH_MAX_THREADS). The threads stay for the next calls.
+ */
+static void queue_batch(struct ioctl_batch* batch)
+{
+    struct ioctl_batch** p;
+    pthread_attr_t attr;
+    pthread_t thread;
+    size_t wanted, idle;
+
+    wanted = batch->groups_count - 1;
+    if (wanted > GRD_BATCH_MAX_THREADS - 1)
+        wanted = GRD_BATCH_MAX_THREADS - 1;
+    pthread_mutex_lock(&batch_mutex);
+    for (p = &batches; *p; p = &(*p)->next_batch)
+        ;
+    batch->next_batch = NULL;
+    batch->workers = 0;
+    batch->queued = 1;
+    *p = batch;
+    idle = batch_idle;
+    if (idle < wanted  &&  batch_threads < GRD_BATCH_MAX_THREADS - 1
+        &&  pthread_attr_init(&attr) == 0
+        )
+    {
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        while (idle < wanted  &&  batch_threads < GRD_BATCH_MAX_THREADS - 1
+               &&  pthread_create(&thread, &attr, run_batch_worker, NULL) == 0
+               )
+        {
+            ++batch_threads;
+            ++idle;
+        }
+        pthread_attr_destroy(&attr);
+    }
+    pthread_cond_broadcast(&batch_queued);
+    pthread_mutex_unlock(&batch_mutex);
+}
+
+int grd_ioctl_devices(struct grd_ioctl_request* requests, size_t count)
+{
+    struct ioctl_batch batch;
+    size_t* last;
+    size_t i, g;
+    int ret = 0;
+
+    if (!requests)
+        return -1;
+    if (count == 0)
         return 0;
+    pthread_once(&sessions_once, sessions_init); /* resets the pool in a child */
+    memset(&batch, 0, sizeof(batch));
+    batch.requests = requests;
+    batch.next = malloc(count * 3 * sizeof(size_t));
+    if (!batch.next)
+    {
+        for (i = 0; i < count; ++i)
+            requests[i].status = ENOMEM;
+        return -1;
+    }
+    batch.groups = batch.next + count;
+    last = batch.groups + count; /* the last request of each group */
+
+    for (i = 0; i < count; ++i)
+    {
+        struct grd_ioctl_request* r = &requests[i];
+
+        batch.next[i] = GRD_BATCH_END;
+        if (!r->dev_path  ||  r->pack_size == 0
+            ||  r->len_in % r->pack_size != 0  ||  r->len_out % r->pack_size != 0
+            ||  (r->len_in  &&  !r->in)  ||  (r->len_out  &&  !r->out)
+            )
+        {
+            r->status = EINVAL;
+            continue;
+        }
+        r->status = EINPROGRESS;
+        for (g = 0; g < batch.groups_count; ++g)
+            if (strcmp(requests[batch.groups[g]].dev_path, r->dev_path) == 0)
+                break;
+        if (g == batch.groups_count)
+            batch.groups[batch.groups_count++] = i;
+        else
+            batch.next[last[g]] = i;
+        last[g] = i;
+    }
+
+    /* one worker per device (up to GRD_BATCH_MAX_THREADS), the caller too */
+    if (batch.groups_count > 1)
+        queue_batch(&batch);
+    run_ioctl_batch(&batch);
+    if (batch.groups_count > 1)
+    {
+        /* no worker joins now, wait for the ones running it */
+        pthread_mutex_lock(&batch_mutex);
+        unlink_batch(&batch);
+        while (batch.workers > 0)
+            pthread_cond_wait(&batch_done, &batch_mutex);
+        pthread_mutex_unlock(&batch_mutex);
+    }
+    free(batch.next);
+
+    for (i = 0; i < count; ++i)
+        if (requests[i].status != 0)
+            ret = -1;
+    return ret;
+}
+
+static int probe_device(struct grd_device* dev, unsigned int* id)
+{
+    assert(dev && dev->transport);
+    if (!dev->transport->get_prodid)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    return dev->transport->get_prodid(dev, id);
+}
+
+static int get_probe_key(const char* path, struct probe_key* key)
+{
+    struct grd_dev_id id;
+    struct stat buf;
+
+    assert(path);
+    assert(key);
+    memset(key, 0, sizeof(*key));
+    if (grd_transport_override())
+    {
+        /* the emulated devices do not change */
+        if (grd_device_identify(path, &id) != 0)
+            return -1;
+        key->dev = ((uint64_t)id.major << 32) | id.minor;
+        key->ino = id.ino;
+        return 0;
+    }
+    if (stat(path, &buf) != 0)
+        return -1;
+    key->dev = (uint64_t)(S_ISCHR(buf.st_mode) ? buf.st_rdev : buf.st_dev);
+    key->ino = (uint64_t)buf.st_ino;
+    key->ctime_sec = (int64_t)buf.st_ctim.tv_sec;
+    key->ctime_nsec = (int64_t)buf.st_ctim.tv_nsec;
+    return 0;
+}
+
+/*
+ * Find the probe result of the node (no locks).
+ * Return zero on success.
+ */
+static int probe_cache_lookup(const char* path, const struct probe_key* key,
+                              unsigned int* prod_id)
+{
+    struct probe_entry* e;
+    unsigned int id;
+    uint32_t seq;
+    size_t i;
+    int hit;
+
+    assert(path && key && prod_id);
+    for (i = 0; i < GRD_PROBE_CACHE_SIZE; ++i)
+    {
+        e = &probe_cache[i];
+        do
+        {
+            seq = e->seq;
+            __sync_synchronize();
+            hit = !(seq & 1)  &&  e->valid
+                  &&  memcmp(&e->key, key, sizeof(*key)) == 0
+                  &&  strncmp(e->path, path, sizeof(e->path)) == 0;
+            id = e->prod_id;
+            __sync_synchronize();
+        } while (e->seq != seq);
+        if (hit)
+        {
+            *prod_id = id;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* Write the entry (probe_cache_mutex is locked) */
+static void probe_entry_set(struct probe_entry* e, int valid, const char* path,
+                            const struct probe_key* key, unsigned int prod_id)
+{
+    assert(e);
+    ++e->seq;
+    __sync_synchronize();
+    e->valid = valid;
+    if (valid)
+    {
+        assert(path && key);
+        e->prod_id = prod_id;
+        e->key = *key;
+        strcpy(e->path, path);
+    }
+    __sync_synchronize();
+    ++e->seq;
+}
+
+static void probe_cache_store(const char* path, const struct probe_key* key,
+                              unsigned int prod_id)
+{
+    struct probe_entry* e = NULL;
+    size_t i;
+
+    assert(path && key);
+    if (strlen(path) >= sizeof(e->path))
+        return;
+    pthread_mutex_lock(&probe_cache_mutex);
+    /* the entry of the path (an old node), a free one, or the next victim */
+    for (i = 0; i < GRD_PROBE_CACHE_SIZE; ++i)
+        if (probe_cache[i].valid  &&  strcmp(probe_cache[i].path, path) == 0)
+            e = &probe_cache[i];
+    for (i = 0; i < GRD_PROBE_CACHE_SIZE  &&  !e; ++i)
+        if (!probe_cache[i].valid)
+            e = &probe_cache[i];
+    if (!e)
+        e = &probe_cache[probe_cache_victim++ % GRD_PROBE_CACHE_SIZE];
+    probe_entry_set(e, 1, path, key, prod_id);
+    pthread_mutex_unlock(&probe_cache_mutex);
 }
 
-static int hiddevice_get_prodid(int fd, unsigned int* id)
+/* Forget the probe result of the path (the node was added or removed) */
+static void probe_cache_invalidate(const char* path)
 {
-    struct hiddev_devinfo devinfo;
+    size_t i;
 
-    assert(fd >= 0);
-    if (ioctl(fd, HIDIOCGDEVINFO, &devinfo) != 0)
-        return -1;
-    if (devinfo.vendor != GRD_VENDOR)
-        return -1;
-    if (devinfo.product != GRD_PRODID_S3S_HID && devinfo.product != GRD_PRODID_S3C_HID)
-        return -1;
-    assert(id);
-    *id = devinfo.product;
-    return 0;
+    assert(path);
+    pthread_mutex_lock(&probe_cache_mutex);
+    for (i = 0; i < GRD_PROBE_CACHE_SIZE; ++i)
+        if (probe_cache[i].valid  &&  strcmp(probe_cache[i].path, path) == 0)
+            probe_entry_set(&probe_cache[i], 0, NULL, NULL, 0);
+    pthread_mutex_unlock(&probe_cache_mutex);
 }
 
-static int hiddevice_write(int fd, void* buf, size_t len)
+/*
+ * Product id from sysfs, without a lock and device I/O: the attributes of
+ * the USB device of a usbfs node, of the parent of the interface of a
+ * hiddev node. Return zero if it is a Guardant device, 1 if it is not,
+ * -1 if sysfs has no such node.
+ */
+static int probe_sysfs(const char* path, unsigned int* prod_id)
 {
-    const size_t report_len = 64;
-    struct hiddev_usage_ref_multi ref;
-    struct hiddev_report_info info;
-    size_t i, n;
-
-    if (len == 0 && buf == NULL)
-        len = report_len; /* idle report */
+    char dir[PATH_MAX];
+    struct stat buf;
+    unsigned int vendor, product;
+    const int ishid = grd_is_hid_path(path);
+    struct grd_hid_info info;
+    int dir_fd, ret;
 
-    assert(len > 0);
-    assert(len % report_len == 0);
-    for (n = 0; n < len / report_len; ++n)
+    assert(path && prod_id);
+    if (ishid  &&  grd_hid_find_path(path, &info) == 0  &&  access(path, R_OK | W_OK) == 0)
     {
-        ref.uref.report_type = HID_REPORT_TYPE_OUTPUT;
-        ref.uref.report_id = 0;
-        ref.uref.field_index = 0;
-        ref.uref.usage_index = 0;
-        ref.uref.usage_code = 0xffa00004;
-        ref.uref.value = 0;
-        ref.num_values = report_len;
-        assert(sizeof(ref.values) / sizeof(ref.values[0]) >= ref.num_values);
-        for (i = 0; i < ref.num_values; ++i)
-            if (!buf)
-                ref.values[i] = 0;
-            else
-                ref.values[i] = ((unsigned char*)buf)[i + report_len * n];
-
-        assert(fd >= 0);
-        if (ioctl(fd, HIDIOCSUSAGES, &ref) != 0)
-            return -1;
-
-        info.report_type = HID_REPORT_TYPE_OUTPUT;
-        info.report_id = 0;
-        info.num_fields = 0;
-        if (ioctl(fd, HIDIOCSREPORT, &info) != 0)
-            return -1;
+        *prod_id = info.prod_id;
+        return 0;
     }
-    return 0;
+    /* no access: probe the device, it fails as the exchanges would */
+    if (grd_transport_override()  ||  stat(path, &buf) != 0  ||  !S_ISCHR(buf.st_mode)
+        ||  access(path, R_OK | W_OK) != 0
+        )
+        return -1;
+    ret = snprintf(dir, sizeof(dir), "%s/dev/char/%u:%u%s", grd_sysfs_path(),
+                   major(buf.st_rdev), minor(buf.st_rdev), ishid ? "/device/.." : "");
+    if (ret < 0  ||  (size_t)ret >= sizeof(dir))
+        return -1;
+    dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0)
+        return -1;
+    if (grd_read_sysfs_uint(dir_fd, "idVendor", 16, &vendor) != 0
+        ||  grd_read_sysfs_uint(dir_fd, "idProduct", 16, &product) != 0
+        )
+        ret = -1;
+    else if (vendor == GRD_VENDOR
+             &&  (ishid ? grd_is_hid_prodid(product) : grd_is_usbfs_prodid(product))
+             )
+    {
+        *prod_id = product;
+        ret = 0;
+    }
+    else
+        ret = 1;
+    close(dir_fd);
+    return ret;
 }
 
-static int hiddevice_read(int fd, void* buf, size_t len)
+/* Probe the opened device (locked) */
+static int probe_session(const char* dev_path, unsigned int* id)
 {
-    const size_t report_len = 64;
-    struct hiddev_usage_ref_multi ref;
-    struct hiddev_report_info info;
-    size_t i, n;
-    fd_set rfds, efds;
-    struct timeval tv;
+    struct grd_session* s;
     int ret;
 
-    assert(len > 0);
-    assert(len % report_len == 0);
-    for (n = 0; n < len / report_len; ++n)
-    {
-        assert(fd >= 0);
-
-        if (n > 0)
-            /* write an idle report before reading the next report */
-            if (hiddevice_write(fd, NULL, 0) != 0)
-                return -1;
-
-        FD_ZERO(&rfds);
-        FD_ZERO(&efds);
-        FD_SET(fd, &rfds);
-        FD_SET(fd, &efds);
-        tv.tv_sec = 3;
-        tv.tv_usec = 0;
-        ret = select(fd + 1, &rfds, NULL, &efds, &tv);
-        if (ret != 1 || !FD_ISSET(fd, &rfds) || FD_ISSET(fd, &efds))
-            return -1;
-
-        ret = read(fd, (char*)&ref.uref, sizeof(ref.uref));
-        if (ret < 0 || (size_t)ret != sizeof(ref.uref))
-            return -1;
-
-        info.report_type = HID_REPORT_TYPE_INPUT;
-        info.report_id = 0;
-        info.num_fields = 0;
-        if (ioctl(fd, HIDIOCGREPORT, &info) != 0)
-            return -1;
-        ref.uref.report_type = HID_REPORT_TYPE_INPUT;
-        ref.uref.report_id = 0;
-        ref.uref.field_index = 0;
-        ref.uref.usage_index = 0;
-        ref.uref.usage_code = 0xffa00003;
-        ref.uref.value = 0;
-        ref.num_values = report_len;
-        assert(sizeof(ref.values) / sizeof(ref.values[0]) >= ref.num_values);
-        if (ioctl(fd, HIDIOCGUSAGES, &ref) != 0)
-            return -1;
+    s = session_acquire(dev_path);
+    if (!s)
+        return -1;
 
-        assert(buf);
-        assert(ref.num_values == report_len);
-        assert(sizeof(ref.values) / sizeof(ref.values[0]) >= ref.num_values);
-        for (i = 0; i < ref.num_values; ++i)
-            ((unsigned char*)buf)[i + report_len * n] = (unsigned char)ref.values[i];
+    errno = 0;
+    ret = probe_device(&s->dev, id);
+    if (ret != 0  &&  is_stale_error(errno))
+    {
+        /* the opened handle is stale: open device again and repeat */
+        session_drop_fd(s);
+        grd_stats_inc(s->stats, &s->stats->reopens);
+        if (session_open_fd(s) == 0)
+            ret = probe_device(&s->dev, id);
     }
-    return 0;
+    if (ret != 0)
+        grd_stats_inc(s->stats, &s->stats->errors);
+    /* unlock process (device stays opened), s may be freed then */
+    if (session_release(s) != 0)
+        ret = -1;
+    return ret;
 }
 
-int grd_ioctl_device(const char* dev_path, unsigned int prod_id, size_t pack_size,
-                     void* in, size_t len_in, void* out, size_t len_out)
+/*
+ * If device (dev_path is usbfs path) is Guardant Sign/Time/Code,
+ * or device (dev_path is a hiddev node, see grdhidreg.h) is
+ * Guardant Sign/Time/Code HID  then return 0, else return -1.
+ * The results are cached by device node: the next probe of the node
+ * takes no lock and does no device I/O. The capture of the call is
+ * filled if call is not NULL.
+ */
+static int probe_path(const char* dev_path, unsigned int* prod_id, struct grd_capture_call* call)
 {
-    const int ishid = (prod_id == GRD_PRODID_S3S_HID || prod_id == GRD_PRODID_S3C_HID);
-    struct lock_descr lock;
-    int fd, r;
-    int ret = -1, interface = 0, flags = HIDDEV_FLAG_UREF | HIDDEV_FLAG_REPORT;
+    struct probe_key key;
+    unsigned int id = 0;
+    int ret, has_key;
+    uint64_t start;
 
     assert(dev_path);
-    /* lock process and open device */
-    fd = open_device(dev_path, &lock);
-    if (fd < 0)
-        return -1;
-
-    assert(fd >= 0);
-    if ((!ishid && ioctl(fd, USBDEVFS_CLAIMINTERFACE, &interface) == 0)
-        ||  (ishid && ioctl(fd, HIDIOCSFLAG, &flags) == 0)
-        )
+    assert(prod_id);
+    start = grd_stats_begin();
+    has_key = get_probe_key(dev_path, &key) == 0;
+    if (has_key  &&  probe_cache_lookup(dev_path, &key, &id) == 0)
+    {
+        ret = 0;
+        if (call)
+            call->flags |= GRD_CAPTURE_CACHED;
+    }
+    else if ((ret = grd_broker_probe(dev_path, &id)) != GRD_BROKER_UNAVAILABLE)
     {
-        assert(pack_size > 0);
-        assert(len_out % pack_size == 0);
-        assert(len_in % pack_size == 0);
-        while (pack_size  &&  (len_out >= pack_size || len_in >= pack_size))
+        /* the broker owns the devices (if it is running) */
+        if (ret == 0  &&  has_key)
+            probe_cache_store(dev_path, &key, id);
+        if (ret == 0)
+            *prod_id = id;
+        if (call)
+            call->flags |= GRD_CAPTURE_BROKER;
+        return ret;
+    }
+    else
+    {
+        ret = probe_sysfs(dev_path, &id);
+        if (ret > 0)
         {
-            if (len_out >= pack_size)
-            {
-                /* write */
-                assert(out);
-                if (ishid)
-                    r = hiddevice_write(fd, out, pack_size);
-                else
-                    r = ioctl_device_bulk(fd, 1, out, pack_size);
-                if (r != 0)
-                    break;
-                len_out -= pack_size;
-                out = (unsigned char*)out + pack_size;
-            }
-            else if (ishid)
-            {
-                /* write idle pack */
-                if (hiddevice_write(fd, NULL, 0) != 0)
-                    break;
-            }
-            /* read the latest pack after the last written pack */
-            if ((len_in == pack_size && len_out < pack_size)
-                || len_in > pack_size
-                )
-            {
-                /* read */
-                assert(in);
-                if (ishid)
-                    r = hiddevice_read(fd, in, pack_size);
-                else
-                    r = ioctl_device_bulk(fd, 0x81, in, pack_size);
-                if (r != 0)
-                    break;
-                len_in -= pack_size;
-                in = (unsigned char*)in + pack_size;
-            }
-        }
-        if (len_out == 0 && len_in == 0)
+            id = 0; /* not a Guardant device, for sure */
             ret = 0;
-        if (!ishid && ioctl(fd, USBDEVFS_RELEASEINTERFACE, &interface) != 0)
-            ret = -1;
+        }
+        else if (ret < 0)
+            ret = probe_session(dev_path, &id);
+        if (ret == 0  &&  has_key)
+            probe_cache_store(dev_path, &key, id);
     }
-    assert(fd >= 0);
-    /* close device and unlock process */
-    if (close_device(fd, &lock) != 0)
-        ret = -1;
-    return ret;
+    if (start)
+        grd_stats_end(grd_stats_device(dev_path), GRD_PHASE_PROBE, start);
+    if (ret != 0  ||  id == 0)
+    {
+        if (ret == 0)
+            errno = EINVAL; /* the node is not a Guardant device */
+        return -1;
+    }
+    *prod_id = id;
+    return 0;
 }
 
-/*
- * If device (dev_path is usbfs path) is Guardant Sign/Time/Code,
- * or device (dev_path eq "GRDHID_PATH_HEAD + N") is
- * Guardant Sign/Time/Code HID  then return 0, else return -1
- */
 int grd_probe_device(const char* dev_path, unsigned int* prod_id)
 {
-    unsigned char buf_tmpl[4] = {0x89, 0x0a, 0x00, 0x00};
-    unsigned char buf[16];
-    struct lock_descr lock;
-    unsigned int id;
-    int fd, ret;
+    struct grd_capture_call call;
+    int ret;
 
     if (!dev_path || !prod_id)
         return -1;
+    call.start = grd_capture_begin();
+    if (!call.start)
+        return probe_path(dev_path, prod_id, NULL);
+    call.lock_ns = 0;
+    call.flags = 0;
+    ret = probe_path(dev_path, prod_id, &call);
+    grd_capture_probe(dev_path, ret == 0 ? *prod_id : 0, &call, ret ? errno : 0);
+    return ret;
+}
 
-    /* lock process and open usbdev_fs device */
-    fd = open_device(dev_path, &lock);
-    if (fd < 0)
-        return -1;
+int grd_device_open(struct grd_device* dev, const char* path)
+{
+    const struct grd_transport* tr;
 
-    if (strncmp(dev_path, GRDHID_PATH_HEAD, sizeof(GRDHID_PATH_HEAD) - 1) == 0)
-    {
-        assert(fd >= 0);
-        ret = hiddevice_get_prodid(fd, &id);
-    }
-    else
+    assert(dev);
+    assert(path);
+    pthread_once(&sessions_once, sessions_init);
+    memset(dev, 0, sizeof(*dev));
+    dev->fd = -1;
+    tr = grd_transport_override();
+    if (!tr  &&  grd_is_hid_path(path))
     {
-        assert(fd >= 0);
-        ret = read(fd, buf, sizeof(buf));
-        if (ret < 0 || (size_t)ret != sizeof(buf))
-            ret = -1;
-        else
+        /* hidraw: a report is one syscall; hiddev if there is no hidraw node */
+        if (use_hidraw  &&  grd_transport_hidraw.open(dev, path) == 0)
         {
-            unsigned char p = 0;
-            unsigned char prod_ids[4] = {GRD_PRODID_S3S, GRD_PRODID_S3S_WINUSB, GRD_PRODID_S3C, GRD_PRODID_S3C_WINUSB};
-            ret = -1;
-            assert(sizeof(buf_tmpl) == 4);
-            for (; p < sizeof(prod_ids); ++p)
-            {
-                buf_tmpl[2] = prod_ids[p];
-                if (!memcmp(buf + 8, buf_tmpl, sizeof(buf_tmpl)))
-                {
-                    id = prod_ids[p];
-                    ret = 0;
-                    break;
-                }
-            }
+            dev->transport = &grd_transport_hidraw;
+            return 0;
         }
+        tr = &grd_transport_hiddev;
     }
-    assert(fd >= 0);
-    /* close usbdev_fs device and unlock process */
-    if (close_device(fd, &lock) != 0)
-        ret = -1;
-    if (ret == 0)
-        *prod_id = id;
-    return ret;
+    else if (!tr)
+        tr = &grd_transport_usbfs;
+    if (tr->open(dev, path) != 0)
+        return -1;
+    dev->transport = tr;
+    return 0;
+}
+
+void grd_device_close(struct grd_device* dev)
+{
+    assert(dev);
+    if (dev->transport)
+        dev->transport->close(dev);
+    memset(dev, 0, sizeof(*dev));
+    dev->fd = -1;
+}
+
+int grd_device_identify(const char* path, struct grd_dev_id* id)
+{
+    const struct grd_transport* tr = grd_transport_override();
+
+    if (tr  &&  tr->identify)
+        return tr->identify(path, id);
+    return grd_dev_id_get(path, id);
 }
 
 static int load_usbfs_path(char* buf, size_t size)
@@ -533,9 +1792,16 @@ static size_t search_grdhid_devices(search_usb_device_callback callback, void* p
     size_t i;
     int ret, count = 0;
 
+    /* any count of hiddev nodes, the names are not needed */
+    if (grd_hid_registry_scan() >= 0)
+    {
+        ret = grd_hid_search(callback, param);
+        return ret > 0 ? (size_t)ret : 0;
+    }
+    /* no sysfs: the names of the udev rule (etc/grdnt_hid.udev) */
     for (i = 0; i < GRDHID_MAX_COUNT; ++i)
     {
-        ret = snprintf(dev_path, sizeof(dev_path), "%s%d",
+        ret = snprintf(dev_path, sizeof(dev_path), "%s%zu",
                        GRDHID_PATH_HEAD, i);
         assert(ret > 0  &&  (size_t)ret < sizeof(dev_path));
         if (ret < 0  ||  (size_t)ret >= sizeof(dev_path))
@@ -551,17 +1817,443 @@ static size_t search_grdhid_devices(search_usb_device_callback callback, void* p
     return count;
 }
 
-int search_usb_devices(search_usb_device_callback callback, void* param)
+const char* grd_sysfs_path(void)
+{
+    const char* path;
+
+    path = getenv(SYSFS_PATH_ENV);
+    return path ? path : SYSFS_PATH;
+}
+
+int grd_usbfs_device_path(unsigned int busnum, unsigned int devnum, char* buf, size_t size)
 {
     char usbfs_path[PATH_MAX];
+    int ret;
+
+    assert(buf);
+    if (load_usbfs_path(usbfs_path, sizeof(usbfs_path)) != 0)
+        return -1;
+    ret = snprintf(buf, size, "%s/%03u/%03u", usbfs_path, busnum, devnum);
+    return (ret > 0  &&  (size_t)ret < size) ? 0 : -1;
+}
+
+int grd_read_sysfs_attr(int dir_fd, const char* name, char* buf, size_t size)
+{
+    int fd, ret;
+
+    assert(buf);
+    assert(size > 0);
+    fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    ret = read(fd, buf, size - 1);
+    close(fd);
+    if (ret < 0)
+        return -1;
+    while (ret > 0  &&  (buf[ret - 1] == '\n' || buf[ret - 1] == ' '))
+        --ret;
+    buf[ret] = '\0';
+    return ret;
+}
+
+int grd_read_sysfs_uint(int dir_fd, const char* name, int base, unsigned int* val)
+{
+    char buf[16];
+    char* end;
+    unsigned long n;
+
+    if (grd_read_sysfs_attr(dir_fd, name, buf, sizeof(buf)) <= 0)
+        return -1;
+    n = strtoul(buf, &end, base);
+    if (*end != '\0')
+        return -1;
+    assert(val);
+    *val = (unsigned int)n;
+    return 0;
+}
+
+int grd_is_usbfs_prodid(unsigned int prod_id)
+{
+    return prod_id == GRD_PRODID_S3S  ||  prod_id == GRD_PRODID_S3S_WINUSB
+           ||  prod_id == GRD_PRODID_S3C  ||  prod_id == GRD_PRODID_S3C_WINUSB;
+}
+
+int grd_is_hid_prodid(unsigned int prod_id)
+{
+    return prod_id == GRD_PRODID_S3S_HID  ||  prod_id == GRD_PRODID_S3C_HID;
+}
+
+struct usb_location
+{
+    unsigned int busnum;
+    unsigned int devnum;
+};
+
+static int compare_usb_location(const void* a, const void* b)
+{
+    const struct usb_location* l = (const struct usb_location*)a;
+    const struct usb_location* r = (const struct usb_location*)b;
+
+    if (l->busnum != r->busnum)
+        return l->busnum < r->busnum ? -1 : 1;
+    if (l->devnum != r->devnum)
+        return l->devnum < r->devnum ? -1 : 1;
+    return 0;
+}
+
+/*
+ * Search for Guardant USB devices using sysfs (idVendor/idProduct of every
+ * USB device), without opening any device node.
+ * Return -1 if sysfs is not available.
+ */
+static int search_sysfs_devices(const char* usbfs_path,
+                                search_usb_device_callback callback, void* param,
+                                size_t* count)
+{
+    char path[PATH_MAX];
+    struct usb_location found[GRD_MAX_DEVICES];
+    DIR* dir;
+    struct dirent* entry;
+    unsigned int vendor, product;
+    size_t n = 0, i;
+    int dir_fd, dev_fd, ret;
+
+    ret = snprintf(path, sizeof(path), "%s/%s", grd_sysfs_path(), SYSFS_USB_DEVICES);
+    if (ret < 0  ||  (size_t)ret >= sizeof(path))
+        return -1;
+    dir = opendir(path);
+    if (!dir)
+        return -1;
+
+    dir_fd = dirfd(dir);
+    while ((entry = readdir(dir)) && n < sizeof(found) / sizeof(found[0]))
+    {
+        /* skip ".", ".." and interfaces ("1-1:1.0") */
+        if (entry->d_name[0] == '.'  ||  strchr(entry->d_name, ':'))
+            continue;
+
+        dev_fd = openat(dir_fd, entry->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dev_fd < 0)
+            continue;
+        if (grd_read_sysfs_uint(dev_fd, "idVendor", 16, &vendor) == 0
+            &&  vendor == GRD_VENDOR
+            &&  grd_read_sysfs_uint(dev_fd, "idProduct", 16, &product) == 0
+            &&  grd_is_usbfs_prodid(product)
+            &&  grd_read_sysfs_uint(dev_fd, "busnum", 10, &found[n].busnum) == 0
+            &&  grd_read_sysfs_uint(dev_fd, "devnum", 10, &found[n].devnum) == 0
+            )
+            ++n;
+        close(dev_fd);
+    }
+    closedir(dir);
+
+    /* report in a stable order */
+    qsort(found, n, sizeof(found[0]), compare_usb_location);
+    assert(count);
+    for (i = 0; i < n; ++i)
+    {
+        ret = snprintf(path, sizeof(path), "%s/%03u/%03u",
+                       usbfs_path, found[i].busnum, found[i].devnum);
+        assert(ret > 0  &&  (size_t)ret < sizeof(path));
+        if (ret < 0  ||  (size_t)ret >= sizeof(path))
+            continue;
+
+        assert(callback);
+        if (callback(path, param))
+            ++*count;
+    }
+    return 0;
+}
+
+/* Hotplug monitor: the device node was added or removed */
+static void hotplug_notify(const char* path, int added)
+{
+    struct grd_session* s;
+
+    probe_cache_invalidate(path);
+    if (added)
+        return;
+    pthread_mutex_lock(&sessions_mutex);
+    for (s = sessions; s; s = s->next)
+        if (strcmp(s->path, path) == 0)
+            s->gone = 1;
+    pthread_mutex_unlock(&sessions_mutex);
+}
+
+enum search_state
+{
+    SEARCH_PENDING,
+    SEARCH_RUNNING,
+    SEARCH_FOUND,
+    SEARCH_NOT_FOUND,
+    SEARCH_EXPIRED              /* not probed before the deadline */
+};
+
+struct search_candidate
+{
+    char* path;
+    enum search_state state;
+    struct timespec started;
+};
+
+/*
+ * Candidates of one probing search. The workers are detached: a worker
+ * stuck behind a wedged device keeps the job until it returns.
+ */
+struct search_job
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;        /* a candidate was probed */
+    unsigned int refs;          /* the caller and the workers */
+    unsigned int workers;       /* running workers */
+    size_t next;                /* the first candidate not taken */
     size_t count;
+    size_t size;
+    struct search_candidate* candidates;
+};
 
-    if (!callback)
+static int __attribute__((ms_abi)) add_candidate(const char* path, void* param)
+{
+    struct search_job* job = param;
+    struct search_candidate* c;
+    size_t size;
+
+    assert(job);
+    if (job->count == job->size)
+    {
+        size = job->size ? job->size * 2 : 16;
+        c = realloc(job->candidates, size * sizeof(*c));
+        if (!c)
+            return 0;
+        job->candidates = c;
+        job->size = size;
+    }
+    c = &job->candidates[job->count];
+    memset(c, 0, sizeof(*c));
+    c->path = strdup(path);
+    if (!c->path)
+        return 0;
+    ++job->count;
+    return 1;
+}
+
+/* Release a reference of the job (the job mutex is locked) */
+static void search_job_unref(struct search_job* job)
+{
+    size_t i;
+
+    assert(job && job->refs > 0);
+    if (--job->refs > 0)
+    {
+        pthread_mutex_unlock(&job->mutex);
+        return;
+    }
+    pthread_mutex_unlock(&job->mutex);
+    for (i = 0; i < job->count; ++i)
+        free(job->candidates[i].path);
+    free(job->candidates);
+    pthread_cond_destroy(&job->cond);
+    pthread_mutex_destroy(&job->mutex);
+    free(job);
+}
+
+static void* search_worker(void* arg)
+{
+    struct search_job* job = arg;
+    struct search_candidate* c;
+    unsigned int prod_id;
+    int found;
+
+    assert(job);
+    pthread_mutex_lock(&job->mutex);
+    while (job->next < job->count)
+    {
+        c = &job->candidates[job->next++];
+        c->state = SEARCH_RUNNING;
+        clock_gettime(CLOCK_MONOTONIC, &c->started);
+        pthread_mutex_unlock(&job->mutex);
+        found = grd_probe_device(c->path, &prod_id) == 0;
+        pthread_mutex_lock(&job->mutex);
+        if (c->state == SEARCH_RUNNING)
+            c->state = found ? SEARCH_FOUND : SEARCH_NOT_FOUND;
+        pthread_cond_signal(&job->cond);
+    }
+    --job->workers;
+    pthread_cond_signal(&job->cond);
+    search_job_unref(job);
+    return NULL;
+}
+
+/*
+ * Probe the candidates with up to search_workers workers (another one is
+ * started for each probe past its deadline), then call callback for the
+ * Guardant devices in the order of the candidates.
+ * Return the count of non-zero values returned from callback.
+ */
+static int probe_candidates(struct search_job* job,
+                            search_usb_device_callback callback, void* param)
+{
+    struct search_candidate* c;
+    pthread_attr_t attr;
+    pthread_t thread;
+    struct timespec now, wake;
+    size_t i, pending, running, stuck;
+    long left, wait_ms;
+    int count = 0;
+
+    assert(job && callback);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_mutex_lock(&job->mutex);
+    for (;;)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        pending = job->count - job->next;
+        running = stuck = 0;
+        wait_ms = search_deadline_ms;
+        for (i = 0; i < job->next; ++i)
+        {
+            c = &job->candidates[i];
+            if (c->state != SEARCH_RUNNING)
+                continue;
+            left = search_deadline_ms - elapsed_ms(&c->started, &now);
+            if (left <= 0)
+                ++stuck;
+            else
+            {
+                ++running;
+                if (left < wait_ms)
+                    wait_ms = left;
+            }
+        }
+        if (pending == 0  &&  running == 0)
+            break;
+        /* the stuck workers do not count */
+        while (pending > 0  &&  job->workers < search_workers + stuck
+               &&  job->workers - stuck < pending
+               )
+        {
+            ++job->refs;
+            if (pthread_create(&thread, &attr, search_worker, job) != 0)
+            {
+                --job->refs;
+                break;
+            }
+            ++job->workers;
+        }
+        if (job->workers == stuck)
+            break; /* no worker could be started */
+        wake.tv_sec = now.tv_sec + wait_ms / 1000;
+        wake.tv_nsec = now.tv_nsec + (wait_ms % 1000) * 1000000;
+        if (wake.tv_nsec >= 1000000000)
+        {
+            ++wake.tv_sec;
+            wake.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&job->cond, &job->mutex, &wake);
+    }
+    pthread_attr_destroy(&attr);
+    /* the late workers must not start the expired candidates */
+    job->next = job->count;
+    for (i = 0; i < job->count; ++i)
+        if (job->candidates[i].state == SEARCH_PENDING
+            ||  job->candidates[i].state == SEARCH_RUNNING
+            )
+            job->candidates[i].state = SEARCH_EXPIRED;
+    pthread_mutex_unlock(&job->mutex);
+
+    /* the states are final now, the late workers do not change them */
+    for (i = 0; i < job->count; ++i)
+        if (job->candidates[i].state == SEARCH_FOUND
+            &&  callback(job->candidates[i].path, param)
+            )
+            ++count;
+
+    pthread_mutex_lock(&job->mutex);
+    search_job_unref(job);
+    return count;
+}
+
+/*
+ * Search with probing (GRD_SEARCH_PROBE): collect the candidate nodes,
+ * probe them in parallel and report the Guardant devices only.
+ */
+static int scan_probe_devices(const char* usbfs_path,
+                              search_usb_device_callback callback, void* param)
+{
+    struct search_job* job;
+    pthread_condattr_t cond_attr;
+    size_t count = 0;
+
+    job = calloc(1, sizeof(*job));
+    if (!job)
         return -1;
+    pthread_mutex_init(&job->mutex, NULL);
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&job->cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+    job->refs = 1;
+
+    if (search_sysfs_devices(usbfs_path, add_candidate, job, &count) != 0)
+        search_usbfs_devices(usbfs_path, add_candidate, job);
+    search_grdhid_devices(add_candidate, job);
+    return probe_candidates(job, callback, param);
+}
+
+static int scan_usb_devices(search_usb_device_callback callback, void* param)
+{
+    char usbfs_path[PATH_MAX];
+    size_t count = 0;
+
+    pthread_once(&sessions_once, sessions_init);
     if (load_usbfs_path(usbfs_path, sizeof(usbfs_path)) != 0)
         return -1;
-    count = search_usbfs_devices(usbfs_path, callback, param);
+    if (search_workers > 0)
+        return scan_probe_devices(usbfs_path, callback, param);
+    if (search_sysfs_devices(usbfs_path, callback, param, &count) != 0)
+        count = search_usbfs_devices(usbfs_path, callback, param);
     count += search_grdhid_devices(callback, param);
     return (int)count;
 }
 
+static int search_devices(search_usb_device_callback callback, void* param)
+{
+    const struct grd_transport* tr;
+    char usbfs_path[PATH_MAX];
+    int ret;
+
+    /* the emulated devices replace the USB devices */
+    tr = grd_transport_override();
+    if (tr  &&  tr->search)
+        return tr->search(callback, param);
+    if (load_usbfs_path(usbfs_path, sizeof(usbfs_path)) != 0)
+        return -1;
+    /* the table of the hotplug monitor (if it is running) */
+    if (grd_hotplug_start(usbfs_path, hotplug_notify, scan_usb_devices) == 0)
+    {
+        ret = grd_hotplug_search(callback, param);
+        if (ret >= 0)
+            return ret;
+    }
+    return scan_usb_devices(callback, param);
+}
+
+int search_usb_devices(search_usb_device_callback callback, void* param)
+{
+    struct grd_stats_dev* stats;
+    uint64_t start;
+    int ret;
+
+    if (!callback)
+        return -1;
+    ret = grd_broker_search(callback, param);
+    if (ret != GRD_BROKER_UNAVAILABLE)
+        return ret;
+
+    stats = grd_stats_device(NULL);
+    start = grd_stats_begin();
+    ret = search_devices(callback, param);
+    grd_stats_end(stats, GRD_PHASE_SEARCH, start);
+    return ret;
+}
@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2008 Aktiv Co. (Aleksey Samsonov)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/*
+ * Internal interface between the modules of the Linux implementation.
+ */
+
+#ifndef GRDIMPL_LINUX__H__
+#define GRDIMPL_LINUX__H__
+
+#include "grdimpl.h"
+
+#define GRD_VENDOR              0x0a89
+#define GRD_PRODID_S3S          0x08 /* Guardant Sign/Time USB */
+#define GRD_PRODID_S3S_HID      0x0C /* Guardant Sign/Time USB HID */
+#define GRD_PRODID_S3S_WINUSB   0xC2 /* Guardant Sign/Time USB (WINUSB) */
+#define GRD_PRODID_S3C          0x09 /* Guardant Code USB */
+#define GRD_PRODID_S3C_HID      0x0D /* Guardant Code USB HID */
+#define GRD_PRODID_S3C_WINUSB   0xC3 /* Guardant Code USB (WINSUB) */
+#define USBFS_PATH_ENV          "USB_DEVFS_PATH"
+#define USBFS_PATH_1            "/dev/bus/usb"
+#define USBFS_PATH_2            "/proc/bus/usb"
+#define SYSFS_PATH_ENV          "GRD_SYSFS_PATH"
+#define SYSFS_PATH              "/sys"
+#define GRDHID_PATH_HEAD        "/dev/grdhid"
+#define GRDHID_MAX_COUNT        16
+
+/*
+ * Return non-zero if prod_id is a Guardant usbfs (bulk) device.
+ */
+int grd_is_usbfs_prodid(unsigned int prod_id);
+
+/*
+ * Return non-zero if prod_id is a Guardant HID device.
+ */
+int grd_is_hid_prodid(unsigned int prod_id);
+
+/*
+ * Return the root of sysfs (GRD_SYSFS_PATH or "/sys").
+ */
+const char* grd_sysfs_path(void);
+
+/*
+ * Make the usbfs path of the USB device busnum/devnum.
+ * Return zero on success.
+ */
+int grd_usbfs_device_path(unsigned int busnum, unsigned int devnum, char* buf, size_t size);
+
+/*
+ * Read the sysfs attribute "name" of the directory dir_fd (trailing
+ * new line removed). Return the length of the value or -1.
+ */
+int grd_read_sysfs_attr(int dir_fd, const char* name, char* buf, size_t size);
+
+/*
+ * Read the sysfs attribute "name" as an unsigned number.
+ * Return zero on success.
+ */
+int grd_read_sysfs_uint(int dir_fd, const char* name, int base, unsigned int* val);
+
+#endif /* !GRDIMPL_LINUX__H__ */
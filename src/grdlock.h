@@ -0,0 +1,131 @@
+/*
+ * Copyright (C) 2008 Aktiv Co. (Aleksey Samsonov)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#ifndef GRDLOCK__H__
+#define GRDLOCK__H__
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+#ifdef HAVE_STDDEF_H
+#include <stddef.h>
+#endif /* HAVE_STDDEF_H */
+#include <stdint.h>
+#include <sys/types.h>
+
+#define GRD_DEV_ID_NONE         0
+#define GRD_DEV_ID_CHAR         1 /* character device: major, minor */
+#define GRD_DEV_ID_FILE         2 /* other file (usbfs in /proc): st_dev, st_ino */
+#define GRD_DEV_ID_NAME         3 /* no node (emulated device): serial is the name */
+
+/*
+ * Device identity (the same layout for 32-bit and 64-bit processes).
+ * Unlike the legacy lock path hash it never maps two devices to one lock.
+ */
+struct grd_dev_id
+{
+    uint32_t kind;              /* GRD_DEV_ID_* */
+    uint32_t major;
+    uint32_t minor;
+    uint32_t reserved;
+    uint64_t ino;
+    char serial[64];            /* sysfs serial number, may be empty */
+} __attribute__((aligned(8)));
+
+struct grd_lock_file;
+
+/*
+ * Cross-process lock of one device.
+ */
+struct grd_lock
+{
+    struct grd_dev_id id;
+    struct grd_lock_file* file; /* legacy lock file (libgrdapi.a) */
+    off_t legacy_offset;        /* byte of the legacy lock file locked by us */
+    int slot;                   /* slot of the shared segment, -1 if none */
+    int held;                   /* non-zero while the lock is held */
+};
+
+/*
+ * Make path of the IPC object "name" (in the GRD_IPC_NAME directory).
+ * Return zero on success.
+ */
+int grd_ipc_path(const char* name, char* buf, size_t buf_size);
+
+/*
+ * Make path of the IPC object "name" of this user only: in the GRD_IPC_NAME
+ * directory, or in XDG_RUNTIME_DIR if GRD_IPC_NAME is not set. The directory
+ * must belong to root or to the user and must not be writable by the
+ * others, else another user could plant the object: there is no default.
+ * Return zero on success.
+ */
+int grd_private_ipc_path(const char* name, char* buf, size_t buf_size);
+
+/*
+ * Get identity of the device.
+ * Return zero on success.
+ */
+int grd_dev_id_get(const char* dev_path, struct grd_dev_id* id);
+
+/*
+ * Prepare lock of the device with identity id (the lock is not acquired).
+ * Return zero on success.
+ */
+int grd_lock_init(struct grd_lock* lock, const char* dev_path,
+                  const struct grd_dev_id* id);
+
+void grd_lock_destroy(struct grd_lock* lock);
+
+/*
+ * Lock device (wait). A process owns the lock, not a thread.
+ * Return zero on success.
+ */
+int grd_lock_acquire(struct grd_lock* lock);
+
+/*
+ * Lock device if it is free (do not wait).
+ * Return zero on success, -1 with errno EBUSY if the lock is held.
+ */
+int grd_lock_try(struct grd_lock* lock);
+
+/*
+ * Unlock device.
+ * Return zero on success.
+ */
+int grd_lock_release(struct grd_lock* lock);
+
+/*
+ * Unlock device. If threads of other processes wait for it, this process
+ * does not lock it again before one of them has (or the wait has timed out).
+ * Return zero on success.
+ */
+int grd_lock_yield(struct grd_lock* lock);
+
+/*
+ * Return pid of the process holding the lock of the device, or zero (the
+ * lock is free or the holder is unknown).
+ */
+pid_t grd_lock_owner(const struct grd_lock* lock);
+
+/*
+ * Return the load of the device seen by the lock: one if the lock is held,
+ * plus the count of the threads waiting for it (of all processes).
+ */
+unsigned int grd_lock_load(const struct grd_lock* lock);
+
+#endif /* !GRDLOCK__H__ */
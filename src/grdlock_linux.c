@@ -0,0 +1,768 @@
+/*
+ * Cross-process device lock of the GrdWine
+ *
+ * Copyright (C) 2008 Aktiv Co. (Aleksey Samsonov)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/*
+ * Every device has a slot in the shared segment GRD_IPC_NAME/grdwine-lock.2.
+ * The slot is found by the device identity (device number and serial
+ * number), so two devices never share a lock. The lock itself is a futex
+ * word holding the pid of the owner process; waiters sleep in the kernel
+ * and are woken by the owner at once. If the owner dies, a waiter takes the
+ * lock over after GRD_LOCK_DEATH_CHECK_MS. The pid namespace of the owner
+ * is kept next to the word: the owners of another namespace (a container
+ * sharing GRD_IPC_NAME) can not be checked and are never taken over.
+ *
+ * Old clients (libgrdapi.a, older grdwine.dll.so) lock the whole legacy
+ * file GRD_IPC_NAME/grdNN.lock. A holder of the futex lock additionally
+ * locks one byte of that file (at an offset derived from the identity):
+ * the byte conflicts with the whole-file lock of the old clients, but not
+ * with the bytes of other devices.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h> /* for major, minor */
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h> /* for PATH_MAX, INT_MAX */
+#include <stdio.h>  /* for snprintf */
+#include <signal.h> /* for kill */
+#include <time.h>
+#include <pthread.h>
+#include <linux/futex.h>
+#include "grdimpl_linux.h"
+#include "grdlock.h"
+
+#define GRD_IPC_NAME_ENV        "GRD_IPC_NAME"
+#define GRD_PRIVATE_DIR_ENV     "XDG_RUNTIME_DIR" /* unless GRD_IPC_NAME is set */
+#define GRD_LEGACY_LOCK_ENV     "GRD_LEGACY_LOCK"
+#define GRD_LOCK_SHM_NAME       "grdwine-lock.2"
+#define GRD_LOCK_SHM_MAGIC      0x4b4c4447 /* "GDLK" */
+#define GRD_LOCK_SLOTS          256
+#define GRD_LOCK_WAITERS        0x80000000u
+#define GRD_LOCK_DEATH_CHECK_MS 100  /* check the owner is alive so often */
+#define GRD_LOCK_REUSE_MS       10000 /* a slot unused so long may be reused */
+
+#define GRD_LOCK_HELD_SLOT      1
+#define GRD_LOCK_HELD_FILE      2
+
+struct grd_lock_slot
+{
+    volatile uint32_t word;     /* owner pid | GRD_LOCK_WAITERS, 0 if free */
+    volatile uint32_t waiters;  /* count of the waiting threads */
+    volatile uint32_t owner_ns; /* pid namespace of the owner (see pid_namespace) */
+    volatile uint32_t handoff;  /* pid that yielded the word to the waiters, or 0 */
+    uint64_t last_used;         /* CLOCK_MONOTONIC, ms */
+    struct grd_dev_id id;       /* id.kind == GRD_DEV_ID_NONE: free slot */
+} __attribute__((aligned(8)));
+
+struct grd_lock_shm
+{
+    volatile uint32_t magic;
+    uint32_t slots_count;
+    volatile uint32_t table;    /* futex word guarding the slot assignment */
+    volatile uint32_t table_ns; /* pid namespace of its owner */
+    struct grd_lock_slot slots[GRD_LOCK_SLOTS];
+} __attribute__((aligned(8)));
+
+/*
+ * Legacy lock file. One object per lock path is shared by the process:
+ * POSIX record locks belong to the process, and closing any descriptor of
+ * the file would release all of them.
+ */
+struct grd_lock_file
+{
+    struct grd_lock_file* next;
+    pthread_mutex_t mutex;      /* whole-file lock holders of the process */
+    unsigned int refs;
+    int fd;
+    char path[PATH_MAX];
+};
+
+static pthread_once_t lock_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t lock_files_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct grd_lock_file* lock_files;
+static struct grd_lock_shm* lock_shm; /* NULL: only the legacy lock file */
+static uint32_t lock_pid;
+static uint32_t lock_ns;
+static int legacy_lock = 1;
+
+int grd_ipc_path(const char* name, char* buf, size_t buf_size)
+{
+    const char* name_prefix;
+    const char* slash;
+    size_t len;
+    int ret;
+
+    name_prefix = getenv(GRD_IPC_NAME_ENV);
+    if (!name_prefix)
+        name_prefix = "/tmp"; /* default */
+
+    len = strlen(name_prefix);
+    if (len == 0  ||  name_prefix[len - 1] != '/')
+        slash = "/";
+    else
+        slash = "";
+
+    assert(buf);
+    assert(name);
+    ret = snprintf(buf, buf_size, "%s%s%s", name_prefix, slash, name);
+    assert(ret > 0  &&  (size_t)ret < buf_size);
+    if (ret > 0  &&  (size_t)ret < buf_size)
+        return 0;
+    return -1;
+}
+
+int grd_private_ipc_path(const char* name, char* buf, size_t buf_size)
+{
+    const char* dir;
+    struct stat st;
+    int ret;
+
+    assert(name);
+    assert(buf);
+    dir = getenv(GRD_IPC_NAME_ENV);
+    if (!dir)
+        dir = getenv(GRD_PRIVATE_DIR_ENV);
+    if (!dir  ||  stat(dir, &st) != 0  ||  !S_ISDIR(st.st_mode)
+        ||  (st.st_uid != 0  &&  st.st_uid != geteuid())
+        ||  (st.st_mode & (S_IWGRP | S_IWOTH))
+        )
+    {
+        errno = EACCES;
+        return -1;
+    }
+    ret = snprintf(buf, buf_size, "%s/%s", dir, name);
+    return (ret > 0  &&  (size_t)ret < buf_size) ? 0 : -1;
+}
+
+static int create_lock_path(const char* dev_path, char* buf, size_t buf_size)
+{
+    char name[16];
+    size_t i, magic_num = 0;
+
+    assert(dev_path);
+    for (i = 0; dev_path[i]; ++i)
+    {
+        magic_num += dev_path[i] * (i + 1);
+        magic_num %= 0x61;
+    }
+    snprintf(name, sizeof(name), "grd%02d.lock", (int)magic_num);
+    return grd_ipc_path(name, buf, buf_size);
+}
+
+static uint64_t monotonic_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void read_sysfs_serial(unsigned int major, unsigned int minor, char* buf, size_t size)
+{
+    /* usb_device has "serial"; hiddev is a child of the interface */
+    static const char* const names[] = { "serial", "device/../serial" };
+    char path[PATH_MAX];
+    size_t i;
+    int fd, ret = -1;
+
+    assert(buf);
+    assert(size > 0);
+    for (i = 0; i < sizeof(names) / sizeof(names[0]) && ret <= 0; ++i)
+    {
+        snprintf(path, sizeof(path), "%s/dev/char/%u:%u/%s",
+                 grd_sysfs_path(), major, minor, names[i]);
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            continue;
+        ret = read(fd, buf, size - 1);
+        close(fd);
+    }
+    if (ret <= 0)
+        ret = 0;
+    while (ret > 0  &&  (buf[ret - 1] == '\n' || buf[ret - 1] == ' '))
+        --ret;
+    buf[ret] = '\0';
+}
+
+int grd_dev_id_get(const char* dev_path, struct grd_dev_id* id)
+{
+    struct stat buf;
+
+    assert(dev_path);
+    assert(id);
+    memset(id, 0, sizeof(*id));
+    if (stat(dev_path, &buf) != 0)
+        return -1;
+    if (S_ISCHR(buf.st_mode))
+    {
+        id->kind = GRD_DEV_ID_CHAR;
+        id->major = major(buf.st_rdev);
+        id->minor = minor(buf.st_rdev);
+        read_sysfs_serial(id->major, id->minor, id->serial, sizeof(id->serial));
+    }
+    else
+    {
+        id->kind = GRD_DEV_ID_FILE;
+        id->major = major(buf.st_dev);
+        id->minor = minor(buf.st_dev);
+        id->ino = (uint64_t)buf.st_ino;
+    }
+    return 0;
+}
+
+static int dev_id_equal(const struct grd_dev_id* a, const struct grd_dev_id* b)
+{
+    assert(a && b);
+    return a->kind == b->kind  &&  a->major == b->major  &&  a->minor == b->minor
+           &&  a->ino == b->ino  &&  strncmp(a->serial, b->serial, sizeof(a->serial)) == 0;
+}
+
+/* Offset of the byte of the legacy lock file which is locked for the device */
+static off_t dev_id_legacy_offset(const struct grd_dev_id* id)
+{
+    uint32_t n;
+
+    assert(id);
+    if (id->kind == GRD_DEV_ID_CHAR)
+        n = ((id->major & 0x3ff) << 20) | (id->minor & 0xfffff);
+    else /* GRD_DEV_ID_FILE: inode, GRD_DEV_ID_NAME: hash of the name */
+        n = (uint32_t)id->ino & 0x3fffffff;
+    return (off_t)(n | 0x40000000); /* far from the pid written by libgrdapi.a */
+}
+
+static int futex_wait(volatile uint32_t* addr, uint32_t val, long ms)
+{
+    struct timespec ts;
+
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000;
+    if (syscall(SYS_futex, addr, FUTEX_WAIT, val, &ts, NULL, 0) == 0)
+        return 0;
+    return errno;
+}
+
+static void futex_wake(volatile uint32_t* addr, int count)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE, count, NULL, NULL, 0);
+}
+
+static int cas(volatile uint32_t* addr, uint32_t old_val, uint32_t new_val)
+{
+    return __sync_bool_compare_and_swap(addr, old_val, new_val);
+}
+
+/* Inode of the pid namespace, zero without /proc (one namespace is assumed) */
+static uint32_t pid_namespace(void)
+{
+    struct stat buf;
+
+    return stat("/proc/self/ns/pid", &buf) == 0 ? (uint32_t)buf.st_ino : 0;
+}
+
+/* A pid of another namespace means nothing here: the owner is alive */
+static int owner_is_dead(uint32_t owner, uint32_t owner_ns)
+{
+    return owner != 0  &&  owner_ns == lock_ns
+           &&  kill((pid_t)owner, 0) != 0  &&  errno == ESRCH;
+}
+
+/* The word is locked: end the yield of another process (see word_yield) */
+static void word_locked(volatile uint32_t* handoff)
+{
+    if (handoff  &&  *handoff != 0)
+    {
+        *handoff = 0;
+        futex_wake(handoff, INT_MAX);
+    }
+}
+
+/*
+ * Lock the futex word for the process and record the pid namespace in ns.
+ * The owner is the process (not the thread), so other threads of the owner
+ * wait too. An owner is checked only once it kept the word over a whole
+ * wait: its namespace is recorded by then. The process that yielded the
+ * word (handoff) waits until another process locks it.
+ */
+static void word_lock(volatile uint32_t* word, volatile uint32_t* waiters,
+                      volatile uint32_t* ns, volatile uint32_t* handoff)
+{
+    const uint32_t pid = lock_pid;
+    uint32_t v, waited = 0;
+
+    assert(word);
+    assert(ns);
+    if ((!handoff  ||  *handoff != pid)  &&  cas(word, 0, pid))
+    {
+        *ns = lock_ns;
+        word_locked(handoff);
+        return; /* not contended */
+    }
+
+    if (waiters)
+        __sync_fetch_and_add(waiters, 1);
+    for (;;)
+    {
+        v = *word;
+        if (v == 0  &&  handoff  &&  *handoff == pid)
+        {
+            /* the waiter woken by our unlock goes first, unless it is gone */
+            if (futex_wait(handoff, pid, GRD_LOCK_DEATH_CHECK_MS) == ETIMEDOUT)
+                cas(handoff, pid, 0);
+            continue;
+        }
+        if (v == 0)
+        {
+            /* somebody else may still wait: keep the flag */
+            if (cas(word, 0, pid | GRD_LOCK_WAITERS))
+                break;
+            continue;
+        }
+        if (v == waited  &&  owner_is_dead(v & ~GRD_LOCK_WAITERS, *ns))
+        {
+            /* the owner died with the lock held: take the lock over */
+            if (cas(word, v, pid | GRD_LOCK_WAITERS))
+                break;
+            continue;
+        }
+        if (!(v & GRD_LOCK_WAITERS)  &&  !cas(word, v, v | GRD_LOCK_WAITERS))
+            continue;
+        v |= GRD_LOCK_WAITERS;
+        waited = futex_wait(word, v, GRD_LOCK_DEATH_CHECK_MS) == ETIMEDOUT ? v : 0;
+    }
+    *ns = lock_ns;
+    word_locked(handoff);
+    if (waiters)
+        __sync_fetch_and_sub(waiters, 1);
+}
+
+static void word_unlock(volatile uint32_t* word)
+{
+    assert(word);
+    if (__sync_lock_test_and_set(word, 0) & GRD_LOCK_WAITERS)
+        futex_wake(word, 1);
+}
+
+/* The descriptors are inherited, but not the record and futex locks */
+static void lock_atfork_child(void)
+{
+    struct grd_lock_file* lf;
+
+    lock_pid = (uint32_t)getpid();
+    pthread_mutex_init(&lock_files_mutex, NULL);
+    for (lf = lock_files; lf; lf = lf->next)
+        pthread_mutex_init(&lf->mutex, NULL);
+}
+
+static struct grd_lock_shm* open_lock_shm(void)
+{
+    char path[PATH_MAX];
+    struct grd_lock_shm* shm;
+    struct stat buf;
+    mode_t mode;
+    void* p;
+    int fd;
+
+    if (grd_ipc_path(GRD_LOCK_SHM_NAME, path, sizeof(path)) != 0)
+        return NULL;
+
+    mode = umask(0);
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC,
+              S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+    umask(mode);
+    if (fd < 0)
+        return NULL;
+    /* zero-filled segment is a valid one: all slots free and unlocked */
+    if (fstat(fd, &buf) != 0
+        ||  ((size_t)buf.st_size < sizeof(*shm)  &&  ftruncate(fd, sizeof(*shm)) != 0)
+        )
+    {
+        close(fd);
+        return NULL;
+    }
+    p = mmap(NULL, sizeof(*shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return NULL;
+
+    shm = (struct grd_lock_shm*)p;
+    if (cas(&shm->magic, 0, GRD_LOCK_SHM_MAGIC))
+        shm->slots_count = GRD_LOCK_SLOTS;
+    if (shm->magic != GRD_LOCK_SHM_MAGIC)
+    {
+        munmap(p, sizeof(*shm));
+        return NULL;
+    }
+    return shm;
+}
+
+static void lock_init(void)
+{
+    const char* env;
+
+    lock_pid = (uint32_t)getpid();
+    lock_ns = pid_namespace();
+    env = getenv(GRD_LEGACY_LOCK_ENV);
+    if (env  &&  strcmp(env, "0") == 0)
+        legacy_lock = 0;
+    lock_shm = open_lock_shm();
+    pthread_atfork(NULL, NULL, lock_atfork_child);
+}
+
+/*
+ * Find the slot of the device (or assign a free or long unused one).
+ * Return index of the slot, or -1 if the segment is full.
+ */
+static int find_slot(const struct grd_dev_id* id)
+{
+    struct grd_lock_slot* slot;
+    uint64_t now;
+    int i, found = -1, free_slot = -1, unused = -1;
+
+    assert(lock_shm);
+    assert(id);
+    now = monotonic_ms();
+    word_lock(&lock_shm->table, NULL, &lock_shm->table_ns, NULL);
+    for (i = 0; i < GRD_LOCK_SLOTS; ++i)
+    {
+        slot = &lock_shm->slots[i];
+        if (slot->id.kind == GRD_DEV_ID_NONE)
+        {
+            if (free_slot < 0)
+                free_slot = i;
+        }
+        else if (dev_id_equal(&slot->id, id))
+        {
+            found = i;
+            break;
+        }
+        else if (slot->word == 0  &&  slot->waiters == 0
+                 &&  now - slot->last_used >= GRD_LOCK_REUSE_MS
+                 &&  (unused < 0 || slot->last_used < lock_shm->slots[unused].last_used)
+                 )
+            unused = i;
+    }
+    if (found < 0  &&  free_slot >= 0)
+    {
+        found = free_slot;
+        slot = &lock_shm->slots[found];
+        slot->id = *id;
+        slot->last_used = now;
+    }
+    else if (found < 0  &&  unused >= 0)
+    {
+        /* the holders check the identity under the lock of the slot */
+        slot = &lock_shm->slots[unused];
+        if (cas(&slot->word, 0, lock_pid))
+        {
+            slot->owner_ns = lock_ns;
+            found = unused;
+            slot->id = *id;
+            slot->last_used = now;
+            word_unlock(&slot->word);
+        }
+    }
+    word_unlock(&lock_shm->table);
+    return found;
+}
+
+static struct grd_lock_file* get_lock_file(const char* dev_path)
+{
+    char lock_path[PATH_MAX];
+    struct grd_lock_file* lf;
+    mode_t mode;
+    int fd;
+
+    assert(dev_path);
+    if (create_lock_path(dev_path, lock_path, sizeof(lock_path)) != 0)
+        return NULL;
+
+    pthread_mutex_lock(&lock_files_mutex);
+    for (lf = lock_files; lf; lf = lf->next)
+        if (strcmp(lf->path, lock_path) == 0)
+        {
+            ++lf->refs;
+            pthread_mutex_unlock(&lock_files_mutex);
+            return lf;
+        }
+
+    mode = umask(0);
+    fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC,
+              S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+    umask(mode);
+    lf = fd >= 0 ? calloc(1, sizeof(*lf)) : NULL;
+    if (lf)
+    {
+        pthread_mutex_init(&lf->mutex, NULL);
+        lf->refs = 1;
+        lf->fd = fd;
+        assert(strlen(lock_path) < sizeof(lf->path));
+        strcpy(lf->path, lock_path);
+        lf->next = lock_files;
+        lock_files = lf;
+    }
+    else if (fd >= 0)
+        close(fd);
+    pthread_mutex_unlock(&lock_files_mutex);
+    return lf;
+}
+
+static void put_lock_file(struct grd_lock_file* lf)
+{
+    struct grd_lock_file** p;
+
+    assert(lf);
+    pthread_mutex_lock(&lock_files_mutex);
+    assert(lf->refs > 0);
+    if (--lf->refs > 0)
+    {
+        pthread_mutex_unlock(&lock_files_mutex);
+        return;
+    }
+    for (p = &lock_files; *p; p = &(*p)->next)
+        if (*p == lf)
+        {
+            *p = lf->next;
+            break;
+        }
+    pthread_mutex_unlock(&lock_files_mutex);
+    assert(lf->fd >= 0);
+    close(lf->fd);
+    pthread_mutex_destroy(&lf->mutex);
+    free(lf);
+}
+
+/*
+ * Record lock of the legacy lock file (wait unless wait is zero: EBUSY).
+ * EDEADLK and ENOLCK are transient here (for synchronization libgrdapi.a
+ * and grdwine.dll.so): retry after a short, growing delay.
+ */
+static int lock_file_range(int fd, short type, off_t start, off_t len, int wait)
+{
+    struct timespec delay = { 0, 1000000 }; /* 1 ms */
+    struct flock lock;
+    int ret;
+
+    lock.l_type = type;
+    lock.l_start = start;
+    lock.l_whence = SEEK_SET;
+    lock.l_len = len;
+    while ((ret = fcntl(fd, type == F_UNLCK  ||  !wait ? F_SETLK : F_SETLKW, &lock)) == -1)
+    {
+        if (errno == EINTR)
+            continue;
+        if (errno == EAGAIN  ||  errno == EACCES)
+        {
+            errno = EBUSY; /* held by another process */
+            break;
+        }
+        if (errno != EDEADLK  &&  errno != ENOLCK)
+            break;
+        nanosleep(&delay, NULL);
+        if (delay.tv_nsec < 128000000)
+            delay.tv_nsec *= 2;
+    }
+    return ret;
+}
+
+int grd_lock_init(struct grd_lock* lock, const char* dev_path,
+                  const struct grd_dev_id* id)
+{
+    assert(lock);
+    assert(dev_path);
+    assert(id);
+    pthread_once(&lock_once, lock_init);
+
+    memset(lock, 0, sizeof(*lock));
+    lock->slot = -1;
+    if (id->kind == GRD_DEV_ID_NONE)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    lock->id = *id;
+    lock->legacy_offset = dev_id_legacy_offset(&lock->id);
+    if (lock_shm)
+        lock->slot = find_slot(&lock->id);
+    if (legacy_lock  ||  lock->slot < 0)
+    {
+        lock->file = get_lock_file(dev_path);
+        if (!lock->file)
+            return -1;
+    }
+    return 0;
+}
+
+void grd_lock_destroy(struct grd_lock* lock)
+{
+    assert(lock);
+    assert(!lock->held);
+    if (lock->file)
+        put_lock_file(lock->file);
+    lock->file = NULL;
+}
+
+/* Lock the whole legacy file, as libgrdapi.a does */
+static int acquire_lock_file(struct grd_lock* lock, int wait)
+{
+    int ret;
+
+    assert(lock->file);
+    if (wait)
+        pthread_mutex_lock(&lock->file->mutex);
+    else if ((ret = pthread_mutex_trylock(&lock->file->mutex)) != 0)
+    {
+        errno = ret;
+        return -1;
+    }
+    if (lock_file_range(lock->file->fd, F_WRLCK, 0, 0, wait) != 0)
+    {
+        pthread_mutex_unlock(&lock->file->mutex);
+        return -1;
+    }
+    lock->held = GRD_LOCK_HELD_FILE;
+    return 0;
+}
+
+/* Lock device, wait unless wait is zero (then fail with EBUSY) */
+static int lock_device(struct grd_lock* lock, int wait)
+{
+    struct grd_lock_slot* slot;
+
+    assert(lock);
+    assert(!lock->held);
+    for (;;)
+    {
+        if (lock->slot < 0)
+            return acquire_lock_file(lock, wait);
+
+        assert(lock_shm);
+        slot = &lock_shm->slots[lock->slot];
+        if (wait)
+            word_lock(&slot->word, &slot->waiters, &slot->owner_ns, &slot->handoff);
+        else if (slot->handoff != lock_pid  &&  cas(&slot->word, 0, lock_pid))
+        {
+            slot->owner_ns = lock_ns;
+            word_locked(&slot->handoff);
+        }
+        else
+        {
+            errno = EBUSY;
+            return -1;
+        }
+        if (dev_id_equal(&slot->id, &lock->id))
+            break;
+        /* the slot was given to another device, find it again */
+        word_unlock(&slot->word);
+        lock->slot = find_slot(&lock->id);
+        if (lock->slot < 0  &&  !lock->file)
+            return -1;
+    }
+    slot->last_used = monotonic_ms();
+    if (legacy_lock
+        &&  lock_file_range(lock->file->fd, F_WRLCK, lock->legacy_offset, 1, wait) != 0
+        )
+    {
+        word_unlock(&slot->word);
+        return -1;
+    }
+    lock->held = GRD_LOCK_HELD_SLOT;
+    return 0;
+}
+
+int grd_lock_acquire(struct grd_lock* lock)
+{
+    return lock_device(lock, 1);
+}
+
+int grd_lock_try(struct grd_lock* lock)
+{
+    return lock_device(lock, 0);
+}
+
+/* Unlock device, let the other processes lock it first if yield is set */
+static int unlock_device(struct grd_lock* lock, int yield)
+{
+    struct grd_lock_slot* slot;
+    int ret = 0;
+
+    assert(lock);
+    if (lock->held == GRD_LOCK_HELD_FILE)
+    {
+        ret = lock_file_range(lock->file->fd, F_UNLCK, 0, 0, 0);
+        pthread_mutex_unlock(&lock->file->mutex);
+    }
+    else if (lock->held == GRD_LOCK_HELD_SLOT)
+    {
+        if (legacy_lock)
+            ret = lock_file_range(lock->file->fd, F_UNLCK, lock->legacy_offset, 1, 0);
+        assert(lock_shm);
+        assert(lock->slot >= 0);
+        slot = &lock_shm->slots[lock->slot];
+        if (yield  &&  slot->waiters > 0)
+        {
+            slot->handoff = lock_pid;
+            __sync_synchronize();
+        }
+        word_unlock(&slot->word);
+    }
+    else
+        ret = -1;
+    lock->held = 0;
+    return ret;
+}
+
+int grd_lock_release(struct grd_lock* lock)
+{
+    return unlock_device(lock, 0);
+}
+
+int grd_lock_yield(struct grd_lock* lock)
+{
+    return unlock_device(lock, 1);
+}
+
+pid_t grd_lock_owner(const struct grd_lock* lock)
+{
+    assert(lock);
+    if (!lock_shm  ||  lock->slot < 0)
+        return 0;
+    return (pid_t)(lock_shm->slots[lock->slot].word & ~GRD_LOCK_WAITERS);
+}
+
+unsigned int grd_lock_load(const struct grd_lock* lock)
+{
+    const struct grd_lock_slot* slot;
+
+    assert(lock);
+    if (!lock_shm  ||  lock->slot < 0)
+        return 0;
+    slot = &lock_shm->slots[lock->slot];
+    return (slot->word ? 1 : 0) + slot->waiters;
+}
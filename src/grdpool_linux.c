@@ -0,0 +1,326 @@
+/*
+ * Communication to any device of a product (grd_ioctl_product)
+ *
+ * Copyright (C) 2008 Aktiv Co. (Aleksey Samsonov)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/*
+ * The devices of a product are found by the search (and the probe) at most
+ * once in GRD_POOL_REFRESH_MS, or when a device is gone. The load of a
+ * device is the calls of this process plus the holder and the waiters of
+ * its cross-process lock; equally loaded devices are taken in turn.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h> /* for UINT_MAX */
+#include <time.h>
+#include <pthread.h>
+#include "grdimpl.h"
+#include "grdlock.h"
+#include "grdtransport.h"
+
+#define GRD_POOL_PRODUCTS       8
+#define GRD_POOL_DEVICES        64
+#define GRD_POOL_PATH_LEN       256
+#define GRD_POOL_REFRESH_MS     1000
+
+struct pool_device
+{
+    char path[GRD_POOL_PATH_LEN];
+    struct grd_lock lock;       /* the load of all processes */
+    int has_lock;
+    volatile unsigned int inflight; /* calls of this process */
+};
+
+/* Devices of a product: replaced as a whole, freed by the last user */
+struct pool_set
+{
+    unsigned int refs;          /* the pool and the running calls */
+    size_t count;
+    struct pool_device devices[1];
+};
+
+struct product_pool
+{
+    unsigned int prod_id;
+    int used;
+    int stale;                  /* a device is gone: search again */
+    struct pool_set* set;
+    uint64_t refreshed_ms;
+    volatile unsigned int next; /* the first device compared */
+};
+
+/* Search result of one refresh */
+struct pool_search
+{
+    unsigned int prod_id;
+    size_t count;
+    char paths[GRD_POOL_DEVICES][GRD_POOL_PATH_LEN];
+};
+
+static pthread_mutex_t pools_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t refresh_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct product_pool pools[GRD_POOL_PRODUCTS];
+
+static uint64_t monotonic_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static int __attribute__((ms_abi)) pool_found(const char* path, void* param)
+{
+    struct pool_search* search = param;
+    unsigned int id;
+
+    assert(search);
+    if (search->count >= GRD_POOL_DEVICES  ||  strlen(path) >= GRD_POOL_PATH_LEN)
+        return 0;
+    if (grd_probe_device(path, &id) != 0  ||  id != search->prod_id)
+        return 0;
+    strcpy(search->paths[search->count++], path);
+    return 1;
+}
+
+/* Find the devices of the product, return the new set (one reference) */
+static struct pool_set* pool_scan(unsigned int prod_id)
+{
+    struct pool_search* search;
+    struct pool_set* set;
+    struct pool_device* d;
+    struct grd_dev_id id;
+    size_t i;
+
+    search = malloc(sizeof(*search));
+    if (!search)
+        return NULL;
+    search->prod_id = prod_id;
+    search->count = 0;
+    if (search_usb_devices(pool_found, search) < 0)
+    {
+        free(search);
+        return NULL;
+    }
+    set = calloc(1, sizeof(*set) + search->count * sizeof(set->devices[0]));
+    if (set)
+    {
+        set->refs = 1;
+        set->count = search->count;
+        for (i = 0; i < search->count; ++i)
+        {
+            d = &set->devices[i];
+            strcpy(d->path, search->paths[i]);
+            d->has_lock = grd_device_identify(d->path, &id) == 0
+                          &&  grd_lock_init(&d->lock, d->path, &id) == 0;
+        }
+    }
+    free(search);
+    return set;
+}
+
+/* Release a reference of the set (pools_mutex is locked) */
+static void set_unref(struct pool_set* set)
+{
+    size_t i;
+
+    assert(set && set->refs > 0);
+    if (--set->refs > 0)
+        return;
+    for (i = 0; i < set->count; ++i)
+        if (set->devices[i].has_lock)
+            grd_lock_destroy(&set->devices[i].lock);
+    free(set);
+}
+
+static void set_put(struct pool_set* set)
+{
+    pthread_mutex_lock(&pools_mutex);
+    set_unref(set);
+    pthread_mutex_unlock(&pools_mutex);
+}
+
+/*
+ * Return the devices of the product (a reference of the set) and its pool,
+ * or NULL. One thread searches again, the others use the old set meanwhile.
+ */
+static struct pool_set* pool_get(unsigned int prod_id, struct product_pool** result)
+{
+    struct product_pool* pool = NULL;
+    struct pool_set* set;
+    struct pool_set* fresh;
+    size_t i;
+    int need;
+
+    pthread_mutex_lock(&pools_mutex);
+    for (i = 0; i < GRD_POOL_PRODUCTS  &&  !pool; ++i)
+        if (pools[i].used  &&  pools[i].prod_id == prod_id)
+            pool = &pools[i];
+    for (i = 0; i < GRD_POOL_PRODUCTS  &&  !pool; ++i)
+        if (!pools[i].used)
+        {
+            pool = &pools[i];
+            pool->used = 1;
+            pool->prod_id = prod_id;
+        }
+    if (!pool)
+    {
+        pthread_mutex_unlock(&pools_mutex);
+        errno = ENOMEM;
+        return NULL;
+    }
+    *result = pool;
+    set = pool->set;
+    if (set)
+        ++set->refs;
+    need = !set  ||  pool->stale  ||  monotonic_ms() - pool->refreshed_ms >= GRD_POOL_REFRESH_MS;
+    pthread_mutex_unlock(&pools_mutex);
+    if (!need)
+        return set;
+
+    if (set)
+    {
+        if (pthread_mutex_trylock(&refresh_mutex) != 0)
+            return set;
+    }
+    else
+        pthread_mutex_lock(&refresh_mutex);
+
+    /* searched by another thread meanwhile? */
+    pthread_mutex_lock(&pools_mutex);
+    need = !pool->set  ||  pool->stale
+           ||  monotonic_ms() - pool->refreshed_ms >= GRD_POOL_REFRESH_MS;
+    pthread_mutex_unlock(&pools_mutex);
+    fresh = need ? pool_scan(prod_id) : NULL;
+
+    pthread_mutex_lock(&pools_mutex);
+    if (fresh)
+    {
+        if (pool->set)
+            set_unref(pool->set);
+        pool->set = fresh;
+        pool->stale = 0;
+        pool->refreshed_ms = monotonic_ms();
+    }
+    if (set)
+        set_unref(set);
+    set = pool->set;
+    if (set)
+        ++set->refs;
+    pthread_mutex_unlock(&pools_mutex);
+    pthread_mutex_unlock(&refresh_mutex);
+    return set;
+}
+
+/* The sticky device, else an idle or the least loaded device */
+static struct pool_device* pool_choose(struct product_pool* pool, struct pool_set* set,
+                                       const char* sticky)
+{
+    struct pool_device* best = NULL;
+    struct pool_device* d;
+    unsigned int load, best_load = UINT_MAX;
+    size_t i, start;
+
+    assert(pool && set);
+    if (sticky  &&  sticky[0])
+    {
+        for (i = 0; i < set->count; ++i)
+            if (strcmp(set->devices[i].path, sticky) == 0)
+                return &set->devices[i];
+        return NULL;
+    }
+    if (set->count == 0)
+        return NULL;
+    start = __sync_fetch_and_add(&pool->next, 1);
+    for (i = 0; i < set->count; ++i)
+    {
+        d = &set->devices[(start + i) % set->count];
+        load = d->inflight + (d->has_lock ? grd_lock_load(&d->lock) : 0);
+        if (load < best_load)
+        {
+            best = d;
+            best_load = load;
+            if (load == 0)
+                break;
+        }
+    }
+    return best;
+}
+
+int grd_ioctl_product(unsigned int prod_id, char* dev_path, size_t dev_path_size,
+                      size_t pack_size, void* in, size_t len_in, void* out, size_t len_out)
+{
+    struct product_pool* pool = NULL;
+    struct pool_set* set;
+    struct pool_device* d;
+    const int sticky = dev_path  &&  dev_path[0];
+    int tries, ret = -1, err = ENODEV;
+
+    if (dev_path  &&  dev_path_size == 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    for (tries = 0; tries < 2; ++tries)
+    {
+        set = pool_get(prod_id, &pool);
+        if (!set)
+            return -1;
+        d = pool_choose(pool, set, dev_path);
+        if (!d)
+        {
+            /* no devices (search again in GRD_POOL_REFRESH_MS), or the sticky one is gone */
+            err = ENODEV;
+            pthread_mutex_lock(&pools_mutex);
+            if (sticky)
+                pool->stale = 1;
+            set_unref(set);
+            pthread_mutex_unlock(&pools_mutex);
+            if (!sticky)
+                break;
+            continue;
+        }
+        __sync_fetch_and_add(&d->inflight, 1);
+        errno = 0;
+        ret = grd_ioctl_device(d->path, prod_id, pack_size, in, len_in, out, len_out);
+        err = errno ? errno : EIO;
+        __sync_fetch_and_sub(&d->inflight, 1);
+        if (dev_path  &&  strlen(d->path) < dev_path_size)
+            strcpy(dev_path, d->path);
+        if (ret != 0  &&  (err == ENOENT  ||  err == ENXIO  ||  err == ENODEV))
+        {
+            pthread_mutex_lock(&pools_mutex);
+            pool->stale = 1;
+            pthread_mutex_unlock(&pools_mutex);
+        }
+        set_put(set);
+        /* the device was gone before the exchange: try another one */
+        if (ret == 0  ||  sticky  ||  (err != ENOENT  &&  err != ENXIO))
+            break;
+    }
+    if (ret != 0)
+        errno = err;
+    return ret;
+}
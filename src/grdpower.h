@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2008 Aktiv Co. (Aleksey Samsonov)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+
+#ifndef GRDPOWER__H__
+#define GRDPOWER__H__
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+/*
+ * Runtime power management of the USB device of a node (sysfs power/).
+ * The low-latency mode (GRD_LOW_LATENCY=1) keeps the devices of the open
+ * sessions awake: the kernel does not autosuspend them between calls.
+ */
+
+struct grd_power
+{
+    int dir_fd;                 /* power/ of the USB device, -1 if unknown */
+    int status_fd;              /* power/runtime_status, -1 if unknown */
+    int pin_fd;                 /* usbfs node forbidding the suspend, -1 if none */
+};
+
+/*
+ * Return non-zero in the low-latency mode.
+ */
+int grd_power_low_latency(void);
+
+/*
+ * Find the USB device of the node dev_path in sysfs. In the low-latency mode
+ * keep it awake until grd_power_close (see grd_power_pin).
+ */
+void grd_power_open(struct grd_power* pw, const char* dev_path);
+
+/*
+ * Let the device autosuspend again (unless other handles keep it awake).
+ */
+void grd_power_close(struct grd_power* pw);
+
+/*
+ * Keep the device awake: USBDEVFS_FORBID_SUSPEND on a descriptor of its
+ * usbfs node (needs access to the node, Linux 5.7). The kernel counts the
+ * descriptors, so the sessions of other processes keep it awake too. A
+ * usbfs device does it on the descriptor of the exchanges instead.
+ * Return zero on success.
+ */
+int grd_power_pin(struct grd_power* pw);
+
+/*
+ * Return non-zero if the device is suspended now: the next exchange pays
+ * the resume.
+ */
+int grd_power_is_suspended(const struct grd_power* pw);
+
+#endif /* !GRDPOWER__H__ */
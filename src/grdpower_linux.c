@@ -0,0 +1,185 @@
+/*
+ * Runtime power management of the Guardant devices
+ *
+ * Copyright (C) 2008 Aktiv Co. (Aleksey Samsonov)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h> /* for PATH_MAX */
+#include <stdio.h>  /* for snprintf */
+#include <pthread.h>
+#include "grdimpl_linux.h"
+#include "grdhidreg.h"
+#include "grdlock.h"
+#include "grdpower.h"
+#include "grdtransport.h"
+
+#define GRD_LOW_LATENCY_ENV     "GRD_LOW_LATENCY"
+
+#ifndef USBDEVFS_FORBID_SUSPEND
+#define USBDEVFS_FORBID_SUSPEND _IO('U', 33) /* Linux 5.7 */
+#endif /* USBDEVFS_FORBID_SUSPEND */
+
+static pthread_once_t low_latency_once = PTHREAD_ONCE_INIT;
+static int low_latency;
+
+static void low_latency_init(void)
+{
+    const char* env = getenv(GRD_LOW_LATENCY_ENV);
+
+    low_latency = env  &&  env[0]  &&  strcmp(env, "0") != 0;
+}
+
+int grd_power_low_latency(void)
+{
+    pthread_once(&low_latency_once, low_latency_init);
+    return low_latency;
+}
+
+/*
+ * The USB device of a node is the nearest parent of its sysfs directory
+ * with idVendor (usb_device for usbfs, the parent of the interface for
+ * hiddev and hidraw).
+ */
+static int open_usb_device_dir(const char* dev_path)
+{
+    char link[PATH_MAX], dir[PATH_MAX];
+    const char* sysfs = grd_sysfs_path();
+    struct grd_dev_id id;
+    size_t root_len = strlen(sysfs);
+    char* slash;
+    int fd;
+
+    if (grd_device_identify(dev_path, &id) != 0  ||  id.kind != GRD_DEV_ID_CHAR)
+        return -1;
+    if (snprintf(link, sizeof(link), "%s/dev/char/%u:%u", sysfs, id.major, id.minor)
+        >= (int)sizeof(link)
+        )
+        return -1;
+    if (!realpath(link, dir))
+        return -1;
+    while (strlen(dir) > root_len)
+    {
+        fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd >= 0)
+        {
+            if (faccessat(fd, "idVendor", F_OK, 0) == 0)
+                return fd;
+            close(fd);
+        }
+        slash = strrchr(dir, '/');
+        if (!slash)
+            break;
+        *slash = '\0';
+    }
+    return -1;
+}
+
+void grd_power_open(struct grd_power* pw, const char* dev_path)
+{
+    int dev_fd;
+
+    assert(pw);
+    assert(dev_path);
+    pw->dir_fd = -1;
+    pw->status_fd = -1;
+    pw->pin_fd = -1;
+    dev_fd = open_usb_device_dir(dev_path);
+    if (dev_fd < 0)
+        return;
+    pw->dir_fd = openat(dev_fd, "power", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    close(dev_fd);
+    if (pw->dir_fd < 0)
+        return;
+    pw->status_fd = openat(pw->dir_fd, "runtime_status", O_RDONLY | O_CLOEXEC);
+    if (grd_power_low_latency()  &&  grd_is_hid_path(dev_path))
+        grd_power_pin(pw);
+}
+
+void grd_power_close(struct grd_power* pw)
+{
+    assert(pw);
+    /* the kernel lets it suspend when no other descriptor forbids it */
+    if (pw->pin_fd >= 0)
+        close(pw->pin_fd);
+    if (pw->status_fd >= 0)
+        close(pw->status_fd);
+    if (pw->dir_fd >= 0)
+        close(pw->dir_fd);
+    pw->dir_fd = -1;
+    pw->status_fd = -1;
+    pw->pin_fd = -1;
+}
+
+int grd_power_pin(struct grd_power* pw)
+{
+    char path[PATH_MAX];
+    unsigned int busnum, devnum;
+    int fd;
+
+    assert(pw);
+    if (pw->pin_fd >= 0)
+        return 0;
+    /* power/ is in the directory of the USB device */
+    if (pw->dir_fd < 0
+        ||  grd_read_sysfs_uint(pw->dir_fd, "../busnum", 10, &busnum) != 0
+        ||  grd_read_sysfs_uint(pw->dir_fd, "../devnum", 10, &devnum) != 0
+        ||  grd_usbfs_device_path(busnum, devnum, path, sizeof(path)) != 0
+        )
+    {
+        errno = ENOENT;
+        return -1;
+    }
+    /* power/control is left alone: it is shared with the other processes */
+    fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    if (ioctl(fd, USBDEVFS_FORBID_SUSPEND) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    pw->pin_fd = fd;
+    return 0;
+}
+
+int grd_power_is_suspended(const struct grd_power* pw)
+{
+    char buf[16];
+    ssize_t len;
+
+    assert(pw);
+    if (pw->status_fd < 0)
+        return 0;
+    /* sysfs makes the value again for a read at offset zero */
+    len = pread(pw->status_fd, buf, sizeof(buf) - 1, 0);
+    if (len <= 0)
+        return 0;
+    buf[len] = '\0';
+    return strncmp(buf, "suspended", 9) == 0;
+}
@@ -0,0 +1,857 @@
+/*
+ * Replay of the GrdWine call captures against emulated devices
+ *
+ * Copyright (C) 2008 Aktiv Co. (Aleksey Samsonov)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/*
+ * grdreplay [-s speed] [-x copies] [-e options] [-k dir] [-l label] [-o file]
+ *           [-b file] capture...
+ * grdreplay -p capture...
+ *
+ * Every captured process (GRD_CAPTURE) is played back by a process, every
+ * captured thread by a thread, which makes the calls of the capture with
+ * their shapes (device kind, pack size, in and out lengths, payload if it
+ * was kept) at their times divided by the speed (-s 0: at once).
+ * -x runs every captured process so many times at once.
+ * The devices are emulated (GRD_EMUL), one per captured device, of its
+ * kind; -e gives the emulator options (by default the latency of the
+ * captured packs). The replay is captured in turn (in -k dir, removed
+ * unless given): the latency and the lock wait of the calls are printed
+ * for the capture and the replay, and written to -o as one JSON object per
+ * line, labelled -l (the library version, say). -b compares the replay
+ * with such a file written by another version.
+ * -p prints the records of the captures.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h> /* for PATH_MAX */
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+#include "grdimpl.h"
+#include "grdimpl_linux.h"
+#include "grdcapture.h"
+
+#define REPLAY_MAX_FILES        256
+#define REPLAY_MAX_DEVICES      64   /* the emulator limit */
+#define REPLAY_MAX_THREADS      256  /* per captured process */
+#define REPLAY_PATH_LEN         256
+#define REPLAY_START_DELAY_NS   200000000u /* for the processes to get ready */
+#define REPLAY_FILE_PREFIX      "replay"
+
+enum replay_class
+{
+    REPLAY_IOCTL_BULK,
+    REPLAY_IOCTL_HID,
+    REPLAY_PROBE,
+    REPLAY_CLASS_COUNT
+};
+
+static const char* const class_names[REPLAY_CLASS_COUNT] =
+{
+    "ioctl_bulk", "ioctl_hid", "probe"
+};
+
+enum replay_source
+{
+    REPLAY_CAPTURE,
+    REPLAY_REPLAY,
+    REPLAY_SOURCE_COUNT
+};
+
+/* A captured device, emulated as emul:<index> */
+struct replay_device
+{
+    char path[REPLAY_PATH_LEN];
+    unsigned int prod_id;
+};
+
+/* A capture file mapped in memory */
+struct replay_file
+{
+    const char* path;
+    const struct grd_capture_header* header;
+    size_t size;
+    const char* records;
+    const char* end;
+    unsigned int devices[REPLAY_MAX_DEVICES + 1]; /* dev of the file -> replay device */
+    unsigned int devices_count;
+    uint32_t tids[REPLAY_MAX_THREADS];
+    unsigned int threads_count;
+};
+
+struct replay_thread
+{
+    const struct replay_file* file;
+    uint32_t tid;
+    uint64_t base_ns;           /* CLOCK_MONOTONIC of first_ns in the replay */
+    uint64_t first_ns;          /* start of the first call of the captures */
+    double speed;
+};
+
+/* Latency and lock wait of the calls of a class */
+struct replay_stats
+{
+    uint64_t* lat_ns;
+    uint64_t* lock_ns;
+    size_t count, size;
+    uint64_t errors;
+    uint64_t passed;
+};
+
+/* Results of a class written by an earlier run (-b) */
+struct replay_result
+{
+    int valid;
+    char label[64];
+    unsigned long calls;
+    unsigned long long errors;
+    double p50_us, p99_us, max_us, lock_p50_us, lock_p99_us, lock_avg_us, passed;
+};
+
+static struct replay_device devices[REPLAY_MAX_DEVICES];
+static unsigned int devices_count;
+static struct replay_stats stats[REPLAY_SOURCE_COUNT][REPLAY_CLASS_COUNT];
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static const struct grd_capture_record* next_record(const struct replay_file* f,
+                                                    const struct grd_capture_record* r)
+{
+    const char* p;
+
+    assert(f);
+    p = r ? (const char*)(r + 1) + ((r->payload + 7u) & ~7u) : f->records;
+    if (p + sizeof(*r) > f->end)
+        return NULL;
+    r = (const struct grd_capture_record*)p;
+    if ((const char*)(r + 1) + r->payload > f->end)
+        return NULL; /* truncated */
+    return r;
+}
+
+static int is_call(const struct grd_capture_record* r)
+{
+    return r->type == GRD_CAPTURE_IOCTL  ||  r->type == GRD_CAPTURE_PROBE;
+}
+
+static enum replay_class record_class(const struct grd_capture_record* r)
+{
+    if (r->type == GRD_CAPTURE_PROBE)
+        return REPLAY_PROBE;
+    return grd_is_hid_prodid(r->prod_id) ? REPLAY_IOCTL_HID : REPLAY_IOCTL_BULK;
+}
+
+static int open_file(const char* path, struct replay_file* f)
+{
+    const struct grd_capture_header* h;
+    struct stat st;
+    void* map;
+    int fd;
+
+    memset(f, 0, sizeof(*f));
+    f->path = path;
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        perror(path);
+        return -1;
+    }
+    if (fstat(fd, &st) != 0  ||  (size_t)st.st_size < sizeof(*h))
+    {
+        fprintf(stderr, "%s: not a capture\n", path);
+        close(fd);
+        return -1;
+    }
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        perror(path);
+        return -1;
+    }
+    h = map;
+    if (h->magic != GRD_CAPTURE_MAGIC  ||  h->version != GRD_CAPTURE_VERSION
+        ||  h->record_size != sizeof(struct grd_capture_record)
+        )
+    {
+        fprintf(stderr, "%s: not a capture\n", path);
+        munmap(map, (size_t)st.st_size);
+        return -1;
+    }
+    f->header = h;
+    f->size = (size_t)st.st_size;
+    f->records = (const char*)(h + 1);
+    /* a capture may be written still: up to its last complete record */
+    f->end = f->records + (h->length < f->size - sizeof(*h) ? h->length : f->size - sizeof(*h));
+    return 0;
+}
+
+/* Map the devices of the file to the replay devices, find the threads */
+static int load_file(struct replay_file* f)
+{
+    const struct grd_capture_record* r;
+    const char* path;
+    unsigned int i;
+
+    for (r = next_record(f, NULL); r; r = next_record(f, r))
+    {
+        if (r->type == GRD_CAPTURE_DEVICE)
+        {
+            path = (const char*)(r + 1);
+            if (r->dev == 0  ||  r->dev > REPLAY_MAX_DEVICES  ||  r->payload == 0
+                ||  path[r->payload - 1] != '\0'
+                )
+                continue;
+            for (i = 0; i < devices_count; ++i)
+                if (strcmp(devices[i].path, path) == 0)
+                    break;
+            if (i == devices_count)
+            {
+                if (devices_count == REPLAY_MAX_DEVICES  ||  strlen(path) >= REPLAY_PATH_LEN)
+                {
+                    fprintf(stderr, "%s: too many devices\n", f->path);
+                    return -1;
+                }
+                strcpy(devices[devices_count++].path, path);
+            }
+            f->devices[r->dev] = i + 1;
+            if (r->dev > f->devices_count)
+                f->devices_count = r->dev;
+            continue;
+        }
+        if (!is_call(r)  ||  r->dev == 0  ||  r->dev > f->devices_count  ||  !f->devices[r->dev])
+            continue;
+        if (r->prod_id  &&  !devices[f->devices[r->dev] - 1].prod_id)
+            devices[f->devices[r->dev] - 1].prod_id = r->prod_id;
+        for (i = 0; i < f->threads_count; ++i)
+            if (f->tids[i] == r->tid)
+                break;
+        if (i == f->threads_count)
+        {
+            if (f->threads_count == REPLAY_MAX_THREADS)
+            {
+                fprintf(stderr, "%s: too many threads\n", f->path);
+                return -1;
+            }
+            f->tids[f->threads_count++] = r->tid;
+        }
+    }
+    return 0;
+}
+
+static const char* emul_kind(unsigned int prod_id)
+{
+    switch (prod_id)
+    {
+    case GRD_PRODID_S3S_HID:    return "sign_hid";
+    case GRD_PRODID_S3S_WINUSB: return "sign_winusb";
+    case GRD_PRODID_S3C:        return "code";
+    case GRD_PRODID_S3C_HID:    return "code_hid";
+    case GRD_PRODID_S3C_WINUSB: return "code_winusb";
+    default:                    return "sign";
+    }
+}
+
+static int compare_u64(const void* a, const void* b)
+{
+    const uint64_t x = *(const uint64_t*)a;
+    const uint64_t y = *(const uint64_t*)b;
+
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static double percentile_us(const uint64_t* sorted, size_t n, double p)
+{
+    size_t i;
+
+    if (n == 0)
+        return 0.0;
+    i = (size_t)(p * (double)(n - 1) + 0.5);
+    return (double)sorted[i] / 1000.0;
+}
+
+/* How much longer than asked the emulator sleeps (the timer slack) */
+static uint64_t sleep_overshoot_ns(void)
+{
+    uint64_t samples[16];
+    struct timespec delay;
+    uint64_t start;
+    size_t i;
+
+    for (i = 0; i < sizeof(samples) / sizeof(samples[0]); ++i)
+    {
+        delay.tv_sec = 0;
+        delay.tv_nsec = 100000;
+        start = now_ns();
+        nanosleep(&delay, NULL);
+        samples[i] = now_ns() - start - 100000;
+    }
+    qsort(samples, i, sizeof(samples[0]), compare_u64);
+    return samples[i / 2];
+}
+
+/*
+ * The emulator latency of a transfer from the captured device time per
+ * pack (half of it for the write, half for the read): the transfer takes
+ * latency plus up to jitter, uniformly, so that the median is kept and the
+ * p10 .. p50 spread is 0.4 jitter.
+ */
+static void captured_latency(const struct replay_file* files, size_t count,
+                             long* latency_us, long* jitter_us)
+{
+    const struct grd_capture_record* r;
+    uint64_t* samples = NULL;
+    uint64_t* p;
+    size_t i, n = 0, size = 0;
+    double p50, jitter;
+    uint64_t ns;
+
+    *latency_us = 0;
+    *jitter_us = 0;
+    for (i = 0; i < count; ++i)
+        for (r = next_record(&files[i], NULL); r; r = next_record(&files[i], r))
+        {
+            if (r->type != GRD_CAPTURE_IOCTL  ||  r->err  ||  r->pack_size == 0
+                ||  r->len_in < r->pack_size  ||  r->duration_ns < r->lock_ns
+                )
+                continue;
+            if (n == size)
+            {
+                p = realloc(samples, (size ? size * 2 : 1024) * sizeof(*samples));
+                if (!p)
+                    break;
+                samples = p;
+                size = size ? size * 2 : 1024;
+            }
+            ns = r->duration_ns - r->lock_ns;
+            samples[n++] = ns / (2 * (r->len_in / r->pack_size));
+        }
+    if (n > 0)
+    {
+        qsort(samples, n, sizeof(samples[0]), compare_u64);
+        p50 = percentile_us(samples, n, 0.5) - (double)sleep_overshoot_ns() / 1000.0;
+        if (p50 < 0)
+            p50 = 0;
+        jitter = (percentile_us(samples, n, 0.5) - percentile_us(samples, n, 0.1)) / 0.4;
+        if (jitter > 2 * p50)
+            jitter = 2 * p50;
+        *latency_us = (long)(p50 - jitter / 2);
+        *jitter_us = (long)jitter;
+    }
+    free(samples);
+}
+
+static void wait_until(uint64_t ns)
+{
+    struct timespec ts;
+
+    ts.tv_sec = (time_t)(ns / 1000000000u);
+    ts.tv_nsec = (long)(ns % 1000000000u);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+static void* run_thread(void* arg)
+{
+    const struct replay_thread* t = arg;
+    const struct replay_file* f = t->file;
+    const struct grd_capture_record* r;
+    const struct replay_device* d;
+    unsigned char* in = NULL;
+    unsigned char* out = NULL;
+    unsigned char* p;
+    size_t size = 0, len;
+    unsigned int id;
+
+    for (r = next_record(f, NULL); r; r = next_record(f, r))
+    {
+        if (r->tid != t->tid  ||  !is_call(r)  ||  r->dev == 0  ||  r->dev > f->devices_count
+            ||  !f->devices[r->dev]
+            )
+            continue;
+        d = &devices[f->devices[r->dev] - 1];
+        if (t->speed > 0)
+            wait_until(t->base_ns + (uint64_t)((double)(r->start_ns - t->first_ns) / t->speed));
+        if (r->type == GRD_CAPTURE_PROBE)
+        {
+            grd_probe_device(d->path, &id);
+            continue;
+        }
+        len = r->len_in > r->len_out ? r->len_in : r->len_out;
+        if (len > size)
+        {
+            p = realloc(in, len);
+            in = p ? p : in;
+            p = p ? realloc(out, len) : NULL;
+            out = p ? p : out;
+            if (!p)
+                continue;
+            size = len;
+        }
+        /* the record keeps in (the reply) then out (written to the device) */
+        if (r->payload == r->len_in + r->len_out)
+            memcpy(out, (const char*)(r + 1) + r->len_in, r->len_out);
+        else
+            memset(out, 0x5a, r->len_out);
+        grd_ioctl_device(d->path, d->prod_id, r->pack_size, in, r->len_in, out, r->len_out);
+    }
+    free(in);
+    free(out);
+    return NULL;
+}
+
+/* Play a captured process back (in a child process) */
+static void replay_process(const struct replay_file* f, uint64_t base_ns, uint64_t first_ns,
+                           double speed)
+{
+    struct replay_thread t[REPLAY_MAX_THREADS];
+    pthread_t tid[REPLAY_MAX_THREADS];
+    unsigned int i, n;
+
+    for (n = 0; n < f->threads_count; ++n)
+    {
+        t[n].file = f;
+        t[n].tid = f->tids[n];
+        t[n].base_ns = base_ns;
+        t[n].first_ns = first_ns;
+        t[n].speed = speed;
+        if (pthread_create(&tid[n], NULL, run_thread, &t[n]) != 0)
+        {
+            perror("pthread_create");
+            break;
+        }
+    }
+    for (i = 0; i < n; ++i)
+        pthread_join(tid[i], NULL);
+}
+
+static int add_sample(struct replay_stats* s, const struct grd_capture_record* r)
+{
+    uint64_t* p;
+    size_t size;
+
+    if (s->count == s->size)
+    {
+        size = s->size ? s->size * 2 : 1024;
+        p = realloc(s->lat_ns, size * sizeof(*p));
+        if (!p)
+            return -1;
+        s->lat_ns = p;
+        p = realloc(s->lock_ns, size * sizeof(*p));
+        if (!p)
+            return -1;
+        s->lock_ns = p;
+        s->size = size;
+    }
+    s->lat_ns[s->count] = r->duration_ns;
+    s->lock_ns[s->count] = r->lock_ns;
+    ++s->count;
+    if (r->err)
+        ++s->errors;
+    if (r->flags & GRD_CAPTURE_PASSED)
+        ++s->passed;
+    return 0;
+}
+
+static int add_file_stats(const struct replay_file* f, enum replay_source source)
+{
+    const struct grd_capture_record* r;
+
+    for (r = next_record(f, NULL); r; r = next_record(f, r))
+        if (is_call(r)  &&  add_sample(&stats[source][record_class(r)], r) != 0)
+            return -1;
+    return 0;
+}
+
+/* Read the captures of the replay (those of the children) */
+static int load_replay_stats(const char* dir)
+{
+    struct replay_file f;
+    char path[PATH_MAX];
+    struct dirent* d;
+    DIR* dp;
+    char pid[32];
+    int ret = 0;
+
+    snprintf(pid, sizeof(pid), REPLAY_FILE_PREFIX ".%d", (int)getpid());
+    dp = opendir(dir);
+    if (!dp)
+    {
+        perror(dir);
+        return -1;
+    }
+    while ((d = readdir(dp)) != NULL  &&  ret == 0)
+    {
+        if (strncmp(d->d_name, REPLAY_FILE_PREFIX ".", sizeof(REPLAY_FILE_PREFIX)) != 0
+            ||  strcmp(d->d_name, pid) == 0
+            ||  (size_t)snprintf(path, sizeof(path), "%s/%s", dir, d->d_name) >= sizeof(path)
+            )
+            continue;
+        if (open_file(path, &f) != 0)
+            continue;
+        ret = add_file_stats(&f, REPLAY_REPLAY);
+        munmap((void*)f.header, f.size);
+    }
+    closedir(dp);
+    return ret;
+}
+
+static void remove_dir(const char* dir)
+{
+    char path[PATH_MAX];
+    struct dirent* d;
+    DIR* dp;
+
+    dp = opendir(dir);
+    if (!dp)
+        return;
+    while ((d = readdir(dp)) != NULL)
+        if (strncmp(d->d_name, REPLAY_FILE_PREFIX ".", sizeof(REPLAY_FILE_PREFIX)) == 0
+            &&  (size_t)snprintf(path, sizeof(path), "%s/%s", dir, d->d_name) < sizeof(path)
+            )
+            unlink(path);
+    closedir(dp);
+    rmdir(dir);
+}
+
+static void compute_result(struct replay_stats* s, struct replay_result* res)
+{
+    uint64_t sum = 0;
+    size_t i;
+
+    memset(res, 0, sizeof(*res));
+    res->valid = s->count > 0;
+    res->calls = (unsigned long)s->count;
+    res->errors = (unsigned long long)s->errors;
+    if (s->count == 0)
+        return;
+    for (i = 0; i < s->count; ++i)
+        sum += s->lock_ns[i];
+    qsort(s->lat_ns, s->count, sizeof(s->lat_ns[0]), compare_u64);
+    qsort(s->lock_ns, s->count, sizeof(s->lock_ns[0]), compare_u64);
+    res->p50_us = percentile_us(s->lat_ns, s->count, 0.5);
+    res->p99_us = percentile_us(s->lat_ns, s->count, 0.99);
+    res->max_us = (double)s->lat_ns[s->count - 1] / 1000.0;
+    res->lock_p50_us = percentile_us(s->lock_ns, s->count, 0.5);
+    res->lock_p99_us = percentile_us(s->lock_ns, s->count, 0.99);
+    res->lock_avg_us = (double)sum / (double)s->count / 1000.0;
+    res->passed = (double)s->passed / (double)s->count;
+}
+
+static void print_result(const char* class_name, const char* source,
+                         const struct replay_result* r)
+{
+    printf("%-11s %-9s %8lu %7llu %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f %6.1f%%\n",
+           class_name, source, r->calls, r->errors, r->p50_us, r->p99_us, r->max_us,
+           r->lock_p50_us, r->lock_p99_us, r->lock_avg_us, r->passed * 100.0);
+}
+
+static double change(double now, double then)
+{
+    return then > 0 ? (now - then) * 100.0 / then : 0.0;
+}
+
+static void print_change(const char* class_name, const struct replay_result* now,
+                         const struct replay_result* then)
+{
+    printf("%-11s %-9s %8s %7s %+8.1f%% %+8.1f%% %+8.1f%% %+8.1f%% %+8.1f%% %+8.1f%%\n",
+           class_name, "change", "", "", change(now->p50_us, then->p50_us),
+           change(now->p99_us, then->p99_us), change(now->max_us, then->max_us),
+           change(now->lock_p50_us, then->lock_p50_us),
+           change(now->lock_p99_us, then->lock_p99_us),
+           change(now->lock_avg_us, then->lock_avg_us));
+}
+
+/* Read the results of the classes from a file written by -o (the last run) */
+static int read_baseline(const char* path, struct replay_result* results)
+{
+    struct replay_result r;
+    char line[1024], name[32];
+    unsigned int c;
+    FILE* f;
+
+    f = fopen(path, "r");
+    if (!f)
+    {
+        perror(path);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f))
+    {
+        memset(&r, 0, sizeof(r));
+        if (sscanf(line, "{\"label\":\"%63[^\"]\",\"class\":\"%31[^\"]\",\"calls\":%lu,"
+                         "\"errors\":%llu,\"p50_us\":%lf,\"p99_us\":%lf,\"max_us\":%lf,"
+                         "\"lock_p50_us\":%lf,\"lock_p99_us\":%lf,\"lock_avg_us\":%lf,"
+                         "\"passed\":%lf",
+                   r.label, name, &r.calls, &r.errors, &r.p50_us, &r.p99_us, &r.max_us,
+                   &r.lock_p50_us, &r.lock_p99_us, &r.lock_avg_us, &r.passed) != 11
+            )
+            continue;
+        for (c = 0; c < REPLAY_CLASS_COUNT; ++c)
+            if (strcmp(name, class_names[c]) == 0)
+            {
+                r.valid = 1;
+                results[c] = r;
+            }
+    }
+    fclose(f);
+    return 0;
+}
+
+static void print_records(const struct replay_file* f)
+{
+    static const char* const type_names[] = { "?", "device", "ioctl", "probe" };
+    const struct grd_capture_record* r;
+    const uint64_t first = f->header->monotonic_ns;
+
+    printf("%s: pid %u, %s, %u dropped\n", f->path, f->header->pid,
+           f->header->flags & GRD_CAPTURE_PAYLOADS ? "payloads" : "redacted",
+           f->header->dropped);
+    for (r = next_record(f, NULL); r; r = next_record(f, r))
+    {
+        if (r->type == GRD_CAPTURE_DEVICE)
+        {
+            printf("%12.6f %6u device %u %.*s\n", (double)(int64_t)(r->start_ns - first) / 1e9,
+                   r->tid, r->dev, (int)r->payload, (const char*)(r + 1));
+            continue;
+        }
+        printf("%12.6f %6u %-6s dev %u prod 0x%02x pack %u in %u out %u%s%s%s"
+               " %.1f us lock %.1f us%s%s\n",
+               (double)(int64_t)(r->start_ns - first) / 1e9, r->tid,
+               r->type < sizeof(type_names) / sizeof(type_names[0]) ? type_names[r->type] : "?",
+               r->dev, r->prod_id, r->pack_size, r->len_in, r->len_out,
+               r->flags & GRD_CAPTURE_BROKER ? " broker" : "",
+               r->flags & GRD_CAPTURE_PASSED ? " passed" : "",
+               r->flags & GRD_CAPTURE_CACHED ? " cached" : "",
+               (double)r->duration_ns / 1000.0, (double)r->lock_ns / 1000.0,
+               r->err ? "  " : "", r->err ? strerror(r->err) : "");
+    }
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: grdreplay [-s speed] [-x copies] [-e options] [-k dir] [-l label] "
+                    "[-o file] [-b file] capture...\n"
+                    "       grdreplay -p capture...\n");
+    exit(2);
+}
+
+int main(int argc, char* argv[])
+{
+    static struct replay_file files[REPLAY_MAX_FILES];
+    struct replay_result now, baseline[REPLAY_CLASS_COUNT];
+    const struct grd_capture_record* r;
+    const char* options = NULL;
+    const char* keep = NULL;
+    const char* label = "";
+    const char* baseline_path = NULL;
+    char dir[PATH_MAX], prefix[PATH_MAX + sizeof("/" REPLAY_FILE_PREFIX)], emul[4096];
+    double speed = 1.0;
+    unsigned int copies = 1, i, c, s;
+    uint64_t first_ns = UINT64_MAX, base_ns, start;
+    long latency_us, jitter_us;
+    size_t files_count = 0, len;
+    int opt, print = 0, status, ret;
+    FILE* json = NULL;
+    pid_t pid;
+
+    while ((opt = getopt(argc, argv, "s:x:e:k:l:o:b:p")) != -1)
+    {
+        switch (opt)
+        {
+        case 's': speed = atof(optarg); break;
+        case 'x': copies = (unsigned int)atoi(optarg); break;
+        case 'e': options = optarg; break;
+        case 'k': keep = optarg; break;
+        case 'l': label = optarg; break;
+        case 'b': baseline_path = optarg; break;
+        case 'p': print = 1; break;
+        case 'o':
+            json = fopen(optarg, "a");
+            if (!json)
+            {
+                perror(optarg);
+                return 1;
+            }
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind == argc  ||  speed < 0  ||  copies < 1  ||  copies > 64
+        ||  argc - optind > REPLAY_MAX_FILES  ||  strchr(label, '"')
+        )
+        usage();
+    for (; optind < argc; ++optind)
+        if (open_file(argv[optind], &files[files_count]) == 0)
+            ++files_count;
+    if (files_count == 0)
+        return 1;
+    if (print)
+    {
+        for (i = 0; i < files_count; ++i)
+            print_records(&files[i]);
+        return 0;
+    }
+    memset(baseline, 0, sizeof(baseline));
+    if (baseline_path  &&  read_baseline(baseline_path, baseline) != 0)
+        return 1;
+
+    for (i = 0; i < files_count; ++i)
+    {
+        if (load_file(&files[i]) != 0)
+            return 1;
+        for (r = next_record(&files[i], NULL); r; r = next_record(&files[i], r))
+            if (is_call(r)  &&  r->start_ns < first_ns)
+                first_ns = r->start_ns;
+        if (add_file_stats(&files[i], REPLAY_CAPTURE) != 0)
+            return 1;
+    }
+    if (devices_count == 0  ||  first_ns == UINT64_MAX)
+    {
+        fprintf(stderr, "grdreplay: no calls captured\n");
+        return 1;
+    }
+
+    /* one emulated device per captured device: emul:<index> */
+    len = 0;
+    for (i = 0; i < devices_count; ++i)
+    {
+        len += (size_t)snprintf(emul + len, sizeof(emul) - len, "%s%s", i ? "," : "",
+                                emul_kind(devices[i].prod_id));
+        snprintf(devices[i].path, sizeof(devices[i].path), "emul:%u", i);
+        if (!devices[i].prod_id)
+            devices[i].prod_id = GRD_PRODID_S3S;
+    }
+    if (options)
+        snprintf(emul + len, sizeof(emul) - len, ":%s", options);
+    else
+    {
+        captured_latency(files, files_count, &latency_us, &jitter_us);
+        snprintf(emul + len, sizeof(emul) - len, ":latency=%ld:jitter=%ld",
+                 latency_us, jitter_us);
+    }
+
+    if (keep)
+    {
+        ret = snprintf(dir, sizeof(dir), "%s", keep);
+        if (ret <= 0  ||  (size_t)ret >= sizeof(dir))
+        {
+            fprintf(stderr, "grdreplay: %s: path too long\n", keep);
+            return 1;
+        }
+    }
+    else
+    {
+        snprintf(dir, sizeof(dir), "/tmp/grdreplay.XXXXXX");
+        if (!mkdtemp(dir))
+        {
+            perror("mkdtemp");
+            return 1;
+        }
+    }
+    ret = snprintf(prefix, sizeof(prefix), "%s/" REPLAY_FILE_PREFIX, dir);
+    assert(ret > 0  &&  (size_t)ret < sizeof(prefix)); /* sized for any dir */
+    /* before the first call of the library: the children inherit it */
+    setenv("GRD_EMUL", emul, 1);
+    setenv("GRD_BROKER", "0", 1);
+    setenv(GRD_CAPTURE_ENV, prefix, 1);
+    unsetenv(GRD_CAPTURE_PAYLOAD_ENV);
+    printf("GRD_EMUL=%s, %zu processes x %u, %u devices, speed %g\n",
+           emul, files_count, copies, devices_count, speed);
+
+    start = now_ns();
+    base_ns = start + REPLAY_START_DELAY_NS;
+    for (i = 0; i < files_count; ++i)
+        for (c = 0; c < copies; ++c)
+        {
+            pid = fork();
+            if (pid < 0)
+            {
+                perror("fork");
+                break;
+            }
+            if (pid == 0)
+            {
+                replay_process(&files[i], base_ns, first_ns, speed);
+                _exit(0);
+            }
+        }
+    while (wait(&status) > 0  ||  errno == EINTR)
+        ;
+    printf("replayed in %.3f s\n", (double)(now_ns() - (speed > 0 ? base_ns : start)) / 1e9);
+    if (load_replay_stats(dir) != 0)
+        return 1;
+    if (!keep)
+        remove_dir(dir);
+
+    printf("%-11s %-9s %8s %7s %9s %9s %9s %9s %9s %9s %7s\n", "class", "source", "calls",
+           "errors", "p50 us", "p99 us", "max us", "lock p50", "lock p99", "lock avg", "passed");
+    for (c = 0; c < REPLAY_CLASS_COUNT; ++c)
+    {
+        for (s = 0; s < REPLAY_SOURCE_COUNT; ++s)
+        {
+            compute_result(&stats[s][c], &now);
+            if (!now.valid)
+                continue;
+            print_result(class_names[c], s == REPLAY_CAPTURE ? "capture" : "replay", &now);
+        }
+        if (!now.valid)
+            continue;
+        if (baseline[c].valid)
+        {
+            print_result(class_names[c], "baseline", &baseline[c]);
+            print_change(class_names[c], &now, &baseline[c]);
+        }
+        if (json)
+        {
+            fprintf(json, "{\"label\":\"%s\",\"class\":\"%s\",\"calls\":%lu,"
+                          "\"errors\":%llu,\"p50_us\":%.2f,\"p99_us\":%.2f,\"max_us\":%.2f,"
+                          "\"lock_p50_us\":%.2f,\"lock_p99_us\":%.2f,\"lock_avg_us\":%.2f,"
+                          "\"passed\":%.4f,\"speed\":%g,\"copies\":%u}\n",
+                    label, class_names[c], now.calls, now.errors, now.p50_us, now.p99_us,
+                    now.max_us, now.lock_p50_us, now.lock_p99_us, now.lock_avg_us,
+                    now.passed, speed, copies);
+            fflush(json);
+        }
+    }
+    if (json)
+        fclose(json);
+    return 0;
+}
@@ -0,0 +1,193 @@
+/*
+ * Reader of the GrdWine statistics segment
+ *
+ * Copyright (C) 2008 Aktiv Co. (Aleksey Samsonov)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/*
+ * grdstat [-i seconds] [-c count] [-r] [-d]
+ * The processes record the statistics while grdstat runs. It prints them
+ * every -i seconds (-c times, until interrupted by default).
+ * -r: reset the statistics; -d: stop the recording (after a killed grdstat).
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+#include <signal.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "grdstats.h"
+
+static const char* const phase_names[GRD_PHASE_COUNT] =
+{
+    "lock", "open", "claim", "transfer", "read_wait", "ioctl", "probe", "search",
+    "resume"
+};
+
+/* GRD_BREAKER_CLOSED, _OPEN and _HALF_OPEN */
+static const char* const breaker_names[] = { "closed", "open", "half-open" };
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    stop = 1;
+}
+
+/* Upper bound of the bucket where the p part of the calls ends (microseconds) */
+static uint64_t percentile_us(const struct grd_stats_hist* h, uint64_t count, double p)
+{
+    uint64_t sum = 0, target;
+    unsigned int b;
+
+    target = (uint64_t)(p * (double)count);
+    if (target == 0)
+        target = 1;
+    for (b = 0; b < GRD_STATS_BUCKETS; ++b)
+    {
+        sum += h->buckets[b];
+        if (sum >= target)
+            break;
+    }
+    return (uint64_t)2 << (b < GRD_STATS_BUCKETS ? b : GRD_STATS_BUCKETS - 1);
+}
+
+static void print_stats(const struct grd_stats_shm* shm)
+{
+    const struct grd_stats_dev* dev;
+    const struct grd_stats_hist* h;
+    unsigned int i, p;
+    uint64_t count;
+
+    for (i = 0; i < GRD_STATS_DEVICES; ++i)
+    {
+        dev = &shm->devices[i];
+        if (i > 0  &&  dev->state != 2)
+            continue;
+        for (p = 0, count = 0; p < GRD_PHASE_COUNT; ++p)
+            count += dev->phases[p].count;
+        if (count == 0)
+            continue;
+
+        printf("%s: errors %llu, timeouts %llu, reopens %llu, resumes %llu, lock holder %u\n",
+               i == 0 ? "(search)" : dev->path, (unsigned long long)dev->errors,
+               (unsigned long long)dev->timeouts, (unsigned long long)dev->reopens,
+               (unsigned long long)dev->resumes, dev->lock_holder);
+        if (i > 0)
+            printf("  breaker %s, opens %llu, fast fails %llu, timeout %u ms\n",
+                   dev->breaker < 3 ? breaker_names[dev->breaker] : "?",
+                   (unsigned long long)dev->breaker_opens,
+                   (unsigned long long)dev->fast_fails, dev->timeout_ms);
+        printf("  %-10s %10s %10s %10s %10s %10s\n",
+               "phase", "count", "avg us", "p50 us<", "p99 us<", "max us");
+        for (p = 0; p < GRD_PHASE_COUNT; ++p)
+        {
+            h = &dev->phases[p];
+            count = h->count;
+            if (count == 0)
+                continue;
+            printf("  %-10s %10llu %10.1f %10llu %10llu %10.1f\n", phase_names[p],
+                   (unsigned long long)count, (double)h->sum_ns / (double)count / 1000.0,
+                   (unsigned long long)percentile_us(h, count, 0.5),
+                   (unsigned long long)percentile_us(h, count, 0.99),
+                   (double)h->max_ns / 1000.0);
+        }
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+static void reset_stats(struct grd_stats_shm* shm)
+{
+    struct grd_stats_dev* dev;
+    unsigned int i;
+
+    for (i = 0; i < GRD_STATS_DEVICES; ++i)
+    {
+        dev = &shm->devices[i];
+        dev->lock_holder = 0;
+        dev->errors = 0;
+        dev->timeouts = 0;
+        dev->reopens = 0;
+        dev->resumes = 0;
+        dev->breaker_opens = 0;
+        dev->fast_fails = 0;
+        memset(dev->phases, 0, sizeof(dev->phases));
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    struct grd_stats_shm* shm;
+    unsigned int interval = 1;
+    uint32_t n;
+    long count = -1;
+    int opt, reset = 0, disable = 0;
+
+    while ((opt = getopt(argc, argv, "i:c:rd")) != -1)
+    {
+        switch (opt)
+        {
+        case 'i': interval = (unsigned int)atoi(optarg); break;
+        case 'c': count = atol(optarg); break;
+        case 'r': reset = 1; break;
+        case 'd': disable = 1; break;
+        default:
+            fprintf(stderr, "usage: grdstat [-i seconds] [-c count] [-r] [-d]\n");
+            return 2;
+        }
+    }
+    shm = grd_stats_open();
+    if (!shm)
+    {
+        perror("grdstat: " GRD_STATS_SHM_NAME);
+        return 1;
+    }
+    if (disable)
+    {
+        shm->readers = 0;
+        return 0;
+    }
+    if (reset)
+    {
+        reset_stats(shm);
+        if (count < 0)
+            return 0;
+    }
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    __sync_fetch_and_add(&shm->readers, 1);
+    while (!stop  &&  count != 0)
+    {
+        sleep(interval);
+        print_stats(shm);
+        if (count > 0)
+            --count;
+    }
+    /* not below zero (-d may have cleared it) */
+    while ((n = shm->readers) > 0
+           &&  !__sync_bool_compare_and_swap(&shm->readers, n, n - 1)
+           )
+        ;
+    return 0;
+}
@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2008 Aktiv Co. (Aleksey Samsonov)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#ifndef GRDSTATS__H__
+#define GRDSTATS__H__
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+#include <stdint.h>
+
+#define GRD_STATS_SHM_NAME      "grdwine-stats.3"
+#define GRD_STATS_SHM_MAGIC     0x54534447 /* "GDST" */
+#define GRD_STATS_DEVICES       64   /* slot 0 is for the calls of no device */
+#define GRD_STATS_BUCKETS       32   /* bucket n: [2^n, 2^(n+1)) microseconds */
+#define GRD_STATS_PATH_LEN      128
+
+/* Phases of the calls */
+enum grd_stats_phase
+{
+    GRD_PHASE_LOCK,             /* wait for the cross-process lock */
+    GRD_PHASE_OPEN,             /* open the device node */
+    GRD_PHASE_CLAIM,            /* claim interface, set HID flags */
+    GRD_PHASE_TRANSFER,         /* exchange of the packs */
+    GRD_PHASE_READ_WAIT,        /* wait for an input HID report */
+    GRD_PHASE_IOCTL,            /* grd_ioctl_device */
+    GRD_PHASE_PROBE,            /* grd_probe_device */
+    GRD_PHASE_SEARCH,           /* search_usb_devices */
+    GRD_PHASE_RESUME,           /* open, claim and exchange of a suspended device */
+    GRD_PHASE_COUNT
+};
+
+struct grd_stats_hist
+{
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+    uint64_t buckets[GRD_STATS_BUCKETS];
+} __attribute__((aligned(8)));
+
+struct grd_stats_dev
+{
+    volatile uint32_t state;    /* 0: free, 1: being claimed, 2: used */
+    volatile uint32_t lock_holder; /* pid which held the lock we waited for */
+    uint64_t errors;            /* failed grd_ioctl_device/grd_probe_device */
+    uint64_t timeouts;          /* exchanges failed with ETIMEDOUT */
+    uint64_t reopens;           /* stale handles opened again */
+    uint64_t resumes;           /* calls which found the device suspended */
+    volatile uint32_t breaker;  /* GRD_BREAKER_CLOSED, _OPEN or _HALF_OPEN */
+    uint32_t timeout_ms;        /* transfer timeout of a pack */
+    uint64_t breaker_opens;     /* the breaker was opened */
+    uint64_t fast_fails;        /* calls failed by the open breaker */
+    char path[GRD_STATS_PATH_LEN];
+    struct grd_stats_hist phases[GRD_PHASE_COUNT];
+} __attribute__((aligned(8)));
+
+/*
+ * Statistics segment, shared by all processes (GRD_IPC_NAME directory).
+ * The processes record only while readers is non-zero.
+ */
+struct grd_stats_shm
+{
+    volatile uint32_t magic;
+    uint32_t devices_count;
+    volatile uint32_t readers;  /* count of the running readers (grdstat) */
+    uint32_t reserved;
+    struct grd_stats_dev devices[GRD_STATS_DEVICES];
+} __attribute__((aligned(8)));
+
+extern struct grd_stats_shm* grd_stats_shm;
+
+/*
+ * Map the segment (create it if needed).
+ * Return the segment, or NULL.
+ */
+struct grd_stats_shm* grd_stats_open(void);
+
+/*
+ * Return the statistics of the device (dev_path NULL: of no device),
+ * or NULL.
+ */
+struct grd_stats_dev* grd_stats_device(const char* dev_path);
+
+uint64_t grd_stats_now(void);
+
+void grd_stats_record(struct grd_stats_dev* dev, enum grd_stats_phase phase,
+                      uint64_t start);
+
+/* Start of a phase: zero if nobody reads the statistics */
+static inline uint64_t grd_stats_begin(void)
+{
+    return (grd_stats_shm  &&  grd_stats_shm->readers) ? grd_stats_now() : 0;
+}
+
+/* End of a phase started by grd_stats_begin */
+static inline void grd_stats_end(struct grd_stats_dev* dev, enum grd_stats_phase phase,
+                                 uint64_t start)
+{
+    if (start  &&  dev)
+        grd_stats_record(dev, phase, start);
+}
+
+/* Add one to the counter of the device (if somebody reads) */
+static inline void grd_stats_inc(struct grd_stats_dev* dev, uint64_t* counter)
+{
+    if (dev  &&  grd_stats_shm->readers)
+        __sync_fetch_and_add(counter, 1);
+}
+
+#endif /* !GRDSTATS__H__ */
@@ -0,0 +1,149 @@
+/*
+ * Statistics of the GrdWine calls (shared-memory segment)
+ *
+ * Copyright (C) 2008 Aktiv Co. (Aleksey Samsonov)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <limits.h> /* for PATH_MAX */
+#include <time.h>
+#include <pthread.h>
+#include "grdlock.h"
+#include "grdstats.h"
+
+struct grd_stats_shm* grd_stats_shm;
+
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+
+static void stats_init(void)
+{
+    char path[PATH_MAX];
+    struct grd_stats_shm* shm;
+    struct stat buf;
+    mode_t mode;
+    void* p;
+    int fd;
+
+    if (grd_ipc_path(GRD_STATS_SHM_NAME, path, sizeof(path)) != 0)
+        return;
+
+    mode = umask(0);
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC,
+              S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+    umask(mode);
+    if (fd < 0)
+        return;
+    /* zero-filled segment is a valid one: no devices, no readers */
+    if (fstat(fd, &buf) != 0
+        ||  ((size_t)buf.st_size < sizeof(*shm)  &&  ftruncate(fd, sizeof(*shm)) != 0)
+        )
+    {
+        close(fd);
+        return;
+    }
+    p = mmap(NULL, sizeof(*shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return;
+
+    shm = (struct grd_stats_shm*)p;
+    if (__sync_bool_compare_and_swap(&shm->magic, 0, GRD_STATS_SHM_MAGIC))
+        shm->devices_count = GRD_STATS_DEVICES;
+    if (shm->magic != GRD_STATS_SHM_MAGIC)
+    {
+        munmap(p, sizeof(*shm));
+        return;
+    }
+    grd_stats_shm = shm;
+}
+
+struct grd_stats_shm* grd_stats_open(void)
+{
+    pthread_once(&stats_once, stats_init);
+    return grd_stats_shm;
+}
+
+struct grd_stats_dev* grd_stats_device(const char* dev_path)
+{
+    struct grd_stats_dev* dev;
+    unsigned int i;
+
+    if (!grd_stats_open())
+        return NULL;
+    if (!dev_path)
+        return &grd_stats_shm->devices[0];
+    if (strlen(dev_path) >= sizeof(dev->path))
+        return NULL;
+    for (i = 1; i < GRD_STATS_DEVICES; ++i)
+    {
+        dev = &grd_stats_shm->devices[i];
+        if (dev->state == 2  &&  strcmp(dev->path, dev_path) == 0)
+            return dev;
+    }
+    /* the slots are never freed: a removed device keeps its statistics */
+    for (i = 1; i < GRD_STATS_DEVICES; ++i)
+    {
+        dev = &grd_stats_shm->devices[i];
+        if (dev->state == 0  &&  __sync_bool_compare_and_swap(&dev->state, 0, 1))
+        {
+            strcpy(dev->path, dev_path);
+            __sync_synchronize();
+            dev->state = 2;
+            return dev;
+        }
+    }
+    return NULL;
+}
+
+uint64_t grd_stats_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec + 1; /* non-zero */
+}
+
+void grd_stats_record(struct grd_stats_dev* dev, enum grd_stats_phase phase,
+                      uint64_t start)
+{
+    struct grd_stats_hist* h;
+    uint64_t ns, us, max;
+    unsigned int b = 0;
+
+    assert(dev);
+    assert(phase < GRD_PHASE_COUNT);
+    ns = grd_stats_now() - start;
+    for (us = ns / 1000; us > 1  &&  b < GRD_STATS_BUCKETS - 1; us >>= 1)
+        ++b;
+    h = &dev->phases[phase];
+    __sync_fetch_and_add(&h->count, 1);
+    __sync_fetch_and_add(&h->sum_ns, ns);
+    __sync_fetch_and_add(&h->buckets[b], 1);
+    while ((max = h->max_ns) < ns
+           &&  !__sync_bool_compare_and_swap(&h->max_ns, max, ns)
+           )
+        ;
+}
@@ -0,0 +1,1460 @@
+/*
+ * Syscall budgets of the call paths of the grdimpl.h layer
+ *
+ * Copyright (C) 2008 Aktiv Co. (Aleksey Samsonov)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/*
+ * grdsyscalls [-r] [-k]
+ * Runs the search, the probes and the one-pack and multi-pack exchanges of
+ * a bulk and a HID device (hidraw, then hiddev with GRD_HIDRAW=0) on a fake
+ * usbfs and sysfs tree, and counts the syscalls of the calling thread by
+ * class: the first call of a path, and the most of the next calls. The
+ * bulk exchange runs once more with the broker enabled but not running.
+ * Run by make check.
+ * The libc functions are wrapped at link time (-Wl,--wrap, see
+ * Makefile.am): the wrappers count the calls and play the device nodes.
+ * Exit status 1 if a path fails or needs more calls of a class than its
+ * budget (budgets[]). -r prints the counts as budgets[] lines, -k keeps the
+ * fake tree.
+ * The calls are counted at the libc functions: opendir is an open and a
+ * stat, a readdir is counted although libc reads several entries with one
+ * getdents64, the futexes of pthread and clock_gettime (vDSO) are not seen.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h> /* for makedev */
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <poll.h>
+#include <ftw.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h> /* for PATH_MAX */
+#include <stdio.h>
+#include <pthread.h>
+#include <linux/usbdevice_fs.h>
+#include <linux/hiddev.h>
+#include <linux/hidraw.h>
+#include "grdimpl.h"
+#include "grdimpl_linux.h"
+
+#ifndef USBDEVFS_FORBID_SUSPEND
+#define USBDEVFS_FORBID_SUSPEND _IO('U', 33) /* Linux 5.7 */
+#endif /* USBDEVFS_FORBID_SUSPEND */
+
+#define FAKE_FDS                1024
+#define FAKE_QUEUE              64   /* input reports and completed URBs */
+#define FAKE_PACK_SIZE          64
+#define FAKE_MULTI_PACKS        8
+#define FAKE_REPORT_LEN         64
+#define FAKE_BULK_PATH          "/usb/001/002"  /* under the tree */
+#define FAKE_OTHER_PATH         "/usb/001/003"  /* not a Guardant device */
+#define FAKE_HIDDEV_PATH        "/dev/usb/hiddev0"
+#define FAKE_HIDRAW_PATH        "/dev/hidraw0"
+#define NEXT_CALLS              3    /* the next calls of a path */
+
+/* The processes of the paths: the environment is read once by a process */
+enum sc_process
+{
+    SC_PROC_HIDRAW,
+    SC_PROC_HIDDEV,             /* GRD_HIDRAW=0 */
+    SC_PROC_BROKER,             /* GRD_BROKER unset, no broker socket */
+    SC_PROC_COUNT
+};
+
+static const char* const process_names[SC_PROC_COUNT] =
+{
+    "hidraw", "hiddev", "broker"
+};
+
+/* Classes of the calls */
+enum sc_class
+{
+    SC_OPEN,
+    SC_CLOSE,
+    SC_READ,        /* read, pread */
+    SC_WRITE,
+    SC_IOCTL,
+    SC_SELECT,
+    SC_POLL,
+    SC_MMAP,        /* mmap, munmap, mremap */
+    SC_STAT,        /* stat, fstat, access, faccessat */
+    SC_FCNTL,
+    SC_UMASK,
+    SC_DIR,         /* readdir */
+    SC_FUTEX,       /* syscall(SYS_futex) of the device locks */
+    SC_OTHER,
+    SC_COUNT
+};
+
+static const char* const class_names[SC_COUNT] =
+{
+    "open", "close", "read", "write", "ioctl", "select", "poll", "mmap", "stat",
+    "fcntl", "umask", "dir", "futex", "other"
+};
+
+/*
+ * Recorded budgets: the most calls of each class of a path (the classes
+ * not listed: none). Update with the lines of -r when a change is meant
+ * to cost more.
+ */
+struct budget
+{
+    const char* path;
+    const char* pass;           /* "first" or "next" */
+    const char* counts;         /* "class=n ..." */
+};
+
+static const struct budget budgets[] =
+{
+    { "search",             "first", "open=22 close=22 read=12 mmap=1 stat=8 fcntl=2 umask=2 dir=15 other=1" },
+    { "search",             "next",  "open=21 close=21 read=12 stat=7 fcntl=2 dir=15" },
+    { "probe_bulk",         "first", "open=3 close=3 read=2 stat=3" },
+    { "probe_bulk",         "next",  "stat=1" },
+    { "probe_hid",          "first", "stat=2" },
+    { "probe_hid",          "next",  "stat=1" },
+    { "probe_other",        "first", "open=3 close=3 read=2 stat=3" },
+    { "probe_other",        "next",  "stat=1" },
+    { "ioctl_bulk",         "first", "open=9 close=5 read=2 ioctl=6 mmap=2 stat=6 fcntl=2 umask=4 other=7" },
+    { "ioctl_bulk",         "next",  "ioctl=6 fcntl=2" },
+    { "ioctl_bulk_multi",   "first", "ioctl=34 fcntl=2" },
+    { "ioctl_bulk_multi",   "next",  "ioctl=34 fcntl=2" },
+    { "ioctl_hidraw",       "first", "open=11 close=6 read=3 write=1 poll=2 stat=6 fcntl=2 umask=2 other=1" },
+    { "ioctl_hidraw",       "next",  "read=1 write=1 poll=2 fcntl=2" },
+    { "ioctl_hidraw_multi", "first", "read=8 write=8 poll=9 fcntl=2" },
+    { "ioctl_hidraw_multi", "next",  "read=8 write=8 poll=9 fcntl=2" },
+    { "ioctl_hiddev",       "first", "open=11 close=6 read=3 ioctl=5 select=1 poll=1 stat=6 fcntl=2 umask=2 other=1" },
+    { "ioctl_hiddev",       "next",  "read=1 ioctl=4 select=1 poll=1 fcntl=2" },
+    { "ioctl_hiddev_multi", "first", "read=8 ioctl=32 select=8 poll=1 fcntl=2" },
+    { "ioctl_hiddev_multi", "next",  "read=8 ioctl=32 select=8 poll=1 fcntl=2" },
+    { "ioctl_bulk_broker",  "first", "open=11 close=7 read=2 ioctl=6 mmap=3 stat=8 fcntl=2 umask=6 other=8" },
+    { "ioctl_bulk_broker",  "next",  "ioctl=6 fcntl=2" },
+    { NULL, NULL, NULL }
+};
+
+/* Fake device nodes */
+enum fake_kind
+{
+    FAKE_USBFS = 1,
+    FAKE_HIDDEV,
+    FAKE_HIDRAW
+};
+
+struct fake_node
+{
+    char path[PATH_MAX];
+    enum fake_kind kind;
+    unsigned int vendor;
+    unsigned int product;
+    unsigned int major;
+    unsigned int minor;
+};
+
+/* An opened fake node (a descriptor of /dev/null) */
+struct fake_fd
+{
+    const struct fake_node* node;
+    unsigned char reports[FAKE_QUEUE][FAKE_REPORT_LEN]; /* input (HID) */
+    size_t reports_head, reports_count;
+    unsigned char output[FAKE_REPORT_LEN];  /* set by HIDIOCSUSAGES */
+    struct usbdevfs_urb* urbs[FAKE_QUEUE];  /* completed, not reaped */
+    size_t urbs_head, urbs_count;
+    unsigned char pack[4096];               /* the last written bulk pack */
+    size_t pack_len;
+};
+
+/* Counts of a path (shared by the processes) */
+struct path_result
+{
+    int ran;
+    int failed;
+    unsigned int counts[SC_COUNT];
+};
+
+/* A measured path */
+struct sc_path
+{
+    const char* name;
+    int process;                /* SC_PROC_*, -1: hidraw and hiddev */
+    int (*call)(void);
+};
+
+static struct fake_node nodes[4];
+static unsigned int nodes_count;
+static struct fake_fd* fake_fds[FAKE_FDS];
+static pthread_mutex_t fake_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread unsigned int* counters;   /* NULL: not counted */
+static char tree[256];
+static char bulk_path[PATH_MAX];
+static char other_path[PATH_MAX];
+
+/* The real functions (-Wl,--wrap) */
+int __real_open(const char* path, int flags, ...);
+int __real_openat(int dir_fd, const char* path, int flags, ...);
+int __real_close(int fd);
+ssize_t __real_read(int fd, void* buf, size_t count);
+ssize_t __real_pread(int fd, void* buf, size_t count, off_t offset);
+ssize_t __real_write(int fd, const void* buf, size_t count);
+int __real_ioctl(int fd, unsigned long request, ...);
+int __real_select(int nfds, fd_set* rfds, fd_set* wfds, fd_set* efds, struct timeval* tv);
+int __real_poll(struct pollfd* fds, nfds_t nfds, int timeout);
+void* __real_mmap(void* addr, size_t len, int prot, int flags, int fd, off_t offset);
+int __real_munmap(void* addr, size_t len);
+void* __real_mremap(void* addr, size_t old_len, size_t new_len, int flags, ...);
+int __real_stat(const char* path, struct stat* buf);
+int __real_fstat(int fd, struct stat* buf);
+int __real_access(const char* path, int mode);
+int __real_faccessat(int dir_fd, const char* path, int mode, int flags);
+int __real_fcntl(int fd, int cmd, ...);
+mode_t __real_umask(mode_t mask);
+DIR* __real_opendir(const char* path);
+DIR* __real_fdopendir(int fd);
+struct dirent* __real_readdir(DIR* dir);
+int __real_closedir(DIR* dir);
+long __real_syscall(long number, ...);
+int __real_ftruncate(int fd, off_t length);
+pid_t __real_getpid(void);
+int __real_kill(pid_t pid, int sig);
+int __real_nanosleep(const struct timespec* req, struct timespec* rem);
+int __real_unlink(const char* path);
+int __real_rename(const char* from, const char* to);
+int __real_mkstemp(char* tmpl);
+int __real_memfd_create(const char* name, unsigned int flags);
+char* __real_realpath(const char* path, char* resolved);
+int __real_inotify_init1(int flags);
+int __real_inotify_add_watch(int fd, const char* path, uint32_t mask);
+int __real_socket(int domain, int type, int protocol);
+int __real_connect(int fd, const struct sockaddr* addr, socklen_t len);
+int __real_bind(int fd, const struct sockaddr* addr, socklen_t len);
+ssize_t __real_sendmsg(int fd, const struct msghdr* msg, int flags);
+ssize_t __real_recv(int fd, void* buf, size_t len, int flags);
+ssize_t __real_recvfrom(int fd, void* buf, size_t len, int flags,
+                        struct sockaddr* addr, socklen_t* addr_len);
+
+static void count(enum sc_class c)
+{
+    if (counters)
+        ++counters[c];
+}
+
+static const struct fake_node* find_node(const char* path)
+{
+    unsigned int i;
+
+    for (i = 0; path  &&  i < nodes_count; ++i)
+        if (strcmp(nodes[i].path, path) == 0)
+            return &nodes[i];
+    return NULL;
+}
+
+/* The other nodes of /dev are hidden: the paths do not depend on the host */
+static int is_hidden(const char* path)
+{
+    return path  &&  strncmp(path, "/dev/", 5) == 0  &&  !find_node(path);
+}
+
+/* The fake descriptor, fake_mutex is locked if it is not NULL */
+static struct fake_fd* lock_fd(int fd)
+{
+    if (fd < 0  ||  fd >= FAKE_FDS)
+        return NULL;
+    pthread_mutex_lock(&fake_mutex);
+    if (fake_fds[fd])
+        return fake_fds[fd];
+    pthread_mutex_unlock(&fake_mutex);
+    return NULL;
+}
+
+static void unlock_fd(void)
+{
+    pthread_mutex_unlock(&fake_mutex);
+}
+
+static void fill_stat(const struct fake_node* node, struct stat* buf)
+{
+    assert(node);
+    memset(buf, 0, sizeof(*buf));
+    buf->st_mode = S_IFCHR | 0666;
+    buf->st_rdev = makedev(node->major, node->minor);
+    buf->st_dev = makedev(0, 5);
+    buf->st_ino = (ino_t)(node - nodes + 1);
+    buf->st_nlink = 1;
+    buf->st_ctim.tv_sec = 1;
+}
+
+static int open_node(const struct fake_node* node, int flags)
+{
+    struct fake_fd* f;
+    int fd;
+
+    fd = __real_open("/dev/null", O_RDWR | (flags & O_CLOEXEC));
+    if (fd < 0)
+        return -1;
+    f = calloc(1, sizeof(*f));
+    if (!f  ||  fd >= FAKE_FDS)
+    {
+        free(f);
+        __real_close(fd);
+        errno = EMFILE;
+        return -1;
+    }
+    f->node = node;
+    pthread_mutex_lock(&fake_mutex);
+    fake_fds[fd] = f;
+    pthread_mutex_unlock(&fake_mutex);
+    return fd;
+}
+
+/* The device answers a report with the report inverted */
+static void queue_report(struct fake_fd* f, const unsigned char* report)
+{
+    unsigned char* dst;
+    size_t i;
+
+    if (f->reports_count == FAKE_QUEUE)
+        return; /* lost, as the kernel drops them */
+    dst = f->reports[(f->reports_head + f->reports_count++) % FAKE_QUEUE];
+    for (i = 0; i < FAKE_REPORT_LEN; ++i)
+        dst[i] = (unsigned char)~report[i];
+}
+
+static void take_report(struct fake_fd* f, unsigned char* report)
+{
+    assert(f->reports_count > 0);
+    memcpy(report, f->reports[f->reports_head], FAKE_REPORT_LEN);
+    f->reports_head = (f->reports_head + 1) % FAKE_QUEUE;
+    --f->reports_count;
+}
+
+/* A bulk transfer: the read gets the last written pack inverted */
+static void transfer_pack(struct fake_fd* f, unsigned int ep, unsigned char* buf, size_t len)
+{
+    size_t i;
+
+    if (len > sizeof(f->pack))
+        len = sizeof(f->pack);
+    if (!(ep & 0x80))
+    {
+        memcpy(f->pack, buf, len);
+        f->pack_len = len;
+        return;
+    }
+    for (i = 0; i < len; ++i)
+        buf[i] = i < f->pack_len ? (unsigned char)~f->pack[i] : 0;
+}
+
+static int ioctl_usbfs(struct fake_fd* f, unsigned long request, void* arg)
+{
+    struct usbdevfs_bulktransfer* bulk;
+    struct usbdevfs_urb* urb;
+
+    switch (request)
+    {
+    case USBDEVFS_CLAIMINTERFACE:
+    case USBDEVFS_RELEASEINTERFACE:
+    case USBDEVFS_FORBID_SUSPEND:
+        return 0;
+    case USBDEVFS_BULK:
+        bulk = arg;
+        transfer_pack(f, bulk->ep, bulk->data, bulk->len);
+        return (int)bulk->len;
+    case USBDEVFS_SUBMITURB:
+        /* completes at once */
+        urb = arg;
+        if (f->urbs_count == FAKE_QUEUE)
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+        transfer_pack(f, urb->endpoint, urb->buffer, (size_t)urb->buffer_length);
+        urb->actual_length = urb->buffer_length;
+        urb->status = 0;
+        f->urbs[(f->urbs_head + f->urbs_count++) % FAKE_QUEUE] = urb;
+        return 0;
+    case USBDEVFS_REAPURB:
+    case USBDEVFS_REAPURBNDELAY:
+        if (f->urbs_count == 0)
+        {
+            errno = EAGAIN;
+            return -1;
+        }
+        *(struct usbdevfs_urb**)arg = f->urbs[f->urbs_head];
+        f->urbs_head = (f->urbs_head + 1) % FAKE_QUEUE;
+        --f->urbs_count;
+        return 0;
+    case USBDEVFS_DISCARDURB:
+        errno = EINVAL; /* completed already */
+        return -1;
+    default:
+        errno = ENOTTY;
+        return -1;
+    }
+}
+
+static int ioctl_hiddev(struct fake_fd* f, unsigned long request, void* arg)
+{
+    struct hiddev_usage_ref_multi* ref;
+    struct hiddev_devinfo* info;
+    unsigned char report[FAKE_REPORT_LEN];
+    unsigned int i;
+
+    switch (request)
+    {
+    case HIDIOCGDEVINFO:
+        info = arg;
+        memset(info, 0, sizeof(*info));
+        info->vendor = (__s16)f->node->vendor;
+        info->product = (__s16)f->node->product;
+        return 0;
+    case HIDIOCSFLAG:
+    case HIDIOCGREPORT:
+        return 0;
+    case HIDIOCSUSAGES:
+        ref = arg;
+        for (i = 0; i < ref->num_values  &&  i < FAKE_REPORT_LEN; ++i)
+            f->output[i] = (unsigned char)ref->values[i];
+        return 0;
+    case HIDIOCSREPORT:
+        queue_report(f, f->output);
+        return 0;
+    case HIDIOCGUSAGES:
+        ref = arg;
+        if (f->reports_count == 0)
+        {
+            errno = EIO;
+            return -1;
+        }
+        take_report(f, report);
+        for (i = 0; i < ref->num_values  &&  i < FAKE_REPORT_LEN; ++i)
+            ref->values[i] = report[i];
+        return 0;
+    default:
+        errno = ENOTTY;
+        return -1;
+    }
+}
+
+static int ioctl_hidraw(struct fake_fd* f, unsigned long request, void* arg)
+{
+    struct hidraw_devinfo* info;
+
+    if (request != HIDIOCGRAWINFO)
+    {
+        errno = ENOTTY;
+        return -1;
+    }
+    info = arg;
+    memset(info, 0, sizeof(*info));
+    info->vendor = (__s16)f->node->vendor;
+    info->product = (__s16)f->node->product;
+    return 0;
+}
+
+/* Is the fake descriptor ready (the device never answers later) */
+static int is_ready(int fd, short events, short* revents)
+{
+    struct fake_fd* f;
+    short ready = 0;
+
+    f = lock_fd(fd);
+    if (!f)
+        return -1;
+    if (f->node->kind == FAKE_USBFS  &&  f->urbs_count > 0)
+        ready = POLLOUT;
+    else if (f->node->kind != FAKE_USBFS  &&  f->reports_count > 0)
+        ready = POLLIN;
+    unlock_fd();
+    *revents = ready & events;
+    return *revents != 0;
+}
+
+int __wrap_open(const char* path, int flags, ...)
+{
+    const struct fake_node* node;
+    mode_t mode = 0;
+    va_list ap;
+
+    count(SC_OPEN);
+    if (flags & (O_CREAT | O_TMPFILE))
+    {
+        va_start(ap, flags);
+        mode = va_arg(ap, mode_t);
+        va_end(ap);
+    }
+    node = find_node(path);
+    if (node)
+        return open_node(node, flags);
+    if (is_hidden(path))
+    {
+        errno = ENOENT;
+        return -1;
+    }
+    return __real_open(path, flags, mode);
+}
+
+int __wrap_openat(int dir_fd, const char* path, int flags, ...)
+{
+    const struct fake_node* node;
+    mode_t mode = 0;
+    va_list ap;
+
+    count(SC_OPEN);
+    if (flags & (O_CREAT | O_TMPFILE))
+    {
+        va_start(ap, flags);
+        mode = va_arg(ap, mode_t);
+        va_end(ap);
+    }
+    node = find_node(path);
+    if (node)
+        return open_node(node, flags);
+    if (is_hidden(path))
+    {
+        errno = ENOENT;
+        return -1;
+    }
+    return __real_openat(dir_fd, path, flags, mode);
+}
+
+int __wrap_close(int fd)
+{
+    struct fake_fd* f;
+
+    count(SC_CLOSE);
+    f = lock_fd(fd);
+    if (f)
+    {
+        fake_fds[fd] = NULL;
+        unlock_fd();
+        free(f);
+    }
+    return __real_close(fd);
+}
+
+ssize_t __wrap_read(int fd, void* buf, size_t count_)
+{
+    struct fake_fd* f;
+    ssize_t ret = -1;
+
+    count(SC_READ);
+    f = lock_fd(fd);
+    if (!f)
+        return __real_read(fd, buf, count_);
+    if (f->reports_count == 0)
+        errno = EAGAIN;
+    else if (f->node->kind == FAKE_HIDDEV  &&  count_ >= sizeof(struct hiddev_usage_ref))
+    {
+        /* the event of the report, the values are taken by HIDIOCGUSAGES */
+        memset(buf, 0, sizeof(struct hiddev_usage_ref));
+        ret = sizeof(struct hiddev_usage_ref);
+    }
+    else if (f->node->kind == FAKE_HIDRAW  &&  count_ >= FAKE_REPORT_LEN)
+    {
+        take_report(f, buf);
+        ret = FAKE_REPORT_LEN;
+    }
+    else
+        errno = EINVAL;
+    unlock_fd();
+    return ret;
+}
+
+ssize_t __wrap_pread(int fd, void* buf, size_t count_, off_t offset)
+{
+    unsigned char desc[18];
+    struct fake_fd* f;
+    size_t len;
+
+    count(SC_READ);
+    f = lock_fd(fd);
+    if (!f)
+        return __real_pread(fd, buf, count_, offset);
+    /* the device descriptor: VID/PID at offset 8 */
+    memset(desc, 0, sizeof(desc));
+    desc[0] = sizeof(desc);
+    desc[1] = 1;
+    desc[8] = (unsigned char)f->node->vendor;
+    desc[9] = (unsigned char)(f->node->vendor >> 8);
+    desc[10] = (unsigned char)f->node->product;
+    desc[11] = (unsigned char)(f->node->product >> 8);
+    unlock_fd();
+    if (offset < 0  ||  (size_t)offset >= sizeof(desc))
+        return 0;
+    len = sizeof(desc) - (size_t)offset;
+    if (len > count_)
+        len = count_;
+    memcpy(buf, desc + offset, len);
+    return (ssize_t)len;
+}
+
+ssize_t __wrap_write(int fd, const void* buf, size_t count_)
+{
+    struct fake_fd* f;
+    ssize_t ret = -1;
+
+    count(SC_WRITE);
+    f = lock_fd(fd);
+    if (!f)
+        return __real_write(fd, buf, count_);
+    /* hidraw: the report number, then the report */
+    if (f->node->kind == FAKE_HIDRAW  &&  count_ == 1 + FAKE_REPORT_LEN)
+    {
+        queue_report(f, (const unsigned char*)buf + 1);
+        ret = (ssize_t)count_;
+    }
+    else
+        errno = EINVAL;
+    unlock_fd();
+    return ret;
+}
+
+int __wrap_ioctl(int fd, unsigned long request, ...)
+{
+    struct fake_fd* f;
+    void* arg;
+    va_list ap;
+    int ret;
+
+    count(SC_IOCTL);
+    va_start(ap, request);
+    arg = va_arg(ap, void*);
+    va_end(ap);
+    f = lock_fd(fd);
+    if (!f)
+        return __real_ioctl(fd, request, arg);
+    switch (f->node->kind)
+    {
+    case FAKE_USBFS:
+        ret = ioctl_usbfs(f, request, arg);
+        break;
+    case FAKE_HIDDEV:
+        ret = ioctl_hiddev(f, request, arg);
+        break;
+    default:
+        ret = ioctl_hidraw(f, request, arg);
+        break;
+    }
+    unlock_fd();
+    return ret;
+}
+
+int __wrap_select(int nfds, fd_set* rfds, fd_set* wfds, fd_set* efds, struct timeval* tv)
+{
+    short revents;
+    int fd, ret = 0;
+
+    count(SC_SELECT);
+    for (fd = 0; fd < nfds; ++fd)
+        if (((rfds  &&  FD_ISSET(fd, rfds))  ||  (wfds  &&  FD_ISSET(fd, wfds)))
+            &&  is_ready(fd, 0, &revents) < 0
+            )
+            return __real_select(nfds, rfds, wfds, efds, tv);
+    /* fake descriptors only: no wait */
+    for (fd = 0; fd < nfds; ++fd)
+    {
+        if (rfds  &&  FD_ISSET(fd, rfds))
+        {
+            if (is_ready(fd, POLLIN, &revents) > 0)
+                ++ret;
+            else
+                FD_CLR(fd, rfds);
+        }
+        if (wfds  &&  FD_ISSET(fd, wfds))
+        {
+            if (is_ready(fd, POLLOUT, &revents) > 0)
+                ++ret;
+            else
+                FD_CLR(fd, wfds);
+        }
+    }
+    if (efds)
+        FD_ZERO(efds);
+    return ret;
+}
+
+int __wrap_poll(struct pollfd* fds, nfds_t nfds, int timeout)
+{
+    nfds_t i;
+    int ret = 0;
+
+    count(SC_POLL);
+    for (i = 0; i < nfds; ++i)
+        if (is_ready(fds[i].fd, fds[i].events, &fds[i].revents) < 0)
+            return __real_poll(fds, nfds, timeout);
+    /* fake descriptors only: no wait */
+    for (i = 0; i < nfds; ++i)
+        if (fds[i].revents)
+            ++ret;
+    return ret;
+}
+
+void* __wrap_mmap(void* addr, size_t len, int prot, int flags, int fd, off_t offset)
+{
+    struct fake_fd* f;
+
+    count(SC_MMAP);
+    f = lock_fd(fd);
+    if (!f)
+        return __real_mmap(addr, len, prot, flags, fd, offset);
+    unlock_fd();
+    /* the URB buffers of usbfs */
+    return __real_mmap(addr, len, prot, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+}
+
+int __wrap_munmap(void* addr, size_t len)
+{
+    count(SC_MMAP);
+    return __real_munmap(addr, len);
+}
+
+void* __wrap_mremap(void* addr, size_t old_len, size_t new_len, int flags, ...)
+{
+    void* new_addr = NULL;
+    va_list ap;
+
+    count(SC_MMAP);
+    if (flags & MREMAP_FIXED)
+    {
+        va_start(ap, flags);
+        new_addr = va_arg(ap, void*);
+        va_end(ap);
+    }
+    return __real_mremap(addr, old_len, new_len, flags, new_addr);
+}
+
+int __wrap_stat(const char* path, struct stat* buf)
+{
+    const struct fake_node* node;
+
+    count(SC_STAT);
+    node = find_node(path);
+    if (node)
+    {
+        fill_stat(node, buf);
+        return 0;
+    }
+    if (is_hidden(path))
+    {
+        errno = ENOENT;
+        return -1;
+    }
+    return __real_stat(path, buf);
+}
+
+int __wrap_fstat(int fd, struct stat* buf)
+{
+    struct fake_fd* f;
+
+    count(SC_STAT);
+    f = lock_fd(fd);
+    if (!f)
+        return __real_fstat(fd, buf);
+    fill_stat(f->node, buf);
+    unlock_fd();
+    return 0;
+}
+
+int __wrap_access(const char* path, int mode)
+{
+    count(SC_STAT);
+    if (find_node(path))
+        return 0;
+    if (is_hidden(path))
+    {
+        errno = ENOENT;
+        return -1;
+    }
+    return __real_access(path, mode);
+}
+
+int __wrap_faccessat(int dir_fd, const char* path, int mode, int flags)
+{
+    count(SC_STAT);
+    return __real_faccessat(dir_fd, path, mode, flags);
+}
+
+int __wrap_fcntl(int fd, int cmd, ...)
+{
+    void* arg;
+    va_list ap;
+
+    count(SC_FCNTL);
+    va_start(ap, cmd);
+    arg = va_arg(ap, void*);
+    va_end(ap);
+    return __real_fcntl(fd, cmd, arg);
+}
+
+mode_t __wrap_umask(mode_t mask)
+{
+    count(SC_UMASK);
+    return __real_umask(mask);
+}
+
+/* libc: openat and fstat */
+DIR* __wrap_opendir(const char* path)
+{
+    count(SC_OPEN);
+    count(SC_STAT);
+    return __real_opendir(path);
+}
+
+/* libc: fstat and fcntl(F_GETFL) */
+DIR* __wrap_fdopendir(int fd)
+{
+    count(SC_STAT);
+    count(SC_FCNTL);
+    return __real_fdopendir(fd);
+}
+
+struct dirent* __wrap_readdir(DIR* dir)
+{
+    count(SC_DIR);
+    return __real_readdir(dir);
+}
+
+int __wrap_closedir(DIR* dir)
+{
+    count(SC_CLOSE);
+    return __real_closedir(dir);
+}
+
+long __wrap_syscall(long number, ...)
+{
+    long a[6];
+    va_list ap;
+    int i;
+
+    count(number == SYS_futex ? SC_FUTEX : SC_OTHER);
+    va_start(ap, number);
+    for (i = 0; i < 6; ++i)
+        a[i] = va_arg(ap, long);
+    va_end(ap);
+    return __real_syscall(number, a[0], a[1], a[2], a[3], a[4], a[5]);
+}
+
+int __wrap_ftruncate(int fd, off_t length)
+{
+    count(SC_OTHER);
+    return __real_ftruncate(fd, length);
+}
+
+pid_t __wrap_getpid(void)
+{
+    count(SC_OTHER);
+    return __real_getpid();
+}
+
+int __wrap_kill(pid_t pid, int sig)
+{
+    count(SC_OTHER);
+    return __real_kill(pid, sig);
+}
+
+int __wrap_nanosleep(const struct timespec* req, struct timespec* rem)
+{
+    count(SC_OTHER);
+    return __real_nanosleep(req, rem);
+}
+
+int __wrap_unlink(const char* path)
+{
+    count(SC_OTHER);
+    return __real_unlink(path);
+}
+
+int __wrap_rename(const char* from, const char* to)
+{
+    count(SC_OTHER);
+    return __real_rename(from, to);
+}
+
+int __wrap_mkstemp(char* tmpl)
+{
+    count(SC_OPEN);
+    return __real_mkstemp(tmpl);
+}
+
+int __wrap_memfd_create(const char* name, unsigned int flags)
+{
+    count(SC_OPEN);
+    return __real_memfd_create(name, flags);
+}
+
+/* libc: a readlink per component, counted once */
+char* __wrap_realpath(const char* path, char* resolved)
+{
+    count(SC_OTHER);
+    return __real_realpath(path, resolved);
+}
+
+int __wrap_inotify_init1(int flags)
+{
+    count(SC_OPEN);
+    return __real_inotify_init1(flags);
+}
+
+int __wrap_inotify_add_watch(int fd, const char* path, uint32_t mask)
+{
+    count(SC_OTHER);
+    return __real_inotify_add_watch(fd, path, mask);
+}
+
+int __wrap_socket(int domain, int type, int protocol)
+{
+    count(SC_OPEN);
+    return __real_socket(domain, type, protocol);
+}
+
+int __wrap_connect(int fd, const struct sockaddr* addr, socklen_t len)
+{
+    count(SC_OTHER);
+    return __real_connect(fd, addr, len);
+}
+
+int __wrap_bind(int fd, const struct sockaddr* addr, socklen_t len)
+{
+    count(SC_OTHER);
+    return __real_bind(fd, addr, len);
+}
+
+ssize_t __wrap_sendmsg(int fd, const struct msghdr* msg, int flags)
+{
+    count(SC_WRITE);
+    return __real_sendmsg(fd, msg, flags);
+}
+
+ssize_t __wrap_recv(int fd, void* buf, size_t len, int flags)
+{
+    count(SC_READ);
+    return __real_recv(fd, buf, len, flags);
+}
+
+ssize_t __wrap_recvfrom(int fd, void* buf, size_t len, int flags,
+                        struct sockaddr* addr, socklen_t* addr_len)
+{
+    count(SC_READ);
+    return __real_recvfrom(fd, buf, len, flags, addr, addr_len);
+}
+
+/* The fake tree */
+
+static int make_dir(const char* rel)
+{
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s/%s", tree, rel);
+    if (mkdir(path, 0755) != 0  &&  errno != EEXIST)
+    {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
+
+static int make_file(const char* rel, const char* value)
+{
+    char path[PATH_MAX];
+    FILE* f;
+
+    snprintf(path, sizeof(path), "%s/%s", tree, rel);
+    f = fopen(path, "w");
+    if (!f  ||  fputs(value, f) == EOF  ||  fclose(f) != 0)
+    {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
+
+static int make_link(const char* target, const char* rel)
+{
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s/%s", tree, rel);
+    if (symlink(target, path) != 0)
+    {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
+
+/* A USB device of sysfs (devices/usb1/1-port) and its usbfs node */
+static int make_usb_device(unsigned int port, const char* vendor, const char* product,
+                           const char* serial)
+{
+    char rel[PATH_MAX], target[PATH_MAX], value[16];
+    int ret;
+
+    snprintf(rel, sizeof(rel), "sys/devices/usb1/1-%u", port);
+    ret = make_dir(rel);
+    snprintf(rel, sizeof(rel), "sys/devices/usb1/1-%u/idVendor", port);
+    ret |= make_file(rel, vendor);
+    snprintf(rel, sizeof(rel), "sys/devices/usb1/1-%u/idProduct", port);
+    ret |= make_file(rel, product);
+    snprintf(rel, sizeof(rel), "sys/devices/usb1/1-%u/busnum", port);
+    ret |= make_file(rel, "1\n");
+    snprintf(rel, sizeof(rel), "sys/devices/usb1/1-%u/devnum", port);
+    snprintf(value, sizeof(value), "%u\n", port);
+    ret |= make_file(rel, value);
+    snprintf(rel, sizeof(rel), "sys/devices/usb1/1-%u/serial", port);
+    ret |= make_file(rel, serial);
+    snprintf(rel, sizeof(rel), "sys/bus/usb/devices/1-%u", port);
+    snprintf(target, sizeof(target), "../../../devices/usb1/1-%u", port);
+    ret |= make_link(target, rel);
+    /* usbfs minor: (bus - 1) * 128 + devnum - 1 */
+    snprintf(rel, sizeof(rel), "sys/dev/char/189:%u", port - 1);
+    snprintf(target, sizeof(target), "../../devices/usb1/1-%u", port);
+    ret |= make_link(target, rel);
+    snprintf(rel, sizeof(rel), "usb/001/%03u", port);
+    ret |= make_file(rel, "");
+    return ret;
+}
+
+static void add_node(const char* path, enum fake_kind kind, unsigned int vendor,
+                     unsigned int product, unsigned int major, unsigned int minor)
+{
+    struct fake_node* node;
+
+    assert(nodes_count < sizeof(nodes) / sizeof(nodes[0]));
+    node = &nodes[nodes_count++];
+    snprintf(node->path, sizeof(node->path), "%s", path);
+    node->kind = kind;
+    node->vendor = vendor;
+    node->product = product;
+    node->major = major;
+    node->minor = minor;
+}
+
+/*
+ * usb/001/002: Guardant Sign (bulk), 001/003: another device,
+ * usb/hiddev0 of the USB device 1-4: Guardant Sign HID, with hidraw0.
+ */
+static int make_tree(void)
+{
+    static const char* const dirs[] =
+    {
+        "ipc", "usb", "usb/001", "sys", "sys/devices", "sys/devices/usb1", "sys/bus",
+        "sys/bus/usb", "sys/bus/usb/devices", "sys/class", "sys/class/usbmisc",
+        "sys/dev", "sys/dev/char"
+    };
+    static const char* const hid_dirs[] =
+    {
+        "sys/devices/usb1/1-4/1-4:1.0", "sys/devices/usb1/1-4/1-4:1.0/usbmisc",
+        "sys/devices/usb1/1-4/1-4:1.0/usbmisc/hiddev0",
+        "sys/devices/usb1/1-4/1-4:1.0/0003:0A89:000C.0001",
+        "sys/devices/usb1/1-4/1-4:1.0/0003:0A89:000C.0001/hidraw",
+        "sys/devices/usb1/1-4/1-4:1.0/0003:0A89:000C.0001/hidraw/hidraw0"
+    };
+    char path[PATH_MAX];
+    size_t i;
+    int ret = 0;
+
+    snprintf(tree, sizeof(tree), "/tmp/grdsyscalls.XXXXXX");
+    if (!mkdtemp(tree))
+    {
+        perror("mkdtemp");
+        return -1;
+    }
+    for (i = 0; i < sizeof(dirs) / sizeof(dirs[0]); ++i)
+        ret |= make_dir(dirs[i]);
+    ret |= make_usb_device(2, "0a89\n", "0008\n", "SIGN0001\n");
+    ret |= make_usb_device(3, "046d\n", "c52b\n", "\n");
+    ret |= make_usb_device(4, "0a89\n", "000c\n", "SIGN0002\n");
+    for (i = 0; i < sizeof(hid_dirs) / sizeof(hid_dirs[0]); ++i)
+        ret |= make_dir(hid_dirs[i]);
+    ret |= make_link("../../devices/usb1/1-4/1-4:1.0", "sys/bus/usb/devices/1-4:1.0");
+    ret |= make_file("sys/devices/usb1/1-4/1-4:1.0/usbmisc/hiddev0/dev", "180:96\n");
+    ret |= make_file("sys/devices/usb1/1-4/1-4:1.0/usbmisc/hiddev0/uevent",
+                     "MAJOR=180\nMINOR=96\nDEVNAME=usb/hiddev0\n");
+    ret |= make_link("../../../1-4:1.0", "sys/devices/usb1/1-4/1-4:1.0/usbmisc/hiddev0/device");
+    ret |= make_link("../../devices/usb1/1-4/1-4:1.0/usbmisc/hiddev0",
+                     "sys/class/usbmisc/hiddev0");
+    ret |= make_link("../../devices/usb1/1-4/1-4:1.0/usbmisc/hiddev0", "sys/dev/char/180:96");
+    if (ret != 0)
+        return -1;
+
+    snprintf(bulk_path, sizeof(bulk_path), "%s" FAKE_BULK_PATH, tree);
+    snprintf(other_path, sizeof(other_path), "%s" FAKE_OTHER_PATH, tree);
+    add_node(bulk_path, FAKE_USBFS, GRD_VENDOR, GRD_PRODID_S3S, 189, 1);
+    add_node(other_path, FAKE_USBFS, 0x046d, 0xc52b, 189, 2);
+    add_node(FAKE_HIDDEV_PATH, FAKE_HIDDEV, GRD_VENDOR, GRD_PRODID_S3S_HID, 180, 96);
+    add_node(FAKE_HIDRAW_PATH, FAKE_HIDRAW, GRD_VENDOR, GRD_PRODID_S3S_HID, 243, 0);
+
+    /* the defaults of everything else */
+    snprintf(path, sizeof(path), "%s/usb", tree);
+    setenv(USBFS_PATH_ENV, path, 1);
+    snprintf(path, sizeof(path), "%s/sys", tree);
+    setenv(SYSFS_PATH_ENV, path, 1);
+    snprintf(path, sizeof(path), "%s/ipc", tree);
+    setenv("GRD_IPC_NAME", path, 1);
+    setenv("GRD_BROKER", "0", 1);
+    for (i = 0; environ[i]; )
+        if (strncmp(environ[i], "GRD_", 4) == 0
+            &&  strncmp(environ[i], "GRD_IPC_NAME=", 13) != 0
+            &&  strncmp(environ[i], "GRD_BROKER=", 11) != 0
+            &&  strncmp(environ[i], "GRD_SYSFS_PATH=", 15) != 0
+            )
+        {
+            snprintf(path, sizeof(path), "%.*s", (int)strcspn(environ[i], "="), environ[i]);
+            unsetenv(path);
+        }
+        else
+            ++i;
+    return 0;
+}
+
+static int remove_entry(const char* path, const struct stat* st, int flag, struct FTW* ftw)
+{
+    (void)st;
+    (void)flag;
+    (void)ftw;
+    return remove(path);
+}
+
+/* The paths */
+
+static int __attribute__((ms_abi)) count_device(const char* path, void* param)
+{
+    (void)path;
+    ++*(int*)param;
+    return 1;
+}
+
+static int call_search(void)
+{
+    int found = 0;
+
+    return search_usb_devices(count_device, &found) == 2  &&  found == 2 ? 0 : -1;
+}
+
+static int probe(const char* path, unsigned int expected)
+{
+    unsigned int prod_id = 0;
+
+    return grd_probe_device(path, &prod_id) == 0  &&  prod_id == expected ? 0 : -1;
+}
+
+static int call_probe_bulk(void)
+{
+    return probe(bulk_path, GRD_PRODID_S3S);
+}
+
+static int call_probe_hid(void)
+{
+    return probe(FAKE_HIDDEV_PATH, GRD_PRODID_S3S_HID);
+}
+
+static int call_probe_other(void)
+{
+    unsigned int prod_id;
+
+    return grd_probe_device(other_path, &prod_id) != 0  &&  errno == EINVAL ? 0 : -1;
+}
+
+/* Every pack read is the pack written before it, inverted */
+static int exchange(const char* path, unsigned int prod_id, size_t packs)
+{
+    unsigned char out[FAKE_PACK_SIZE * FAKE_MULTI_PACKS];
+    unsigned char in[FAKE_PACK_SIZE * FAKE_MULTI_PACKS];
+    size_t i, len;
+
+    assert(packs <= FAKE_MULTI_PACKS);
+    len = packs * FAKE_PACK_SIZE;
+    for (i = 0; i < len; ++i)
+        out[i] = (unsigned char)(i * 7 + 1);
+    memset(in, 0, len);
+    if (grd_ioctl_device(path, prod_id, FAKE_PACK_SIZE, in, len, out, len) != 0)
+        return -1;
+    for (i = 0; i < len; ++i)
+        if (in[i] != (unsigned char)~out[i])
+            return -1;
+    return 0;
+}
+
+static int call_ioctl_bulk(void)
+{
+    return exchange(bulk_path, GRD_PRODID_S3S, 1);
+}
+
+static int call_ioctl_bulk_multi(void)
+{
+    return exchange(bulk_path, GRD_PRODID_S3S, FAKE_MULTI_PACKS);
+}
+
+static int call_ioctl_hid(void)
+{
+    return exchange(FAKE_HIDDEV_PATH, GRD_PRODID_S3S_HID, 1);
+}
+
+static int call_ioctl_hid_multi(void)
+{
+    return exchange(FAKE_HIDDEV_PATH, GRD_PRODID_S3S_HID, FAKE_MULTI_PACKS);
+}
+
+/* In the order of a program: search, probe, exchanges */
+static const struct sc_path paths[] =
+{
+    { "search",             -1,             call_search },
+    { "probe_bulk",         -1,             call_probe_bulk },
+    { "probe_hid",          -1,             call_probe_hid },
+    { "probe_other",        -1,             call_probe_other },
+    { "ioctl_bulk",         -1,             call_ioctl_bulk },
+    { "ioctl_bulk_multi",   -1,             call_ioctl_bulk_multi },
+    { "ioctl_hidraw",       SC_PROC_HIDRAW, call_ioctl_hid },
+    { "ioctl_hidraw_multi", SC_PROC_HIDRAW, call_ioctl_hid_multi },
+    { "ioctl_hiddev",       SC_PROC_HIDDEV, call_ioctl_hid },
+    { "ioctl_hiddev_multi", SC_PROC_HIDDEV, call_ioctl_hid_multi },
+    { "ioctl_bulk_broker",  SC_PROC_BROKER, call_ioctl_bulk }
+};
+
+#define PATHS_COUNT             (sizeof(paths) / sizeof(paths[0]))
+#define PASSES                  2    /* first, next */
+
+static const char* const pass_names[PASSES] = { "first", "next" };
+
+/* Run the paths of the process (enum sc_process) */
+static int run_paths(int process, struct path_result* results)
+{
+    unsigned int calls[SC_COUNT];
+    struct path_result* r;
+    size_t i, n, c;
+    int failed;
+
+    if (process == SC_PROC_HIDDEV)
+        setenv("GRD_HIDRAW", "0", 1);
+    else if (process == SC_PROC_BROKER)
+        unsetenv("GRD_BROKER"); /* the socket is not in GRD_IPC_NAME */
+    for (i = 0; i < PATHS_COUNT; ++i)
+    {
+        if (paths[i].process >= 0  ?  paths[i].process != process
+                                   :  process == SC_PROC_BROKER)
+            continue;
+        /* the paths of both HID processes are reported by the hidraw one */
+        r = (paths[i].process >= 0  ||  process == SC_PROC_HIDRAW) ? &results[i * PASSES] : NULL;
+        for (n = 0; n <= NEXT_CALLS; ++n)
+        {
+            memset(calls, 0, sizeof(calls));
+            counters = calls;
+            failed = paths[i].call() != 0;
+            counters = NULL;
+            if (!r)
+                continue;
+            r[n ? 1 : 0].ran = 1;
+            r[n ? 1 : 0].failed |= failed;
+            for (c = 0; c < SC_COUNT; ++c)
+                if (calls[c] > r[n ? 1 : 0].counts[c])
+                    r[n ? 1 : 0].counts[c] = calls[c];
+        }
+    }
+    return 0;
+}
+
+/* Parse "class=n ..." into counts, return -1 if it is not valid */
+static int parse_budget(const char* s, unsigned int* counts)
+{
+    char name[16];
+    unsigned int value;
+    size_t c;
+    int n;
+
+    memset(counts, 0, SC_COUNT * sizeof(counts[0]));
+    while (*s)
+    {
+        if (*s == ' ')
+        {
+            ++s;
+            continue;
+        }
+        if (sscanf(s, "%15[a-z]=%u%n", name, &value, &n) != 2)
+            return -1;
+        for (c = 0; c < SC_COUNT  &&  strcmp(class_names[c], name) != 0; ++c)
+            ;
+        if (c == SC_COUNT)
+            return -1;
+        counts[c] = value;
+        s += n;
+    }
+    return 0;
+}
+
+static const struct budget* find_budget(const char* path, const char* pass)
+{
+    const struct budget* b;
+
+    for (b = budgets; b->path; ++b)
+        if (strcmp(b->path, path) == 0  &&  strcmp(b->pass, pass) == 0)
+            return b;
+    return NULL;
+}
+
+/* Print the results against the budgets, return the count of failures */
+static int check_results(const struct path_result* results, int record)
+{
+    const struct path_result* r;
+    const struct budget* b;
+    unsigned int limit[SC_COUNT];
+    char note[256];
+    size_t i, p, c, len;
+    unsigned int total;
+    int failures = 0, over;
+
+    printf("%-20s %-5s", "path", "pass");
+    for (c = 0; c < SC_COUNT; ++c)
+        printf(" %5s", class_names[c]);
+    printf(" %5s  budget\n", "total");
+    for (i = 0; i < PATHS_COUNT; ++i)
+        for (p = 0; p < PASSES; ++p)
+        {
+            r = &results[i * PASSES + p];
+            if (!r->ran)
+                continue;
+            total = 0;
+            printf("%-20s %-5s", paths[i].name, pass_names[p]);
+            for (c = 0; c < SC_COUNT; ++c)
+            {
+                printf(" %5u", r->counts[c]);
+                total += r->counts[c];
+            }
+            printf(" %5u  ", total);
+
+            b = find_budget(paths[i].name, pass_names[p]);
+            if (r->failed)
+            {
+                printf("FAILED (the call did not work)\n");
+                ++failures;
+            }
+            else if (!b  ||  parse_budget(b->counts, limit) != 0)
+            {
+                printf("%s\n", b ? "BAD BUDGET" : "no budget");
+                ++failures;
+            }
+            else
+            {
+                over = 0;
+                len = 0;
+                note[0] = '\0';
+                for (c = 0; c < SC_COUNT; ++c)
+                    if (r->counts[c] > limit[c]  &&  len < sizeof(note))
+                    {
+                        len += (size_t)snprintf(note + len, sizeof(note) - len, " %s %u > %u",
+                                                class_names[c], r->counts[c], limit[c]);
+                        over = 1;
+                    }
+                if (over)
+                {
+                    printf("OVER:%s\n", note);
+                    ++failures;
+                }
+                else if (memcmp(r->counts, limit, sizeof(limit)) != 0)
+                    printf("ok (under: record it)\n");
+                else
+                    printf("ok\n");
+            }
+        }
+
+    if (!record)
+        return failures;
+    printf("\n");
+    for (i = 0; i < PATHS_COUNT; ++i)
+        for (p = 0; p < PASSES; ++p)
+        {
+            r = &results[i * PASSES + p];
+            if (!r->ran)
+                continue;
+            snprintf(note, sizeof(note), "\"%s\",", paths[i].name);
+            printf("    { %-21s \"%s\",%s \"", note, pass_names[p], p ? " " : "");
+            for (c = 0, len = 0; c < SC_COUNT; ++c)
+                if (r->counts[c])
+                    printf("%s%s=%u", len++ ? " " : "", class_names[c], r->counts[c]);
+            printf("\" },\n");
+        }
+    return failures;
+}
+
+int main(int argc, char* argv[])
+{
+    struct path_result* results;
+    pid_t pid;
+    int opt, process, status, record = 0, keep = 0, ret = 0;
+
+    while ((opt = getopt(argc, argv, "rk")) != -1)
+    {
+        switch (opt)
+        {
+        case 'r': record = 1; break;
+        case 'k': keep = 1; break;
+        default:
+            fprintf(stderr, "usage: grdsyscalls [-r] [-k]\n");
+            return 2;
+        }
+    }
+    results = mmap(NULL, PATHS_COUNT * PASSES * sizeof(*results), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (results == MAP_FAILED)
+    {
+        perror("mmap");
+        return 2;
+    }
+    memset(results, 0, PATHS_COUNT * PASSES * sizeof(*results));
+    if (make_tree() != 0)
+        ret = 2;
+
+    for (process = 0; process < SC_PROC_COUNT  &&  ret == 0; ++process)
+    {
+        fflush(stdout);
+        pid = fork();
+        if (pid < 0)
+        {
+            perror("fork");
+            ret = 2;
+            break;
+        }
+        if (pid == 0)
+            _exit(run_paths(process, results));
+        if (waitpid(pid, &status, 0) != pid  ||  !WIFEXITED(status)  ||  WEXITSTATUS(status))
+        {
+            fprintf(stderr, "grdsyscalls: the %s process failed\n", process_names[process]);
+            ret = 1;
+        }
+    }
+    if (ret != 2  &&  check_results(results, record) > 0)
+        ret = 1;
+
+    if (tree[0]  &&  keep)
+        printf("fake tree: %s\n", tree);
+    else if (tree[0])
+        nftw(tree, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    return ret;
+}
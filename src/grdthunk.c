@@ -0,0 +1,115 @@
+/*
+ * Cost of a call into grdwine.dll from a Windows program
+ *
+ * Copyright (C) 2008 Aktiv Co. (Aleksey Samsonov)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/*
+ * wine grdthunk.exe [calls] [device]
+ *
+ * Times GrdWine_GetVersion (no Unix side) and GrdWine_DeviceProbe and
+ * GrdWine_DeviceIoctl of the device (default "emul:0", run with GRD_EMUL
+ * and GRD_BROKER=0). The difference is the cost of the PE to Unix call:
+ * compare a --enable-unixlib build with a winelib one.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "windef.h"
+#include "winbase.h"
+
+#define THUNK_CALLS             100000
+#define THUNK_PACK_SIZE         64
+
+typedef DWORD (WINAPI * GetVersion_Func)(void);
+typedef BOOL (WINAPI * DeviceProbe_Func)(LPCSTR lpDevName, LPDWORD pProdId);
+typedef BOOL (WINAPI * DeviceIoctl_Func)(LPCSTR lpDevName, DWORD ProdId, DWORD dwPackSize,
+                                         LPVOID lpIn, DWORD nInSize, LPVOID lpOut, DWORD nOutSize);
+
+static double elapsed_ns(const LARGE_INTEGER* start, const LARGE_INTEGER* freq, int calls)
+{
+    LARGE_INTEGER now;
+
+    QueryPerformanceCounter(&now);
+    return (double)(now.QuadPart - start->QuadPart) * 1e9 / (double)freq->QuadPart / calls;
+}
+
+int main(int argc, char** argv)
+{
+    unsigned char in[THUNK_PACK_SIZE], out[THUNK_PACK_SIZE];
+    const char* dev_path = "emul:0";
+    GetVersion_Func get_version;
+    DeviceProbe_Func probe;
+    DeviceIoctl_Func ioctl;
+    LARGE_INTEGER freq, start;
+    HMODULE module;
+    DWORD prod_id = 0;
+    int calls = THUNK_CALLS;
+    int i, failed;
+
+    if (argc > 1)
+        calls = atoi(argv[1]);
+    if (argc > 2)
+        dev_path = argv[2];
+    if (calls <= 0)
+    {
+        fprintf(stderr, "usage: grdthunk [calls] [device]\n");
+        return 2;
+    }
+    module = LoadLibraryA("grdwine.dll");
+    if (!module)
+    {
+        fprintf(stderr, "grdwine.dll not loaded (error %lu)\n", (unsigned long)GetLastError());
+        return 1;
+    }
+    get_version = (GetVersion_Func)GetProcAddress(module, "GrdWine_GetVersion");
+    probe = (DeviceProbe_Func)GetProcAddress(module, "GrdWine_DeviceProbe");
+    ioctl = (DeviceIoctl_Func)GetProcAddress(module, "GrdWine_DeviceIoctl");
+    if (!get_version  ||  !probe  ||  !ioctl)
+    {
+        fprintf(stderr, "no GrdWine_* exports\n");
+        return 1;
+    }
+    QueryPerformanceFrequency(&freq);
+
+    QueryPerformanceCounter(&start);
+    for (i = 0; i < calls; ++i)
+        get_version();
+    printf("version %-8s %10.1f ns/call\n", "", elapsed_ns(&start, &freq, calls));
+
+    failed = 0;
+    QueryPerformanceCounter(&start);
+    for (i = 0; i < calls; ++i)
+        if (!probe(dev_path, &prod_id))
+            ++failed;
+    printf("probe   %-8s %10.1f ns/call (%d failed)\n", dev_path,
+           elapsed_ns(&start, &freq, calls), failed);
+
+    memset(out, 0, sizeof(out));
+    failed = 0;
+    QueryPerformanceCounter(&start);
+    for (i = 0; i < calls; ++i)
+        if (!ioctl(dev_path, prod_id, sizeof(out), in, sizeof(in), out, sizeof(out)))
+            ++failed;
+    printf("ioctl   %-8s %10.1f ns/call (%d failed)\n", dev_path,
+           elapsed_ns(&start, &freq, calls), failed);
+
+    FreeLibrary(module);
+    return 0;
+}
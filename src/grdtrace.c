@@ -0,0 +1,328 @@
+/*
+ * Decoder of the GrdWine trace dumps
+ *
+ * Copyright (C) 2008 Aktiv Co. (Aleksey Samsonov)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/*
+ * grdtrace [-d] [-w ms] [file...]
+ * Prints the events of the dumps merged in time order, one per line.
+ * -d: make the tracing processes dump their rings (touch the control file),
+ * wait -w ms (500 by default) and print the new dumps.
+ * The control file and the dumps are in the GRD_IPC_NAME directory, else in
+ * XDG_RUNTIME_DIR (see grd_private_ipc_path).
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h> /* for PATH_MAX */
+#include <stdio.h>
+#include <time.h>
+#include "grdlock.h"
+#include "grdtrace.h"
+
+static const char* const type_names[GRD_TRACE_TYPE_COUNT] =
+{
+    "?", "ioctl", "lock_wait", "lock", "unlock", "open", "claim", "write", "read",
+    "idle", "error"
+};
+
+/* A dump read in memory */
+struct trace_dump
+{
+    struct grd_trace_file_header header;
+    char (*devices)[GRD_TRACE_PATH_LEN];
+};
+
+/* An event of a dump */
+struct trace_line
+{
+    struct grd_trace_event event;
+    const struct trace_dump* dump;
+    uint32_t tid;
+};
+
+static struct trace_line* lines;
+static size_t lines_count, lines_size;
+
+static int add_line(const struct grd_trace_event* e, const struct trace_dump* dump, uint32_t tid)
+{
+    struct trace_line* p;
+
+    if (lines_count == lines_size)
+    {
+        p = realloc(lines, (lines_size ? lines_size * 2 : 4096) * sizeof(*lines));
+        if (!p)
+            return -1;
+        lines = p;
+        lines_size = lines_size ? lines_size * 2 : 4096;
+    }
+    lines[lines_count].event = *e;
+    lines[lines_count].dump = dump;
+    lines[lines_count].tid = tid;
+    ++lines_count;
+    return 0;
+}
+
+static int read_dump(const char* path)
+{
+    struct grd_trace_file_thread thread;
+    struct grd_trace_event e;
+    struct trace_dump* dump;
+    uint64_t lost = 0;
+    size_t events = 0;
+    uint32_t t, i;
+    FILE* f;
+    int ret = -1;
+
+    f = fopen(path, "rb");
+    if (!f)
+    {
+        perror(path);
+        return -1;
+    }
+    dump = calloc(1, sizeof(*dump));
+    if (!dump
+        ||  fread(&dump->header, sizeof(dump->header), 1, f) != 1
+        ||  dump->header.magic != GRD_TRACE_MAGIC
+        ||  dump->header.version != GRD_TRACE_VERSION
+        ||  dump->header.event_size != sizeof(e)
+        ||  dump->header.devices_count >= GRD_TRACE_DEVICES
+        )
+    {
+        fprintf(stderr, "%s: not a trace dump\n", path);
+        goto out;
+    }
+    dump->devices = calloc(dump->header.devices_count + 1, sizeof(dump->devices[0]));
+    if (!dump->devices
+        ||  fread(dump->devices[1], sizeof(dump->devices[0]), dump->header.devices_count, f)
+            != dump->header.devices_count
+        )
+        goto truncated;
+    for (i = 1; i <= dump->header.devices_count; ++i)
+        dump->devices[i][GRD_TRACE_PATH_LEN - 1] = '\0';
+    strcpy(dump->devices[0], "-");
+
+    for (t = 0; t < dump->header.threads_count; ++t)
+    {
+        if (fread(&thread, sizeof(thread), 1, f) != 1)
+            goto truncated;
+        lost += thread.lost;
+        for (i = 0; i < thread.count; ++i)
+        {
+            if (fread(&e, sizeof(e), 1, f) != 1)
+                goto truncated;
+            if (e.dev > dump->header.devices_count)
+                e.dev = 0;
+            if (add_line(&e, dump, thread.tid) != 0)
+                goto out;
+            ++events;
+        }
+    }
+    printf("%s: pid %u, %u threads, %zu events, %llu overwritten\n", path,
+           dump->header.pid, dump->header.threads_count, events, (unsigned long long)lost);
+    ret = 0;
+    dump = NULL; /* used by the lines */
+    goto out;
+
+truncated:
+    fprintf(stderr, "%s: truncated\n", path);
+out:
+    if (dump)
+        free(dump->devices);
+    free(dump);
+    fclose(f);
+    return ret;
+}
+
+static int compare_lines(const void* a, const void* b)
+{
+    const struct trace_line* x = a;
+    const struct trace_line* y = b;
+
+    if (x->event.time_ns != y->event.time_ns)
+        return x->event.time_ns < y->event.time_ns ? -1 : 1;
+    return 0;
+}
+
+static void print_line(const struct trace_line* l)
+{
+    const struct grd_trace_event* e = &l->event;
+    const struct grd_trace_file_header* h = &l->dump->header;
+    char when[32], value[32], duration[32];
+    struct tm tm;
+    uint64_t ns;
+    time_t sec;
+
+    /* the wall time from the clocks at the dump */
+    ns = h->realtime_ns - (h->monotonic_ns - e->time_ns);
+    sec = (time_t)(ns / 1000000000u);
+    localtime_r(&sec, &tm);
+    strftime(when, sizeof(when), "%H:%M:%S", &tm);
+
+    value[0] = '\0';
+    switch (e->type)
+    {
+    case GRD_TRACE_IOCTL:
+    case GRD_TRACE_WRITE:
+    case GRD_TRACE_READ:
+        snprintf(value, sizeof(value), "%u B", e->value);
+        break;
+    case GRD_TRACE_LOCK_WAIT:
+        if (e->value)
+            snprintf(value, sizeof(value), "holder %u", e->value);
+        break;
+    case GRD_TRACE_LOCK:
+        if (e->value)
+            snprintf(value, sizeof(value), "passed");
+        break;
+    default:
+        break;
+    }
+    duration[0] = '\0';
+    if (e->duration_ns)
+        snprintf(duration, sizeof(duration), "%.1f us", (double)e->duration_ns / 1000.0);
+
+    printf("%s.%06u %6u/%-6u %-9s %-24s %-12s %12s%s%s\n", when,
+           (unsigned int)(ns % 1000000000u / 1000), h->pid, l->tid,
+           e->type < GRD_TRACE_TYPE_COUNT ? type_names[e->type] : "?",
+           l->dump->devices[e->dev], value, duration,
+           e->err ? "  " : "", e->err ? strerror(e->err) : "");
+}
+
+/* Make the processes dump, return the time of the request */
+static int request_dump(struct timespec* requested)
+{
+    char path[PATH_MAX];
+    int fd;
+
+    if (grd_private_ipc_path(GRD_TRACE_CONTROL_NAME, path, sizeof(path)) != 0)
+    {
+        perror(GRD_TRACE_CONTROL_NAME);
+        return -1;
+    }
+    /* the clock of the file times */
+    clock_gettime(CLOCK_REALTIME_COARSE, requested);
+    fd = open(path, O_WRONLY | O_CREAT | O_NOFOLLOW | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (fd < 0)
+    {
+        perror(path);
+        return -1;
+    }
+    /* the watchers wake up on the close after a write open */
+    close(fd);
+    return 0;
+}
+
+/* Read the dumps written after the request */
+static int read_new_dumps(const struct timespec* requested)
+{
+    const size_t prefix = strlen(GRD_TRACE_FILE_PREFIX);
+    const size_t suffix = strlen(GRD_TRACE_FILE_SUFFIX);
+    char dir[PATH_MAX], path[PATH_MAX];
+    struct dirent* d;
+    struct stat st;
+    size_t len;
+    DIR* dp;
+    int count = 0;
+
+    if (grd_private_ipc_path("", dir, sizeof(dir)) != 0)
+        return -1;
+    dp = opendir(dir);
+    if (!dp)
+    {
+        perror(dir);
+        return -1;
+    }
+    while ((d = readdir(dp)) != NULL)
+    {
+        len = strlen(d->d_name);
+        if (len <= prefix + suffix
+            ||  strncmp(d->d_name, GRD_TRACE_FILE_PREFIX, prefix) != 0
+            ||  strcmp(d->d_name + len - suffix, GRD_TRACE_FILE_SUFFIX) != 0
+            ||  (size_t)snprintf(path, sizeof(path), "%s%s", dir, d->d_name) >= sizeof(path)
+            ||  stat(path, &st) != 0
+            )
+            continue;
+        if (st.st_mtim.tv_sec < requested->tv_sec
+            ||  (st.st_mtim.tv_sec == requested->tv_sec
+                 &&  st.st_mtim.tv_nsec < requested->tv_nsec)
+            )
+            continue; /* an old dump */
+        if (read_dump(path) == 0)
+            ++count;
+    }
+    closedir(dp);
+    return count;
+}
+
+int main(int argc, char* argv[])
+{
+    struct timespec requested;
+    unsigned int wait_ms = 500;
+    size_t i;
+    int opt, dump = 0, count = 0;
+
+    while ((opt = getopt(argc, argv, "dw:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'd': dump = 1; break;
+        case 'w': wait_ms = (unsigned int)atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: grdtrace [-d] [-w ms] [file...]\n");
+            return 2;
+        }
+    }
+    if (!dump  &&  optind == argc)
+    {
+        fprintf(stderr, "usage: grdtrace [-d] [-w ms] [file...]\n");
+        return 2;
+    }
+    if (dump)
+    {
+        if (request_dump(&requested) != 0)
+            return 1;
+        usleep(wait_ms * 1000);
+        count = read_new_dumps(&requested);
+        if (count < 0)
+            return 1;
+    }
+    for (; optind < argc; ++optind)
+        if (read_dump(argv[optind]) == 0)
+            ++count;
+    if (count == 0)
+    {
+        fprintf(stderr, "grdtrace: no dumps\n");
+        return 1;
+    }
+
+    qsort(lines, lines_count, sizeof(lines[0]), compare_lines);
+    for (i = 0; i < lines_count; ++i)
+        print_line(&lines[i]);
+    return 0;
+}
@@ -0,0 +1,159 @@
+/*
+ * Copyright (C) 2008 Aktiv Co. (Aleksey Samsonov)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#ifndef GRDTRACE__H__
+#define GRDTRACE__H__
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+#include <stdint.h>
+#include "grdstats.h"
+
+/*
+ * Binary trace: every thread records its events in its own ring of the
+ * last GRD_TRACE_EVENTS events, without locks. Touching the control file
+ * grdwine-trace.ctl makes every tracing process dump its rings to
+ * grdwine-trace.<pid>.bin (see grdtrace -d); both are in the private IPC
+ * directory of the user (see grd_private_ipc_path).
+ * GRD_TRACE="0" disables the trace.
+ */
+
+#define GRD_TRACE_ENV           "GRD_TRACE"
+#define GRD_TRACE_CONTROL_NAME  "grdwine-trace.ctl"
+#define GRD_TRACE_FILE_PREFIX   "grdwine-trace."
+#define GRD_TRACE_FILE_SUFFIX   ".bin"
+#define GRD_TRACE_MAGIC         0x52544447 /* "GDTR" */
+#define GRD_TRACE_VERSION       1
+#define GRD_TRACE_EVENTS        4096 /* per thread, a power of two */
+#define GRD_TRACE_DEVICES       64   /* device 0 is none */
+#define GRD_TRACE_PATH_LEN      128
+
+/* Events */
+enum grd_trace_type
+{
+    GRD_TRACE_IOCTL = 1,        /* a call ended: value is the bytes of in and out */
+    GRD_TRACE_LOCK_WAIT,        /* the lock is requested: value is the holder pid */
+    GRD_TRACE_LOCK,             /* the lock is acquired: value 1 if passed by a thread */
+    GRD_TRACE_UNLOCK,           /* the lock is released */
+    GRD_TRACE_OPEN,             /* the device is opened */
+    GRD_TRACE_CLAIM,            /* the device is claimed */
+    GRD_TRACE_WRITE,            /* a pack is written: value is its size */
+    GRD_TRACE_READ,             /* a pack is read: value is its size */
+    GRD_TRACE_IDLE,             /* an idle HID report is written */
+    GRD_TRACE_ERROR,            /* an exchange failed */
+    GRD_TRACE_TYPE_COUNT
+};
+
+struct grd_trace_event
+{
+    uint64_t time_ns;           /* CLOCK_MONOTONIC at the end of the event */
+    uint32_t duration_ns;       /* saturated (4.3 s) */
+    uint32_t value;
+    uint16_t type;              /* GRD_TRACE_* */
+    uint16_t dev;               /* see grd_trace_device, zero: none */
+    int32_t err;                /* errno, zero: success */
+};
+
+/* Ring of a thread: the writer is the thread, the readers dump it */
+struct grd_trace_ring
+{
+    struct grd_trace_ring* next;
+    volatile uint64_t head;     /* events written: the next index */
+    uint32_t tid;
+    int used;                   /* owned by a running thread */
+    struct grd_trace_event events[GRD_TRACE_EVENTS];
+};
+
+/*
+ * Dump file: the header, the paths of the devices (GRD_TRACE_PATH_LEN
+ * bytes each, device 1 first), then for every thread its header and its
+ * events, the oldest first.
+ */
+struct grd_trace_file_header
+{
+    uint32_t magic;             /* GRD_TRACE_MAGIC */
+    uint32_t version;           /* GRD_TRACE_VERSION */
+    uint32_t pid;
+    uint32_t devices_count;
+    uint32_t threads_count;
+    uint32_t event_size;        /* sizeof(struct grd_trace_event) */
+    uint64_t realtime_ns;       /* CLOCK_REALTIME at the dump */
+    uint64_t monotonic_ns;      /* CLOCK_MONOTONIC at the dump */
+} __attribute__((aligned(8)));
+
+struct grd_trace_file_thread
+{
+    uint32_t tid;
+    uint32_t count;             /* events which follow */
+    uint64_t lost;              /* older events overwritten */
+} __attribute__((aligned(8)));
+
+extern int grd_trace_enabled;
+extern __thread struct grd_trace_ring* grd_trace_ring;
+
+/*
+ * Return the ring of this thread (create it), or NULL if the trace is
+ * disabled.
+ */
+struct grd_trace_ring* grd_trace_thread(void);
+
+/*
+ * Return the number of the device in the dump (zero if the table is full).
+ */
+unsigned int grd_trace_device(const char* dev_path);
+
+/*
+ * Write the rings of all threads to the file descriptor.
+ * Return zero on success.
+ */
+int grd_trace_dump(int fd);
+
+/* Start of an event: zero if the trace is disabled */
+static inline uint64_t grd_trace_begin(void)
+{
+    return grd_trace_enabled ? grd_stats_now() : 0;
+}
+
+/* Record an event (start from grd_trace_begin, zero: no duration) */
+static inline void grd_trace(enum grd_trace_type type, unsigned int dev, uint32_t value,
+                             uint64_t start, int err)
+{
+    struct grd_trace_ring* r = grd_trace_ring;
+    struct grd_trace_event* e;
+    uint64_t now, head;
+
+    if (!r)
+    {
+        if (!grd_trace_enabled  ||  (r = grd_trace_thread()) == NULL)
+            return;
+    }
+    now = grd_stats_now();
+    head = r->head;
+    e = &r->events[head & (GRD_TRACE_EVENTS - 1)];
+    e->time_ns = now;
+    e->duration_ns = !start ? 0 : now - start > UINT32_MAX ? UINT32_MAX : (uint32_t)(now - start);
+    e->value = value;
+    e->type = (uint16_t)type;
+    e->dev = (uint16_t)dev;
+    e->err = err;
+    /* the event is complete before a reader sees it */
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+#endif /* !GRDTRACE__H__ */
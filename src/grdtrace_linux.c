@@ -0,0 +1,303 @@
+/*
+ * Binary trace of the calls and the packs
+ *
+ * Copyright (C) 2008 Aktiv Co. (Aleksey Samsonov)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/*
+ * A ring is taken by a thread on its first event and given up when the
+ * thread exits (the events stay until another thread takes the ring). The
+ * dump copies a ring while its thread writes: the events which may have
+ * been overwritten meanwhile are dropped. The control file is watched with
+ * inotify by a thread of every tracing process (the signals belong to
+ * Wine in its processes).
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h> /* for PATH_MAX, NAME_MAX */
+#include <stdio.h>  /* for snprintf, rename */
+#include <time.h>
+#include <pthread.h>
+#include "grdlock.h"
+#include "grdtrace.h"
+
+int grd_trace_enabled = 1; /* until the environment says otherwise */
+__thread struct grd_trace_ring* grd_trace_ring;
+
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key;
+static struct grd_trace_ring* rings;
+static char devices[GRD_TRACE_DEVICES][GRD_TRACE_PATH_LEN]; /* rings_mutex */
+static unsigned int devices_count = 1;
+static pid_t watcher_pid;           /* the process of the watcher thread */
+
+static void ring_release(void* p)
+{
+    struct grd_trace_ring* r = p;
+
+    pthread_mutex_lock(&rings_mutex);
+    r->used = 0;
+    pthread_mutex_unlock(&rings_mutex);
+}
+
+static void trace_atfork_child(void)
+{
+    pthread_mutex_init(&rings_mutex, NULL);
+}
+
+static void trace_init(void)
+{
+    const char* env;
+
+    env = getenv(GRD_TRACE_ENV);
+    if ((env  &&  strcmp(env, "0") == 0)  ||  pthread_key_create(&ring_key, ring_release) != 0)
+    {
+        grd_trace_enabled = 0;
+        return;
+    }
+    pthread_atfork(NULL, NULL, trace_atfork_child);
+}
+
+/* Dump to grdwine-trace.<pid>.bin of the private IPC directory
+   (written to a new unique file, renamed when complete) */
+static void dump_to_file(void)
+{
+    char name[64], path[PATH_MAX], tmp[PATH_MAX];
+    int fd, ret;
+
+    snprintf(name, sizeof(name), GRD_TRACE_FILE_PREFIX "%d" GRD_TRACE_FILE_SUFFIX, (int)getpid());
+    if (grd_private_ipc_path(name, path, sizeof(path)) != 0)
+        return;
+    ret = snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+    if (ret < 0  ||  (size_t)ret >= sizeof(tmp))
+        return;
+    /* mode 0600 */
+    fd = mkostemp(tmp, O_CLOEXEC);
+    if (fd < 0)
+        return;
+    ret = grd_trace_dump(fd);
+    if (close(fd) != 0  ||  ret != 0  ||  rename(tmp, path) != 0)
+        unlink(tmp);
+}
+
+static void* run_watcher(void* arg)
+{
+    char buf[sizeof(struct inotify_event) + NAME_MAX + 1]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    const int fd = (int)(intptr_t)arg;
+    ssize_t n;
+
+    for (;;)
+    {
+        /* the events read at once are one request */
+        n = read(fd, buf, sizeof(buf));
+        if (n < 0  &&  errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        dump_to_file();
+    }
+    close(fd);
+    return NULL;
+}
+
+/* Watch the control file (rings_mutex is locked) */
+static void start_watcher(void)
+{
+    char path[PATH_MAX];
+    pthread_attr_t attr;
+    pthread_t thread;
+    int fd;
+
+    watcher_pid = getpid();
+    if (grd_private_ipc_path(GRD_TRACE_CONTROL_NAME, path, sizeof(path)) != 0)
+        return;
+    fd = open(path, O_RDONLY | O_CREAT | O_NOFOLLOW | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (fd >= 0)
+        close(fd);
+    fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0)
+        return;
+    if (inotify_add_watch(fd, path, IN_ATTRIB | IN_CLOSE_WRITE) < 0
+        ||  pthread_attr_init(&attr) != 0
+        )
+    {
+        close(fd);
+        return;
+    }
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, run_watcher, (void*)(intptr_t)fd) != 0)
+        close(fd);
+    pthread_attr_destroy(&attr);
+}
+
+struct grd_trace_ring* grd_trace_thread(void)
+{
+    struct grd_trace_ring* r;
+
+    pthread_once(&trace_once, trace_init);
+    if (!grd_trace_enabled)
+        return NULL;
+    pthread_mutex_lock(&rings_mutex);
+    for (r = rings; r; r = r->next)
+        if (!r->used)
+            break;
+    if (r)
+        r->head = 0;
+    else
+    {
+        r = calloc(1, sizeof(*r));
+        if (r)
+        {
+            r->next = rings;
+            rings = r;
+        }
+    }
+    if (r)
+    {
+        r->used = 1;
+        r->tid = (uint32_t)syscall(SYS_gettid);
+        pthread_setspecific(ring_key, r);
+        grd_trace_ring = r;
+    }
+    if (watcher_pid != getpid())
+        start_watcher();
+    pthread_mutex_unlock(&rings_mutex);
+    return r;
+}
+
+unsigned int grd_trace_device(const char* dev_path)
+{
+    unsigned int i;
+
+    assert(dev_path);
+    if (!grd_trace_enabled)
+        return 0;
+    pthread_mutex_lock(&rings_mutex);
+    for (i = 1; i < devices_count; ++i)
+        if (strncmp(devices[i], dev_path, GRD_TRACE_PATH_LEN - 1) == 0)
+            break;
+    if (i == devices_count)
+    {
+        if (devices_count < GRD_TRACE_DEVICES)
+        {
+            strncpy(devices[i], dev_path, GRD_TRACE_PATH_LEN - 1);
+            ++devices_count;
+        }
+        else
+            i = 0;
+    }
+    pthread_mutex_unlock(&rings_mutex);
+    return i;
+}
+
+static int write_all(int fd, const void* buf, size_t len)
+{
+    const char* p = buf;
+    ssize_t n;
+
+    while (len > 0)
+    {
+        n = write(fd, p, len);
+        if (n < 0  &&  errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static uint64_t clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+int grd_trace_dump(int fd)
+{
+    struct grd_trace_file_header header;
+    struct grd_trace_file_thread thread;
+    struct grd_trace_event* copy;
+    struct grd_trace_ring* r;
+    uint64_t head, last, first, valid;
+    size_t i;
+    int ret = 0;
+
+    copy = malloc(sizeof(r->events));
+    if (!copy)
+        return -1;
+    pthread_mutex_lock(&rings_mutex);
+    memset(&header, 0, sizeof(header));
+    header.magic = GRD_TRACE_MAGIC;
+    header.version = GRD_TRACE_VERSION;
+    header.pid = (uint32_t)getpid();
+    header.devices_count = devices_count - 1;
+    header.event_size = sizeof(struct grd_trace_event);
+    for (r = rings; r; r = r->next)
+        ++header.threads_count;
+    header.realtime_ns = clock_ns(CLOCK_REALTIME);
+    header.monotonic_ns = clock_ns(CLOCK_MONOTONIC);
+    if (write_all(fd, &header, sizeof(header)) != 0
+        ||  write_all(fd, devices[1], (devices_count - 1) * sizeof(devices[0])) != 0
+        )
+        ret = -1;
+
+    for (r = rings; r  &&  ret == 0; r = r->next)
+    {
+        head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        first = head > GRD_TRACE_EVENTS ? head - GRD_TRACE_EVENTS : 0;
+        for (i = 0; first + i < head; ++i)
+            copy[i] = r->events[(first + i) & (GRD_TRACE_EVENTS - 1)];
+        /* the slot of the next event may be written now as well */
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        last = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        valid = last + 1 > GRD_TRACE_EVENTS ? last + 1 - GRD_TRACE_EVENTS : 0;
+        if (valid < first)
+            valid = first;
+        if (valid > head)
+            valid = head;
+
+        memset(&thread, 0, sizeof(thread));
+        thread.tid = r->tid;
+        thread.count = (uint32_t)(head - valid);
+        thread.lost = valid;
+        if (write_all(fd, &thread, sizeof(thread)) != 0
+            ||  write_all(fd, copy + (valid - first), thread.count * sizeof(copy[0])) != 0
+            )
+            ret = -1;
+    }
+    pthread_mutex_unlock(&rings_mutex);
+    free(copy);
+    return ret;
+}
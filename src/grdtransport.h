@@ -0,0 +1,128 @@
+/*
+ * Copyright (C) 2008 Aktiv Co. (Aleksey Samsonov)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#ifndef GRDTRANSPORT__H__
+#define GRDTRANSPORT__H__
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+#ifdef HAVE_STDDEF_H
+#include <stddef.h>
+#endif /* HAVE_STDDEF_H */
+#include "grdimpl.h"
+#include "grdlock.h"
+#include "grdstats.h"
+
+#define GRD_BULK_EXCHANGE_UNSUPPORTED   (-2)
+#define GRD_TRANSFER_TIMEOUT_MS         3000 /* of one pack, if the device has none */
+
+struct grd_transport;
+
+/*
+ * Opened device.
+ */
+struct grd_device
+{
+    const struct grd_transport* transport; /* NULL if closed */
+    int fd;                     /* descriptor of the node, if any */
+    int prepared;               /* transport state kept between exchanges */
+    void* priv;                 /* transport data */
+    struct grd_stats_dev* stats; /* statistics of the device, may be NULL */
+    unsigned int trace_dev;     /* the device in the trace (see grd_trace_device) */
+    unsigned int timeout_ms;    /* of one pack (zero: GRD_TRANSFER_TIMEOUT_MS) */
+};
+
+static inline int grd_device_timeout(const struct grd_device* dev)
+{
+    return dev->timeout_ms ? (int)dev->timeout_ms : GRD_TRANSFER_TIMEOUT_MS;
+}
+
+/*
+ * Transport: the I/O of one kind of device node. Every function returns
+ * zero on success, or -1 with errno set.
+ */
+struct grd_transport
+{
+    const char* name;
+
+    /* identity of the device for the cross-process lock */
+    int (*identify)(const char* path, struct grd_dev_id* id);
+
+    int (*open)(struct grd_device* dev, const char* path);
+    void (*close)(struct grd_device* dev);
+
+    /* product id of the device (NULL: not a Guardant device) */
+    int (*get_prodid)(struct grd_device* dev, unsigned int* prod_id);
+
+    /* before and after an exchange (claim interface, set HID flags,
+       drop stale input) */
+    int (*claim)(struct grd_device* dev);
+    int (*release)(struct grd_device* dev);
+
+    /* bulk packs: write to ep 1, read from ep 0x81 */
+    int (*bulk_write)(struct grd_device* dev, void* buf, size_t len);
+    int (*bulk_read)(struct grd_device* dev, void* buf, size_t len);
+
+    /*
+     * Optional: the whole bulk exchange (pipelined), *started is set as soon
+     * as some data was transferred. Return GRD_BULK_EXCHANGE_UNSUPPORTED
+     * (nothing was sent) to fall back to bulk_write/bulk_read.
+     */
+    int (*bulk_exchange)(struct grd_device* dev, size_t pack_size,
+                         void* in, size_t len_in, void* out, size_t len_out,
+                         int* started);
+
+    /* HID reports (64 bytes each): buf NULL and len 0 is the idle report */
+    int (*hid_write)(struct grd_device* dev, void* buf, size_t len);
+    int (*hid_read)(struct grd_device* dev, void* buf, size_t len);
+    /* drop input left unread (optional) */
+    void (*hid_flush)(struct grd_device* dev);
+
+    /* optional: enumeration instead of the usbfs/hiddev search */
+    int (*search)(search_usb_device_callback callback, void* param);
+};
+
+extern const struct grd_transport grd_transport_usbfs;
+extern const struct grd_transport grd_transport_hiddev;
+extern const struct grd_transport grd_transport_hidraw;
+extern const struct grd_transport grd_transport_emul;
+
+/*
+ * Return the transport replacing the USB devices (the emulator selected by
+ * the GRD_EMUL environment variable), or NULL.
+ */
+const struct grd_transport* grd_transport_override(void);
+
+/*
+ * Open the device with the transport of its node: the override transport,
+ * hidraw (if GRD_HIDRAW is not "0") or hiddev for GRDHID_PATH_HEAD nodes,
+ * usbfs for the others.
+ * Return zero on success.
+ */
+int grd_device_open(struct grd_device* dev, const char* path);
+
+void grd_device_close(struct grd_device* dev);
+
+/*
+ * Identity of the device for the cross-process lock.
+ * Return zero on success.
+ */
+int grd_device_identify(const char* path, struct grd_dev_id* id);
+
+#endif /* !GRDTRANSPORT__H__ */
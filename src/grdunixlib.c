@@ -0,0 +1,544 @@
+/*
+ * GrdWine - Unix side of the calls (see grdunixlib.h)
+ *
+ * Copyright (C) 2008 Aktiv Co. (Aleksey Samsonov)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+#ifdef HAVE_STDDEF_H
+#include <stddef.h>
+#endif /* HAVE_STDDEF_H */
+#include <stdarg.h> /* for #include "winbase.h" */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "ntstatus.h"   /* <wine/windows/ntstatus.h> */
+#define WIN32_NO_STATUS
+#include "windef.h"     /* <wine/windows/windef.h> */
+#include "winbase.h"    /* <wine/windows/winbase.h> */
+#include "winternl.h"   /* <wine/windows/winternl.h> */
+#include "winerror.h"   /* <wine/windows/winerror.h> */
+#ifdef GRDWINE_UNIXLIB
+#include "wine/unixlib.h" /* <wine/unixlib.h> */
+#endif /* GRDWINE_UNIXLIB */
+#include "grdimpl.h"
+#include "grdunixlib.h"
+
+static DWORD error_from_errno(int err)
+{
+    switch (err)
+    {
+    case 0:             return ERROR_SUCCESS;
+    case EINVAL:        return ERROR_INVALID_PARAMETER;
+    case ENOMEM:        return ERROR_NOT_ENOUGH_MEMORY;
+    case ETIMEDOUT:     return ERROR_SEM_TIMEOUT;
+    case ECANCELED:     return ERROR_OPERATION_ABORTED;
+    case EAGAIN:        return ERROR_TOO_MANY_CMDS;
+    case EEXIST:        return ERROR_ALREADY_EXISTS;
+    case ENODEV:
+    case ENOENT:
+    case ENXIO:
+    case ESHUTDOWN:     return ERROR_DEVICE_NOT_CONNECTED;
+    case EACCES:
+    case EPERM:         return ERROR_ACCESS_DENIED;
+    case EBUSY:         return ERROR_BUSY;
+    case EBADF:         return ERROR_INVALID_HANDLE;
+    case EMFILE:        return ERROR_TOO_MANY_OPEN_FILES;
+    default:            return ERROR_GEN_FAILURE;
+    }
+}
+
+static int __attribute__((ms_abi)) add_path(const char* path, void* param)
+{
+    struct search_devices_params* params = param;
+    const size_t len = strlen(path) + 1;
+
+    if (params->needed + len <= params->size)
+    {
+        memcpy(params->buf + params->needed, path, len);
+        ++params->count;
+    }
+    params->needed += (UINT)len;
+    return 1;
+}
+
+NTSTATUS grdwine_search_devices(void* args)
+{
+    struct search_devices_params* params = args;
+
+    params->count = 0;
+    params->needed = 0;
+    if (search_usb_devices(add_path, params) < 0)
+        params->needed = 0;
+    if (params->needed > params->size)
+        params->count = 0; /* not all paths: the caller searches again */
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS grdwine_probe_device(void* args)
+{
+    struct probe_device_params* params = args;
+    unsigned int prod_id;
+
+    params->ret = grd_probe_device(params->path, &prod_id) == 0;
+    if (params->ret)
+        params->prod_id = prod_id;
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS grdwine_ioctl_device(void* args)
+{
+    struct ioctl_device_params* params = args;
+
+    params->ret = grd_ioctl_device(params->path, params->prod_id, params->pack_size,
+                                   params->in, params->in_size,
+                                   params->out, params->out_size) == 0;
+    return STATUS_SUCCESS;
+}
+
+/* Run the requests, return the statuses (ERROR_*) in status */
+static BOOL ioctl_batch(struct grd_ioctl_request* requests, UINT count, DWORD* status)
+{
+    UINT i;
+    int ret;
+
+    ret = grd_ioctl_devices(requests, count);
+    for (i = 0; i < count; ++i)
+        status[i] = error_from_errno(requests[i].status);
+    return ret == 0;
+}
+
+NTSTATUS grdwine_ioctl_batch(void* args)
+{
+    struct ioctl_batch_params* params = args;
+    struct grd_ioctl_request* requests;
+    GRDWINE_IOCTL_REQUEST* r;
+    DWORD* status;
+    UINT i;
+
+    requests = malloc(params->count * (sizeof(*requests) + sizeof(*status)));
+    if (!requests)
+        return STATUS_NO_MEMORY;
+    status = (DWORD*)(requests + params->count);
+    for (i = 0; i < params->count; ++i)
+    {
+        r = &params->requests[i];
+        requests[i].dev_path = r->lpDevName;
+        requests[i].prod_id = (unsigned int)r->ProdId;
+        requests[i].pack_size = (size_t)r->dwPackSize;
+        requests[i].in = r->lpIn;
+        requests[i].len_in = (size_t)r->nInSize;
+        requests[i].out = r->lpOut;
+        requests[i].len_out = (size_t)r->nOutSize;
+        requests[i].status = 0;
+    }
+    params->ret = ioctl_batch(requests, params->count, status);
+    for (i = 0; i < params->count; ++i)
+        params->requests[i].dwStatus = status[i];
+    free(requests);
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS grdwine_ioctl_product(void* args)
+{
+    struct ioctl_product_params* params = args;
+
+    errno = 0;
+    params->ret = grd_ioctl_product(params->prod_id, params->path, params->path_size,
+                                    params->pack_size, params->in, params->in_size,
+                                    params->out, params->out_size) == 0;
+    params->error = params->ret ? ERROR_SUCCESS : error_from_errno(errno ? errno : EIO);
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS grdwine_ioctl_submit(void* args)
+{
+    struct ioctl_submit_params* params = args;
+
+    params->ret = grd_ioctl_submit(params->path, params->prod_id, params->pack_size,
+                                   params->in, params->in_size, params->out, params->out_size,
+                                   params->timeout, params->cookie) == 0;
+    params->error = params->ret ? ERROR_SUCCESS : error_from_errno(errno);
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS grdwine_ioctl_cancel(void* args)
+{
+    struct ioctl_cancel_params* params = args;
+
+    params->ret = grd_ioctl_cancel(params->cookie) == 0;
+    if (params->ret)
+        params->error = ERROR_SUCCESS;
+    else
+        params->error = errno == EBUSY ? ERROR_BUSY : ERROR_NOT_FOUND;
+    return STATUS_SUCCESS;
+}
+
+/* The completions are returned in the buffer of the caller */
+NTSTATUS grdwine_ioctl_wait(void* args)
+{
+    struct ioctl_wait_params* params = args;
+    struct grd_ioctl_completion done[16];
+    size_t i, n;
+
+    params->count = 0;
+    n = grd_ioctl_wait(done, params->max < ARRAYSIZE(done) ? params->max : ARRAYSIZE(done),
+                       params->timeout);
+    for (i = 0; i < n; ++i)
+    {
+        params->done[i].cookie = done[i].cookie;
+        params->done[i].error = error_from_errno(done[i].status);
+        params->done[i].reserved = 0;
+    }
+    params->count = (UINT)n;
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS grdwine_session_open(void* args)
+{
+    struct session_open_params* params = args;
+    unsigned long long handle = 0;
+
+    errno = 0;
+    params->ret = grd_session_open(params->path, params->prod_id, params->hold, params->idle,
+                                   &handle) == 0;
+    params->session = handle;
+    params->error = params->ret ? ERROR_SUCCESS : error_from_errno(errno ? errno : EIO);
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS grdwine_session_ioctl(void* args)
+{
+    struct session_ioctl_params* params = args;
+
+    errno = 0;
+    params->ret = grd_session_ioctl(params->session, params->pack_size,
+                                    params->in, params->in_size,
+                                    params->out, params->out_size) == 0;
+    params->error = params->ret ? ERROR_SUCCESS : error_from_errno(errno ? errno : EIO);
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS grdwine_session_close(void* args)
+{
+    struct session_close_params* params = args;
+
+    errno = 0;
+    params->ret = grd_session_close(params->session) == 0;
+    params->error = params->ret ? ERROR_SUCCESS : error_from_errno(errno ? errno : EIO);
+    return STATUS_SUCCESS;
+}
+
+#ifdef GRDWINE_UNIXLIB
+
+const unixlib_entry_t __wine_unix_call_funcs[] =
+{
+    grdwine_search_devices,
+    grdwine_probe_device,
+    grdwine_ioctl_device,
+    grdwine_ioctl_batch,
+    grdwine_ioctl_product,
+    grdwine_ioctl_submit,
+    grdwine_ioctl_cancel,
+    grdwine_ioctl_wait,
+    grdwine_session_open,
+    grdwine_session_ioctl,
+    grdwine_session_close,
+};
+
+C_ASSERT(ARRAYSIZE(__wine_unix_call_funcs) == unix_funcs_count);
+
+#ifdef _WIN64
+
+/* WoW64: the params of a 32-bit process (pointers are 32-bit) */
+
+typedef ULONG PTR32;
+
+static NTSTATUS wow64_search_devices(void* args)
+{
+    struct
+    {
+        PTR32 buf;
+        UINT size;
+        UINT count;
+        UINT needed;
+    } *params32 = args;
+    struct search_devices_params params;
+    NTSTATUS status;
+
+    params.buf = ULongToPtr(params32->buf);
+    params.size = params32->size;
+    status = grdwine_search_devices(&params);
+    params32->count = params.count;
+    params32->needed = params.needed;
+    return status;
+}
+
+static NTSTATUS wow64_probe_device(void* args)
+{
+    struct
+    {
+        PTR32 path;
+        UINT prod_id;
+        BOOL ret;
+    } *params32 = args;
+    struct probe_device_params params;
+    NTSTATUS status;
+
+    params.path = ULongToPtr(params32->path);
+    status = grdwine_probe_device(&params);
+    params32->prod_id = params.prod_id;
+    params32->ret = params.ret;
+    return status;
+}
+
+static NTSTATUS wow64_ioctl_device(void* args)
+{
+    struct
+    {
+        PTR32 path;
+        UINT prod_id;
+        UINT pack_size;
+        PTR32 in;
+        UINT in_size;
+        PTR32 out;
+        UINT out_size;
+        BOOL ret;
+    } *params32 = args;
+    struct ioctl_device_params params;
+    NTSTATUS status;
+
+    params.path = ULongToPtr(params32->path);
+    params.prod_id = params32->prod_id;
+    params.pack_size = params32->pack_size;
+    params.in = ULongToPtr(params32->in);
+    params.in_size = params32->in_size;
+    params.out = ULongToPtr(params32->out);
+    params.out_size = params32->out_size;
+    status = grdwine_ioctl_device(&params);
+    params32->ret = params.ret;
+    return status;
+}
+
+static NTSTATUS wow64_ioctl_batch(void* args)
+{
+    struct request32
+    {
+        PTR32 lpDevName;
+        DWORD ProdId;
+        DWORD dwPackSize;
+        PTR32 lpIn;
+        DWORD nInSize;
+        PTR32 lpOut;
+        DWORD nOutSize;
+        DWORD dwStatus;
+    };
+    struct
+    {
+        PTR32 requests;
+        UINT count;
+        BOOL ret;
+    } *params32 = args;
+    struct request32* r = ULongToPtr(params32->requests);
+    struct grd_ioctl_request* requests;
+    DWORD* status;
+    UINT i;
+
+    requests = malloc(params32->count * (sizeof(*requests) + sizeof(*status)));
+    if (!requests)
+        return STATUS_NO_MEMORY;
+    status = (DWORD*)(requests + params32->count);
+    for (i = 0; i < params32->count; ++i)
+    {
+        requests[i].dev_path = ULongToPtr(r[i].lpDevName);
+        requests[i].prod_id = (unsigned int)r[i].ProdId;
+        requests[i].pack_size = (size_t)r[i].dwPackSize;
+        requests[i].in = ULongToPtr(r[i].lpIn);
+        requests[i].len_in = (size_t)r[i].nInSize;
+        requests[i].out = ULongToPtr(r[i].lpOut);
+        requests[i].len_out = (size_t)r[i].nOutSize;
+        requests[i].status = 0;
+    }
+    params32->ret = ioctl_batch(requests, params32->count, status);
+    for (i = 0; i < params32->count; ++i)
+        r[i].dwStatus = status[i];
+    free(requests);
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS wow64_ioctl_product(void* args)
+{
+    struct
+    {
+        UINT prod_id;
+        PTR32 path;
+        UINT path_size;
+        UINT pack_size;
+        PTR32 in;
+        UINT in_size;
+        PTR32 out;
+        UINT out_size;
+        DWORD error;
+        BOOL ret;
+    } *params32 = args;
+    struct ioctl_product_params params;
+    NTSTATUS status;
+
+    params.prod_id = params32->prod_id;
+    params.path = ULongToPtr(params32->path);
+    params.path_size = params32->path_size;
+    params.pack_size = params32->pack_size;
+    params.in = ULongToPtr(params32->in);
+    params.in_size = params32->in_size;
+    params.out = ULongToPtr(params32->out);
+    params.out_size = params32->out_size;
+    status = grdwine_ioctl_product(&params);
+    params32->error = params.error;
+    params32->ret = params.ret;
+    return status;
+}
+
+static NTSTATUS wow64_ioctl_submit(void* args)
+{
+    struct
+    {
+        PTR32 path;
+        UINT prod_id;
+        UINT pack_size;
+        PTR32 in;
+        UINT in_size;
+        PTR32 out;
+        UINT out_size;
+        UINT timeout;
+        ULONGLONG cookie;
+        DWORD error;
+        BOOL ret;
+    } *params32 = args;
+    struct ioctl_submit_params params;
+    NTSTATUS status;
+
+    params.path = ULongToPtr(params32->path);
+    params.prod_id = params32->prod_id;
+    params.pack_size = params32->pack_size;
+    params.in = ULongToPtr(params32->in);
+    params.in_size = params32->in_size;
+    params.out = ULongToPtr(params32->out);
+    params.out_size = params32->out_size;
+    params.timeout = params32->timeout;
+    params.cookie = params32->cookie;
+    status = grdwine_ioctl_submit(&params);
+    params32->error = params.error;
+    params32->ret = params.ret;
+    return status;
+}
+
+static NTSTATUS wow64_ioctl_wait(void* args)
+{
+    struct
+    {
+        PTR32 done;
+        UINT max;
+        INT timeout;
+        UINT count;
+    } *params32 = args;
+    struct ioctl_wait_params params;
+    NTSTATUS status;
+
+    params.done = ULongToPtr(params32->done);
+    params.max = params32->max;
+    params.timeout = params32->timeout;
+    status = grdwine_ioctl_wait(&params);
+    params32->count = params.count;
+    return status;
+}
+
+static NTSTATUS wow64_session_open(void* args)
+{
+    struct
+    {
+        PTR32 path;
+        UINT prod_id;
+        UINT hold;
+        UINT idle;
+        ULONGLONG session;
+        DWORD error;
+        BOOL ret;
+    } *params32 = args;
+    struct session_open_params params;
+    NTSTATUS status;
+
+    params.path = ULongToPtr(params32->path);
+    params.prod_id = params32->prod_id;
+    params.hold = params32->hold;
+    params.idle = params32->idle;
+    status = grdwine_session_open(&params);
+    params32->session = params.session;
+    params32->error = params.error;
+    params32->ret = params.ret;
+    return status;
+}
+
+static NTSTATUS wow64_session_ioctl(void* args)
+{
+    struct
+    {
+        ULONGLONG session;
+        UINT pack_size;
+        PTR32 in;
+        UINT in_size;
+        PTR32 out;
+        UINT out_size;
+        DWORD error;
+        BOOL ret;
+    } *params32 = args;
+    struct session_ioctl_params params;
+    NTSTATUS status;
+
+    params.session = params32->session;
+    params.pack_size = params32->pack_size;
+    params.in = ULongToPtr(params32->in);
+    params.in_size = params32->in_size;
+    params.out = ULongToPtr(params32->out);
+    params.out_size = params32->out_size;
+    status = grdwine_session_ioctl(&params);
+    params32->error = params.error;
+    params32->ret = params.ret;
+    return status;
+}
+
+const unixlib_entry_t __wine_unix_call_wow64_funcs[] =
+{
+    wow64_search_devices,
+    wow64_probe_device,
+    wow64_ioctl_device,
+    wow64_ioctl_batch,
+    wow64_ioctl_product,
+    wow64_ioctl_submit,
+    grdwine_ioctl_cancel,   /* no pointers */
+    wow64_ioctl_wait,
+    wow64_session_open,
+    wow64_session_ioctl,
+    grdwine_session_close,  /* no pointers */
+};
+
+C_ASSERT(ARRAYSIZE(__wine_unix_call_wow64_funcs) == unix_funcs_count);
+
+#endif /* _WIN64 */
+
+#endif /* GRDWINE_UNIXLIB */
@@ -0,0 +1,208 @@
+/*
+ * Copyright (C) 2008 Aktiv Co. (Aleksey Samsonov)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/*
+ * Calls from grdwine.c (PE side) to grdunixlib.c (Unix side). With
+ * GRDWINE_UNIXLIB they cross with __wine_unix_call, otherwise grdwine.c
+ * and grdunixlib.c are one winelib module and call each other directly.
+ * Pointers are passed as is: the buffers of the application are used by
+ * the Unix side without copies.
+ */
+
+#ifndef GRDUNIXLIB__H__
+#define GRDUNIXLIB__H__
+
+/* Request of GrdWine_DeviceIoctlBatch (the arguments of GrdWine_DeviceIoctl) */
+typedef struct _GRDWINE_IOCTL_REQUEST
+{
+    LPCSTR lpDevName;
+    DWORD ProdId;
+    DWORD dwPackSize;
+    LPVOID lpIn;
+    DWORD nInSize;
+    LPVOID lpOut;
+    DWORD nOutSize;
+    DWORD dwStatus;     /* result: ERROR_SUCCESS or an error code */
+} GRDWINE_IOCTL_REQUEST, *PGRDWINE_IOCTL_REQUEST;
+
+/*
+ * Asynchronous GrdWine_DeviceIoctl (like OVERLAPPED): the structure is used
+ * by GrdWine until dwStatus is not ERROR_IO_PENDING.
+ */
+typedef struct _GRDWINE_ASYNC GRDWINE_ASYNC, *PGRDWINE_ASYNC;
+typedef void (WINAPI * GRDWINE_ASYNC_CALLBACK)(PGRDWINE_ASYNC lpAsync);
+
+struct _GRDWINE_ASYNC
+{
+    HANDLE hEvent;                  /* set on completion, may be NULL */
+    GRDWINE_ASYNC_CALLBACK Func;    /* called on completion (the GrdWine thread), may be NULL */
+    LPVOID lpParam;                 /* for Func */
+    DWORD dwTimeout;                /* ms for the exchange to start, zero: no deadline */
+    DWORD dwStatus;                 /* result: ERROR_IO_PENDING, then ERROR_SUCCESS or an error code */
+};
+
+enum grdwine_funcs
+{
+    unix_search_devices,
+    unix_probe_device,
+    unix_ioctl_device,
+    unix_ioctl_batch,
+    unix_ioctl_product,
+    unix_ioctl_submit,
+    unix_ioctl_cancel,
+    unix_ioctl_wait,
+    unix_session_open,
+    unix_session_ioctl,
+    unix_session_close,
+    unix_funcs_count
+};
+
+/*
+ * Search: the paths of the devices, NUL-terminated, one after another.
+ * If size is too small, needed is the size for all paths (count is zero).
+ */
+struct search_devices_params
+{
+    char* buf;
+    UINT size;
+    UINT count;                 /* out: count of the paths in buf */
+    UINT needed;                /* out: size of all paths */
+};
+
+struct probe_device_params
+{
+    LPCSTR path;
+    UINT prod_id;               /* out */
+    BOOL ret;                   /* out */
+};
+
+struct ioctl_device_params
+{
+    LPCSTR path;
+    UINT prod_id;
+    UINT pack_size;
+    void* in;
+    UINT in_size;
+    void* out;
+    UINT out_size;
+    BOOL ret;                   /* out */
+};
+
+struct ioctl_batch_params
+{
+    GRDWINE_IOCTL_REQUEST* requests; /* dwStatus is set */
+    UINT count;
+    BOOL ret;                   /* out: TRUE if all requests succeeded */
+};
+
+struct ioctl_product_params
+{
+    UINT prod_id;
+    char* path;                 /* in: sticky device (if not empty), out: device used; may be NULL */
+    UINT path_size;
+    UINT pack_size;
+    void* in;
+    UINT in_size;
+    void* out;
+    UINT out_size;
+    DWORD error;                /* out: ERROR_* */
+    BOOL ret;                   /* out */
+};
+
+struct ioctl_submit_params
+{
+    LPCSTR path;
+    UINT prod_id;
+    UINT pack_size;
+    void* in;
+    UINT in_size;
+    void* out;
+    UINT out_size;
+    UINT timeout;               /* ms, zero: no deadline */
+    ULONGLONG cookie;           /* the request (GRDWINE_ASYNC) */
+    DWORD error;                /* out: ERROR_* */
+    BOOL ret;                   /* out */
+};
+
+struct ioctl_cancel_params
+{
+    ULONGLONG cookie;
+    DWORD error;                /* out: ERROR_* */
+    BOOL ret;                   /* out */
+};
+
+/* Completion of ioctl_submit (the same layout for 32-bit and 64-bit) */
+struct ioctl_completion
+{
+    ULONGLONG cookie;
+    DWORD error;                /* ERROR_* */
+    DWORD reserved;
+};
+
+struct ioctl_wait_params
+{
+    struct ioctl_completion* done;
+    UINT max;
+    INT timeout;                /* ms, negative: no timeout */
+    UINT count;                 /* out */
+};
+
+struct session_open_params
+{
+    LPCSTR path;
+    UINT prod_id;
+    UINT hold;                  /* ms, zero: the default */
+    UINT idle;                  /* ms, zero: the default */
+    ULONGLONG session;          /* out */
+    DWORD error;                /* out: ERROR_* */
+    BOOL ret;                   /* out */
+};
+
+struct session_ioctl_params
+{
+    ULONGLONG session;
+    UINT pack_size;
+    void* in;
+    UINT in_size;
+    void* out;
+    UINT out_size;
+    DWORD error;                /* out: ERROR_* */
+    BOOL ret;                   /* out */
+};
+
+struct session_close_params
+{
+    ULONGLONG session;
+    DWORD error;                /* out: ERROR_* */
+    BOOL ret;                   /* out */
+};
+
+/* Unix side (grdunixlib.c), args are the params above */
+NTSTATUS grdwine_search_devices(void* args);
+NTSTATUS grdwine_probe_device(void* args);
+NTSTATUS grdwine_ioctl_device(void* args);
+NTSTATUS grdwine_ioctl_batch(void* args);
+NTSTATUS grdwine_ioctl_product(void* args);
+NTSTATUS grdwine_ioctl_submit(void* args);
+NTSTATUS grdwine_ioctl_cancel(void* args);
+NTSTATUS grdwine_ioctl_wait(void* args);
+NTSTATUS grdwine_session_open(void* args);
+NTSTATUS grdwine_session_ioctl(void* args);
+NTSTATUS grdwine_session_close(void* args);
+
+#endif /* !GRDUNIXLIB__H__ */
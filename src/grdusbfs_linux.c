@@ -0,0 +1,435 @@
+/*
+ * USB Device Filesystem transport of the GrdWine (bulk devices)
+ *
+ * Copyright (C) 2008 Aktiv Co. (Aleksey Samsonov)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+#include <assert.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <linux/usbdevice_fs.h>
+#include "grdimpl_linux.h"
+#include "grdpower.h"
+#include "grdtrace.h"
+#include "grdtransport.h"
+
+#ifndef USBDEVFS_FORBID_SUSPEND
+#define USBDEVFS_FORBID_SUSPEND _IO('U', 33) /* Linux 5.7 */
+#endif /* USBDEVFS_FORBID_SUSPEND */
+
+#define GRD_URB_WINDOW          8    /* bulk URBs in flight */
+#define GRD_URB_BUFFER_SIZE     4096 /* mapped buffer of one URB (larger packs: no mapping) */
+#define GRD_URB_MAP_RETRY_MS    1000 /* usbfs memory is used up: map again later */
+
+static volatile int bulk_urb = 1; /* asynchronous bulk transfers (URB) */
+static volatile int bulk_mmap = 1; /* URB buffers mapped from usbfs (Linux 4.6) */
+static volatile uint64_t bulk_mmap_retry_at; /* CLOCK_MONOTONIC, ms */
+
+static uint64_t monotonic_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static int ioctl_device_bulk(int fd, unsigned int ep, void* buf, size_t len, int timeout_ms)
+{
+    struct usbdevfs_bulktransfer packet;
+    int ret;
+
+    assert(fd >= 0);
+    assert(buf);
+    assert(len > 0);
+    assert(len <= 16384 /* MAX_USBFS_BUFFER_SIZE */);
+    packet.ep = ep;
+    packet.len = (unsigned int)len;
+    packet.timeout = (unsigned int)timeout_ms;
+    packet.data = buf;
+    ret = ioctl(fd, USBDEVFS_BULK, &packet);
+    if (ret >= 0 && (size_t)ret != len)
+        errno = EIO; /* short transfer */
+    if (ret < 0 || (size_t)ret != len)
+        return ret < 0 ? ret : -1;
+    else
+        return 0;
+}
+
+/*
+ * Packs of a bulk exchange in the order of exchange_device:
+ * write (ep 1), then read (ep 0x81) when the read condition holds.
+ */
+struct pack_iter
+{
+    size_t pack_size;
+    unsigned char* in;
+    size_t len_in;
+    unsigned char* out;
+    size_t len_out;
+    int read_phase;
+};
+
+/* Return zero if there are no more packs */
+static int next_bulk_pack(struct pack_iter* it, unsigned int* ep, unsigned char** buf)
+{
+    const size_t pack_size = it->pack_size;
+
+    assert(pack_size > 0);
+    while (it->len_out >= pack_size || it->len_in >= pack_size)
+    {
+        if (!it->read_phase)
+        {
+            it->read_phase = 1;
+            if (it->len_out >= pack_size)
+            {
+                *ep = 1;
+                *buf = it->out;
+                it->out += pack_size;
+                it->len_out -= pack_size;
+                return 1;
+            }
+        }
+        it->read_phase = 0;
+        if ((it->len_in == pack_size && it->len_out < pack_size)
+            || it->len_in > pack_size
+            )
+        {
+            *ep = 0x81;
+            *buf = it->in;
+            it->in += pack_size;
+            it->len_in -= pack_size;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Cancel the URBs in flight and wait for them (the buffers are ours).
+ */
+static void discard_urbs(int fd, struct usbdevfs_urb* urbs, int* busy, size_t count)
+{
+    struct usbdevfs_urb* urb;
+    size_t i, in_flight = 0;
+
+    for (i = 0; i < count; ++i)
+        if (busy[i])
+        {
+            if (ioctl(fd, USBDEVFS_DISCARDURB, &urbs[i]) != 0  &&  errno != EINVAL)
+                busy[i] = 0; /* device is gone: nothing to reap */
+            else
+                ++in_flight;
+        }
+    while (in_flight > 0)
+    {
+        if (ioctl(fd, USBDEVFS_REAPURB, &urb) != 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        assert(urb >= urbs  &&  urb < urbs + count);
+        busy[urb - urbs] = 0;
+        --in_flight;
+    }
+}
+
+/*
+ * Bulk exchange with several URBs in flight: the read URB is queued before
+ * the write URB completes, and the next packs follow without waiting.
+ * Packs of one endpoint complete in order. With map (GRD_URB_WINDOW buffers
+ * mapped from the device) the packs are copied here to and from the mapped
+ * buffers and the kernel uses them as is; otherwise the kernel allocates a
+ * buffer and copies the pack for every URB. Either way a pack is copied
+ * once: the buffers of the caller can not be mapped.
+ * Return 0 on success, -1 on error, or GRD_BULK_EXCHANGE_UNSUPPORTED if the
+ * URBs are not supported (nothing was sent).
+ */
+static int exchange_device_urb(int fd, unsigned char* map, size_t pack_size,
+                               void* in, size_t len_in, void* out, size_t len_out,
+                               int timeout_ms, unsigned int trace_dev, int* started)
+{
+    struct usbdevfs_urb urbs[GRD_URB_WINDOW];
+    struct usbdevfs_urb* urb;
+    unsigned char* dest[GRD_URB_WINDOW]; /* where a read pack goes (mapped buffers) */
+    uint64_t submitted[GRD_URB_WINDOW]; /* for the trace */
+    int busy[GRD_URB_WINDOW];
+    struct pack_iter it;
+    struct pollfd pfd;
+    unsigned int ep;
+    unsigned char* buf;
+    size_t i, in_flight = 0;
+    int more, ret, err = 0;
+
+    assert(fd >= 0);
+    assert(pack_size > 0  &&  pack_size <= 16384 /* MAX_USBFS_BUFFER_SIZE */);
+    assert(!map  ||  pack_size <= GRD_URB_BUFFER_SIZE);
+    memset(&it, 0, sizeof(it));
+    it.pack_size = pack_size;
+    it.in = (unsigned char*)in;
+    it.len_in = len_in;
+    it.out = (unsigned char*)out;
+    it.len_out = len_out;
+    memset(busy, 0, sizeof(busy));
+
+    more = next_bulk_pack(&it, &ep, &buf);
+    while (more  ||  in_flight > 0)
+    {
+        /* fill the window */
+        for (i = 0; more  &&  in_flight < GRD_URB_WINDOW; ++i)
+        {
+            assert(i < GRD_URB_WINDOW);
+            if (busy[i])
+                continue;
+            memset(&urbs[i], 0, sizeof(urbs[i]));
+            urbs[i].type = USBDEVFS_URB_TYPE_BULK;
+            urbs[i].endpoint = ep;
+            urbs[i].buffer = buf;
+            urbs[i].buffer_length = (int)pack_size;
+            dest[i] = NULL;
+            if (map)
+            {
+                urbs[i].buffer = map + i * GRD_URB_BUFFER_SIZE;
+                if (ep & 0x80)
+                    dest[i] = buf;
+                else
+                    memcpy(urbs[i].buffer, buf, pack_size);
+            }
+            if (ioctl(fd, USBDEVFS_SUBMITURB, &urbs[i]) != 0)
+            {
+                err = errno;
+                if (!*started  &&  in_flight == 0
+                    &&  (err == ENOTTY || err == EINVAL || err == ENOSYS)
+                    )
+                    return GRD_BULK_EXCHANGE_UNSUPPORTED;
+                break;
+            }
+            busy[i] = 1;
+            submitted[i] = grd_trace_begin();
+            ++in_flight;
+            more = next_bulk_pack(&it, &ep, &buf);
+        }
+        if (err)
+            break;
+
+        /* take one completion (wait for it) */
+        if (ioctl(fd, USBDEVFS_REAPURBNDELAY, &urb) != 0)
+        {
+            if (errno != EAGAIN)
+            {
+                err = errno;
+                break;
+            }
+            pfd.fd = fd;
+            pfd.events = POLLOUT;
+            pfd.revents = 0;
+            ret = poll(&pfd, 1, timeout_ms); /* no completion for so long: timeout */
+            if (ret == 0)
+            {
+                err = ETIMEDOUT;
+                break;
+            }
+            if (ret < 0  &&  errno != EINTR)
+            {
+                err = errno;
+                break;
+            }
+            if (pfd.revents & (POLLERR | POLLHUP))
+            {
+                err = ENODEV;
+                break;
+            }
+            continue;
+        }
+        assert(urb >= urbs  &&  urb < urbs + GRD_URB_WINDOW);
+        busy[urb - urbs] = 0;
+        --in_flight;
+        grd_trace((urb->endpoint & 0x80) ? GRD_TRACE_READ : GRD_TRACE_WRITE, trace_dev,
+                  (uint32_t)urb->actual_length, submitted[urb - urbs], -urb->status);
+        if (urb->status != 0)
+        {
+            err = -urb->status;
+            break;
+        }
+        if (urb->actual_length != (int)pack_size)
+        {
+            err = EIO; /* short transfer */
+            break;
+        }
+        if (dest[urb - urbs])
+            memcpy(dest[urb - urbs], urb->buffer, pack_size);
+        *started = 1;
+    }
+    if (err)
+    {
+        discard_urbs(fd, urbs, busy, GRD_URB_WINDOW);
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+static int usbfs_open(struct grd_device* dev, const char* path)
+{
+    assert(dev);
+    assert(path);
+    dev->fd = open(path, O_RDWR | O_CLOEXEC); /* open device */
+    if (dev->fd < 0)
+        return -1;
+    /* no autosuspend until the descriptor is closed (fails on older kernels) */
+    if (grd_power_low_latency())
+        ioctl(dev->fd, USBDEVFS_FORBID_SUSPEND);
+    return 0;
+}
+
+static void usbfs_close(struct grd_device* dev)
+{
+    assert(dev);
+    if (dev->priv)
+        munmap(dev->priv, GRD_URB_WINDOW * GRD_URB_BUFFER_SIZE);
+    dev->priv = NULL;
+    if (dev->fd >= 0)
+        close(dev->fd);
+    dev->fd = -1;
+}
+
+/* Device descriptor: VID/PID at offset 8 */
+static int usbfs_get_prodid(struct grd_device* dev, unsigned int* prod_id)
+{
+    unsigned char buf_tmpl[4] = {0x89, 0x0a, 0x00, 0x00};
+    unsigned char buf[16];
+    int ret;
+
+    assert(dev);
+    assert(dev->fd >= 0);
+    ret = pread(dev->fd, buf, sizeof(buf), 0);
+    if (ret < 0 || (size_t)ret != sizeof(buf))
+        ret = -1;
+    else
+    {
+        unsigned char p = 0;
+        unsigned char prod_ids[4] = {GRD_PRODID_S3S, GRD_PRODID_S3S_WINUSB, GRD_PRODID_S3C, GRD_PRODID_S3C_WINUSB};
+        ret = -1;
+        assert(sizeof(buf_tmpl) == 4);
+        for (; p < sizeof(prod_ids); ++p)
+        {
+            buf_tmpl[2] = prod_ids[p];
+            if (!memcmp(buf + 8, buf_tmpl, sizeof(buf_tmpl)))
+            {
+                assert(prod_id);
+                *prod_id = prod_ids[p];
+                ret = 0;
+                break;
+            }
+        }
+    }
+    return ret;
+}
+
+static int usbfs_claim(struct grd_device* dev)
+{
+    int interface = 0;
+
+    assert(dev);
+    assert(dev->fd >= 0);
+    return ioctl(dev->fd, USBDEVFS_CLAIMINTERFACE, &interface) == 0 ? 0 : -1;
+}
+
+static int usbfs_release(struct grd_device* dev)
+{
+    int interface = 0;
+
+    assert(dev);
+    assert(dev->fd >= 0);
+    return ioctl(dev->fd, USBDEVFS_RELEASEINTERFACE, &interface) == 0 ? 0 : -1;
+}
+
+static int usbfs_bulk_write(struct grd_device* dev, void* buf, size_t len)
+{
+    assert(dev);
+    return ioctl_device_bulk(dev->fd, 1, buf, len, grd_device_timeout(dev));
+}
+
+static int usbfs_bulk_read(struct grd_device* dev, void* buf, size_t len)
+{
+    assert(dev);
+    return ioctl_device_bulk(dev->fd, 0x81, buf, len, grd_device_timeout(dev));
+}
+
+static int usbfs_bulk_exchange(struct grd_device* dev, size_t pack_size,
+                               void* in, size_t len_in, void* out, size_t len_out,
+                               int* started)
+{
+    void* map;
+    int ret;
+
+    assert(dev);
+    if (!bulk_urb)
+        return GRD_BULK_EXCHANGE_UNSUPPORTED;
+    /* the URB buffers are mapped on the first exchange, not by the probe */
+    if (!dev->priv  &&  bulk_mmap  &&  pack_size <= GRD_URB_BUFFER_SIZE
+        &&  (!bulk_mmap_retry_at  ||  monotonic_ms() >= bulk_mmap_retry_at)
+        )
+    {
+        map = mmap(NULL, GRD_URB_WINDOW * GRD_URB_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_SHARED, dev->fd, 0);
+        if (map != MAP_FAILED)
+        {
+            dev->priv = map;
+            bulk_mmap_retry_at = 0;
+        }
+        else if (errno == ENOMEM)
+            bulk_mmap_retry_at = monotonic_ms() + GRD_URB_MAP_RETRY_MS; /* usbfs_memory_mb */
+        else
+            bulk_mmap = 0; /* usbfs without mmap: the kernel copies */
+    }
+    ret = exchange_device_urb(dev->fd, pack_size <= GRD_URB_BUFFER_SIZE ? dev->priv : NULL,
+                              pack_size, in, len_in, out, len_out,
+                              grd_device_timeout(dev), dev->trace_dev, started);
+    if (ret == GRD_BULK_EXCHANGE_UNSUPPORTED)
+        bulk_urb = 0; /* no USBDEVFS_SUBMITURB: synchronous transfers */
+    return ret;
+}
+
+const struct grd_transport grd_transport_usbfs =
+{
+    "usbfs",
+    grd_dev_id_get,
+    usbfs_open,
+    usbfs_close,
+    usbfs_get_prodid,
+    usbfs_claim,
+    usbfs_release,
+    usbfs_bulk_write,
+    usbfs_bulk_read,
+    usbfs_bulk_exchange,
+    NULL, /* hid_write */
+    NULL, /* hid_read */
+    NULL, /* hid_flush */
+    NULL  /* search */
+};
@@ -25,78 +25,398 @@
 #include <stddef.h>
 #endif /* HAVE_STDDEF_H */
 #include <stdarg.h> /* for #include "winbase.h" */
+#include <string.h>
+#include "ntstatus.h"   /* <wine/windows/ntstatus.h> */
+#define WIN32_NO_STATUS
 #include "windef.h"     /* <wine/windows/windef.h> */
 #include "winbase.h"    /* <wine/windows/winbase.h> */
 #include "winnt.h"      /* <wine/windows/winnt.h> */
+#include "winternl.h"   /* <wine/windows/winternl.h> */
+#include "winerror.h"   /* <wine/windows/winerror.h> */
 #include "wine/debug.h" /* <wine/debug.h> */
-#include "grdimpl.h"
+#ifdef GRDWINE_UNIXLIB
+#include "wine/unixlib.h" /* <wine/unixlib.h> */
+#endif /* GRDWINE_UNIXLIB */
+#include "grdunixlib.h"
 
 #define GRD_DRIVER_VERSION      0x0540
+#define GRD_SEARCH_BUFFER_SIZE  4096 /* paths of the devices, on the stack */
+#define GRD_SEARCH_TRIES        4    /* the devices may be plugged in meanwhile */
+#define GRD_COMPLETIONS         16   /* taken by one call of the completion thread */
+
+#ifdef GRDWINE_UNIXLIB
+#define GRD_UNIX_CALL(func, params)     WINE_UNIX_CALL(unix_##func, params)
+#else
+#define GRD_UNIX_CALL(func, params)     grdwine_##func(params)
+#endif /* GRDWINE_UNIXLIB */
 
 WINE_DEFAULT_DEBUG_CHANNEL(grdwine);
 
 typedef BOOL (__attribute__((ms_abi)) * GrdWine_SearchUsbDevices_Callback)(LPCSTR lpDevName, LPVOID lpParam);
 
+static INIT_ONCE completion_once = INIT_ONCE_STATIC_INIT;
+
 DWORD WINAPI GrdWine_GetVersion()
 {
     TRACE("() Version 0x%x\n", GRD_DRIVER_VERSION);
     return GRD_DRIVER_VERSION;
 }
 
+/*
+ * The Unix side returns all paths at once, the callback is called here:
+ * no calls from the Unix side back to the PE side.
+ */
 DWORD WINAPI GrdWine_SearchUsbDevices(GrdWine_SearchUsbDevices_Callback Func, LPVOID lpParam)
 {
-    search_usb_device_callback func = (search_usb_device_callback)Func;
-    void* param = (void*)lpParam;
-    int ret;
+    char stack_buf[GRD_SEARCH_BUFFER_SIZE];
+    struct search_devices_params params;
+    const char* path;
+    char* heap_buf = NULL;
+    DWORD ret = 0;
+    UINT i;
+    int tries;
 
-    TRACE("(%p, %p)\n", (void*)Func, param);
-    if (!func || !param)
+    TRACE("(%p, %p)\n", (void*)Func, lpParam);
+    if (!Func || !lpParam)
         return FALSE;
 
-    TRACE("Call search_usb_devices(%p, %p)\n", (void*)func, param);
-    ret = search_usb_devices(func, param);
-    TRACE("Ret search_usb_devices %d\n", ret);
-
-    return ret > 0 ? (DWORD)ret : 0;
+    params.buf = stack_buf;
+    params.size = sizeof(stack_buf);
+    for (tries = 0; tries < GRD_SEARCH_TRIES; ++tries)
+    {
+        if (GRD_UNIX_CALL(search_devices, &params) != STATUS_SUCCESS)
+            break;
+        TRACE("Ret search_devices: %u paths, %u bytes\n", params.count, params.needed);
+        if (params.needed <= params.size)
+            break;
+        HeapFree(GetProcessHeap(), 0, heap_buf);
+        heap_buf = HeapAlloc(GetProcessHeap(), 0, params.needed);
+        if (!heap_buf)
+            return 0;
+        params.buf = heap_buf;
+        params.size = params.needed;
+    }
+    if (params.needed <= params.size)
+        for (i = 0, path = params.buf; i < params.count; ++i, path += strlen(path) + 1)
+            if (Func(path, lpParam))
+                ++ret;
+    HeapFree(GetProcessHeap(), 0, heap_buf);
+    return ret;
 }
 
 BOOL WINAPI GrdWine_DeviceProbe(LPCSTR lpDevName, LPDWORD pProdId)
 {
-    char* path = (char*)lpDevName;
-    unsigned int* prod_id = (unsigned int*)pProdId;
-    int ret;
+    struct probe_device_params params;
 
     TRACE("(%s, %p)\n", lpDevName, pProdId);
-    if (!path || !prod_id)
+    if (!lpDevName || !pProdId)
         return FALSE;
 
-    TRACE("Call grd_probe_device(%s, %p)\n", path, prod_id);
-    ret = grd_probe_device(path, prod_id);
-    TRACE("Ret grd_probe_device %d\n", ret);
-
-    return ret == 0 ? TRUE : FALSE;
+    params.path = lpDevName;
+    params.ret = FALSE;
+    if (GRD_UNIX_CALL(probe_device, &params) != STATUS_SUCCESS)
+        return FALSE;
+    TRACE("Ret probe_device %d\n", params.ret);
+    if (params.ret)
+        *pProdId = params.prod_id;
+    return params.ret ? TRUE : FALSE;
 }
 
 BOOL WINAPI GrdWine_DeviceIoctl(LPCSTR lpDevName, DWORD ProdId, DWORD dwPackSize,
                                 LPVOID lpIn, DWORD nInSize, LPVOID lpOut, DWORD nOutSize)
 {
-    char* path = (char*)lpDevName;
-    void* in = lpIn, * out = lpOut;
-    size_t in_size = (size_t)nInSize, out_size = (size_t)nOutSize;
-    size_t pack_size = (size_t)dwPackSize;
-    unsigned int prod_id = (unsigned int)ProdId;
-    int ret;
+    struct ioctl_device_params params;
 
     TRACE("(%s, %u, %u, %p, %u, %p, %u)\n", lpDevName, ProdId, dwPackSize, lpIn, nInSize, lpOut, nOutSize);
-    if (!path || !in || !out)
+    if (!lpDevName || !lpIn || !lpOut)
+        return FALSE;
+
+    /* the buffers of the caller are used as is */
+    params.path = lpDevName;
+    params.prod_id = ProdId;
+    params.pack_size = dwPackSize;
+    params.in = lpIn;
+    params.in_size = nInSize;
+    params.out = lpOut;
+    params.out_size = nOutSize;
+    params.ret = FALSE;
+    if (GRD_UNIX_CALL(ioctl_device, &params) != STATUS_SUCCESS)
+        return FALSE;
+    TRACE("Ret ioctl_device %d\n", params.ret);
+    return params.ret ? TRUE : FALSE;
+}
+
+/*
+ * Several GrdWine_DeviceIoctl in one call: the requests to different devices
+ * run in parallel, the requests to one device run in the array order.
+ * Return TRUE if all requests succeeded (see dwStatus of each request).
+ */
+BOOL WINAPI GrdWine_DeviceIoctlBatch(PGRDWINE_IOCTL_REQUEST lpRequests, DWORD nCount)
+{
+    struct ioctl_batch_params params;
+
+    TRACE("(%p, %u)\n", (void*)lpRequests, nCount);
+    if (!lpRequests || nCount == 0)
+        return FALSE;
+
+    params.requests = lpRequests;
+    params.count = nCount;
+    params.ret = FALSE;
+    if (GRD_UNIX_CALL(ioctl_batch, &params) != STATUS_SUCCESS)
+        return FALSE;
+    TRACE("Ret ioctl_batch %d\n", params.ret);
+    return params.ret ? TRUE : FALSE;
+}
+
+/*
+ * GrdWine_DeviceIoctl to any device of the product ProdId: an idle or the
+ * least loaded one. lpDevName (nDevNameSize bytes, may be NULL) is the
+ * device to stick to if not empty, and the device used on return: pass the
+ * same buffer for the calls of one exchange.
+ */
+BOOL WINAPI GrdWine_ProductIoctl(DWORD ProdId, LPSTR lpDevName, DWORD nDevNameSize, DWORD dwPackSize,
+                                 LPVOID lpIn, DWORD nInSize, LPVOID lpOut, DWORD nOutSize)
+{
+    struct ioctl_product_params params;
+
+    TRACE("(%u, %s, %u, %u, %p, %u, %p, %u)\n", ProdId, lpDevName, nDevNameSize, dwPackSize,
+          lpIn, nInSize, lpOut, nOutSize);
+    if (!lpIn || !lpOut || (lpDevName && nDevNameSize == 0))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    params.prod_id = ProdId;
+    params.path = lpDevName;
+    params.path_size = lpDevName ? nDevNameSize : 0;
+    params.pack_size = dwPackSize;
+    params.in = lpIn;
+    params.in_size = nInSize;
+    params.out = lpOut;
+    params.out_size = nOutSize;
+    params.error = ERROR_GEN_FAILURE;
+    params.ret = FALSE;
+    if (GRD_UNIX_CALL(ioctl_product, &params) != STATUS_SUCCESS)
         return FALSE;
+    TRACE("Ret ioctl_product %d\n", params.ret);
+    if (!params.ret)
+        SetLastError(params.error);
+    return params.ret ? TRUE : FALSE;
+}
+
+static void complete_async(PGRDWINE_ASYNC lpAsync, DWORD dwStatus)
+{
+    /* lpAsync may be freed as soon as dwStatus is set */
+    GRDWINE_ASYNC_CALLBACK func = lpAsync->Func;
+    HANDLE event = lpAsync->hEvent;
+
+    InterlockedExchange((LONG*)&lpAsync->dwStatus, (LONG)dwStatus);
+    if (func)
+        func(lpAsync);
+    if (event)
+        SetEvent(event);
+}
 
-    TRACE("Call grd_ioctl_device(%s, %u, %u, %p, %u, %p, %u)\n",
-          path, prod_id, pack_size, in, in_size, out, out_size);
-    ret = grd_ioctl_device(path, prod_id, pack_size, in, in_size, out, out_size);
-    TRACE("Ret grd_ioctl_device %d\n", ret);
+/* Deliver the completions of the Unix side, until the process exits */
+static DWORD WINAPI completion_thread(LPVOID lpParam)
+{
+    struct ioctl_completion done[GRD_COMPLETIONS];
+    struct ioctl_wait_params params;
+    UINT i;
+
+    for (;;)
+    {
+        params.done = done;
+        params.max = GRD_COMPLETIONS;
+        params.timeout = -1;
+        params.count = 0;
+        if (GRD_UNIX_CALL(ioctl_wait, &params) != STATUS_SUCCESS)
+        {
+            Sleep(100);
+            continue;
+        }
+        for (i = 0; i < params.count; ++i)
+            complete_async((PGRDWINE_ASYNC)(ULONG_PTR)done[i].cookie, done[i].error);
+    }
+    return 0;
+}
+
+static BOOL WINAPI start_completion_thread(INIT_ONCE* once, void* param, void** context)
+{
+    HMODULE module;
+    HANDLE thread;
+
+    /* the thread keeps the module loaded */
+    if (!GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS,
+                            (LPCWSTR)completion_thread, &module))
+        return FALSE;
+    thread = CreateThread(NULL, 0, completion_thread, NULL, 0, NULL);
+    if (!thread)
+    {
+        FreeLibrary(module);
+        return FALSE;
+    }
+    CloseHandle(thread);
+    return TRUE;
+}
+
+/*
+ * GrdWine_DeviceIoctl which returns at once. On completion lpAsync->dwStatus
+ * is set, then lpAsync->Func is called and lpAsync->hEvent is set (by a
+ * GrdWine thread). The buffers and lpAsync are used until then.
+ * Return FALSE if the request is not queued (see GetLastError).
+ */
+BOOL WINAPI GrdWine_DeviceIoctlAsync(LPCSTR lpDevName, DWORD ProdId, DWORD dwPackSize,
+                                     LPVOID lpIn, DWORD nInSize, LPVOID lpOut, DWORD nOutSize,
+                                     PGRDWINE_ASYNC lpAsync)
+{
+    struct ioctl_submit_params params;
+
+    TRACE("(%s, %u, %u, %p, %u, %p, %u, %p)\n", lpDevName, ProdId, dwPackSize,
+          lpIn, nInSize, lpOut, nOutSize, (void*)lpAsync);
+    if (!lpDevName || !lpIn || !lpOut || !lpAsync)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    if (!InitOnceExecuteOnce(&completion_once, start_completion_thread, NULL, NULL))
+    {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return FALSE;
+    }
+
+    lpAsync->dwStatus = ERROR_IO_PENDING;
+    params.path = lpDevName;
+    params.prod_id = ProdId;
+    params.pack_size = dwPackSize;
+    params.in = lpIn;
+    params.in_size = nInSize;
+    params.out = lpOut;
+    params.out_size = nOutSize;
+    params.timeout = lpAsync->dwTimeout;
+    params.cookie = (ULONG_PTR)lpAsync;
+    params.error = ERROR_GEN_FAILURE;
+    params.ret = FALSE;
+    if (GRD_UNIX_CALL(ioctl_submit, &params) != STATUS_SUCCESS)
+        params.ret = FALSE;
+    TRACE("Ret ioctl_submit %d\n", params.ret);
+    if (!params.ret)
+    {
+        lpAsync->dwStatus = params.error;
+        SetLastError(params.error);
+    }
+    return params.ret ? TRUE : FALSE;
+}
+
+/*
+ * Cancel the request of GrdWine_DeviceIoctlAsync if its exchange is not
+ * started: it completes with ERROR_OPERATION_ABORTED. A started exchange is
+ * not interrupted (the dongle would be left in the middle of it).
+ */
+BOOL WINAPI GrdWine_CancelIoctl(PGRDWINE_ASYNC lpAsync)
+{
+    struct ioctl_cancel_params params;
+
+    TRACE("(%p)\n", (void*)lpAsync);
+    if (!lpAsync)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    params.cookie = (ULONG_PTR)lpAsync;
+    params.error = ERROR_GEN_FAILURE;
+    params.ret = FALSE;
+    if (GRD_UNIX_CALL(ioctl_cancel, &params) != STATUS_SUCCESS)
+        params.ret = FALSE;
+    TRACE("Ret ioctl_cancel %d\n", params.ret);
+    if (!params.ret)
+        SetLastError(params.error);
+    return params.ret ? TRUE : FALSE;
+}
+
+/*
+ * Open an explicit session: the device is opened, claimed and locked for
+ * the GrdWine_SessionIoctl calls until GrdWine_CloseSession, so the steps of
+ * one operation (login, reads, logout) run without the calls of the others
+ * in between. The session ends after dwHoldTime ms in all, or dwIdleTime ms
+ * without a call (zero: the defaults); its calls fail with ERROR_SEM_TIMEOUT
+ * then, the session is still to be closed.
+ */
+BOOL WINAPI GrdWine_OpenSession(LPCSTR lpDevName, DWORD ProdId, DWORD dwHoldTime,
+                                DWORD dwIdleTime, PULONGLONG pSession)
+{
+    struct session_open_params params;
+
+    TRACE("(%s, %u, %u, %u, %p)\n", lpDevName, ProdId, dwHoldTime, dwIdleTime, (void*)pSession);
+    if (!lpDevName || !pSession)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    params.path = lpDevName;
+    params.prod_id = ProdId;
+    params.hold = dwHoldTime;
+    params.idle = dwIdleTime;
+    params.session = 0;
+    params.error = ERROR_GEN_FAILURE;
+    params.ret = FALSE;
+    if (GRD_UNIX_CALL(session_open, &params) != STATUS_SUCCESS)
+        params.ret = FALSE;
+    TRACE("Ret session_open %d, %s\n", params.ret, wine_dbgstr_longlong(params.session));
+    if (!params.ret)
+        SetLastError(params.error);
+    *pSession = params.ret ? params.session : 0;
+    return params.ret ? TRUE : FALSE;
+}
+
+/* GrdWine_DeviceIoctl to the device of the session */
+BOOL WINAPI GrdWine_SessionIoctl(ULONGLONG Session, DWORD dwPackSize,
+                                 LPVOID lpIn, DWORD nInSize, LPVOID lpOut, DWORD nOutSize)
+{
+    struct session_ioctl_params params;
+
+    TRACE("(%s, %u, %p, %u, %p, %u)\n", wine_dbgstr_longlong(Session), dwPackSize,
+          lpIn, nInSize, lpOut, nOutSize);
+    if (!lpIn || !lpOut)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    params.session = Session;
+    params.pack_size = dwPackSize;
+    params.in = lpIn;
+    params.in_size = nInSize;
+    params.out = lpOut;
+    params.out_size = nOutSize;
+    params.error = ERROR_GEN_FAILURE;
+    params.ret = FALSE;
+    if (GRD_UNIX_CALL(session_ioctl, &params) != STATUS_SUCCESS)
+        params.ret = FALSE;
+    TRACE("Ret session_ioctl %d\n", params.ret);
+    if (!params.ret)
+        SetLastError(params.error);
+    return params.ret ? TRUE : FALSE;
+}
+
+/* Release the device of the session */
+BOOL WINAPI GrdWine_CloseSession(ULONGLONG Session)
+{
+    struct session_close_params params;
 
-    return ret == 0 ? TRUE : FALSE;
+    TRACE("(%s)\n", wine_dbgstr_longlong(Session));
+    params.session = Session;
+    params.error = ERROR_GEN_FAILURE;
+    params.ret = FALSE;
+    if (GRD_UNIX_CALL(session_close, &params) != STATUS_SUCCESS)
+        params.ret = FALSE;
+    TRACE("Ret session_close %d\n", params.ret);
+    if (!params.ret)
+        SetLastError(params.error);
+    return params.ret ? TRUE : FALSE;
 }
 
 BOOL WINAPI DllMain(HINSTANCE hinstDLL, DWORD fdwReason, LPVOID lpvReserved)
@@ -107,6 +427,10 @@ BOOL WINAPI DllMain(HINSTANCE hinstDLL, DWORD fdwReason, LPVOID lpvReserved)
     {
     case DLL_PROCESS_ATTACH:
         // DisableThreadLibraryCalls(hinstDLL);
+#ifdef GRDWINE_UNIXLIB
+        if (__wine_init_unix_call())
+            return FALSE;
+#endif /* GRDWINE_UNIXLIB */
         break;
     }
     return TRUE;
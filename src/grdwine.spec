@@ -2,3 +2,10 @@
 @ stdcall GrdWine_SearchUsbDevices(ptr ptr)
 @ stdcall GrdWine_DeviceProbe(str ptr)
 @ stdcall GrdWine_DeviceIoctl(str long long ptr long ptr long)
+@ stdcall GrdWine_DeviceIoctlBatch(ptr long)
+@ stdcall GrdWine_ProductIoctl(long ptr long long ptr long ptr long)
+@ stdcall GrdWine_DeviceIoctlAsync(str long long ptr long ptr long ptr)
+@ stdcall GrdWine_CancelIoctl(ptr)
+@ stdcall GrdWine_OpenSession(str long long long ptr)
+@ stdcall GrdWine_SessionIoctl(int64 long ptr long ptr long)
+@ stdcall GrdWine_CloseSession(int64)